@@ -48,6 +48,7 @@ int    MSXqual_open(MSXproject MSX);
 int    MSXqual_init(MSXproject MSX);
 int    MSXqual_step(MSXproject MSX, long *t, long *tleft);
 int    MSXqual_close(MSXproject MSX);
+void   MSXqual_releaseHydFile(MSXproject MSX);
 int    MSXrpt_write(MSXproject MSX, char *fname);
 int    MSXfile_save(MSXproject MSX, FILE *f);
 int    MSXout_open(MSXproject MSX);
@@ -114,6 +115,7 @@ int   DLLEXPORT  MSXsolveH(MSXproject MSX)
 
 // --- close & remove any existing hydraulics file
 
+    MSXqual_releaseHydFile(MSX);
     if ( MSX->HydFile.file )
     {
         fclose(MSX->HydFile.file);
@@ -159,6 +161,7 @@ int   DLLEXPORT  MSXusehydfile(MSXproject MSX)
 
 // --- close any existing hydraulics file 
 
+    MSXqual_releaseHydFile(MSX);
     if ( MSX->HydFile.file )
     {
         fclose(MSX->HydFile.file);
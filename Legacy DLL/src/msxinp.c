@@ -424,9 +424,9 @@ int addSpecies(MSXproject MSX, char *line)
     int errcode = 0;
     Ntokens = getTokens(line);
     if ( Ntokens < 2 ) return ERR_ITEMS;
-    errcode = checkID(Tok[1]);
+    errcode = checkID(MSX, Tok[1]);
     if ( errcode ) return errcode;
-    if ( addObject(SPECIES, Tok[1], MSX->Nobjects[SPECIES]+1) < 0 )
+    if ( addObject(MSX, SPECIES, Tok[1], MSX->Nobjects[SPECIES]+1) < 0 )
         errcode = 101;
     else MSX->Nobjects[SPECIES]++;
     return errcode;
@@ -460,9 +460,9 @@ int addCoeff(MSXproject MSX, char *line)
 
 // --- check for valid id name
 
-    errcode = checkID(Tok[1]);
+    errcode = checkID(MSX, Tok[1]);
     if ( errcode ) return errcode;
-    if ( addObject(k, Tok[1], MSX->Nobjects[k]+1) < 0 )
+    if ( addObject(MSX, k, Tok[1], MSX->Nobjects[k]+1) < 0 )
         errcode = 101;
     else MSX->Nobjects[k]++;
     return errcode;
@@ -483,10 +483,10 @@ int addTerm(MSXproject MSX, char *id)
 **    an error code (0 if no error)
 */
 {
-    int errcode = checkID(id);
+    int errcode = checkID(MSX, id);
     if ( !errcode )
     {
-        if ( addObject(TERM, id, MSX->Nobjects[TERM]+1) < 0 )
+        if ( addObject(MSX, TERM, id, MSX->Nobjects[TERM]+1) < 0 )
             errcode = 101;
         else MSX->Nobjects[TERM]++;
     }
@@ -512,9 +512,9 @@ int addPattern(MSXproject MSX, char *id)
 
     // --- a time pattern can span several lines
 
-    if ( findObject(PATTERN, id) <= 0 )
+    if ( findObject(MSX, PATTERN, id) <= 0 )
     {
-        if ( addObject(PATTERN, id, MSX->Nobjects[PATTERN]+1) < 0 )
+        if ( addObject(MSX, PATTERN, id, MSX->Nobjects[PATTERN]+1) < 0 )
             errcode = 101;
         else MSX->Nobjects[PATTERN]++;
     }
@@ -650,6 +650,24 @@ int parseOption(MSXproject MSX)
     	  MSX->Compiler = k;
 	  break;
 
+      case JACOBIAN_OPTION:
+          k = MSXutils_findmatch(Tok[1], JacobianWords);
+          if ( k < 0 ) return ERR_KEYWORD;
+          MSX->Jacobian = k;
+          break;
+
+      case SPLITTING_OPTION:
+          k = MSXutils_findmatch(Tok[1], SplittingWords);
+          if ( k < 0 ) return ERR_KEYWORD;
+          MSX->Splitting = k;
+          break;
+
+      case STEPPING_OPTION:
+          k = MSXutils_findmatch(Tok[1], SteppingWords);
+          if ( k < 0 ) return ERR_KEYWORD;
+          MSX->Stepping = k;
+          break;
+
     }
     return 0;
 }
@@ -673,12 +691,12 @@ int parseSpecies(MSXproject MSX)
 // --- get Species index
 
     if ( Ntokens < 3 ) return ERR_ITEMS;
-    i = findObject(SPECIES, Tok[1]);
+    i = findObject(MSX, SPECIES, Tok[1]);
     if ( i <= 0 ) return ERR_NAME;
 
 // --- get pointer to Species name
 
-    MSX->Species[i].id = findID(SPECIES, Tok[1]);
+    MSX->Species[i].id = findID(MSX, SPECIES, Tok[1]);
 
 // --- get Species type
 
@@ -731,12 +749,12 @@ int parseCoeff(MSXproject MSX)
     {
     // --- get Parameter's index
 
-        i = findObject(PARAMETER, Tok[1]);
+        i = findObject(MSX, PARAMETER, Tok[1]);
         if ( i <= 0 ) return ERR_NAME;
 
     // --- get Parameter's value
 
-        MSX->Param[i].id = findID(PARAMETER, Tok[1]); 
+        MSX->Param[i].id = findID(MSX, PARAMETER, Tok[1]); 
         if ( Ntokens >= 3 )
         {
             if ( !MSXutils_getDouble(Tok[2], &x) ) return ERR_NUMBER;
@@ -753,12 +771,12 @@ int parseCoeff(MSXproject MSX)
     {
     // --- get Constant's index
 
-        i = findObject(CONSTANT, Tok[1]);
+        i = findObject(MSX, CONSTANT, Tok[1]);
         if ( i <= 0 ) return ERR_NAME;
 
     // --- get Constant's value
 
-        MSX->Const[i].id = findID(CONSTANT, Tok[1]); 
+        MSX->Const[i].id = findID(MSX, CONSTANT, Tok[1]); 
         MSX->Const[i].value = 0.0;
         if ( Ntokens >= 3 )
         {
@@ -792,15 +810,15 @@ int parseTerm(MSXproject MSX)
 // --- get term's name
 
     if ( Ntokens < 2 ) return 0;
-    i = findObject(TERM, Tok[0]);
-    MSX->Term[i].id = findID(TERM, Tok[0]);                             //1.1.00
+    i = findObject(MSX, TERM, Tok[0]);
+    MSX->Term[i].id = findID(MSX, TERM, Tok[0]);                             //1.1.00
 
 // --- reconstruct the expression string from its tokens
 
     for (j=1; j<Ntokens; j++)
     {                                                                          //1.1.00
         strcat(s, Tok[j]);                     
-        k = findObject(TERM, Tok[j]);                                  //1.1.00
+        k = findObject(MSX, TERM, Tok[j]);                                  //1.1.00
         if ( k > 0 ) TermArray[i][k] = 1.0;                                    //1.1.00
     }                                                                          //1.1.00
     
@@ -842,7 +860,7 @@ int parseExpression(MSXproject MSX, int classType)
 
 // --- determine species associated with expression
 
-    i = findObject(SPECIES, Tok[1]);
+    i = findObject(MSX, SPECIES, Tok[1]);
     if ( i < 1 ) return ERR_NAME;
 
 // --- check that species does not already have an expression
@@ -910,7 +928,7 @@ int parseQuality(MSXproject MSX)
 
     k = 1;
     if ( i >= 2 ) k = 2;
-    m = findObject(SPECIES, Tok[k]);
+    m = findObject(MSX, SPECIES, Tok[k]);
     if ( m <= 0 ) return ERR_NAME;
 
 // --- get quality value
@@ -973,7 +991,7 @@ int parseParameter(MSXproject MSX)
 // --- get parameter name
 
     if ( Ntokens < 4 ) return 0;
-    i = findObject(PARAMETER, Tok[2]);
+    i = findObject(MSX, PARAMETER, Tok[2]);
 
 // --- get parameter value
 
@@ -1032,7 +1050,7 @@ int parseSource(MSXproject MSX)
 
 //  --- get species index
 
-    m = findObject(SPECIES, Tok[2]);
+    m = findObject(MSX, SPECIES, Tok[2]);
     if ( m <= 0 ) return ERR_NAME;
 
 // --- check that species is a BULK species
@@ -1048,7 +1066,7 @@ int parseSource(MSXproject MSX)
     i = 0;
     if ( Ntokens >= 5 )
     {
-        i = findObject(PATTERN, Tok[4]);
+        i = findObject(MSX, PATTERN, Tok[4]);
         if ( i <= 0 ) return ERR_NAME;
     }
 
@@ -1101,9 +1119,9 @@ int parsePattern(MSXproject MSX)
 // --- get time pattern index
 
     if ( Ntokens < 2 ) return ERR_ITEMS;
-    i = findObject(PATTERN, Tok[0]);
+    i = findObject(MSX, PATTERN, Tok[0]);
     if ( i <= 0 ) return ERR_NAME;
-	MSX->Pattern[i].id = findID(PATTERN, Tok[0]);
+	MSX->Pattern[i].id = findID(MSX, PATTERN, Tok[0]);
 
 // --- begin reading pattern multipliers
 
@@ -1195,7 +1213,7 @@ int parseReport(MSXproject MSX)
     // --- keyword is SPECIES; get YES/NO & precision
 
         case 2:
-        j = findObject(SPECIES, Tok[1]);
+        j = findObject(MSX, SPECIES, Tok[1]);
         if ( j <= 0 ) return ERR_NAME;
         if ( Ntokens >= 3 )
         {
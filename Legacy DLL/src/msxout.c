@@ -40,11 +40,17 @@ int   MSXout_saveResults(MSXproject MSX);
 int   MSXout_saveFinalResults(MSXproject MSX);
 float MSXout_getNodeQual(MSXproject MSX, int k, int j, int m);
 float MSXout_getLinkQual(MSXproject MSX, int k, int j, int m);
+int   MSXout_mapResults(MSXproject MSX);
+void  MSXout_unmapResults(MSXproject MSX);
+void  MSXout_getNodeSeries(MSXproject MSX, int j, int m, REAL4 *x);
+void  MSXout_getLinkSeries(MSXproject MSX, int j, int m, REAL4 *x);
 
 //  Local functions
 //-----------------
+static void  readResults(MSXproject MSX, long bp, long stride, int n, REAL4* x);
+static void  freeStatResults(MSXproject MSX);
 static int   saveStatResults(MSXproject MSX);
-static void  getStatResults(MSXproject MSX, int objType, int m, double* stats1,
+static void  getStatResults(MSXproject MSX, int n, double* stats1,
              double* stats2, REAL4* x);
 
 
@@ -62,6 +68,9 @@ int MSXout_open(MSXproject MSX)
 **    an error code (or 0 if no error).
 */
 {
+    int n;
+    SoutMap *out = &MSX->OutMap;
+
 // --- close output file if already opened
 
     if (MSX->OutFile.file != NULL) fclose(MSX->OutFile.file); 
@@ -73,12 +82,18 @@ int MSXout_open(MSXproject MSX)
         return ERR_OPEN_OUT_FILE;
     }
 
-// --- open a scratch output file for statistics
+// --- allocate space for the results of a period and, if a statistic
+//     is reported instead of a time series, for its running values
 
-    if ( MSX->Statflag == SERIES ) MSX->TmpOutFile.file = MSX->OutFile.file;
-    else if ( (MSX->TmpOutFile.file = fopen(MSX->TmpOutFile.name, "w+b")) == NULL)
+    n = MSX->Nobjects[SPECIES] * (MSX->Nobjects[NODE] + MSX->Nobjects[LINK]);
+    freeStatResults(MSX);
+    out->period = (REAL4 *) calloc(n+1, sizeof(REAL4));
+    if ( out->period == NULL ) return ERR_MEMORY;
+    if ( MSX->Statflag != SERIES )
     {
-        return ERR_OPEN_OUT_FILE;
+        out->stats1 = (double *) calloc(n+1, sizeof(double));
+        out->stats2 = (double *) calloc(n+1, sizeof(double));
+        if ( out->stats1 == NULL || out->stats2 == NULL ) return ERR_MEMORY;
     }
 
 // --- write initial results to file
@@ -141,10 +156,9 @@ int MSXout_saveResults(MSXproject MSX)
 /**
 **  Purpose:
 **    saves computed species concentrations for each node and link at the
-**    current time period to the temporary MSX binary output file (which
-**    will be the same as the permanent MSX binary file if time series
-**    values were specified as the reported statistic, which is the
-**    default case).
+**    current time period to the MSX binary output file, or updates their
+**    running statistics if a statistic rather than a time series is to
+**    be reported.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
@@ -153,25 +167,47 @@ int MSXout_saveResults(MSXproject MSX)
 **    an error code (or 0 if no error).
 */
 {
-    int   m, j;
+    int   m, j, n = 0;
     REAL4 x;
+    SoutMap *out = &MSX->OutMap;
+
+// --- collect the results of all nodes and then all links
 
     for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
     {
         for (j=1; j<=MSX->Nobjects[NODE]; j++)
         {
-            x = (REAL4)MSXqual_getNodeQual(MSX, j, m);
-            fwrite(&x, sizeof(REAL4), 1, MSX->TmpOutFile.file);
+            out->period[n++] = (REAL4)MSXqual_getNodeQual(MSX, j, m);
         }
     }
     for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
     {
         for (j=1; j<=MSX->Nobjects[LINK]; j++)
         {
-            x = (REAL4)MSXqual_getLinkQual(MSX, j, m);
-            fwrite(&x, sizeof(REAL4), 1, MSX->TmpOutFile.file);
+            out->period[n++] = (REAL4)MSXqual_getLinkQual(MSX, j, m);
         }
     }
+
+// --- write them to the file as a single record
+
+    if ( MSX->Statflag == SERIES )
+    {
+        fwrite(out->period, sizeof(REAL4), n, MSX->OutFile.file);
+        return 0;
+    }
+
+// --- or else update the running statistic of each result
+
+    if ( MSX->Statflag == AVGERAGE )
+    {
+        for (j = 0; j < n; j++) out->stats1[j] += out->period[j];
+    }
+    else for (j = 0; j < n; j++)
+    {
+        x = out->period[j];
+        out->stats1[j] = MIN(out->stats1[j], x);
+        out->stats2[j] = MAX(out->stats2[j], x);
+    }
     return 0;
 }
 
@@ -201,6 +237,7 @@ int MSXout_saveFinalResults(MSXproject MSX)
 // --- save statistical results to the file
 
     if ( MSX->Statflag != SERIES ) err = saveStatResults(MSX);
+    freeStatResults(MSX);
     if ( err > 0 ) return err;
 
 // --- write closing records to the file
@@ -235,8 +272,7 @@ float MSXout_getNodeQual(MSXproject MSX, int k, int j, int m)
     REAL4 c;
     long bp = ResultsOffset + k * (NodeBytesPerPeriod + LinkBytesPerPeriod);
     bp += ((m-1)*MSX->Nobjects[NODE] + (j-1)) * sizeof(REAL4);
-    fseek(MSX->OutFile.file, bp, SEEK_SET);
-    fread(&c, sizeof(REAL4), 1, MSX->OutFile.file);
+    readResults(MSX, bp, 0, 1, &c);
     return (float)c;
 }
 
@@ -260,147 +296,224 @@ float MSXout_getLinkQual(MSXproject MSX, int k, int j, int m)
     REAL4 c;
     long bp = ResultsOffset + ((k+1)*NodeBytesPerPeriod) + (k*LinkBytesPerPeriod);
     bp += ((m-1)*MSX->Nobjects[LINK] + (j-1)) * sizeof(REAL4);
-    fseek(MSX->OutFile.file, bp, SEEK_SET);
-    fread(&c, sizeof(REAL4), 1, MSX->OutFile.file);
+    readResults(MSX, bp, 0, 1, &c);
     return (float)c;
 }
 
 //=============================================================================
 
-int  saveStatResults(MSXproject MSX)
+void MSXout_getNodeSeries(MSXproject MSX, int j, int m, REAL4 *x)
 /**
 **  Purpose:
-**    saves time statistic results (average, min., max., or range) for each
-**    node and link to the permanent binary output file.
+**    retrieves the results of all time periods for a specific node and
+**    species from the MSX binary output file.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    j = node index
+**    m = species index.
+**
+**  Output:
+**    x[k] = species concentration in time period k.
+*/
+{
+    long bp = ResultsOffset + ((m-1)*MSX->Nobjects[NODE] + (j-1)) * sizeof(REAL4);
+    readResults(MSX, bp, NodeBytesPerPeriod + LinkBytesPerPeriod,
+                MSX->Nperiods, x);
+}
+
+//=============================================================================
+
+void MSXout_getLinkSeries(MSXproject MSX, int j, int m, REAL4 *x)
+/**
+**  Purpose:
+**    retrieves the results of all time periods for a specific link and
+**    species from the MSX binary output file.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    j = link index
+**    m = species index.
+**
+**  Output:
+**    x[k] = species concentration in time period k.
+*/
+{
+    long bp = ResultsOffset + NodeBytesPerPeriod;
+    bp += ((m-1)*MSX->Nobjects[LINK] + (j-1)) * sizeof(REAL4);
+    readResults(MSX, bp, NodeBytesPerPeriod + LinkBytesPerPeriod,
+                MSX->Nperiods, x);
+}
+
+//=============================================================================
+
+int MSXout_mapResults(MSXproject MSX)
+/**
+**  Purpose:
+**    memory-maps the completed MSX binary output file so that results
+**    can be retrieved without a file seek and read for each value.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
 **
 **  Returns:
 **    an error code (or 0 if no error).
+**
+**  Note:
+**    if the file can't be mapped, results are read from it as before.
+*/
+{
+    SoutMap *out = &MSX->OutMap;
+
+    if ( MSX->OutFile.file == NULL ) return ERR_OPEN_OUT_FILE;
+    MSXout_unmapResults(MSX);
+    fflush(MSX->OutFile.file);
+    out->view = MSXfuncs_mapFile(MSX->OutFile.file, &out->size, &out->handle);
+    return 0;
+}
+
+//=============================================================================
+
+void MSXout_unmapResults(MSXproject MSX)
+/**
+**  Purpose:
+**    releases the memory-mapped view of the MSX binary output file.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
 */
 {
-    int     m, err = 0;
-    REAL4*  x = NULL;
-    double* stats1 = NULL;
-    double* stats2 = NULL;
+    SoutMap *out = &MSX->OutMap;
+
+    MSXfuncs_unmapFile(out->view, out->size, out->handle);
+    out->view = NULL;
+    out->size = 0;
+    out->handle = NULL;
+}
 
-// --- create arrays used to store statistics results
+//=============================================================================
 
-    if ( MSX->Nperiods <= 0 ) return err;
-    m = MAX(MSX->Nobjects[NODE], MSX->Nobjects[LINK]);
-    x = (REAL4 *) calloc(m+1, sizeof(REAL4));
-    stats1 = (double *) calloc(m+1, sizeof(double));
-    stats2 = (double *) calloc(m+1, sizeof(double));
+void readResults(MSXproject MSX, long bp, long stride, int n, REAL4* x)
+/**
+**  Purpose:
+**    reads a set of equally spaced results from the MSX binary output file.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    bp = byte offset of the first result
+**    stride = byte distance between successive results
+**    n = number of results to read.
+**
+**  Output:
+**    x = array of results read.
+*/
+{
+    int  i;
+    SoutMap *out = &MSX->OutMap;
 
-// --- get desired statistic for each node & link and save to binary file
+// --- copy results directly out of the mapped file
 
-    if ( x && stats1 && stats2 )
+    if ( n <= 0 ) return;
+    if ( out->view &&
+         (size_t)bp + (size_t)(n-1)*stride + sizeof(REAL4) <= out->size )
     {
-        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++ )
-        {
-            getStatResults(MSX, NODE, m, stats1, stats2, x);
-            fwrite(x+1, sizeof(REAL4), MSX->Nobjects[NODE], MSX->OutFile.file);
-        }
-        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
+        for (i = 0; i < n; i++)
         {
-            getStatResults(MSX, LINK, m, stats1, stats2, x);    
-            fwrite(x+1, sizeof(REAL4), MSX->Nobjects[LINK], MSX->OutFile.file);
+            memcpy(&x[i], out->view + bp + (size_t)i*stride, sizeof(REAL4));
         }
-        MSX->Nperiods = 1;
+        return;
     }
-    else err = ERR_MEMORY;
 
-// --- free allocated arrays
+// --- otherwise read them from the file one at a time
 
-    FREE(x);
-    FREE(stats1);
-    FREE(stats2);
-    return err;
+    for (i = 0; i < n; i++)
+    {
+        fseek(MSX->OutFile.file, bp + i*stride, SEEK_SET);
+        fread(&x[i], sizeof(REAL4), 1, MSX->OutFile.file);
+    }
 }
 
 //=============================================================================
 
-void getStatResults(MSXproject MSX, int objType, int m, double * stats1, double * stats2,
-                    REAL4 * x)
+void  freeStatResults(MSXproject MSX)
 /**
 **  Purpose:
-**    reads all results for a given type of object from the temporary
-**    binary output file and computes the required statistic (average,
-**    min., max., or range) for each object.
+**    frees the arrays that hold a period's results and running statistics.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    objType = type of object (nodes or links)
-**    m = species index
-**    stats1, stats2 = work arrays used to hold intermediate values
-**    x = array used to store results read from file.
-**
-**  Output:
-**    x = array that contains computed statistic for each object.
 */
 {
-    int  j, k;
-    int  n = MSX->Nobjects[objType];
-    long bp;
+    SoutMap *out = &MSX->OutMap;
 
-// --- initialize work arrays
-    
-    for (j = 1; j <= n; j++)
-    {
-        stats1[j] = 0.0;
-        stats2[j] = 0.0; 
-    }
+    FREE(out->period);
+    FREE(out->stats1);
+    FREE(out->stats2);
+}
 
-// --- for all time periods
+//=============================================================================
 
-    for (k = 0; k < MSX->Nperiods; k++)
-    {
+int  saveStatResults(MSXproject MSX)
+/**
+**  Purpose:
+**    saves time statistic results (average, min., max., or range) for each
+**    node and link to the permanent binary output file.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+*/
+{
+    int n;
+    SoutMap *out = &MSX->OutMap;
 
-    // --- position file at start of time period
+// --- place the statistic of each node & link result in the period results
 
-        bp = k*(NodeBytesPerPeriod + LinkBytesPerPeriod);
-        if ( objType == NODE )
-        {
-            bp += (m-1) * MSX->Nobjects[NODE] * sizeof(REAL4);
-        }
-        if ( objType == LINK)
-        {
-            bp += NodeBytesPerPeriod + 
-                  (m-1) * MSX->Nobjects[LINK] * sizeof(REAL4);
-        }
-        fseek(MSX->TmpOutFile.file, bp, SEEK_SET);
+    if ( MSX->Nperiods <= 0 ) return 0;
+    if ( out->stats1 == NULL ) return ERR_MEMORY;
+    n = MSX->Nobjects[SPECIES] * (MSX->Nobjects[NODE] + MSX->Nobjects[LINK]);
+    getStatResults(MSX, n, out->stats1, out->stats2, out->period);
 
-    // --- read concentrations and update stats for all objects
+// --- save them to binary file as a single period
 
-        fread(x+1, sizeof(REAL4), n, MSX->TmpOutFile.file);
-        if ( MSX->Statflag == AVGERAGE )
-        { 
-            for (j = 1; j <= n; j++) stats1[j] += x[j];
-        }
-        else for (j = 1; j <= n; j++)
-        {
-            stats1[j] = MIN(stats1[j], x[j]); 
-            stats2[j] = MAX(stats2[j], x[j]); 
-        }
-    }
+    fwrite(out->period, sizeof(REAL4), n, MSX->OutFile.file);
+    MSX->Nperiods = 1;
+    return 0;
+}
 
-// --- place final stat value for each object in x
+//=============================================================================
 
-    if ( MSX->Statflag == AVGERAGE )
-    {
-        for ( j = 1; j <= n; j++) stats1[j] /= (double)MSX->Nperiods;
-    }
-    if ( MSX->Statflag == RANGE )
-    {
-        for ( j = 1; j <= n; j++)
-            stats1[j] = fabs(stats2[j] - stats1[j]);
-    }
-    if ( MSX->Statflag == MAXIMUM)
+void getStatResults(MSXproject MSX, int n, double * stats1, double * stats2,
+                    REAL4 * x)
+/**
+**  Purpose:
+**    computes the required statistic (average, min., max., or range) of
+**    each result from its running values.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    n = number of results
+**    stats1, stats2 = running values of each result.
+**
+**  Output:
+**    x = array that contains computed statistic for each result.
+*/
+{
+    int  j;
+
+    for (j = 0; j < n; j++)
     {
-        for ( j = 1; j <= MSX->Nobjects[NODE]; j++) stats1[j] = stats2[j]; 
+        if ( MSX->Statflag == AVGERAGE )
+            x[j] = (REAL4)(stats1[j] / (double)MSX->Nperiods);
+        else if ( MSX->Statflag == RANGE )
+            x[j] = (REAL4)fabs(stats2[j] - stats1[j]);
+        else if ( MSX->Statflag == MAXIMUM )
+            x[j] = (REAL4)stats2[j];
+        else
+            x[j] = (REAL4)stats1[j];
     }
-    for (j = 1; j <= n; j++) x[j] = (REAL4)stats1[j];
 }
 
 //=============================================================================
@@ -109,7 +109,7 @@ int  MSXproj_open(MSXproject MSX, char *fname)
 
 // --- create hash tables to look up object ID names
 
-    CALL(errcode, createHashTables());
+    CALL(errcode, createHashTables(MSX));
 
 // --- allocate memory for the required number of objects
 
@@ -165,24 +165,24 @@ void MSXproj_close(MSXproject MSX)
 
     if ( MSX->RptFile.file ) fclose(MSX->RptFile.file);                          //(LR-11/20/07, to fix bug 08)
     if ( MSX->HydFile.file ) fclose(MSX->HydFile.file);
-    if ( MSX->TmpOutFile.file && MSX->TmpOutFile.file != MSX->OutFile.file )
-        fclose(MSX->TmpOutFile.file);
     if ( MSX->OutFile.file ) fclose(MSX->OutFile.file);
 
     // --- delete all temporary files
 
     if ( MSX->HydFile.mode == SCRATCH_FILE ) remove(MSX->HydFile.name);
     if ( MSX->OutFile.mode == SCRATCH_FILE ) remove(MSX->OutFile.name);
-    remove(MSX->TmpOutFile.name);
 
     // --- free all allocated memory
 
     MSX->RptFile.file = NULL;                                                   //(LR-11/20/07, to fix bug 08)
     MSX->HydFile.file = NULL;
     MSX->OutFile.file = NULL;
-    MSX->TmpOutFile.file = NULL;
+    FREE(MSX->OutMap.period);
+    FREE(MSX->OutMap.stats1);
+    FREE(MSX->OutMap.stats2);
+    FREE(MSX->OutMap.series);
     deleteObjects(MSX);
-    deleteHashTables();
+    deleteHashTables(MSX);
     MSX->ProjectOpened = FALSE;
 }
 
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <time.h>
 #include <math.h>
 
@@ -58,8 +59,10 @@ static char IDname[MAXLINE+1];
 
 //  Imported functions
 //--------------------
-float MSXout_getNodeQual(MSXproject MSX, int k, int j, int m);
-float MSXout_getLinkQual(MSXproject MSX, int k, int j, int m);
+int   MSXout_mapResults(MSXproject MSX);
+void  MSXout_unmapResults(MSXproject MSX);
+void  MSXout_getNodeSeries(MSXproject MSX, int j, int m, REAL4 *x);
+void  MSXout_getLinkSeries(MSXproject MSX, int j, int m, REAL4 *x);
 
 
 //  Local functions
@@ -101,6 +104,14 @@ int  MSXrpt_write(MSXproject MSX, char *fname)
     fread(&magic, sizeof(INT4), 1, MSX->OutFile.file);
     if ( magic != MAGICNUMBER ) return ERR_IO_OUT_FILE;
 
+// --- map the output file and allocate space for the results
+//     of all reported species of one node or link
+
+    MSX->OutMap.series = (REAL4 *) calloc((MSX->Nobjects[SPECIES]+1) *
+                                          MSX->Nperiods, sizeof(REAL4));
+    if ( MSX->OutMap.series == NULL ) return ERR_MEMORY;
+    MSXout_mapResults(MSX);
+
 // --- write program logo & project title
 
     PageNum = 1;
@@ -118,6 +129,8 @@ int  MSXrpt_write(MSXproject MSX, char *fname)
     writemassbalance(MSX);
 
     writeLine(MSX, "");
+    MSXout_unmapResults(MSX);
+    FREE(MSX->OutMap.series);
     return 0;
 }
 
@@ -262,6 +275,15 @@ void  writeNodeTable(MSXproject MSX, int j, int tableType)
     char  s[MAXLINE+1];
     float c;
 
+// --- retrieve all results of each reported species at once
+
+    for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
+    {
+        if ( !MSX->Species[m].rpt ) continue;
+        if ( MSX->Species[m].type == WALL ) continue;
+        MSXout_getNodeSeries(MSX, j, m, MSX->OutMap.series + m*MSX->Nperiods);
+    }
+
     for (k=0; k<MSX->Nperiods; k++)
     {
         if ( tableType == SERIES_TABLE )
@@ -279,7 +301,7 @@ void  writeNodeTable(MSXproject MSX, int j, int tableType)
         {
             if ( !MSX->Species[m].rpt ) continue;
             if ( MSX->Species[m].type == WALL ) continue;
-            c = MSXout_getNodeQual(MSX, k, j, m);
+            c = MSX->OutMap.series[m*MSX->Nperiods + k];
             sprintf(s, "  %10.*f", MSX->Species[m].precision, c);
             strcat(Line, s);
         }
@@ -295,6 +317,14 @@ void  writeLinkTable(MSXproject MSX, int j, int tableType)
     char  s[MAXLINE+1];
     float c;
 
+// --- retrieve all results of each reported species at once
+
+    for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
+    {
+        if ( !MSX->Species[m].rpt ) continue;
+        MSXout_getLinkSeries(MSX, j, m, MSX->OutMap.series + m*MSX->Nperiods);
+    }
+
     for (k=0; k<MSX->Nperiods; k++)
     {
         if ( tableType == SERIES_TABLE )
@@ -311,7 +341,7 @@ void  writeLinkTable(MSXproject MSX, int j, int tableType)
         for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
         {
             if ( !MSX->Species[m].rpt ) continue;
-            c = MSXout_getLinkQual(MSX, k, j, m);
+            c = MSX->OutMap.series[m*MSX->Nperiods + k];
             sprintf(s, "  %10.*f", MSX->Species[m].precision, c);
             strcat(Line, s);
         }
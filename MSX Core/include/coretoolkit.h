@@ -93,6 +93,7 @@ int  DLLEXPORT MSX_getpatternvalue(MSXproject MSX, int pat, int period, double *
 int  DLLEXPORT MSX_getinitqual(MSXproject MSX, int type, int index, int species, double *value);
 int  DLLEXPORT MSX_getQualityByIndex(MSXproject MSX, int type, int index, int species, double *value);
 int  DLLEXPORT MSX_getQualityByID(MSXproject MSX, int type, char *id, char *species, double *value);
+int  DLLEXPORT MSX_getReactionCounts(MSXproject MSX, long *reacted, long *skipped);
 int  DLLEXPORT MSX_setconstant(MSXproject MSX, int index, double value);
 int  DLLEXPORT MSX_setparameter(MSXproject MSX, int type, int index, int param, double value);
 int  DLLEXPORT MSX_setinitqual(MSXproject MSX, int type, int index, int species, double value);
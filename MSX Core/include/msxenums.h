@@ -64,7 +64,8 @@
  enum SolverType                       // ODE solver options
                  {EUL,                 //   Euler
                   RK5,                 //   5th order Runge-Kutta
-                  ROS2};               //   2nd order Rosenbrock
+                  ROS2,                //   2nd order Rosenbrock
+                  BDF};                //   variable order BDF
 
  enum CouplingType                     // Degree of coupling for solving DAE's
                  {NO_COUPLING,         //   no coupling between alg. & diff. eqns.
@@ -123,7 +124,23 @@
                   TIMESTEP_OPTION,
                   RTOL_OPTION,
                   ATOL_OPTION,
-                  COMPILER_OPTION};                                            //1.1.00
+                  COMPILER_OPTION,                                             //1.1.00
+                  JACOBIAN_OPTION,
+                  SPLITTING_OPTION,
+                  STEPPING_OPTION};
+
+ enum JacobianType                     // Jacobian updates in the ROS2 solver
+                 {UPDATE_JACOBIAN,     //   new Jacobian for each time step
+                  REUSE_JACOBIAN};     //   Jacobian kept across time steps
+
+ enum SplittingType                    // Splitting of reaction & transport
+                 {LIE_SPLITTING,       //   react then transport (1st order)
+                  STRANG_SPLITTING};   //   half react, transport, half react
+                                       //   (2nd order)
+
+ enum SteppingType                     // Choice of quality time step
+                 {FIXED_STEPPING,      //   the TIMESTEP option
+                  ADAPTIVE_STEPPING};  //   chosen for each hydraulic period
 
  enum CompilerType                     // C compiler type                      //1.1.00
                  {NO_COMPILER,
@@ -91,6 +91,7 @@ int  DLLEXPORT MSXgetpatternvalue(int pat, int period, double *value);
 int  DLLEXPORT MSXgetinitqual(int type, int index, int species, double *value);
 int  DLLEXPORT MSXgetQualityByIndex(int type, int index, int species, double *value);
 int  DLLEXPORT MSXgetQualityByID(int type, char *id, char *species, double *value);
+int  DLLEXPORT MSXgetReactionCounts(long *reacted, long *skipped);
 int  DLLEXPORT MSXsetconstant(int index, double value);
 int  DLLEXPORT MSXsetparameter(int type, int index, int param, double value);
 int  DLLEXPORT MSXsetinitqual(int type, int index, int species, double value);
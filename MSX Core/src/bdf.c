@@ -0,0 +1,800 @@
+/*******************************************************************************
+**  MODULE:        BDF.C
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   a variable order (1 to 5) backward differentiation formula
+**                 method for solving stiff sets of ordinary differential
+**                 equations.
+**  VERSION:       1.1.00
+**  LAST UPDATE:   Refer to git history
+**
+**  This code follows the fixed leading coefficient Nordsieck array form of
+**  the BDF methods used by the LSODE solver, as presented in:
+**    Hindmarsh, A.C., "ODEPACK, a systematized collection of ODE solvers",
+**    in Scientific Computing, R.S. Stepleman et al. (eds.), North-Holland,
+**    Amsterdam, 1983, pp. 55-64.
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include "msxutils.h"
+#include "bdf.h"
+#include "msxtypes.h"
+
+#define fmin(x,y) (((x)<=(y)) ? (x) : (y))     /* minimum of x and y    */
+#define fmax(x,y) (((x)>=(y)) ? (x) : (y))     /* maximum of x and y    */
+
+#define MAX_CORR  3        // max. Newton iterations in a step
+#define MAX_FAIL  10       // max. failed attempts at a single step
+#define JAC_STEPS 20       // steps taken before the Jacobian is refreshed
+#define MAX_GROW  10.0     // max. growth of the step size
+
+//  Local functions
+//-----------------
+static int    integrate(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+                        double t, double tnext, double *htry, double atol[],
+                        double rtol[], MSXSparse *sp);
+static void   evalRates(MSXproject MSX, MSXBdf *bdf, double t, double *y,
+                        int n, double *f);
+static int    evalJacobian(MSXproject MSX, MSXBdf *bdf, MSXSparse *sp,
+                           double t, double *y, int n);
+static int    factorNewton(MSXBdf *bdf, MSXSparse *sp, int n, double gamma);
+static void   solveNewton(MSXBdf *bdf, MSXSparse *sp, int n, double *b);
+static void   predict(double **z, int q, int n, double sign);
+static void   rescale(double **z, int q, int n, double rh);
+static double wrmsNorm(double *v, double *v0, double *ewt, int n);
+
+//=============================================================================
+
+int bdf_open(MSXBdf *bdf, int n)
+/**
+**  Purpose:
+**    Opens the BDF integrator.
+**
+**  Input:
+**    bdf = integrator work space to initialize
+**    n = number of equations to be solved
+**
+**  Returns:
+**    1 if successful, 0 if not.
+*/
+{
+    int    n1 = n + 1;
+    int    q, i;
+    double pc[BDF_MAXORDER+1];
+    double rq1fac;
+
+    bdf->Nmax = n;
+    bdf->Z = createMatrix(BDF_MAXORDER+2, n1);
+    bdf->Acor = (double*)calloc(n1, sizeof(double));
+    bdf->Acor0 = (double*)calloc(n1, sizeof(double));
+    bdf->Ewt = (double*)calloc(n1, sizeof(double));
+    bdf->Ynew = (double*)calloc(n1, sizeof(double));
+    bdf->F = (double*)calloc(n1, sizeof(double));
+    bdf->Del = (double*)calloc(n1, sizeof(double));
+    bdf->W = (double*)calloc(n1, sizeof(double));
+    bdf->Ysys = (double*)calloc(n1, sizeof(double));
+    bdf->Jindx = (int*)calloc(n1, sizeof(int));
+    bdf->J = createMatrix(n1, n1);
+    bdf->P = createMatrix(n1, n1);
+    bdf->BatchY = (double*)calloc(n1*MAX_BATCH, sizeof(double));
+    bdf->BatchF = (double*)calloc(n1*MAX_BATCH, sizeof(double));
+    if (!bdf->Z || !bdf->J || !bdf->P) return 0;
+    if (!bdf->Acor || !bdf->Acor0 || !bdf->Ewt || !bdf->Ynew || !bdf->F ||
+        !bdf->Del || !bdf->W || !bdf->Ysys || !bdf->Jindx) return 0;
+    if (!bdf->BatchY || !bdf->BatchF) return 0;
+
+// --- coefficients of each order's method are those of the
+//     polynomial (x+1)(x+2)...(x+q), scaled so that El[q][1] = 1
+
+    pc[0] = 1.0;
+    rq1fac = 1.0;
+    for (q=1; q<=BDF_MAXORDER; q++)
+    {
+        pc[q] = 0.0;
+        for (i=q; i>=1; i--) pc[i] = pc[i-1] + q*pc[i];
+        pc[0] = q*pc[0];
+        for (i=0; i<=q; i++) bdf->El[q][i] = pc[i] / pc[1];
+        bdf->El[q][1] = 1.0;
+        bdf->Tesco[q][0] = rq1fac;
+        bdf->Tesco[q][1] = (q + 1) / bdf->El[q][0];
+        bdf->Tesco[q][2] = (q + 2) / bdf->El[q][0];
+        rq1fac = rq1fac / q;
+    }
+    return 1;
+}
+
+//=============================================================================
+
+void bdf_close(MSXBdf *bdf)
+/**
+**  Purpose:
+**    closes the BDF integrator.
+**
+**  Input:
+**    bdf = integrator work space to free.
+*/
+{
+    freeMatrix(bdf->Z);
+    bdf->Z = NULL;
+    freeMatrix(bdf->J);
+    bdf->J = NULL;
+    freeMatrix(bdf->P);
+    bdf->P = NULL;
+    if (bdf->Acor) { free(bdf->Acor); bdf->Acor = NULL; }
+    if (bdf->Acor0) { free(bdf->Acor0); bdf->Acor0 = NULL; }
+    if (bdf->Ewt) { free(bdf->Ewt); bdf->Ewt = NULL; }
+    if (bdf->Ynew) { free(bdf->Ynew); bdf->Ynew = NULL; }
+    if (bdf->F) { free(bdf->F); bdf->F = NULL; }
+    if (bdf->Del) { free(bdf->Del); bdf->Del = NULL; }
+    if (bdf->W) { free(bdf->W); bdf->W = NULL; }
+    if (bdf->Ysys) { free(bdf->Ysys); bdf->Ysys = NULL; }
+    if (bdf->Jindx) { free(bdf->Jindx); bdf->Jindx = NULL; }
+    if (bdf->BatchY) { free(bdf->BatchY); bdf->BatchY = NULL; }
+    if (bdf->BatchF) { free(bdf->BatchF); bdf->BatchF = NULL; }
+}
+
+//=============================================================================
+
+int bdf_integrate(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+                  double t, double tnext, double* htry, double atol[], double rtol[],
+                  void (*func)(MSXproject, double, double*, int, double*),
+                  int (*jac)(MSXproject, double, double*, int, double**),
+                  MSXSparse *sp)
+/**
+**  Purpose:
+**    integrates a system of ODEs over a specified time interval.
+**
+**  Input:
+**    bdf = integrator work space
+**    y[1..n] = vector of dependent variable values at the start
+**              of the integration interval
+**    n = number of dependent variables
+**    t = time value at the start of the interval
+**    tnext = time value at the end of the interval
+**    htry = initial step size to be taken
+**    atol[1..n] = vector of absolute tolerances on the variables y
+**    rtol[1..n] = vector of relative tolerances on the variables y
+**    func = name of the function that computes dy/dt for each y
+**    jac = name of the function that computes the Jacobian of the
+**          system analytically (or NULL to use finite differences)
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**
+**  Output:
+**    y[1..n] = vector of dependent variable values at the end
+**              of the integration interval
+**    htry = size of the last full time step taken.
+**
+**  Returns:
+**    the number of times that func() was called, -1 if the
+**    Newton matrix is singular, or -2 if the step size shrinks
+**    to 0 or a step keeps failing.
+**
+**  Notes:
+**  1. The arguments to the function func() are:
+**      t = current time
+**      y[1..n] = vector of dependent variable values
+**      n = number of dependent variables
+**      dfdt[1..n] = vector of derivative values computed.
+**
+**  2. The arguments to the function jac() are the same as for func()
+**     except that the Jacobian matrix a[1..n][1..n] is computed. It
+**     returns 0 if the Jacobian could not be evaluated, in which case
+**     finite differences are used instead.
+**
+**  3. The integration starts at first order each time it is called,
+**     raising the order as the solution allows. The Jacobian is kept
+**     across steps for the Newton iterations, and is only refreshed
+**     when they fail to converge or after JAC_STEPS steps.
+*/
+{
+    bdf->Func = func;
+    bdf->Jac = jac;
+    bdf->BatchFunc = NULL;
+    bdf->BatchJac = NULL;
+    return integrate(MSX, bdf, y, n, t, tnext, htry, atol, rtol, sp);
+}
+
+//=============================================================================
+
+int bdf_integrateBatch(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+                       int nb, double t, double tnext, double htry[], double atol[],
+                       double rtol[],
+                       void (*func)(MSXproject, int, int*, double*, int, double*),
+                       int (*jac)(MSXproject, int, double*, int, double**),
+                       MSXSparse *sp)
+/**
+**  Purpose:
+**    integrates a batch of independent systems of ODEs over a specified
+**    time interval.
+**
+**  Input:
+**    bdf = integrator work space
+**    y[] = dependent variable values of each system at the start
+**          of the integration interval
+**    n = number of dependent variables in each system
+**    nb = number of systems in the batch (no more than MAX_BATCH)
+**    t = time value at the start of the interval
+**    tnext = time value at the end of the interval
+**    htry[] = initial step size to be taken by each system
+**    atol[1..n] = vector of absolute tolerances on the variables y
+**    rtol[1..n] = vector of relative tolerances on the variables y
+**    func = name of the function that computes dy/dt for a batch
+**           of systems
+**    jac = name of the function that computes the Jacobian of a
+**          single system analytically (or NULL to use finite
+**          differences)
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**
+**  Output:
+**    y[] = dependent variable values at the end of the interval
+**    htry[] = size of the last full time step taken by each system.
+**
+**  Returns:
+**    the number of times that func() was called, -1 if the Newton
+**    matrix of some system is singular, or -2 if its step size
+**    shrinks to 0.
+**
+**  Notes:
+**  1. y[] and the arguments to func() and jac() are laid out as
+**     described for ros2_integrateBatch.
+**
+**  2. The step sizes and orders chosen for different systems soon
+**     part ways, so the systems are integrated one at a time, each
+**     taking exactly the steps that bdf_integrate would take for it.
+*/
+{
+    int l, j, ierr, nfcn = 0;
+
+    bdf->Func = NULL;
+    bdf->Jac = NULL;
+    bdf->BatchFunc = func;
+    bdf->BatchJac = jac;
+    for (l=0; l<nb; l++)
+    {
+        bdf->Lane = l;
+        for (j=1; j<=n; j++) bdf->Ysys[j] = y[j*MAX_BATCH+l];
+        ierr = integrate(MSX, bdf, bdf->Ysys, n, t, tnext, &htry[l], atol,
+                         rtol, sp);
+        if ( ierr < 0 ) return ierr;
+        nfcn += ierr;
+        for (j=1; j<=n; j++) y[j*MAX_BATCH+l] = bdf->Ysys[j];
+    }
+    return nfcn;
+}
+
+//=============================================================================
+
+int integrate(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+              double t, double tnext, double *htry, double atol[],
+              double rtol[], MSXSparse *sp)
+/**
+**  Purpose:
+**    integrates the system of ODEs whose functions were assigned
+**    to the integrator.
+**
+**  Input:
+**    same as bdf_integrate.
+**
+**  Output:
+**    same as bdf_integrate.
+**
+**  Returns:
+**    same as bdf_integrate.
+*/
+{
+    double UROUND = 2.3e-16;
+    double **z = bdf->Z;
+    double *acor = bdf->Acor;
+    double *acor0 = bdf->Acor0;
+    double *ewt = bdf->Ewt;
+    double *ynew = bdf->Ynew;
+    double *f = bdf->F;
+    double *del = bdf->Del;
+    double *el;
+    double h, hmin, hnext, tplus, ytol, rh, rhdn, rhup;
+    double gamma, gammaP, crate, dnorm, dprev, dcon, dsm;
+    int    q, newq, nq, jage, jcur, nfail, nfcn, conv, i, j, m;
+
+// --- Initial step size
+
+    evalRates(MSX, bdf, t, y, n, f);
+    nfcn = 1;
+    hmin = 1.e-8;
+    h = *htry;
+    if ( h <= 0.0 )
+    {
+        h = tnext - t;
+        for (j=1; j<=n; j++)
+        {
+            ytol = atol[j] + rtol[j]*fabs(y[j]);
+            if (f[j] != 0.0) h = fmin(h, (ytol/fabs(f[j])));
+        }
+    }
+    h = fmax(hmin, h);
+    h = fmin(tnext - t, h);
+    hnext = h;
+
+// --- start at first order with a history array holding y and h*dy/dt
+
+    q = 1;
+    for (j=1; j<=n; j++)
+    {
+        z[0][j] = y[j];
+        z[1][j] = h*f[j];
+    }
+    nq = 0;
+    jage = -1;
+    gammaP = 0.0;
+    crate = 0.7;
+    nfail = 0;
+
+// --- Start the time loop
+
+    while ( t < tnext )
+    {
+    // --- check for zero step size
+
+        if (0.10*fabs(h) <= fabs(t)*UROUND) return -2;
+
+    // --- error weights are based on the solution at the start of
+    //     the step
+
+        for (j=1; j<=n; j++) ewt[j] = 1.0 / (rtol[j]*fabs(z[0][j]) + atol[j]);
+        el = bdf->El[q];
+
+    // --- shorten a step that would pass tnext
+
+        hnext = h;
+        tplus = t + h;
+        if ( tplus >= tnext )
+        {
+            if ( tplus > tnext )
+            {
+                rescale(z, q, n, (tnext - t)/h);
+                h = tnext - t;
+            }
+            tplus = tnext;
+        }
+
+    // --- predict the solution at the end of the step
+
+        predict(z, q, n, 1.0);
+
+    // --- refresh a missing or outdated Jacobian and factorize the
+    //     Newton matrix for a new step size or order
+
+        jcur = 0;
+        if ( jage < 0 || jage >= JAC_STEPS )
+        {
+            nfcn += evalJacobian(MSX, bdf, sp, tplus, z[0], n);
+            jage = 0;
+            jcur = 1;
+            gammaP = 0.0;
+        }
+        gamma = h*el[0];
+        if ( gamma != gammaP )
+        {
+            if ( !factorNewton(bdf, sp, n, gamma) )
+            {
+                predict(z, q, n, -1.0);
+                if ( jcur ) return -1;
+                jage = -1;
+                continue;
+            }
+            gammaP = gamma;
+            crate = 0.7;
+        }
+
+    // --- Newton iterations for the corrections of the predicted solution
+
+        for (j=1; j<=n; j++)
+        {
+            acor[j] = 0.0;
+            ynew[j] = z[0][j];
+        }
+        conv = 0;
+        dprev = 0.0;
+        for (m=0; m<MAX_CORR; m++)
+        {
+            evalRates(MSX, bdf, tplus, ynew, n, f);
+            nfcn++;
+            for (j=1; j<=n; j++) del[j] = h*f[j] - z[1][j] - acor[j];
+            solveNewton(bdf, sp, n, del);
+            dnorm = wrmsNorm(del, NULL, ewt, n);
+            for (j=1; j<=n; j++)
+            {
+                acor[j] += del[j];
+                ynew[j] = z[0][j] + el[0]*acor[j];
+            }
+            if ( m > 0 ) crate = fmax(0.2*crate, dnorm/dprev);
+            dcon = dnorm * fmin(1.0, 1.5*crate) / (bdf->Tesco[q][1]*0.5/(q+2));
+            if ( dcon <= 1.0 )
+            {
+                conv = 1;
+                break;
+            }
+            if ( m > 0 && dnorm > 2.0*dprev ) break;
+            dprev = dnorm;
+        }
+
+    // --- if the iterations failed, retry with a new Jacobian or
+    //     else with a smaller step
+
+        if ( !conv )
+        {
+            predict(z, q, n, -1.0);
+            if ( ++nfail >= MAX_FAIL ) return -2;
+            if ( !jcur )
+            {
+                jage = -1;
+                continue;
+            }
+            jage = -1;
+            rescale(z, q, n, 0.25);
+            h = 0.25*h;
+            nq = 0;
+            continue;
+        }
+
+    // --- reject a step whose local error is too large
+
+        dsm = wrmsNorm(acor, NULL, ewt, n) / bdf->Tesco[q][1];
+        if ( dsm > 1.0 )
+        {
+            predict(z, q, n, -1.0);
+            if ( ++nfail >= MAX_FAIL ) return -2;
+            nq = 0;
+
+        // --- restart at first order after repeated failures
+
+            if ( nfail >= 3 && q > 1 )
+            {
+                h = 0.1*h;
+                q = 1;
+                evalRates(MSX, bdf, t, z[0], n, f);
+                nfcn++;
+                for (j=1; j<=n; j++) z[1][j] = h*f[j];
+                continue;
+            }
+
+        // --- otherwise shrink the step, lowering the order if
+        //     that allows a larger step
+
+            rh = 1.0 / (1.2*pow(dsm, 1.0/(q+1)) + 1.2e-6);
+            if ( q > 1 )
+            {
+                rhdn = 1.0 / (1.3*pow(wrmsNorm(z[q], NULL, ewt, n) /
+                              bdf->Tesco[q][0], 1.0/q) + 1.3e-6);
+                if ( rhdn > rh )
+                {
+                    rh = rhdn;
+                    q = q - 1;
+                }
+            }
+            rh = fmax(0.1, fmin(0.9, rh));
+            if ( nfail >= 2 ) rh = fmin(0.2, rh);
+            rescale(z, q, n, rh);
+            h = rh*h;
+            continue;
+        }
+
+    // --- accept the step and correct the history array
+
+        for (i=0; i<=q; i++)
+        {
+            for (j=1; j<=n; j++) z[i][j] += el[i]*acor[j];
+        }
+        t = tplus;
+        nfail = 0;
+        jage++;
+        nq++;
+
+    // --- choose a new step size and order after q+1 steps taken
+    //     with the current ones
+
+        if ( nq > q )
+        {
+            rh = 1.0 / (1.2*pow(dsm, 1.0/(q+1)) + 1.2e-6);
+            newq = q;
+            if ( q > 1 )
+            {
+                rhdn = 1.0 / (1.3*pow(wrmsNorm(z[q], NULL, ewt, n) /
+                              bdf->Tesco[q][0], 1.0/q) + 1.3e-6);
+                if ( rhdn > rh )
+                {
+                    rh = rhdn;
+                    newq = q - 1;
+                }
+            }
+            if ( q < BDF_MAXORDER )
+            {
+                rhup = 1.0 / (1.4*pow(wrmsNorm(acor, acor0, ewt, n) /
+                              bdf->Tesco[q][2], 1.0/(q+2)) + 1.4e-6);
+                if ( rhup > rh )
+                {
+                    rh = rhup;
+                    newq = q + 1;
+                }
+            }
+
+        // --- changes that gain little are put off for a few steps
+
+            if ( rh < 1.1 ) nq = q - 2;
+            else
+            {
+                if ( newq > q )
+                {
+                    for (j=1; j<=n; j++) z[newq][j] = acor[j]*el[q]/newq;
+                }
+                q = newq;
+                rh = fmin(MAX_GROW, rh);
+                rescale(z, q, n, rh);
+                h = rh*h;
+                nq = 0;
+            }
+        }
+        for (j=1; j<=n; j++) acor0[j] = acor[j];
+    }
+
+    for (j=1; j<=n; j++) y[j] = z[0][j];
+    *htry = hnext;
+    return nfcn;
+}
+
+//=============================================================================
+
+void evalRates(MSXproject MSX, MSXBdf *bdf, double t, double *y, int n,
+               double *f)
+/**
+**  Purpose:
+**    evaluates the derivatives of the system being integrated.
+**
+**  Input:
+**    bdf = integrator work space
+**    t = current time
+**    y[1..n] = vector of dependent variable values
+**    n = number of dependent variables
+**
+**  Output:
+**    f[1..n] = vector of derivative values.
+*/
+{
+    int j;
+
+    if ( bdf->Func )
+    {
+        bdf->Func(MSX, t, y, n, f);
+        return;
+    }
+    for (j=1; j<=n; j++) bdf->BatchY[j*MAX_BATCH] = y[j];
+    bdf->BatchFunc(MSX, 1, &bdf->Lane, bdf->BatchY, n, bdf->BatchF);
+    for (j=1; j<=n; j++) f[j] = bdf->BatchF[j*MAX_BATCH];
+}
+
+//=============================================================================
+
+int evalJacobian(MSXproject MSX, MSXBdf *bdf, MSXSparse *sp, double t,
+                 double *y, int n)
+/**
+**  Purpose:
+**    computes the Jacobian matrix of the system being integrated.
+**
+**  Input:
+**    bdf = integrator work space
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**    t = current time
+**    y[1..n] = vector of dependent variable values
+**    n = number of dependent variables
+**
+**  Output:
+**    bdf->J[1..n][1..n] = coeffs. of the Jacobian matrix.
+**
+**  Returns:
+**    the number of derivative evaluations made.
+**
+**  Notes:
+**    Uses an analytical Jacobian when one is available, or else the
+**    same central differences as jacobian() and sparseJacobian() in
+**    msxutils.c.
+*/
+{
+    int    i, j, g, p, r, ng;
+    double eps = 1.0e-7, eps2;
+    double **a = bdf->J;
+    double *x0 = a[0];
+    double *f = bdf->Del;
+    double *w = bdf->W;
+
+    if ( bdf->Jac && bdf->Jac(MSX, t, y, n, a) ) return 0;
+    if ( bdf->BatchJac && bdf->BatchJac(MSX, bdf->Lane, y, n, a) ) return 0;
+
+// --- without a sparsity structure each column is a group of its own
+
+    ng = sp ? sp->ngroups : n;
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) a[i][j] = 0.0;
+    }
+    for (g=1; g<=ng; g++)
+    {
+        for (p=(sp ? sp->groupStart[g] : g); p<(sp ? sp->groupStart[g+1] : g+1); p++)
+        {
+            j = sp ? sp->groupCol[p] : p;
+            x0[j] = y[j];
+            y[j] = x0[j] + eps;
+        }
+        evalRates(MSX, bdf, t, y, n, f);
+        for (p=(sp ? sp->groupStart[g] : g); p<(sp ? sp->groupStart[g+1] : g+1); p++)
+        {
+            j = sp ? sp->groupCol[p] : p;
+            if ( x0[j] != 0.0 ) y[j] = x0[j] - eps;
+            else                y[j] = x0[j];
+        }
+        evalRates(MSX, bdf, t, y, n, w);
+        for (p=(sp ? sp->groupStart[g] : g); p<(sp ? sp->groupStart[g+1] : g+1); p++)
+        {
+            j = sp ? sp->groupCol[p] : p;
+            eps2 = (x0[j] == 0.0) ? eps : 2.0*eps;
+            if ( sp )
+            {
+                for (r=sp->colStart[j]; r<sp->colStart[j+1]; r++)
+                {
+                    i = sp->colRow[r];
+                    a[i][j] = (f[i] - w[i]) / eps2;
+                }
+            }
+            else for (i=1; i<=n; i++) a[i][j] = (f[i] - w[i]) / eps2;
+            y[j] = x0[j];
+        }
+    }
+    return 2*ng;
+}
+
+//=============================================================================
+
+int factorNewton(MSXBdf *bdf, MSXSparse *sp, int n, double gamma)
+/**
+**  Purpose:
+**    factorizes the Newton matrix I - gamma*J without changing the
+**    Jacobian J it is formed from.
+**
+**  Input:
+**    bdf = integrator work space
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**    n = matrix size
+**    gamma = step size times the method's leading coefficient.
+**
+**  Output:
+**    bdf->P[][] = LU factors of the Newton matrix.
+**
+**  Returns:
+**    1 if successful, 0 if the matrix is singular.
+*/
+{
+    int i, j;
+    double **a = bdf->J;
+    double **lu = bdf->P;
+
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) lu[i][j] = -gamma*a[i][j];
+        lu[i][i] += 1.0;
+    }
+    bdf->Dense = 0;
+    if ( sp && sp->factor && sparseFactorize(sp, lu, lu) ) return 1;
+    bdf->Dense = 1;
+    if ( sp && sp->factor )
+    {
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++) lu[i][j] = -gamma*a[i][j];
+            lu[i][i] += 1.0;
+        }
+    }
+    return factorize(lu, n, bdf->W, bdf->Jindx);
+}
+
+//=============================================================================
+
+void solveNewton(MSXBdf *bdf, MSXSparse *sp, int n, double *b)
+/**
+**  Purpose:
+**    solves a linear system with the matrix factorized by factorNewton.
+**
+**  Input:
+**    bdf = integrator work space
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**    n = matrix size
+**    b[1..n] = right-hand side vector.
+**
+**  Output:
+**    b[1..n] = solution vector.
+*/
+{
+    if ( bdf->Dense ) solve(bdf->P, n, bdf->Jindx, b);
+    else sparseSolve(sp, bdf->P, b, bdf->W);
+}
+
+//=============================================================================
+
+void predict(double **z, int q, int n, double sign)
+/**
+**  Purpose:
+**    predicts the history array at the end of a step (or undoes
+**    the prediction).
+**
+**  Input:
+**    z[0..q][1..n] = history array of a q-th order method
+**    n = number of variables
+**    sign = 1 to predict, -1 to undo a prediction.
+**
+**  Output:
+**    z[0..q][1..n] = history array multiplied by (or divided by)
+**                    the Pascal triangle matrix.
+*/
+{
+    int i, j, k;
+
+    for (k=1; k<=q; k++)
+    {
+        for (i=q-k; i<q; i++)
+        {
+            for (j=1; j<=n; j++) z[i][j] += sign*z[i+1][j];
+        }
+    }
+}
+
+//=============================================================================
+
+void rescale(double **z, int q, int n, double rh)
+/**
+**  Purpose:
+**    rescales the history array for a new step size.
+**
+**  Input:
+**    z[0..q][1..n] = history array of a q-th order method
+**    n = number of variables
+**    rh = ratio of the new step size to the old one.
+**
+**  Output:
+**    z[i][1..n] = scaled by rh to the power i.
+*/
+{
+    int    i, j;
+    double r = 1.0;
+
+    for (i=1; i<=q; i++)
+    {
+        r = r*rh;
+        for (j=1; j<=n; j++) z[i][j] *= r;
+    }
+}
+
+//=============================================================================
+
+double wrmsNorm(double *v, double *v0, double *ewt, int n)
+/**
+**  Purpose:
+**    computes the weighted root mean square norm of a vector.
+**
+**  Input:
+**    v[1..n] = a vector
+**    v0[1..n] = a vector subtracted from v (or NULL)
+**    ewt[1..n] = inverse error weights
+**    n = vector size.
+**
+**  Returns:
+**    the norm of v - v0.
+*/
+{
+    int    j;
+    double d, sum = 0.0;
+
+    for (j=1; j<=n; j++)
+    {
+        d = v0 ? v[j] - v0[j] : v[j];
+        d = d*ewt[j];
+        sum += d*d;
+    }
+    return sqrt(sum/n);
+}
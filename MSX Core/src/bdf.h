@@ -0,0 +1,59 @@
+/************************************************************************
+**  MODULE:        BDF.H
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Header file for the stiff ODE solver BDF.C.
+**  VERSION:       1.1.00
+**  LAST UPDATE:   Refer to git history
+***********************************************************************/
+
+#include "msxutils.h"
+
+#define BDF_MAXORDER 5             // highest order of the BDF formulas
+
+typedef struct {
+
+    int      Nmax;                  // Max. number of equations
+    double** Z;                     // Nordsieck history array (rows 0..q)
+    double*  Acor;                  // accumulated corrections of a step
+    double*  Acor0;                 // corrections of the previous step
+    double*  Ewt;                   // inverse error weights
+    double*  Ynew;                  // corrector iterate
+    double*  F;                     // function values
+    double*  Del;                   // Newton correction
+    double*  W;                     // work array for LU solutions
+    double*  Ysys;                  // a single system taken from a batch
+    double** J;                     // Jacobian matrix
+    double** P;                     // LU factors of the Newton matrix
+    int*     Jindx;                 // LU column indexes
+    int      Dense;                 // 1 if a sparse matrix had to be pivoted
+    double   El[BDF_MAXORDER+1][BDF_MAXORDER+1];  // BDF method coefficients
+    double   Tesco[BDF_MAXORDER+1][3];            // error test constants
+    double*  BatchY;                // a system laid out as in a batch
+    double*  BatchF;                // its function values
+    int      Lane;                  // index of the batch system integrated
+    void (*Func)(MSXproject, double, double*, int, double*);
+    void (*BatchFunc)(MSXproject, int, int*, double*, int, double*);
+    int  (*Jac)(MSXproject, double, double*, int, double**);
+    int  (*BatchJac)(MSXproject, int, double*, int, double**);
+}MSXBdf;
+
+// Opens the ODE solver system
+int  bdf_open(MSXBdf *bdf, int n);
+
+// Closes the ODE solver system
+void bdf_close(MSXBdf *bdf);
+
+// Applies the solver to integrate a specific system of ODEs
+int  bdf_integrate(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+                   double t, double tnext, double* htry, double atol[], double rtol[],
+                   void (*func)(MSXproject, double, double*, int, double*),
+                   int (*jac)(MSXproject, double, double*, int, double**),
+                   MSXSparse *sp);
+
+// Applies the solver to a batch of independent systems of ODEs
+int  bdf_integrateBatch(MSXproject MSX, MSXBdf *bdf, double y[], int n,
+                        int nb, double t, double tnext, double htry[], double atol[],
+                        double rtol[],
+                        void (*func)(MSXproject, int, int*, double*, int, double*),
+                        int (*jac)(MSXproject, int, double*, int, double**),
+                        MSXSparse *sp);
@@ -30,6 +30,7 @@ int    MSXqual_open(MSXproject MSX);
 int    MSXqual_init(MSXproject MSX);
 int    MSXqual_step(MSXproject MSX, long *t, long *tleft);
 int    MSXqual_close(MSXproject MSX);
+int    MSXchem_catchUp(MSXproject MSX);
 
 //=============================================================================
 
@@ -51,7 +52,7 @@ int DLLEXPORT MSX_open(MSXproject *MSX)
     struct Project *p = (struct Project *) calloc(1, sizeof(struct Project));
     *MSX = p;
     setDefaults(*MSX);
-    createHashTables();
+    createHashTables(*MSX);
     return 0;
 }
 
@@ -66,25 +67,21 @@ int DLLEXPORT MSX_close(MSXproject MSX)
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     if ( MSX->RptFile.file ) fclose(MSX->RptFile.file);                          //(LR-11/20/07, to fix bug 08)
     if ( MSX->HydFile.file ) fclose(MSX->HydFile.file);
-    if ( MSX->TmpOutFile.file && MSX->TmpOutFile.file != MSX->OutFile.file )
-        fclose(MSX->TmpOutFile.file);
     if ( MSX->OutFile.file ) fclose(MSX->OutFile.file);
 
     // --- delete all temporary files
 
     if ( MSX->OutFile.mode == SCRATCH_FILE ) remove(MSX->OutFile.name);
-    remove(MSX->TmpOutFile.name);
 
     // --- free all allocated memory
 
     MSX->RptFile.file = NULL;                                                   //(LR-11/20/07, to fix bug 08)
     MSX->HydFile.file = NULL;
     MSX->OutFile.file = NULL;
-    MSX->TmpOutFile.file = NULL;
     if (MSX->QualityOpened) MSXqual_close(MSX);
     freeIDs(MSX);
     deleteObjects(MSX);
-    deleteHashTables();
+    deleteHashTables(MSX);
     MSX->ProjectOpened = FALSE;
     free(MSX);
     return 0;
@@ -196,10 +193,10 @@ int DLLEXPORT MSX_addNode(MSXproject MSX, char *id)
     // Cannot modify network structure while solvers are active
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(NODE, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-    int err = checkID(id);
+    if ( findObject(MSX, NODE, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    int err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[NODE]+1;
     if (i > MSX->Sizes[NODE]) err = MSX_setSize(MSX, NODE, i);
@@ -238,11 +235,11 @@ int DLLEXPORT MSX_addTank(MSXproject MSX,char *id, double initialVolume, int mix
     // Cannot modify network structure while solvers are active
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(TANK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-    int err = checkID(id);
+    if ( findObject(MSX, TANK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    int err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(TANK, id, MSX->Nobjects[TANK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
-    if ( addObject(NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, TANK, id, MSX->Nobjects[TANK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[TANK]+1;
     if (i > MSX->Sizes[TANK]) err = MSX_setSize(MSX, TANK, i);
@@ -291,11 +288,11 @@ int DLLEXPORT MSX_addReservoir(MSXproject MSX, char *id, double initialVolume, i
     // Cannot modify network structure while solvers are active
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(TANK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-    int err = checkID(id);
+    if ( findObject(MSX, TANK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    int err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(TANK, id, MSX->Nobjects[TANK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
-    if ( addObject(NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, TANK, id, MSX->Nobjects[TANK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, NODE, id, MSX->Nobjects[NODE]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[TANK]+1;
     if (i > MSX->Sizes[TANK]) err = MSX_setSize(MSX, TANK, i);
@@ -347,15 +344,15 @@ int DLLEXPORT MSX_addLink(MSXproject MSX, char *id, char *startNode, char *endNo
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     
-    if ( findObject(LINK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-    int err = checkID(id);
+    if ( findObject(MSX, LINK, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    int err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(LINK, id, MSX->Nobjects[LINK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, LINK, id, MSX->Nobjects[LINK]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     // Check that the start and end nodes exist
-    int x = findObject(NODE, startNode);
+    int x = findObject(MSX, NODE, startNode);
     if ( x <= 0 ) return ERR_NAME;
-    int y = findObject(NODE, endNode);
+    int y = findObject(MSX, NODE, endNode);
     if ( y <= 0 ) return ERR_NAME;
 
     int i = MSX->Nobjects[LINK]+1;
@@ -437,6 +434,24 @@ int DLLEXPORT MSX_addOption(MSXproject MSX, int optionType, char *value)
         if ( !MSXutils_getDouble(value, &MSX->DefAtol) ) return ERR_NUMBER;
         break;
 
+    case JACOBIAN_OPTION:
+        k = MSXutils_findmatch(value, JacobianWords);
+        if ( k < 0 ) return ERR_KEYWORD;
+        MSX->Jacobian = k;
+        break;
+
+    case SPLITTING_OPTION:
+        k = MSXutils_findmatch(value, SplittingWords);
+        if ( k < 0 ) return ERR_KEYWORD;
+        MSX->Splitting = k;
+        break;
+
+    case STEPPING_OPTION:
+        k = MSXutils_findmatch(value, SteppingWords);
+        if ( k < 0 ) return ERR_KEYWORD;
+        MSX->Stepping = k;
+        break;
+
     case COMPILER_OPTION:
         k = MSXutils_findmatch(value, CompilerWords);
         if ( k < 0 ) return ERR_KEYWORD;
@@ -473,11 +488,11 @@ int DLLEXPORT MSX_addSpecies(MSXproject MSX, char *id, int type, int units, doub
     if (!(type == BULK || type == WALL)) return ERR_KEYWORD;
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(SPECIES, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    if ( findObject(MSX, SPECIES, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
 
-    int err = checkID(id);
+    int err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(SPECIES, id, MSX->Nobjects[SPECIES]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, SPECIES, id, MSX->Nobjects[SPECIES]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[SPECIES]+1;
     if (i > MSX->Sizes[SPECIES]) err = MSX_setSize(MSX, SPECIES, i);
@@ -539,10 +554,10 @@ int DLLEXPORT MSX_addCoefficeint(MSXproject MSX, int type, char *id, double valu
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     int err = 0;
     if (type == PARAMETER) {
-        if ( findObject(PATTERN, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-        err = checkID(id);
+        if ( findObject(MSX, PATTERN, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+        err = checkID(MSX, id);
         if ( err ) return err;
-        if ( addObject(PARAMETER, id, MSX->Nobjects[PARAMETER]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+        if ( addObject(MSX, PARAMETER, id, MSX->Nobjects[PARAMETER]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
         int i = MSX->Nobjects[PARAMETER]+1;
         if (i > MSX->Sizes[PARAMETER]) err = MSX_setSize(MSX, PARAMETER, i);
         MSX->Param[i].id = calloc(1, MAXID+1);
@@ -552,10 +567,10 @@ int DLLEXPORT MSX_addCoefficeint(MSXproject MSX, int type, char *id, double valu
         MSX->Nobjects[PARAMETER]++;
     }
     else if (type == CONSTANT) {
-        if ( findObject(CONSTANT, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-        err = checkID(id);
+        if ( findObject(MSX, CONSTANT, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+        err = checkID(MSX, id);
         if ( err ) return err;
-        if ( addObject(CONSTANT, id, MSX->Nobjects[CONSTANT]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+        if ( addObject(MSX, CONSTANT, id, MSX->Nobjects[CONSTANT]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
         int i = MSX->Nobjects[CONSTANT]+1;
         if (i > MSX->Sizes[CONSTANT]) err = MSX_setSize(MSX, CONSTANT, i);
         MSX->Const[i].id = calloc(1, MAXID+1);
@@ -589,11 +604,11 @@ int DLLEXPORT MSX_addTerm(MSXproject MSX, char *id, char *equation)
 {
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(TERM, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    if ( findObject(MSX, TERM, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
     int err = 0;
-    err = checkID(id);
+    err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(TERM, id, MSX->Nobjects[TERM]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, TERM, id, MSX->Nobjects[TERM]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[TERM]+1;
     if (i > MSX->Sizes[TERM]) err = MSX_setSize(MSX, TERM, i);
@@ -646,7 +661,7 @@ int DLLEXPORT MSX_addExpression(MSXproject MSX, int classType, int expressionTyp
 
     // --- determine species associated with expression
 
-    int i = findObject(SPECIES, species);
+    int i = findObject(MSX, SPECIES, species);
     if ( i < 1 ) return ERR_NAME;
 
     // --- check that species does not already have an expression
@@ -703,9 +718,9 @@ int DLLEXPORT MSX_addSource(MSXproject MSX, int sourceType, char *nodeId, char *
     int err = 0;
     // --- determine source type 
     if ( sourceType < 0 || sourceType > 3 ) return ERR_KEYWORD;
-    int j = findObject(NODE, nodeId);
+    int j = findObject(MSX, NODE, nodeId);
     if ( j <= 0 ) return ERR_NAME;
-    int m = findObject(SPECIES, speciesId);
+    int m = findObject(MSX, SPECIES, speciesId);
     if ( m <= 0 ) return ERR_NAME;
     // --- check that species is a BULK species
     if ( MSX->Species[m].type != BULK ) return 0;
@@ -728,7 +743,7 @@ int DLLEXPORT MSX_addSource(MSXproject MSX, int sourceType, char *nodeId, char *
     source->species = m;
     source->c0 = strength;
     int i = 0;
-    i = findObject(PATTERN, timePattern);
+    i = findObject(MSX, PATTERN, timePattern);
     source->pat = i;
     return err;
 }
@@ -764,7 +779,7 @@ int DLLEXPORT MSX_addQuality(MSXproject MSX, char *type, char *speciesId, double
     else return ERR_KEYWORD;
 
     // --- find species index
-    int m = findObject(SPECIES, speciesId);
+    int m = findObject(MSX, SPECIES, speciesId);
     if ( m <= 0 ) return ERR_NAME;
 
     // --- for global specification, set initial quality either for
@@ -783,14 +798,14 @@ int DLLEXPORT MSX_addQuality(MSXproject MSX, char *type, char *speciesId, double
     // --- for a specific node, get its index & set its initial quality
     else if ( i == 2 )
     {
-        int j = findObject(NODE, id);
+        int j = findObject(MSX, NODE, id);
         if ( j <= 0 ) return ERR_NAME;
         if ( MSX->Species[m].type == BULK ) MSX->Node[j].c0[m] = value;
     }
     // --- for a specific link, get its index & set its initial quality
     else if ( i == 3 )
     {
-        int j = findObject(LINK, id);
+        int j = findObject(MSX, LINK, id);
         if ( j <= 0 ) return ERR_NAME;
         MSX->Link[j].c0[m] = value;
     }
@@ -824,19 +839,19 @@ int DLLEXPORT MSX_addParameter(MSXproject MSX, char *type, char *paramId, double
     int err = 0;
 
     // --- get parameter name
-    int i = findObject(PARAMETER, paramId);
+    int i = findObject(MSX, PARAMETER, paramId);
 
     // --- for pipe parameter, get pipe index and update parameter's value
     if ( MSXutils_match(type, "PIPE") )
     {
-        int j = findObject(LINK, id);
+        int j = findObject(MSX, LINK, id);
         if ( j <= 0 ) return ERR_NAME;
         MSX->Link[j].param[i] = value;
     }
     // --- for tank parameter, get tank index and update parameter's value
     else if ( MSXutils_match(type, "TANK") )
     {
-        int j = findObject(TANK, id);
+        int j = findObject(MSX, TANK, id);
         if ( j <= 0 ) return ERR_NAME;
         j = MSX->Node[j].tank;
         if ( j > 0 ) MSX->Tank[j].param[i] = value;
@@ -875,20 +890,20 @@ int DLLEXPORT MSX_setReport(MSXproject MSX, char *reportType, char *id, int prec
     {
         // --- keyword is NODE; parse ID names of reported nodes
         case 0:
-            j = findObject(NODE, id);
+            j = findObject(MSX, NODE, id);
             if ( j <= 0 ) return ERR_NAME;
             MSX->Node[j].rpt = 1;
             break;
 
         // --- keyword is LINK: parse ID names of reported links
         case 1:
-            j = findObject(LINK, id);
+            j = findObject(MSX, LINK, id);
             if ( j <= 0 ) return ERR_NAME;
             MSX->Link[j].rpt = 1;
             break;
         // --- keyword is SPECIES; get YES/NO & precision
         case 2:
-            j = findObject(SPECIES, id);
+            j = findObject(MSX, SPECIES, id);
             if ( j <= 0 ) return ERR_NAME;
             MSX->Species[j].rpt = 1;
             MSX->Species[j].precision = precision;
@@ -939,6 +954,7 @@ int DLLEXPORT MSX_setHydraulics(MSXproject MSX, float *demands, float *heads, fl
         MSX->H[i+1] = heads[i];
     }
     for (i=0; i<nLinks; i++) MSX->Q[i+1] = flows[i];
+    MSX->HydChanged = TRUE;
     return err;
 }
 
@@ -1195,13 +1211,13 @@ int  DLLEXPORT MSX_getindex(MSXproject MSX, int type, char *id, int *index)
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     switch(type)
     {
-        case SPECIES:   i = findObject(SPECIES, id);   break;
-        case CONSTANT:  i = findObject(CONSTANT, id);  break;
-        case PARAMETER: i = findObject(PARAMETER, id); break;
-        case PATTERN:   i = findObject(PATTERN, id);   break;
-        case LINK:      i = findObject(LINK, id);      break;
-        case NODE:      i = findObject(NODE, id);      break;
-        case TANK:      i = findObject(TANK, id);      break;
+        case SPECIES:   i = findObject(MSX, SPECIES, id);   break;
+        case CONSTANT:  i = findObject(MSX, CONSTANT, id);  break;
+        case PARAMETER: i = findObject(MSX, PARAMETER, id); break;
+        case PATTERN:   i = findObject(MSX, PATTERN, id);   break;
+        case LINK:      i = findObject(MSX, LINK, id);      break;
+        case NODE:      i = findObject(MSX, NODE, id);      break;
+        case TANK:      i = findObject(MSX, TANK, id);      break;
         default:            return ERR_INVALID_OBJECT_TYPE;
     }
     if ( i < 1 ) return ERR_UNDEFINED_OBJECT_ID;
@@ -1701,6 +1717,35 @@ int  DLLEXPORT MSX_getQualityByID(MSXproject MSX, int type, char *id, char *spec
 
 //=============================================================================
 
+int  DLLEXPORT MSX_getReactionCounts(MSXproject MSX, long *reacted, long *skipped)
+/**
+**  Purpose:
+**    retrieves how many times the reactions of a pipe or tank segment
+**    have been integrated over a time step, and how many times this
+**    was skipped because the segment was quiescent.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Output:
+**    reacted = number of segment reaction integrations;
+**    skipped = number of segment reaction integrations skipped.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    *reacted = 0;
+    *skipped = 0;
+    if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
+    if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    *reacted = MSX->NumReacted;
+    *skipped = MSX->NumSkipped;
+    return 0;
+}
+
+//=============================================================================
+
 int  DLLEXPORT MSX_setconstant(MSXproject MSX, int index, double value)
 /**
 **  Purpose:
@@ -1718,10 +1763,20 @@ int  DLLEXPORT MSX_setconstant(MSXproject MSX, int index, double value)
 **    an error code or 0 for no error.
 */
 {
+    int err;
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     if ( index < 1 || index > MSX->Nobjects[CONSTANT] ) return ERR_INVALID_OBJECT_INDEX;
+
+    // --- reactions skipped under the old value must first catch up
+    if ( MSX->QualityOpened )
+    {
+        err = MSXchem_catchUp(MSX);
+        if ( err ) return err;
+    }
     MSX->Const[index].value = value;
+    if ( MSX->K ) MSX->K[index] = value;
+    MSX->CoeffChanged = TRUE;
     return 0;
 }
 
@@ -1747,10 +1802,18 @@ int  DLLEXPORT MSX_setparameter(MSXproject MSX, int type, int index, int param,
 **    an error code or 0 for no error.
 */
 {
-    int j;
+    int j, err;
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
     if ( param < 1 || param > MSX->Nobjects[PARAMETER] ) return ERR_INVALID_OBJECT_INDEX;
+    if ( type != NODE && type != LINK ) return ERR_INVALID_OBJECT_TYPE;
+
+    // --- reactions skipped under the old value must first catch up
+    if ( MSX->QualityOpened )
+    {
+        err = MSXchem_catchUp(MSX);
+        if ( err ) return err;
+    }
     if ( type == NODE )
     {
         if ( index < 1 || index > MSX->Nobjects[NODE] ) return ERR_INVALID_OBJECT_INDEX;
@@ -1762,7 +1825,7 @@ int  DLLEXPORT MSX_setparameter(MSXproject MSX, int type, int index, int param,
         if ( index < 1 || index > MSX->Nobjects[LINK] ) return ERR_INVALID_OBJECT_INDEX;
         MSX->Link[index].param[param] = value;
     }
-    else return ERR_INVALID_OBJECT_TYPE;
+    MSX->CoeffChanged = TRUE;
     return 0;
 }
 
@@ -1953,10 +2016,10 @@ int  DLLEXPORT MSX_addpattern(MSXproject MSX, char *id)
 
     if ( MSX == NULL ) return ERR_MSX_NOT_OPENED;
     if ( !MSX->ProjectOpened ) return ERR_MSX_NOT_OPENED;
-    if ( findObject(PATTERN, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
-    err = checkID(id);
+    if ( findObject(MSX, PATTERN, id) >= 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    err = checkID(MSX, id);
     if ( err ) return err;
-    if ( addObject(PATTERN, id, MSX->Nobjects[PATTERN]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
+    if ( addObject(MSX, PATTERN, id, MSX->Nobjects[PATTERN]+1) < 0 ) err = ERR_MEMORY;  // Insufficient memory
 
     int i = MSX->Nobjects[PATTERN]+1;
     if (i > MSX->Sizes[PATTERN]) err = MSX_setSize(MSX, PATTERN, i);
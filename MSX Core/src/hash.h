@@ -4,6 +4,9 @@
 **
 */
 
+#ifndef HASH_H
+#define HASH_H
+
 #define HTMAXSIZE 1999
 #define NOTFOUND  0
 
@@ -21,4 +24,5 @@ int     HTinsert(HTtable *, char *, int);
 int 	HTfind(HTtable *, char *);
 char    *HTfindKey(HTtable *, char *);
 void	HTfree(HTtable *);
-	
+
+#endif
@@ -42,6 +42,16 @@
 **	27 = log10
 **  28 = step (x<=0 ? 0 : 1)
 **	31 = ^
+**
+**   Compiled expressions (see mathexpr_compile) use the same codes for
+**   arithmetic and functions, with variables that can be read directly
+**   from the caller's ExprFrame loaded by:
+**	32 = species concentration
+**	33 = reaction parameter
+**	34 = constant
+**	35 = hydraulic variable
+**	36 = memoized variable
+**	37 = memoized invariant variable
 ******************************************************************************/
 
 #include <ctype.h>
@@ -53,6 +63,14 @@
 #include "msxtypes.h"
 
 #define MAX_STACK_SIZE  1024
+#define MAX_BATCH_STACK 32
+
+#define LOAD_SPECIES    32
+#define LOAD_PARAM      33
+#define LOAD_CONST      34
+#define LOAD_HYD        35
+#define LOAD_MEMO       36
+#define LOAD_INVARIANT  37
 
 //***************************************************                          //1.1.00
 #define MAX_TERM_SIZE  1024
@@ -77,16 +95,56 @@ struct TreeNode
 };
 typedef struct TreeNode ExprTree;
 
-// Local variables
-//----------------
-static int    Err;
-static int    Bc;
-static int    PrevLex, CurLex;
-static int    Len, Pos;
-static char   *S;
-static char   Token[255];
-static int    Ivar;
-static double Fvalue;
+//  Structure for the value of an expression over a batch of segments
+struct BatchValue
+{
+    int    uniform;               // 1 if value is the same for all segments
+    double v[MAX_BATCH];          // value for each segment (v[0] if uniform)
+};
+typedef struct BatchValue BatchValue;
+
+//  State of the parser (or differentiator) working on a single expression,
+//  kept on the caller's stack so that expressions can be built concurrently
+struct ExprState
+{
+    MSXproject MSX;               // project whose variables are referenced
+    int    err;                   // error code
+    int    bc;                    // bracket count
+    int    prevLex, curLex;       // previous and current lexical codes
+    int    len, pos;              // length of and position in formula
+    char   *s;                    // formula being parsed
+    char   token[255];            // current token
+    int    ivar;                  // index of current variable
+    double fvalue;                // value of current number
+    int    (*getVariableIndex) (MSXproject, char *);        // index of named variable
+    MathExpr * (*getVariableDeriv) (MSXproject, int, int);  // derivative of variable
+};
+typedef struct ExprState ExprState;
+
+//  Sub-expression considered for sharing by mathexpr_optimize
+struct OptNode
+{
+    ExprTree *node;               // root of the sub-expression
+    unsigned hash;                // hash of its structure
+    int      size;                // number of nodes in it
+};
+typedef struct OptNode OptNode;
+
+//  State of the optimizer working on a set of expressions
+struct OptState
+{
+    ExprState  ps;                // tree builder state
+    ExprSystem *sys;              // set of expressions being optimized
+    int    (*getSlot) (MSXproject, int, int *);  // kind of a variable
+    int    ntrees;                // number of expressions
+    int    nshared;               // number of shared sub-expressions
+    int    maxShared;             // max. number of shared sub-expressions
+    ExprTree **tree;              // expression trees, then shared ones
+    char   *invariant;            // 1 if a variable is invariant
+    OptNode *cand;                // sub-expressions considered for sharing
+    int    ncand;                 // number of them
+};
+typedef struct OptState OptState;
 
 // math function names
 char *MathFunc[] =  {"COS", "SIN", "TAN", "COT", "ABS", "SGN",
@@ -99,22 +157,50 @@ char *MathFunc[] =  {"COS", "SIN", "TAN", "COT", "ABS", "SGN",
 static int        sametext(char *, char *);
 static int        isDigit(char);
 static int        isLetter(char);
-static void       getToken(void);
-static int        getMathFunc(void);
-static int        getVariable(MSXproject MSX);
-static int        getOperand(void);
-static int        getLex(MSXproject MSX);
-static double     getNumber(void);
-static ExprTree * newNode(void);
-static ExprTree * getSingleOp(MSXproject MSX, int *);
-static ExprTree * getOp(MSXproject MSX, int *);
-static ExprTree * getTree(MSXproject MSX);
+static void       getToken(ExprState *);
+static int        getMathFunc(ExprState *);
+static int        getVariable(ExprState *);
+static int        getOperand(ExprState *);
+static int        getLex(ExprState *);
+static double     getNumber(ExprState *);
+static ExprTree * newNode(ExprState *);
+static ExprTree * getSingleOp(ExprState *, int *);
+static ExprTree * getOp(ExprState *, int *);
+static ExprTree * getTree(ExprState *);
 static void       traverseTree(ExprTree *, MathExpr **);
 static void       deleteTree(ExprTree *);
-
-// Callback functions
-static int    (*getVariableIndex) (MSXproject, char *); // return index of named variable
-static double (*getVariableValue) (MSXproject, int);    // return value of indexed variable
+static ExprTree * exprToTree(ExprState *, MathExpr *);
+static ExprTree * copyTree(ExprState *, ExprTree *);
+static ExprTree * diffTree(ExprState *, ExprTree *, int);
+static ExprTree * numNode(ExprState *, double);
+static ExprTree * unaryNode(ExprState *, int, ExprTree *);
+static ExprTree * binaryNode(ExprState *, int, ExprTree *, ExprTree *);
+static ExprTree * addNodes(ExprState *, ExprTree *, ExprTree *);
+static ExprTree * subNodes(ExprState *, ExprTree *, ExprTree *);
+static ExprTree * mulNodes(ExprState *, ExprTree *, ExprTree *);
+static ExprTree * divNodes(ExprState *, ExprTree *, ExprTree *);
+static ExprTree * powNodes(ExprState *, ExprTree *, ExprTree *);
+static int        isNumber(ExprTree *, double);
+static double     evalFunction(int, double);
+static void       evalBatchFunction(int, BatchValue *, int);
+static void       evalBatchOperator(int, BatchValue *, BatchValue *, int);
+static double     evalOperator(int, double, double);
+static int        optimizeTrees(OptState *);
+static int        saveTrees(OptState *);
+static MathExpr * treeToExpr(ExprTree *);
+static void       foldTree(OptState *, ExprTree *);
+static int        isInvariantTree(OptState *, ExprTree *);
+static int        sameTree(ExprTree *, ExprTree *);
+static ExprTree * varNode(OptState *, int);
+static int        addShared(OptState *, ExprTree *, int);
+static void       hoistInvariants(OptState *, ExprTree **);
+static unsigned   hashTree(OptState *, ExprTree *, int *);
+static int        compareOptNodes(const void *, const void *);
+static ExprTree * findCommonTree(OptState *);
+static void       replaceTree(OptState *, ExprTree **, ExprTree *, int);
+static void       orderShared(OptState *);
+static void       visitShared(OptState *, ExprTree *, int *, int *);
+static void       renumberShared(OptState *, ExprTree *, int *);
 
 //=============================================================================
 
@@ -158,28 +244,28 @@ int isLetter(char c)
 
 //=============================================================================
 
-void getToken()
+void getToken(ExprState *ps)
 {
     char c[] = " ";
-    strcpy(Token, "");
-    while ( Pos <= Len &&
-        ( isLetter(S[Pos]) || isDigit(S[Pos]) ) )
+    strcpy(ps->token, "");
+    while ( ps->pos <= ps->len &&
+        ( isLetter(ps->s[ps->pos]) || isDigit(ps->s[ps->pos]) ) )
     {
-        c[0] = S[Pos];
-        strcat(Token, c);
-        Pos++;
+        c[0] = ps->s[ps->pos];
+        strcat(ps->token, c);
+        ps->pos++;
     }
-    Pos--;
+    ps->pos--;
 }
 
 //=============================================================================
 
-int getMathFunc()
+int getMathFunc(ExprState *ps)
 {
     int i = 0;
     while (MathFunc[i] != NULL)
     {
-        if (sametext(MathFunc[i], Token)) return i+10;
+        if (sametext(MathFunc[i], ps->token)) return i+10;
         i++;
     }
     return(0);
@@ -187,17 +273,17 @@ int getMathFunc()
 
 //=============================================================================
 
-int getVariable(MSXproject MSX)
+int getVariable(ExprState *ps)
 {
-    if ( !getVariableIndex ) return 0;
-    Ivar = getVariableIndex(MSX, Token);
-    if (Ivar >= 0) return 8;
+    if ( !ps->getVariableIndex ) return 0;
+    ps->ivar = ps->getVariableIndex(ps->MSX, ps->token);
+    if (ps->ivar >= 0) return 8;
     return 0;
 }
 
 //=============================================================================
 
-double getNumber()
+double getNumber(ExprState *ps)
 {
     char c[] = " ";
     char sNumber[255];
@@ -205,74 +291,74 @@ double getNumber()
 
     /* --- get whole number portion of number */
     strcpy(sNumber, "");
-    while (Pos < Len && isDigit(S[Pos]))
+    while (ps->pos < ps->len && isDigit(ps->s[ps->pos]))
     {
-        c[0] = S[Pos];
+        c[0] = ps->s[ps->pos];
         strcat(sNumber, c);
-        Pos++;
+        ps->pos++;
     }
 
     /* --- get fractional portion of number */
-    if (Pos < Len)
+    if (ps->pos < ps->len)
     {
-        if (S[Pos] == '.')
+        if (ps->s[ps->pos] == '.')
         {
             strcat(sNumber, ".");
-            Pos++;
-            while (Pos < Len && isDigit(S[Pos]))
+            ps->pos++;
+            while (ps->pos < ps->len && isDigit(ps->s[ps->pos]))
             {
-                c[0] = S[Pos];
+                c[0] = ps->s[ps->pos];
                 strcat(sNumber, c);  
-                Pos++;
+                ps->pos++;
             }
         }
 
         /* --- get exponent */
-        if (Pos < Len && (S[Pos] == 'e' || S[Pos] == 'E'))
+        if (ps->pos < ps->len && (ps->s[ps->pos] == 'e' || ps->s[ps->pos] == 'E'))
         {
             strcat(sNumber, "E");  
-            Pos++;
-            if (Pos >= Len) errflag = 1;
+            ps->pos++;
+            if (ps->pos >= ps->len) errflag = 1;
             else
             {
-                if (S[Pos] == '-' || S[Pos] == '+')
+                if (ps->s[ps->pos] == '-' || ps->s[ps->pos] == '+')
                 {
-                    c[0] = S[Pos];
+                    c[0] = ps->s[ps->pos];
                     strcat(sNumber, c);  
-                    Pos++;
+                    ps->pos++;
                 }
-                if (Pos >= Len || !isDigit(S[Pos])) errflag = 1;
-                else while ( Pos < Len && isDigit(S[Pos]))
+                if (ps->pos >= ps->len || !isDigit(ps->s[ps->pos])) errflag = 1;
+                else while ( ps->pos < ps->len && isDigit(ps->s[ps->pos]))
                 {
-                    c[0] = S[Pos];
+                    c[0] = ps->s[ps->pos];
                     strcat(sNumber, c);  
-                    Pos++;
+                    ps->pos++;
                 }
             }
         }
     }
-    Pos--;
+    ps->pos--;
     if (errflag) return 0;
     else return atof(sNumber);
 }
 
 //=============================================================================
 
-int getOperand()
+int getOperand(ExprState *ps)
 {
     int code;
-    switch(S[Pos])
+    switch(ps->s[ps->pos])
     {
       case '(': code = 1;  break;
       case ')': code = 2;  break;
       case '+': code = 3;  break;
       case '-': code = 4;
-                if (Pos < Len-1 &&
-                    isDigit(S[Pos+1]) &&
-                    (CurLex == 0 || CurLex == 1))
+                if (ps->pos < ps->len-1 &&
+                    isDigit(ps->s[ps->pos+1]) &&
+                    (ps->curLex == 0 || ps->curLex == 1))
                 {
-                    Pos++;
-                    Fvalue = -getNumber();
+                    ps->pos++;
+                    ps->fvalue = -getNumber(ps);
                     code = 7;
                 }
                 break;
@@ -286,45 +372,45 @@ int getOperand()
 
 //=============================================================================
 
-int getLex(MSXproject MSX)
+int getLex(ExprState *ps)
 {
     int n;
 
     /* --- skip spaces */
-    while ( Pos < Len && S[Pos] == ' ' ) Pos++;
-    if ( Pos >= Len ) return 0;
+    while ( ps->pos < ps->len && ps->s[ps->pos] == ' ' ) ps->pos++;
+    if ( ps->pos >= ps->len ) return 0;
 
     /* --- check for operand */
-    n = getOperand();
+    n = getOperand(ps);
 
     /* --- check for function/variable/number */
     if ( n == 0 )
     {
-        if ( isLetter(S[Pos]) )
+        if ( isLetter(ps->s[ps->pos]) )
         {
-            getToken();
-            n = getMathFunc();
-            if ( n == 0 ) n = getVariable(MSX);
+            getToken(ps);
+            n = getMathFunc(ps);
+            if ( n == 0 ) n = getVariable(ps);
         }
-        else if ( isDigit(S[Pos]) )
+        else if ( isDigit(ps->s[ps->pos]) )
         {
             n = 7;
-            Fvalue = getNumber();
+            ps->fvalue = getNumber(ps);
         }
     }
-    Pos++;
-    PrevLex = CurLex;
-    CurLex = n;
+    ps->pos++;
+    ps->prevLex = ps->curLex;
+    ps->curLex = n;
     return n;
 }
 
 //=============================================================================
 
-ExprTree * newNode()
+ExprTree * newNode(ExprState *ps)
 {
     ExprTree *node;
     node = (ExprTree *) malloc(sizeof(ExprTree));
-    if (!node) Err = 2;
+    if (!node) ps->err = 2;
     else
     {
         node->opcode = 0;
@@ -338,7 +424,7 @@ ExprTree * newNode()
 
 //=============================================================================
 
-ExprTree * getSingleOp(MSXproject MSX, int *lex)
+ExprTree * getSingleOp(ExprState *ps, int *lex)
 {
     int opcode;
     ExprTree *left;
@@ -346,8 +432,8 @@ ExprTree * getSingleOp(MSXproject MSX, int *lex)
     /* --- open parenthesis, so continue to grow the tree */
     if ( *lex == 1 )
     {
-        Bc++;
-        left = getTree(MSX);
+        ps->bc++;
+        left = getTree(ps);
     }
 
     else
@@ -355,7 +441,7 @@ ExprTree * getSingleOp(MSXproject MSX, int *lex)
         /* --- Error if not a singleton operand */
         if ( *lex < 7 || *lex == 9 || *lex > 30)
         {
-            Err = 1;
+            ps->err = 1;
             return NULL;
         }
 
@@ -364,28 +450,28 @@ ExprTree * getSingleOp(MSXproject MSX, int *lex)
         /* --- simple number or variable name */
         if ( *lex == 7 || *lex == 8 )
         {
-            left = newNode();
+            left = newNode(ps);
             left->opcode = opcode;
-            if ( *lex == 7 ) left->fvalue = Fvalue;
-            if ( *lex == 8 ) left->ivar = Ivar;
+            if ( *lex == 7 ) left->fvalue = ps->fvalue;
+            if ( *lex == 8 ) left->ivar = ps->ivar;
         }
 
         /* --- function which must have a '(' after it */
         else
         {
-            *lex = getLex(MSX);
+            *lex = getLex(ps);
             if ( *lex != 1 )
             {
-               Err = 1;
+               ps->err = 1;
                return NULL;
             }
-            Bc++;
-            left = newNode();
-            left->left = getTree(MSX);
+            ps->bc++;
+            left = newNode(ps);
+            left->left = getTree(ps);
             left->opcode = opcode;
         }
     }   
-    *lex = getLex(MSX);
+    *lex = getLex(ps);
 
     /* --- exponentiation */  // code deleted                                  //(L.Rossman - 11/03/10)
 
@@ -394,7 +480,7 @@ ExprTree * getSingleOp(MSXproject MSX, int *lex)
 
 //=============================================================================
 
-ExprTree * getOp(MSXproject MSX, int *lex)
+ExprTree * getOp(ExprState *ps, int *lex)
 {
     int opcode;
     ExprTree *left;
@@ -402,24 +488,24 @@ ExprTree * getOp(MSXproject MSX, int *lex)
     ExprTree *node;
     int neg = 0;
 
-    *lex = getLex(MSX);
-    if (PrevLex == 0 || PrevLex == 1 )
+    *lex = getLex(ps);
+    if (ps->prevLex == 0 || ps->prevLex == 1 )
     {
         if ( *lex == 4 )
         {
             neg = 1;
-            *lex = getLex(MSX);
+            *lex = getLex(ps);
         }
-        else if ( *lex == 3) *lex = getLex(MSX);
+        else if ( *lex == 3) *lex = getLex(ps);
     }
-    left = getSingleOp(MSX, lex);
+    left = getSingleOp(ps, lex);
     while ( *lex == 5 || *lex == 6 || *lex == 31)                              //(L.Rossman - 11/03/10)
     {
         opcode = *lex;
-        *lex = getLex(MSX);
-        right = getSingleOp(MSX, lex);
-        node = newNode();
-        if (Err) return NULL;
+        *lex = getLex(ps);
+        right = getSingleOp(ps, lex);
+        node = newNode(ps);
+        if (ps->err) return NULL;
         node->left = left;
         node->right = right;
         node->opcode = opcode;
@@ -427,8 +513,8 @@ ExprTree * getOp(MSXproject MSX, int *lex)
     }
     if ( neg )
     {
-        node = newNode();
-        if (Err) return NULL;
+        node = newNode(ps);
+        if (ps->err) return NULL;
         node->left = left;
         node->right = NULL;
         node->opcode = 9;
@@ -439,7 +525,7 @@ ExprTree * getOp(MSXproject MSX, int *lex)
 
 //=============================================================================
 
-ExprTree * getTree(MSXproject MSX)
+ExprTree * getTree(ExprState *ps)
 {
     int      lex;
     int      opcode;
@@ -447,25 +533,25 @@ ExprTree * getTree(MSXproject MSX)
     ExprTree *right;
     ExprTree *node;
 
-    left = getOp(MSX, &lex);
+    left = getOp(ps, &lex);
     for (;;)
     {
         if ( lex == 0 || lex == 2 )
         {
-            if ( lex == 2 ) Bc--;
+            if ( lex == 2 ) ps->bc--;
             break;
         }
 
         if (lex != 3 && lex != 4 )
         {
-            Err = 1;
+            ps->err = 1;
             break;
         }
 
         opcode = lex;
-        right = getOp(MSX, &lex);
-        node = newNode();
-        if (Err) break;
+        right = getOp(ps, &lex);
+        node = newNode(ps);
+        if (ps->err) break;
         node->left = left;
         node->right = right;
         node->opcode = opcode;
@@ -686,193 +772,1206 @@ double mathexpr_eval(MSXproject MSX, MathExpr *expr, double (*getVariableValue)
 
 //=============================================================================
 
-void mathexpr_delete(MathExpr *expr)
+int mathexpr_evalBatch(MSXproject MSX, MathExpr *expr, int nb, double *result,
+                       int (*getBatchValue) (MSXproject, int, int, double *))
+/**
+**  Purpose:
+**    evaluates a tokenized math expression for a batch of segments.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    expr = tokenized math expression
+**    nb = number of segments in the batch (no more than MAX_BATCH)
+**    getBatchValue = function that places the values of a variable for
+**                    each segment in v[0..nb-1] and returns 0, or places
+**                    a single value shared by all segments in v[0] and
+**                    returns 1.
+**
+**  Output:
+**    result[0..nb-1] = value of the expression for each segment.
+**
+**  Returns:
+**    1 if successful, 0 if the expression is too deeply nested to
+**    be evaluated this way (mathexpr_eval must be used instead).
+**
+**  Notes:
+**    Operations are applied to all segments at once so that the
+**    interpretation overhead is shared by the whole batch and the
+**    arithmetic loops can be vectorized by the compiler.
+*/
 {
-    if (expr) mathexpr_delete(expr->next);
-    free(expr);
+    BatchValue exprStack[MAX_BATCH_STACK];
+    MathExpr *node = expr;
+    int stackindex = 0;
+    int l;
+
+    exprStack[0].uniform = 1;
+    exprStack[0].v[0] = 0.0;
+    while (node != NULL)
+    {
+        switch (node->opcode)
+        {
+          case 3:
+          case 4:
+          case 5:
+          case 6:
+          case 31:
+            evalBatchOperator(node->opcode, &exprStack[stackindex-1],
+                              &exprStack[stackindex], nb);
+            stackindex--;
+            break;
+
+          case 7:
+          case 8:
+            stackindex++;
+            if ( stackindex >= MAX_BATCH_STACK ) return 0;
+            exprStack[stackindex].uniform = 1;
+            exprStack[stackindex].v[0] = 0.0;
+            if ( node->opcode == 7 ) exprStack[stackindex].v[0] = node->fvalue;
+            else if ( getBatchValue != NULL )
+            {
+                exprStack[stackindex].uniform =
+                    getBatchValue(MSX, node->ivar, nb, exprStack[stackindex].v);
+            }
+            break;
+
+          default:
+            evalBatchFunction(node->opcode, &exprStack[stackindex], nb);
+        }
+        node = node->next;
+    }
+    if ( exprStack[stackindex].uniform )
+    {
+        for (l=0; l<nb; l++) result[l] = exprStack[stackindex].v[0];
+    }
+    else
+    {
+        for (l=0; l<nb; l++) result[l] = exprStack[stackindex].v[l];
+    }
+    return 1;
 }
 
 //=============================================================================
 
-MathExpr * mathexpr_create(MSXproject MSX, char *formula, int (*getVar) (MSXproject, char *))
+void evalBatchOperator(int opcode, BatchValue *a, BatchValue *b, int nb)
+// Replaces a with (a opcode b) for a batch of segments
 {
-    ExprTree *tree;
-    MathExpr *expr = NULL;
-    MathExpr *result = NULL;
-    getVariableIndex = getVar;
-    Err = 0;
-    PrevLex = 0;
-    CurLex = 0;
-    S = formula;
-    Len = (int) strlen(S);
-    Pos = 0;
-    Bc = 0;
-    tree = getTree(MSX);
-    if (Bc == 0 && Err == 0)
+    int l;
+    double s;
+
+// --- operands shared by all segments
+
+    if ( a->uniform && b->uniform )
     {
-        traverseTree(tree, &expr);
-        while (expr)
+        switch (opcode)
         {
-            result = expr;
-            expr = expr->prev;
+          case 3:  a->v[0] = a->v[0] + b->v[0]; break;
+          case 4:  a->v[0] = a->v[0] - b->v[0]; break;
+          case 5:  a->v[0] = a->v[0] * b->v[0]; break;
+          case 6:  a->v[0] = a->v[0] / b->v[0]; break;
+          case 31: a->v[0] = exp(b->v[0]*log(a->v[0])); break;
         }
+        return;
     }
-    deleteTree(tree);
-    return result;
-}
 
+// --- expand a shared left operand over all segments
 
-//=============================================================================
+    if ( a->uniform )
+    {
+        s = a->v[0];
+        for (l=0; l<nb; l++) a->v[l] = s;
+        a->uniform = 0;
+    }
 
-char * mathexpr_getStr(MathExpr* expr, char* exprStr,                          //1.1.00
-                       char * (*getVariableStr) (int, char *))
-{
-    Term TermStack[50];
-    MathExpr *node = expr;
-    char r1[MAX_TERM_SIZE], r2[MAX_TERM_SIZE];
-    int stackindex = 0;
+// --- shared right operand
 
-    strcpy(TermStack[0].s, "");
-    while(node != NULL)
+    if ( b->uniform )
     {
-        switch (node->opcode)
+        s = b->v[0];
+        switch (opcode)
         {
-          case 3:  
-            strcpy(r1, TermStack[stackindex].s);
-            stackindex--;
-            strcpy(r2, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "(%s) + (%s)", r2, r1);
-            break;
+          case 3:  for (l=0; l<nb; l++) a->v[l] += s; break;
+          case 4:  for (l=0; l<nb; l++) a->v[l] -= s; break;
+          case 5:  for (l=0; l<nb; l++) a->v[l] *= s; break;
+          case 6:  for (l=0; l<nb; l++) a->v[l] /= s; break;
+          case 31: for (l=0; l<nb; l++) a->v[l] = exp(s*log(a->v[l])); break;
+        }
+        return;
+    }
 
-          case 4:  
-            strcpy(r1, TermStack[stackindex].s);
-            stackindex--;
-            strcpy(r2, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "(%s) - (%s)", r2, r1);
-            break;
+// --- different right operand for each segment
 
-          case 5:  
-            strcpy(r1, TermStack[stackindex].s);
-            stackindex--;
-            strcpy(r2, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "(%s) * (%s)", r2, r1);
-            break;
+    switch (opcode)
+    {
+      case 3:  for (l=0; l<nb; l++) a->v[l] += b->v[l]; break;
+      case 4:  for (l=0; l<nb; l++) a->v[l] -= b->v[l]; break;
+      case 5:  for (l=0; l<nb; l++) a->v[l] *= b->v[l]; break;
+      case 6:  for (l=0; l<nb; l++) a->v[l] /= b->v[l]; break;
+      case 31: for (l=0; l<nb; l++) a->v[l] = exp(b->v[l]*log(a->v[l])); break;
+    }
+}
 
-          case 6:  
-            strcpy(r1, TermStack[stackindex].s);
-            stackindex--;
-            strcpy(r2, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "(%s) / (%s)", r2, r1);
-            break;
+//=============================================================================
 
-          case 7:  
-            stackindex++;
-            sprintf(TermStack[stackindex].s, "%.6g", node->fvalue);
-            break;
+void evalBatchFunction(int opcode, BatchValue *a, int nb)
+// Replaces a with function opcode of a for a batch of segments
+{
+    int l;
+    if ( a->uniform ) a->v[0] = evalFunction(opcode, a->v[0]);
+    else if ( opcode == 9 )
+    {
+        for (l=0; l<nb; l++) a->v[l] = -a->v[l];
+    }
+    else
+    {
+        for (l=0; l<nb; l++) a->v[l] = evalFunction(opcode, a->v[l]);
+    }
+}
 
-          case 8:
-            if (getVariableStr != NULL) strcpy(r1, getVariableStr(node->ivar, r2));
-            else strcpy(r1, "");
-            stackindex++;
-            strcpy(TermStack[stackindex].s, r1);
-            break;
+//=============================================================================
 
-          case 9: 
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "-(%s)", r1);
-            break;
+double evalFunction(int opcode, double x)
+// Evaluates negation or a math function the same way as mathexpr_eval
+{
+    switch (opcode)
+    {
+      case 9:  return -x;
+      case 10: return cos(x);
+      case 11: return sin(x);
+      case 12: return tan(x);
+      case 13: return 1.0/tan(x);
+      case 14: return fabs(x);
+      case 15: if (x < 0.0) return -1.0;
+               if (x > 0.0) return 1.0;
+               return 0.0;
+      case 16: return sqrt(x);
+      case 17: if (x > 0) return log(x);
+               return 0.0;
+      case 18: return exp(x);
+      case 19: return asin(x);
+      case 20: return acos(x);
+      case 21: return atan(x);
+      case 22: return 1.57079632679489661923 - atan(x);
+      case 23: return (exp(x)-exp(-x))/2.0;
+      case 24: return (exp(x)+exp(-x))/2.0;
+      case 25: return (exp(x)-exp(-x))/(exp(x)+exp(-x));
+      case 26: return (exp(x)+exp(-x))/(exp(x)-exp(-x));
+      case 27: if (x > 0) return log10(x);
+               return 0.0;
+      case 28: if (x <= 0.0) return 0.0;
+               return 1.0;
+    }
+    return x;
+}
 
-          case 10:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "cos(%s)", r1);
-            break;
+//=============================================================================
 
-          case 11:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "sin(%s)", r1);
-            break;
+ExprCode * mathexpr_compile(MSXproject MSX, MathExpr *expr,
+                            int (*getSlot) (MSXproject, int, int *))
+/**
+**  Purpose:
+**    compiles a tokenized math expression into a flat array of
+**    register machine instructions.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    expr = tokenized math expression
+**    getSlot = function that returns the kind of a variable (see
+**              ExprSlotType) and places its position in the matching
+**              ExprFrame array in its last argument (NULL if all
+**              variables are found when the expression is run).
+**              Memoized variables are looked up by their own index.
+**
+**  Returns:
+**    the compiled expression, or NULL if memory could not be allocated
+**    or the expression is malformed.
+**
+**  Notes:
+**    Register n holds what would be the n-th entry of mathexpr_eval's
+**    stack, so operations are carried out in the same order and give
+**    identical results. An operator's result replaces its left operand.
+*/
+{
+    ExprCode  *code;
+    ExprInstr *ins;
+    MathExpr  *node;
+    int n = 0;
+    int depth = 0;
+    int j;
+
+// --- allocate one instruction for each token
+
+    for (node = expr; node != NULL; node = node->next) n++;
+    code = (ExprCode *)calloc(1, sizeof(ExprCode));
+    if ( code == NULL ) return NULL;
+    code->instr = (ExprInstr *)calloc(MAX(n, 1), sizeof(ExprInstr));
+    if ( code->instr == NULL )
+    {
+        free(code);
+        return NULL;
+    }
+    code->nregs = 1;
 
-          case 12:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "tan(%s)", r1);
-            break;
+// --- assign each token's operands and result to registers
 
-          case 13:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "cot(%s)", r1);
+    for (node = expr; node != NULL; node = node->next)
+    {
+        ins = &code->instr[code->ninstr];
+        ins->opcode = node->opcode;
+        switch (node->opcode)
+        {
+          case 3:
+          case 4:
+          case 5:
+          case 6:
+          case 31:
+            if ( depth < 2 ) depth = -1;
+            ins->dst = depth - 1;
+            ins->a = depth - 1;
+            ins->b = depth;
+            depth--;
             break;
 
-          case 14:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "abs(%s)", r1);
+          case 7:
+            depth++;
+            ins->dst = depth;
+            ins->fvalue = node->fvalue;
             break;
 
-          case 15:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "sgn(%s)", r1);
+          case 8:
+            depth++;
+            ins->dst = depth;
+            ins->a = node->ivar;
+            j = node->ivar;
+            switch ( getSlot ? getSlot(MSX, node->ivar, &j) : EXPR_VARIABLE )
+            {
+              case EXPR_SPECIES: ins->opcode = LOAD_SPECIES; ins->a = j; break;
+              case EXPR_PARAM:   ins->opcode = LOAD_PARAM;   ins->a = j; break;
+              case EXPR_CONST:   ins->opcode = LOAD_CONST;   ins->a = j; break;
+              case EXPR_HYD:     ins->opcode = LOAD_HYD;     ins->a = j; break;
+              case EXPR_ZERO:    ins->opcode = 7; ins->fvalue = 0.0;     break;
+              case EXPR_MEMO:      ins->opcode = LOAD_MEMO;      break;
+              case EXPR_INVARIANT: ins->opcode = LOAD_INVARIANT; break;
+            }
             break;
 
-          case 16:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "sqrt(%s)", r1);
-            break;
+          default:
+            if ( node->opcode < 9 || node->opcode > 28 ) continue;
+            if ( depth < 1 ) depth = -1;
+            ins->dst = depth;
+            ins->a = depth;
+        }
+        if ( depth < 0 || depth >= MAX_STACK_SIZE )
+        {
+            mathexpr_deleteCode(code);
+            return NULL;
+        }
+        code->nregs = MAX(code->nregs, depth + 1);
+        code->ninstr++;
+    }
+    if ( depth > 1 )
+    {
+        mathexpr_deleteCode(code);
+        return NULL;
+    }
+    return code;
+}
 
-          case 17:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "log(%s)", r1);
-            break;
+//=============================================================================
 
-          case 18:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "exp(%s)", r1);
-            break;
+double mathexpr_run(MSXproject MSX, ExprCode *code, ExprFrame *frame,
+                    double (*getVariableValue) (MSXproject, int))
+/**
+**  Purpose:
+**    evaluates a compiled math expression.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    code = compiled math expression
+**    frame = arrays holding the variables loaded directly
+**    getVariableValue = function returning the value of any other variable
+**
+**  Returns:
+**    the value of the expression.
+*/
+{
 
-          case 19:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "asin(%s)", r1);
-            break;
+// --- Note: the registers must be declared locally and not globally
+//     since this function can be called recursively.
 
-          case 20:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "acos(%s)", r1);
-            break;
+    double reg[MAX_STACK_SIZE];
+    ExprInstr *ins;
+    ExprInstr *end;
 
-          case 21:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "atan(%s)", r1);
+    if ( code == NULL || code->ninstr == 0 ) return 0.0;
+    end = code->instr + code->ninstr;
+    for (ins = code->instr; ins < end; ins++)
+    {
+        switch (ins->opcode)
+        {
+          case 3:  reg[ins->dst] = reg[ins->a] + reg[ins->b]; break;
+          case 4:  reg[ins->dst] = reg[ins->a] - reg[ins->b]; break;
+          case 5:  reg[ins->dst] = reg[ins->a] * reg[ins->b]; break;
+          case 6:  reg[ins->dst] = reg[ins->a] / reg[ins->b]; break;
+          case 31: reg[ins->dst] = exp(reg[ins->b]*log(reg[ins->a])); break;
+          case 7:  reg[ins->dst] = ins->fvalue; break;
+          case 8:
+            if ( getVariableValue != NULL )
+                reg[ins->dst] = getVariableValue(MSX, ins->a);
+            else reg[ins->dst] = 0.0;
             break;
-
-          case 22:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "acot(%s)", r1);
+          case LOAD_SPECIES: reg[ins->dst] = frame->c[ins->a]; break;
+          case LOAD_PARAM:   reg[ins->dst] = frame->p[ins->a]; break;
+          case LOAD_CONST:   reg[ins->dst] = frame->k[ins->a]; break;
+          case LOAD_HYD:     reg[ins->dst] = frame->h[ins->a]; break;
+          case LOAD_MEMO:
+            if ( frame->tag[ins->a] == frame->state )
+                reg[ins->dst] = frame->memo[ins->a];
+            else reg[ins->dst] = getVariableValue(MSX, ins->a);
             break;
-
-          case 23:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "sinh(%s)", r1);
+          case LOAD_INVARIANT:
+            if ( frame->tag[ins->a] == frame->invariantState )
+                reg[ins->dst] = frame->memo[ins->a];
+            else reg[ins->dst] = getVariableValue(MSX, ins->a);
             break;
+          case 9:  reg[ins->dst] = -reg[ins->a]; break;
+          default: reg[ins->dst] = evalFunction(ins->opcode, reg[ins->a]);
+        }
+    }
+    return reg[1];
+}
 
-          case 24:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "cosh(%s)", r1);
-            break;
+//=============================================================================
 
-          case 25:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "tanh(%s)", r1);
-            break;
+int mathexpr_runBatch(MSXproject MSX, ExprCode *code, ExprFrame *frame, int nb,
+                      double *result, int (*getBatchValue) (MSXproject, int, int, double *))
+/**
+**  Purpose:
+**    evaluates a compiled math expression for a batch of segments.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    code = compiled math expression
+**    frame = arrays holding the variables loaded directly, where
+**            c[i*MAX_BATCH + l] is species i of segment l
+**    nb = number of segments in the batch (no more than MAX_BATCH)
+**    getBatchValue = function returning the values of any other
+**                    variable (see mathexpr_evalBatch).
+**
+**  Output:
+**    result[0..nb-1] = value of the expression for each segment.
+**
+**  Returns:
+**    1 if successful, 0 if the expression needs too many registers
+**    to be evaluated this way (mathexpr_run must be used instead).
+*/
+{
+    BatchValue reg[MAX_BATCH_STACK];
+    BatchValue *r;
+    ExprInstr *ins;
+    ExprInstr *end;
+    int l;
 
-          case 26:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "coth(%s)", r1);
+    if ( code == NULL || code->ninstr == 0 )
+    {
+        for (l=0; l<nb; l++) result[l] = 0.0;
+        return 1;
+    }
+    if ( code->nregs > MAX_BATCH_STACK ) return 0;
+    end = code->instr + code->ninstr;
+    for (ins = code->instr; ins < end; ins++)
+    {
+        r = &reg[ins->dst];
+        switch (ins->opcode)
+        {
+          case 3:
+          case 4:
+          case 5:
+          case 6:
+          case 31:
+            evalBatchOperator(ins->opcode, r, &reg[ins->b], nb);
             break;
-
-          case 27:
-            strcpy(r1, TermStack[stackindex].s);
-            sprintf(TermStack[stackindex].s, "log10(%s)", r1);
+          case 7:
+            r->uniform = 1;
+            r->v[0] = ins->fvalue;
             break;
-
-          case 28:
+          case 8:
+          case LOAD_MEMO:
+          case LOAD_INVARIANT:
+            r->uniform = 1;
+            r->v[0] = 0.0;
+            if ( getBatchValue != NULL )
+                r->uniform = getBatchValue(MSX, ins->a, nb, r->v);
+            break;
+          case LOAD_SPECIES:
+            r->uniform = 0;
+            for (l=0; l<nb; l++) r->v[l] = frame->c[ins->a*MAX_BATCH+l];
+            break;
+          case LOAD_PARAM: r->uniform = 1; r->v[0] = frame->p[ins->a]; break;
+          case LOAD_CONST: r->uniform = 1; r->v[0] = frame->k[ins->a]; break;
+          case LOAD_HYD:   r->uniform = 1; r->v[0] = frame->h[ins->a]; break;
+          default:
+            evalBatchFunction(ins->opcode, r, nb);
+        }
+    }
+    r = &reg[1];
+    if ( r->uniform )
+    {
+        for (l=0; l<nb; l++) result[l] = r->v[0];
+    }
+    else
+    {
+        for (l=0; l<nb; l++) result[l] = r->v[l];
+    }
+    return 1;
+}
+
+//=============================================================================
+
+void mathexpr_deleteCode(ExprCode *code)
+{
+    if ( code == NULL ) return;
+    free(code->instr);
+    free(code);
+}
+
+//=============================================================================
+
+int mathexpr_optimize(MSXproject MSX, ExprSystem *sys,
+                      int (*getSlot) (MSXproject, int, int *))
+/**
+**  Purpose:
+**    optimizes a set of expressions that are evaluated together.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    sys = set of expressions, with the variable each one defines (so
+**          that references to it can be recognized) and the index to
+**          give the first shared sub-expression (must exceed all
+**          other variable indexes)
+**    getSlot = function that returns the kind of a variable (see
+**              mathexpr_compile).
+**
+**  Output:
+**    sys->opt = optimized expressions
+**    sys->shared = shared sub-expressions, where shared[j] defines
+**                  variable firstShared + j and only refers to shared
+**                  sub-expressions that come before it
+**    sys->invariant = 1 for each optimized (then shared) expression that
+**                     depends only on parameters, constants & hydraulics.
+**
+**  Returns:
+**    1 if successful, 0 if not (out of memory or malformed expression).
+**
+**  Notes:
+**    Operations on numbers alone are folded into numbers and variables
+**    of kind EXPR_ZERO replaced by 0. Each largest invariant
+**    sub-expression is then made a shared sub-expression, so that it
+**    can be evaluated once for as long as parameters, constants and
+**    hydraulics don't change, and so is any other sub-expression that
+**    appears more than once in the whole set. Sharing only changes how
+**    often an operation is carried out, not its result.
+*/
+{
+    OptState state;
+    OptState *os = &state;
+    MathExpr *node;
+    int i, ntotal;
+    int ok = 0;
+
+    memset(os, 0, sizeof(OptState));
+    os->ps.MSX = MSX;
+    os->sys = sys;
+    os->getSlot = getSlot;
+    os->ntrees = sys->nexpr;
+    sys->nshared = 0;
+    sys->opt = NULL;
+    sys->shared = NULL;
+    sys->invariant = NULL;
+
+// --- allocate room for the expression trees and for shared sub-expressions
+//     (each one is a distinct sub-tree of the original trees, and each one
+//     made from an invariant sub-tree adds one node to them)
+
+    ntotal = 0;
+    for (i=0; i<sys->nexpr; i++)
+    {
+        for (node = sys->expr[i]; node != NULL; node = node->next) ntotal++;
+    }
+    os->maxShared = 2*ntotal + 1;
+    os->tree = (ExprTree **)calloc(sys->nexpr + os->maxShared, sizeof(ExprTree *));
+    os->invariant = (char *)calloc(sys->firstShared + os->maxShared, sizeof(char));
+    os->cand = (OptNode *)calloc(os->maxShared, sizeof(OptNode));
+
+// --- optimize the trees and convert them back to expressions
+
+    if ( os->tree && os->invariant && os->cand )
+    {
+        ok = optimizeTrees(os) && saveTrees(os);
+    }
+
+// --- free the optimizer's work space
+
+    if ( os->tree )
+    {
+        for (i=0; i<os->ntrees + os->nshared; i++) deleteTree(os->tree[i]);
+        free(os->tree);
+    }
+    free(os->invariant);
+    free(os->cand);
+    if ( !ok ) mathexpr_deleteSystem(sys);
+    return ok;
+}
+
+//=============================================================================
+
+int optimizeTrees(OptState *os)
+// Folds, hoists and shares the sub-trees of the optimizer's trees
+{
+    ExprSystem *sys = os->sys;
+    ExprTree *def;
+    int i, n;
+
+// --- convert each expression to a tree and fold its constants
+
+    for (i=0; i<sys->nexpr && !os->ps.err; i++)
+    {
+        if ( sys->expr[i] == NULL ) continue;
+        os->tree[i] = exprToTree(&os->ps, sys->expr[i]);
+        foldTree(os, os->tree[i]);
+    }
+    if ( os->ps.err ) return 0;
+
+// --- find the variables defined by invariant expressions
+
+    do
+    {
+        n = 0;
+        for (i=0; i<sys->nexpr; i++)
+        {
+            if ( sys->var[i] <= 0 || os->invariant[sys->var[i]] ) continue;
+            if ( os->tree[i] && isInvariantTree(os, os->tree[i]) )
+            {
+                os->invariant[sys->var[i]] = 1;
+                n = 1;
+            }
+        }
+    } while ( n );
+
+// --- make the largest invariant sub-expressions shared ones
+
+    for (i=0; i<sys->nexpr; i++)
+    {
+        if ( sys->var[i] > 0 && os->invariant[sys->var[i]] ) continue;
+        hoistInvariants(os, &os->tree[i]);
+    }
+
+// --- share repeated sub-expressions, largest first
+
+    while ( !os->ps.err && os->nshared < os->maxShared )
+    {
+        def = findCommonTree(os);
+        if ( def == NULL ) break;
+        def = copyTree(&os->ps, def);
+        if ( os->ps.err ) break;
+        n = addShared(os, def, isInvariantTree(os, def));
+        def = os->tree[os->ntrees + n - sys->firstShared];
+        for (i=0; i<os->ntrees + os->nshared; i++)
+        {
+            replaceTree(os, &os->tree[i], def, n);
+        }
+    }
+    if ( !os->ps.err ) orderShared(os);
+    return !os->ps.err;
+}
+
+//=============================================================================
+
+int saveTrees(OptState *os)
+// Converts the optimizer's trees back to expressions
+{
+    ExprSystem *sys = os->sys;
+    int i;
+
+    sys->nshared = os->nshared;
+    sys->opt = (MathExpr **)calloc(sys->nexpr + 1, sizeof(MathExpr *));
+    sys->shared = (MathExpr **)calloc(os->nshared + 1, sizeof(MathExpr *));
+    sys->invariant = (char *)calloc(sys->nexpr + os->nshared + 1, sizeof(char));
+    if ( !sys->opt || !sys->shared || !sys->invariant ) return 0;
+    for (i=0; i<sys->nexpr; i++)
+    {
+        sys->opt[i] = treeToExpr(os->tree[i]);
+        sys->invariant[i] = (char)isInvariantTree(os, os->tree[i]);
+    }
+    for (i=0; i<os->nshared; i++)
+    {
+        sys->shared[i] = treeToExpr(os->tree[os->ntrees + i]);
+        sys->invariant[sys->nexpr + i] = os->invariant[sys->firstShared + i];
+    }
+    return 1;
+}
+
+//=============================================================================
+
+void mathexpr_deleteSystem(ExprSystem *sys)
+{
+    int i;
+    if ( sys->opt )
+    {
+        for (i=0; i<sys->nexpr; i++) mathexpr_delete(sys->opt[i]);
+    }
+    if ( sys->shared )
+    {
+        for (i=0; i<sys->nshared; i++) mathexpr_delete(sys->shared[i]);
+    }
+    free(sys->opt);
+    free(sys->shared);
+    free(sys->invariant);
+    sys->opt = NULL;
+    sys->shared = NULL;
+    sys->invariant = NULL;
+    sys->nshared = 0;
+}
+
+//=============================================================================
+
+MathExpr * treeToExpr(ExprTree *tree)
+// Converts a binary tree to a linked list (postfix format) returning its head
+{
+    MathExpr *expr = NULL;
+    MathExpr *head = NULL;
+    traverseTree(tree, &expr);
+    while (expr)
+    {
+        head = expr;
+        expr = expr->prev;
+    }
+    return head;
+}
+
+
+//=============================================================================
+
+double evalOperator(int opcode, double a, double b)
+// Evaluates a binary operator the same way as mathexpr_run
+{
+    switch (opcode)
+    {
+      case 3:  return a + b;
+      case 4:  return a - b;
+      case 5:  return a * b;
+      case 6:  return a / b;
+      case 31: return exp(b*log(a));
+    }
+    return a;
+}
+
+//=============================================================================
+
+void foldTree(OptState *os, ExprTree *tree)
+// Replaces operations on numbers alone (and variables that are always 0)
+// with numbers, unless the result is not a finite number
+{
+    int j;
+    double x;
+    if ( tree == NULL ) return;
+    foldTree(os, tree->left);
+    foldTree(os, tree->right);
+    switch (tree->opcode)
+    {
+      case 3:
+      case 4:
+      case 5:
+      case 6:
+      case 31:
+        if ( tree->left->opcode != 7 || tree->right->opcode != 7 ) return;
+        x = evalOperator(tree->opcode, tree->left->fvalue, tree->right->fvalue);
+        break;
+
+      case 8:
+        if ( tree->ivar >= os->sys->firstShared || os->getSlot == NULL ) return;
+        if ( os->getSlot(os->ps.MSX, tree->ivar, &j) != EXPR_ZERO ) return;
+        x = 0.0;
+        break;
+
+      default:
+        if ( tree->opcode < 9 || tree->opcode > 28 ) return;
+        if ( tree->left->opcode != 7 ) return;
+        x = evalFunction(tree->opcode, tree->left->fvalue);
+    }
+    if ( x - x != 0.0 ) return;
+    tree->fvalue = x;
+    deleteTree(tree->left);
+    deleteTree(tree->right);
+    tree->left = NULL;
+    tree->right = NULL;
+    tree->opcode = 7;
+    tree->ivar = -1;
+}
+
+//=============================================================================
+
+int isInvariantTree(OptState *os, ExprTree *tree)
+// Checks if a tree depends only on parameters, constants & hydraulics
+{
+    int j;
+    if ( tree == NULL || tree->opcode == 7 ) return 1;
+    if ( tree->opcode == 8 )
+    {
+        if ( tree->ivar >= os->sys->firstShared ) return os->invariant[tree->ivar];
+        if ( os->getSlot == NULL ) return 0;
+        switch ( os->getSlot(os->ps.MSX, tree->ivar, &j) )
+        {
+          case EXPR_PARAM:
+          case EXPR_CONST:
+          case EXPR_HYD:
+          case EXPR_ZERO:    return 1;
+          case EXPR_SPECIES: return 0;
+        }
+        return os->invariant[tree->ivar];
+    }
+    return isInvariantTree(os, tree->left) && isInvariantTree(os, tree->right);
+}
+
+//=============================================================================
+
+int sameTree(ExprTree *a, ExprTree *b)
+{
+    if ( a == NULL || b == NULL ) return ( a == b );
+    if ( a->opcode != b->opcode ) return 0;
+    if ( a->opcode == 7 ) return ( memcmp(&a->fvalue, &b->fvalue, sizeof(double)) == 0 );
+    if ( a->opcode == 8 ) return ( a->ivar == b->ivar );
+    return sameTree(a->left, b->left) && sameTree(a->right, b->right);
+}
+
+//=============================================================================
+
+ExprTree * varNode(OptState *os, int ivar)
+{
+    ExprTree *node = newNode(&os->ps);
+    if ( os->ps.err ) return NULL;
+    node->opcode = 8;
+    node->ivar = ivar;
+    return node;
+}
+
+//=============================================================================
+
+int addShared(OptState *os, ExprTree *tree, int invariant)
+// Adds a tree to the shared sub-expressions (unless already there)
+// and returns the index of the variable that stands for it
+{
+    int j;
+    for (j=0; j<os->nshared; j++)
+    {
+        if ( sameTree(os->tree[os->ntrees + j], tree) )
+        {
+            deleteTree(tree);
+            return os->sys->firstShared + j;
+        }
+    }
+    j = os->nshared++;
+    os->tree[os->ntrees + j] = tree;
+    os->invariant[os->sys->firstShared + j] = (char)invariant;
+    return os->sys->firstShared + j;
+}
+
+//=============================================================================
+
+void hoistInvariants(OptState *os, ExprTree **tree)
+// Replaces the largest invariant sub-trees of a tree with shared variables
+{
+    ExprTree *node = *tree;
+    if ( node == NULL || node->opcode == 7 || node->opcode == 8 ) return;
+    if ( os->nshared < os->maxShared && isInvariantTree(os, node) )
+    {
+        *tree = varNode(os, addShared(os, node, 1));
+        return;
+    }
+    hoistInvariants(os, &node->left);
+    hoistInvariants(os, &node->right);
+}
+
+//=============================================================================
+
+unsigned hashTree(OptState *os, ExprTree *tree, int *size)
+// Hashes the structure of a tree, listing its sub-trees worth sharing
+{
+    unsigned char bytes[sizeof(double)];
+    unsigned h;
+    int i, nleft, nright;
+    OptNode *cand;
+
+    *size = 0;
+    if ( tree == NULL ) return 0;
+    h = 2166136261u ^ (unsigned)tree->opcode;
+    if ( tree->opcode == 7 )
+    {
+        memcpy(bytes, &tree->fvalue, sizeof(double));
+        for (i=0; i<(int)sizeof(double); i++) h = (h ^ bytes[i]) * 16777619u;
+    }
+    if ( tree->opcode == 8 ) h = (h ^ (unsigned)tree->ivar) * 16777619u;
+    h = (h ^ hashTree(os, tree->left, &nleft)) * 16777619u;
+    h = (h ^ hashTree(os, tree->right, &nright)) * 16777619u;
+    *size = 1 + nleft + nright;
+
+// --- operations other than negating a single value are worth sharing
+
+    if ( tree->left && !(tree->opcode == 9 && *size == 2) )
+    {
+        cand = &os->cand[os->ncand++];
+        cand->node = tree;
+        cand->hash = h;
+        cand->size = *size;
+    }
+    return h;
+}
+
+//=============================================================================
+
+int compareOptNodes(const void *a, const void *b)
+{
+    const OptNode *na = (const OptNode *)a;
+    const OptNode *nb = (const OptNode *)b;
+    if ( na->hash != nb->hash ) return ( na->hash < nb->hash ) ? -1 : 1;
+    return nb->size - na->size;
+}
+
+//=============================================================================
+
+ExprTree * findCommonTree(OptState *os)
+// Finds the largest sub-tree that appears more than once in all trees
+{
+    ExprTree *best = NULL;
+    int bestSize = 0;
+    int i, j, k, l, size;
+
+    os->ncand = 0;
+    for (i=0; i<os->ntrees + os->nshared; i++) hashTree(os, os->tree[i], &size);
+    qsort(os->cand, os->ncand, sizeof(OptNode), compareOptNodes);
+    for (i=0; i<os->ncand; i=j)
+    {
+        for (j=i+1; j<os->ncand && os->cand[j].hash == os->cand[i].hash; j++) ;
+        for (k=i; k<j-1; k++)
+        {
+            if ( os->cand[k].size <= bestSize ) continue;
+            for (l=k+1; l<j; l++)
+            {
+                if ( sameTree(os->cand[k].node, os->cand[l].node) )
+                {
+                    best = os->cand[k].node;
+                    bestSize = os->cand[k].size;
+                    break;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+//=============================================================================
+
+void replaceTree(OptState *os, ExprTree **tree, ExprTree *def, int ivar)
+// Replaces each copy of def within a tree with variable ivar
+{
+    ExprTree *node = *tree;
+    if ( node == NULL || node == def || node->left == NULL ) return;
+    if ( sameTree(node, def) )
+    {
+        deleteTree(node);
+        *tree = varNode(os, ivar);
+        return;
+    }
+    replaceTree(os, &node->left, def, ivar);
+    replaceTree(os, &node->right, def, ivar);
+}
+
+//=============================================================================
+
+void orderShared(OptState *os)
+// Renumbers shared sub-expressions so that each one only refers to
+// those that come before it
+{
+    int *order;
+    int j, count = 0;
+    int first = os->sys->firstShared;
+    ExprTree **tree;
+    char *invariant;
+
+    order = (int *)malloc((os->nshared + 1) * sizeof(int));
+    tree = (ExprTree **)malloc((os->nshared + 1) * sizeof(ExprTree *));
+    invariant = (char *)malloc((os->nshared + 1) * sizeof(char));
+    if ( !order || !tree || !invariant )
+    {
+        os->ps.err = 2;
+        free(order);
+        free(tree);
+        free(invariant);
+        return;
+    }
+    for (j=0; j<os->nshared; j++) order[j] = -1;
+    for (j=0; j<os->nshared; j++)
+    {
+        visitShared(os, os->tree[os->ntrees + j], order, &count);
+        if ( order[j] < 0 ) order[j] = count++;
+    }
+    for (j=0; j<os->ntrees + os->nshared; j++) renumberShared(os, os->tree[j], order);
+    for (j=0; j<os->nshared; j++)
+    {
+        tree[order[j]] = os->tree[os->ntrees + j];
+        invariant[order[j]] = os->invariant[first + j];
+    }
+    for (j=0; j<os->nshared; j++)
+    {
+        os->tree[os->ntrees + j] = tree[j];
+        os->invariant[first + j] = invariant[j];
+    }
+    free(order);
+    free(tree);
+    free(invariant);
+}
+
+//=============================================================================
+
+void visitShared(OptState *os, ExprTree *tree, int *order, int *count)
+// Numbers the shared sub-expressions a tree refers to (depth first)
+{
+    int j;
+    if ( tree == NULL ) return;
+    if ( tree->opcode == 8 && tree->ivar >= os->sys->firstShared )
+    {
+        j = tree->ivar - os->sys->firstShared;
+        if ( order[j] != -1 ) return;
+        order[j] = -2;
+        visitShared(os, os->tree[os->ntrees + j], order, count);
+        order[j] = (*count)++;
+        return;
+    }
+    visitShared(os, tree->left, order, count);
+    visitShared(os, tree->right, order, count);
+}
+
+//=============================================================================
+
+void renumberShared(OptState *os, ExprTree *tree, int *order)
+{
+    int first = os->sys->firstShared;
+    if ( tree == NULL ) return;
+    if ( tree->opcode == 8 && tree->ivar >= first )
+    {
+        tree->ivar = first + order[tree->ivar - first];
+    }
+    renumberShared(os, tree->left, order);
+    renumberShared(os, tree->right, order);
+}
+
+//=============================================================================
+
+int mathexpr_usesVariable(MathExpr *expr, int ivar)
+// Checks if a variable appears in an expression
+{
+    MathExpr *node;
+    for (node = expr; node != NULL; node = node->next)
+    {
+        if ( node->opcode == 8 && node->ivar == ivar ) return 1;
+    }
+    return 0;
+}
+
+//=============================================================================
+
+void mathexpr_delete(MathExpr *expr)
+{
+    if (expr) mathexpr_delete(expr->next);
+    free(expr);
+}
+
+//=============================================================================
+
+MathExpr * mathexpr_create(MSXproject MSX, char *formula, int (*getVar) (MSXproject, char *))
+{
+    ExprTree *tree;
+    MathExpr *expr = NULL;
+    MathExpr *result = NULL;
+    ExprState state;
+    ExprState *ps = &state;
+
+    ps->MSX = MSX;
+    ps->getVariableIndex = getVar;
+    ps->getVariableDeriv = NULL;
+    ps->err = 0;
+    ps->prevLex = 0;
+    ps->curLex = 0;
+    ps->s = formula;
+    ps->len = (int) strlen(ps->s);
+    ps->pos = 0;
+    ps->bc = 0;
+    tree = getTree(ps);
+    if (ps->bc == 0 && ps->err == 0)
+    {
+        traverseTree(tree, &expr);
+        while (expr)
+        {
+            result = expr;
+            expr = expr->prev;
+        }
+    }
+    deleteTree(tree);
+    return result;
+}
+
+
+//=============================================================================
+
+char * mathexpr_getStr(MSXproject MSX, MathExpr* expr, char* exprStr,          //1.1.00
+                       char * (*getVariableStr) (MSXproject, int, char *))
+{
+    Term TermStack[50];
+    MathExpr *node = expr;
+    char r1[MAX_TERM_SIZE], r2[MAX_TERM_SIZE];
+    int stackindex = 0;
+
+    strcpy(TermStack[0].s, "");
+    while(node != NULL)
+    {
+        switch (node->opcode)
+        {
+          case 3:  
+            strcpy(r1, TermStack[stackindex].s);
+            stackindex--;
+            strcpy(r2, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "(%s) + (%s)", r2, r1);
+            break;
+
+          case 4:  
+            strcpy(r1, TermStack[stackindex].s);
+            stackindex--;
+            strcpy(r2, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "(%s) - (%s)", r2, r1);
+            break;
+
+          case 5:  
+            strcpy(r1, TermStack[stackindex].s);
+            stackindex--;
+            strcpy(r2, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "(%s) * (%s)", r2, r1);
+            break;
+
+          case 6:  
+            strcpy(r1, TermStack[stackindex].s);
+            stackindex--;
+            strcpy(r2, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "(%s) / (%s)", r2, r1);
+            break;
+
+          case 7:  
+            stackindex++;
+            sprintf(TermStack[stackindex].s, "%.17g", node->fvalue);
+            break;
+
+          case 8:
+            if (getVariableStr != NULL) strcpy(r1, getVariableStr(MSX, node->ivar, r2));
+            else strcpy(r1, "");
+            stackindex++;
+            strcpy(TermStack[stackindex].s, r1);
+            break;
+
+          case 9: 
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "-(%s)", r1);
+            break;
+
+          case 10:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "cos(%s)", r1);
+            break;
+
+          case 11:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "sin(%s)", r1);
+            break;
+
+          case 12:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "tan(%s)", r1);
+            break;
+
+          case 13:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "cot(%s)", r1);
+            break;
+
+          case 14:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "abs(%s)", r1);
+            break;
+
+          case 15:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "sgn(%s)", r1);
+            break;
+
+          case 16:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "sqrt(%s)", r1);
+            break;
+
+          case 17:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "log(%s)", r1);
+            break;
+
+          case 18:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "exp(%s)", r1);
+            break;
+
+          case 19:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "asin(%s)", r1);
+            break;
+
+          case 20:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "acos(%s)", r1);
+            break;
+
+          case 21:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "atan(%s)", r1);
+            break;
+
+          case 22:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "acot(%s)", r1);
+            break;
+
+          case 23:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "sinh(%s)", r1);
+            break;
+
+          case 24:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "cosh(%s)", r1);
+            break;
+
+          case 25:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "tanh(%s)", r1);
+            break;
+
+          case 26:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "coth(%s)", r1);
+            break;
+
+          case 27:
+            strcpy(r1, TermStack[stackindex].s);
+            sprintf(TermStack[stackindex].s, "log10(%s)", r1);
+            break;
+
+          case 28:
             strcpy(r1, TermStack[stackindex].s);
             sprintf(TermStack[stackindex].s, "step(%s)", r1);
             break;
@@ -889,3 +1988,441 @@ char * mathexpr_getStr(MathExpr* expr, char* exprStr,                          /
     strcpy(exprStr, TermStack[stackindex].s);
     return exprStr;
 }
+
+//=============================================================================
+
+int mathexpr_fitsStr(MathExpr *expr, int varSize)
+// Checks that the string mathexpr_getStr builds for an expression (and
+// every part of it) fits in its work space, given the longest string
+// used for a variable
+{
+    int size[50];
+    MathExpr *node;
+    int stackindex = 0;
+
+    size[0] = 0;
+    for (node = expr; node != NULL; node = node->next)
+    {
+        switch (node->opcode)
+        {
+          case 3:
+          case 4:
+          case 5:
+          case 6:
+            stackindex--;
+            size[stackindex] += size[stackindex+1] + 7;
+            break;
+
+          case 7:
+          case 8:
+            if ( ++stackindex >= 50 ) return 0;
+            if ( node->opcode == 8 ) size[stackindex] = varSize;
+            else size[stackindex] = snprintf(NULL, 0, "%.17g", node->fvalue);
+            break;
+
+          case 31:
+            stackindex--;
+            size[stackindex] += size[stackindex+1] + 6;
+            break;
+
+          default:
+            if ( node->opcode >= 9 && node->opcode <= 28 ) size[stackindex] += 7;
+        }
+        if ( stackindex < 0 || size[stackindex] >= MAX_TERM_SIZE ) return 0;
+    }
+    return 1;
+}
+
+//=============================================================================
+
+int mathexpr_diff(MSXproject MSX, MathExpr *expr, int ivar,
+                  MathExpr * (*getDeriv) (MSXproject, int, int), MathExpr **deriv)
+/**
+**  Purpose:
+**    symbolically differentiates a tokenized math expression with
+**    respect to one of its variables.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    expr = tokenized math expression
+**    ivar = index of the variable to differentiate with respect to
+**    getDeriv = function that returns the derivative of a variable
+**               other than ivar (e.g., an intermediate term) with
+**               respect to ivar, or NULL if that derivative is zero.
+**
+**  Output:
+**    deriv = tokenized derivative expression (NULL if the derivative
+**            is identically zero).
+**
+**  Returns:
+**    1 if successful, 0 if not (out of memory).
+**
+**  Notes:
+**    The derivative of a variable returned by getDeriv is copied into
+**    the result, so its storage remains owned by the caller.
+*/
+{
+    ExprTree *tree;
+    ExprTree *dtree;
+    MathExpr *dexpr = NULL;
+    ExprState state;
+    ExprState *ps = &state;
+
+    *deriv = NULL;
+    if ( expr == NULL ) return 1;
+    ps->MSX = MSX;
+    ps->getVariableIndex = NULL;
+    ps->getVariableDeriv = getDeriv;
+    ps->err = 0;
+    tree = exprToTree(ps, expr);
+    if ( ps->err )
+    {
+        deleteTree(tree);
+        return 0;
+    }
+    dtree = diffTree(ps, tree, ivar);
+    deleteTree(tree);
+    if ( ps->err )
+    {
+        deleteTree(dtree);
+        return 0;
+    }
+    if ( dtree )
+    {
+        traverseTree(dtree, &dexpr);
+        while (dexpr)
+        {
+            *deriv = dexpr;
+            dexpr = dexpr->prev;
+        }
+        deleteTree(dtree);
+    }
+    return 1;
+}
+
+//=============================================================================
+
+ExprTree * exprToTree(ExprState *ps, MathExpr *expr)
+// Converts linked list (postfix format) back to a binary tree
+{
+    ExprTree *treeStack[MAX_STACK_SIZE];
+    ExprTree *node;
+    int stackindex = 0;
+
+    while ( expr != NULL && !ps->err )
+    {
+        node = newNode(ps);
+        if ( ps->err ) break;
+        node->opcode = expr->opcode;
+        node->ivar = expr->ivar;
+        node->fvalue = expr->fvalue;
+        switch (expr->opcode)
+        {
+          case 3:
+          case 4:
+          case 5:
+          case 6:
+          case 31:
+            if ( stackindex < 2 ) ps->err = 1;
+            else
+            {
+                node->right = treeStack[--stackindex];
+                node->left = treeStack[--stackindex];
+            }
+            break;
+
+          case 7:
+          case 8:
+            break;
+
+          default:
+            if ( stackindex < 1 ) ps->err = 1;
+            else node->left = treeStack[--stackindex];
+        }
+        if ( ps->err || stackindex >= MAX_STACK_SIZE )
+        {
+            ps->err = 1;
+            deleteTree(node);
+            break;
+        }
+        treeStack[stackindex++] = node;
+        expr = expr->next;
+    }
+    if ( stackindex != 1 ) ps->err = 1;
+    while ( ps->err && stackindex > 0 ) deleteTree(treeStack[--stackindex]);
+    if ( ps->err ) return NULL;
+    return treeStack[0];
+}
+
+//=============================================================================
+
+ExprTree * copyTree(ExprState *ps, ExprTree *tree)
+{
+    ExprTree *node;
+    if ( tree == NULL || ps->err ) return NULL;
+    node = newNode(ps);
+    if ( ps->err ) return NULL;
+    node->opcode = tree->opcode;
+    node->ivar = tree->ivar;
+    node->fvalue = tree->fvalue;
+    node->left = copyTree(ps, tree->left);
+    node->right = copyTree(ps, tree->right);
+    return node;
+}
+
+//=============================================================================
+
+ExprTree * diffTree(ExprState *ps, ExprTree *tree, int ivar)
+// Returns the derivative of a tree with respect to variable ivar
+// (or NULL if the derivative is identically zero)
+{
+    ExprTree *a, *b;
+    ExprTree *da, *db;
+    ExprTree *f = NULL;
+    MathExpr *dexpr;
+
+    if ( tree == NULL || ps->err ) return NULL;
+    a = tree->left;
+    b = tree->right;
+
+// --- numbers and variables
+
+    if ( tree->opcode == 7 ) return NULL;
+    if ( tree->opcode == 8 )
+    {
+        if ( tree->ivar == ivar ) return numNode(ps, 1.0);
+        if ( ps->getVariableDeriv == NULL ) return NULL;
+        dexpr = ps->getVariableDeriv(ps->MSX, tree->ivar, ivar);
+        if ( dexpr == NULL ) return NULL;
+        return exprToTree(ps, dexpr);
+    }
+
+    da = diffTree(ps, a, ivar);
+    db = diffTree(ps, b, ivar);
+    switch (tree->opcode)
+    {
+
+    // --- sums, products and quotients
+
+      case 3: return addNodes(ps, da, db);
+      case 4: return subNodes(ps, da, db);
+      case 5: return addNodes(ps, mulNodes(ps, da, copyTree(ps, b)), mulNodes(ps, copyTree(ps, a), db));
+      case 6:
+        if ( db == NULL ) return divNodes(ps, da, copyTree(ps, b));
+        return divNodes(ps, subNodes(ps, mulNodes(ps, da, copyTree(ps, b)), mulNodes(ps, copyTree(ps, a), db)),
+                        mulNodes(ps, copyTree(ps, b), copyTree(ps, b)));
+      case 9: return unaryNode(ps, 9, da);
+
+    // --- a^b is evaluated as exp(b*log(a))
+
+      case 31:
+        if ( db == NULL )
+        {
+            if ( da == NULL ) return NULL;
+            return mulNodes(ps, mulNodes(ps, copyTree(ps, b),
+                   powNodes(ps, copyTree(ps, a), subNodes(ps, copyTree(ps, b), numNode(ps, 1.0)))), da);
+        }
+        return mulNodes(ps, copyTree(ps, tree),
+               addNodes(ps, mulNodes(ps, db, unaryNode(ps, 17, copyTree(ps, a))),
+                        divNodes(ps, mulNodes(ps, copyTree(ps, b), da), copyTree(ps, a))));
+    }
+
+// --- functions of a single argument: f'(a) * da
+
+    if ( da == NULL ) return NULL;
+    switch (tree->opcode)
+    {
+      case 10: f = unaryNode(ps, 9, unaryNode(ps, 11, copyTree(ps, a)));                break;
+      case 11: f = unaryNode(ps, 10, copyTree(ps, a));                                  break;
+      case 12: f = addNodes(ps, numNode(ps, 1.0), mulNodes(ps, unaryNode(ps, 12, copyTree(ps, a)),
+                                                              unaryNode(ps, 12, copyTree(ps, a))));
+               break;
+      case 13: f = unaryNode(ps, 9, addNodes(ps, numNode(ps, 1.0),
+                   mulNodes(ps, unaryNode(ps, 13, copyTree(ps, a)), unaryNode(ps, 13, copyTree(ps, a)))));
+               break;
+      case 14: f = unaryNode(ps, 15, copyTree(ps, a));                                  break;
+      case 16: f = divNodes(ps, numNode(ps, 0.5), unaryNode(ps, 16, copyTree(ps, a)));  break;
+      case 17: f = divNodes(ps, unaryNode(ps, 28, copyTree(ps, a)), copyTree(ps, a));   break;
+      case 18: f = unaryNode(ps, 18, copyTree(ps, a));                                  break;
+      case 19:
+      case 20: f = divNodes(ps, numNode(ps, tree->opcode == 19 ? 1.0 : -1.0),
+                   unaryNode(ps, 16, subNodes(ps, numNode(ps, 1.0),
+                   mulNodes(ps, copyTree(ps, a), copyTree(ps, a)))));
+               break;
+      case 21:
+      case 22: f = divNodes(ps, numNode(ps, tree->opcode == 21 ? 1.0 : -1.0),
+                   addNodes(ps, numNode(ps, 1.0), mulNodes(ps, copyTree(ps, a), copyTree(ps, a))));
+               break;
+      case 23: f = unaryNode(ps, 24, copyTree(ps, a));                                  break;
+      case 24: f = unaryNode(ps, 23, copyTree(ps, a));                                  break;
+      case 25:
+      case 26: f = subNodes(ps, numNode(ps, 1.0), mulNodes(ps, unaryNode(ps, tree->opcode, copyTree(ps, a)),
+                                                           unaryNode(ps, tree->opcode, copyTree(ps, a))));
+               break;
+      case 27: f = divNodes(ps, unaryNode(ps, 28, copyTree(ps, a)),
+                            mulNodes(ps, copyTree(ps, a), numNode(ps, log(10.0))));
+               break;
+
+    // --- sgn() and step() have a zero derivative almost everywhere
+
+      default:
+        deleteTree(da);
+        return NULL;
+    }
+    return mulNodes(ps, f, da);
+}
+
+//=============================================================================
+
+ExprTree * numNode(ExprState *ps, double x)
+{
+    ExprTree *node = newNode(ps);
+    if ( ps->err ) return NULL;
+    node->opcode = 7;
+    node->fvalue = x;
+    return node;
+}
+
+//=============================================================================
+
+int isNumber(ExprTree *tree, double x)
+{
+    return ( tree && tree->opcode == 7 && tree->fvalue == x );
+}
+
+//=============================================================================
+
+ExprTree * unaryNode(ExprState *ps, int opcode, ExprTree *a)
+// Note: a NULL argument stands for zero, so only negation may receive one
+{
+    ExprTree *node;
+    if ( opcode == 9 )
+    {
+        if ( a == NULL ) return NULL;
+        if ( a->opcode == 7 )
+        {
+            a->fvalue = -a->fvalue;
+            return a;
+        }
+    }
+    node = newNode(ps);
+    if ( ps->err )
+    {
+        deleteTree(a);
+        return NULL;
+    }
+    node->opcode = opcode;
+    node->left = a;
+    return node;
+}
+
+//=============================================================================
+
+ExprTree * binaryNode(ExprState *ps, int opcode, ExprTree *a, ExprTree *b)
+{
+    ExprTree *node = newNode(ps);
+    if ( ps->err )
+    {
+        deleteTree(a);
+        deleteTree(b);
+        return NULL;
+    }
+    node->opcode = opcode;
+    node->left = a;
+    node->right = b;
+    return node;
+}
+
+//=============================================================================
+
+ExprTree * addNodes(ExprState *ps, ExprTree *a, ExprTree *b)
+{
+    if ( a == NULL ) return b;
+    if ( b == NULL ) return a;
+    if ( a->opcode == 7 && b->opcode == 7 )
+    {
+        a->fvalue += b->fvalue;
+        deleteTree(b);
+        return a;
+    }
+    return binaryNode(ps, 3, a, b);
+}
+
+//=============================================================================
+
+ExprTree * subNodes(ExprState *ps, ExprTree *a, ExprTree *b)
+{
+    if ( b == NULL ) return a;
+    if ( a == NULL ) return unaryNode(ps, 9, b);
+    if ( a->opcode == 7 && b->opcode == 7 )
+    {
+        a->fvalue -= b->fvalue;
+        deleteTree(b);
+        return a;
+    }
+    return binaryNode(ps, 4, a, b);
+}
+
+//=============================================================================
+
+ExprTree * mulNodes(ExprState *ps, ExprTree *a, ExprTree *b)
+{
+    if ( a == NULL || b == NULL || isNumber(a, 0.0) || isNumber(b, 0.0) )
+    {
+        deleteTree(a);
+        deleteTree(b);
+        return NULL;
+    }
+    if ( isNumber(a, 1.0) )
+    {
+        deleteTree(a);
+        return b;
+    }
+    if ( isNumber(b, 1.0) )
+    {
+        deleteTree(b);
+        return a;
+    }
+    if ( a->opcode == 7 && b->opcode == 7 )
+    {
+        a->fvalue *= b->fvalue;
+        deleteTree(b);
+        return a;
+    }
+    return binaryNode(ps, 5, a, b);
+}
+
+//=============================================================================
+
+ExprTree * divNodes(ExprState *ps, ExprTree *a, ExprTree *b)
+{
+    if ( a == NULL )
+    {
+        deleteTree(b);
+        return NULL;
+    }
+    if ( isNumber(b, 1.0) )
+    {
+        deleteTree(b);
+        return a;
+    }
+    return binaryNode(ps, 6, a, b);
+}
+
+//=============================================================================
+
+ExprTree * powNodes(ExprState *ps, ExprTree *a, ExprTree *b)
+{
+    if ( b == NULL || isNumber(b, 0.0) )
+    {
+        deleteTree(a);
+        deleteTree(b);
+        return numNode(ps, 1.0);
+    }
+    if ( isNumber(b, 1.0) )
+    {
+        deleteTree(b);
+        return a;
+    }
+    return binaryNode(ps, 31, a, b);
+}
@@ -23,6 +23,68 @@ struct ExprNode
 };
 typedef struct ExprNode MathExpr;
 
+//  Instruction of a compiled math expression
+struct ExprInstr
+{
+    int    opcode;                // operator code
+    int    dst;                   // register receiving the result
+    int    a, b;                  // operand registers (or variable slot)
+    double fvalue;                // numerical value
+};
+typedef struct ExprInstr ExprInstr;
+
+//  Math expression compiled into register machine instructions
+struct ExprCode
+{
+    int    ninstr;                // number of instructions
+    int    nregs;                 // number of registers used
+    ExprInstr *instr;             // instructions in execution order
+};
+typedef struct ExprCode ExprCode;
+
+//  Kinds of variables that a compiled expression reads directly
+enum ExprSlotType
+{
+    EXPR_VARIABLE,                // found by the caller's getVal function
+    EXPR_SPECIES,                 // species concentration c[]
+    EXPR_PARAM,                   // reaction parameter p[]
+    EXPR_CONST,                   // constant k[]
+    EXPR_HYD,                     // hydraulic variable h[]
+    EXPR_ZERO,                    // always 0
+    EXPR_MEMO,                    // memo[] if current, else found by getVal
+    EXPR_INVARIANT                // same, for values that depend only on
+                                  // parameters, constants & hydraulics
+};
+
+//  Values read by a compiled expression
+struct ExprFrame
+{
+    double *c;                    // species concentrations
+    double *p;                    // reaction parameters
+    double *k;                    // constants
+    double *h;                    // hydraulic variables
+    double *memo;                 // memoized variable values
+    unsigned *tag;                // state each memoized value belongs to
+    unsigned state;               // current state of EXPR_MEMO values
+    unsigned invariantState;      // current state of EXPR_INVARIANT values
+};
+typedef struct ExprFrame ExprFrame;
+
+//  Set of expressions optimized together by mathexpr_optimize
+struct ExprSystem
+{
+    int       nexpr;              // number of expressions
+    MathExpr  **expr;             // expressions to optimize (not changed)
+    int       *var;               // variable each one defines (or 0)
+    int       firstShared;        // variable index of first shared sub-expression
+    int       nshared;            // number of shared sub-expressions
+    MathExpr  **opt;              // optimized expressions
+    MathExpr  **shared;           // shared sub-expressions
+    char      *invariant;         // 1 if an optimized (then shared) expression
+                                  // depends only on invariant variables
+};
+typedef struct ExprSystem ExprSystem;
+
 // Opaque Pointer
 typedef struct Project *MSXproject;
 
@@ -32,9 +94,45 @@ MathExpr* mathexpr_create(MSXproject MSX, char* s, int (*getVar) (MSXproject, ch
 //  Evaluates a tokenized math expression
 double mathexpr_eval(MSXproject MSX, MathExpr* expr, double (*getVal) (MSXproject, int));
 
+//  Evaluates a tokenized math expression for a batch of segments
+int mathexpr_evalBatch(MSXproject MSX, MathExpr* expr, int nb, double* result,
+                       int (*getBatchValue) (MSXproject, int, int, double*));
+
+//  Compiles a tokenized math expression into register machine instructions
+ExprCode* mathexpr_compile(MSXproject MSX, MathExpr* expr,
+                           int (*getSlot) (MSXproject, int, int *));
+
+//  Evaluates a compiled math expression
+double mathexpr_run(MSXproject MSX, ExprCode* code, ExprFrame* frame,
+                    double (*getVal) (MSXproject, int));
+
+//  Evaluates a compiled math expression for a batch of segments
+int mathexpr_runBatch(MSXproject MSX, ExprCode* code, ExprFrame* frame, int nb,
+                      double* result, int (*getBatchValue) (MSXproject, int, int, double*));
+
+//  Folds constants and extracts shared sub-expressions from a set of expressions
+int mathexpr_optimize(MSXproject MSX, ExprSystem* sys,
+                      int (*getSlot) (MSXproject, int, int *));
+
+//  Deletes the expressions created by mathexpr_optimize
+void  mathexpr_deleteSystem(ExprSystem* sys);
+
+//  Checks if a variable appears in a tokenized math expression
+int mathexpr_usesVariable(MathExpr* expr, int ivar);
+
+//  Deletes a compiled math expression
+void  mathexpr_deleteCode(ExprCode* code);
+
 //  Deletes a tokenized math expression
 void  mathexpr_delete(MathExpr* expr);
 
+//  Symbolically differentiates a tokenized math expression
+int mathexpr_diff(MSXproject MSX, MathExpr* expr, int ivar,
+                  MathExpr* (*getDeriv) (MSXproject, int, int), MathExpr** deriv);
+
 // Returns reconstructed string version of a tokenized expression              //1.1.00
-char * mathexpr_getStr(MathExpr* expr, char* exprStr,
-                       char * (*getVariableStr) (int, char *));
+char * mathexpr_getStr(MSXproject MSX, MathExpr* expr, char* exprStr,
+                       char * (*getVariableStr) (MSXproject, int, char *));
+
+// Checks if mathexpr_getStr can reconstruct a tokenized expression
+int mathexpr_fitsStr(MathExpr* expr, int varSize);
@@ -7,11 +7,13 @@
 **
 **  Modified by Lew Rossman, 8/13/94.
 **
-**  AllocInit()     - create an alloc pool, returns the old pool handle
-**  Alloc()         - allocate memory
-**  AllocReset()    - reset the current pool
-**  AllocSetPool()  - set the current pool
-**  AllocFree()     - free the memory used by the current pool.
+**  AllocInit()     - create an alloc pool, returns the new pool handle
+**  Alloc()         - allocate memory from a pool
+**  AllocReset()    - reset a pool
+**  AllocFreePool() - free the memory used by a pool.
+**
+**  Modified so that every routine is given the pool it works on
+**  (there is no longer a current pool shared by all callers).
 **
 */
 
@@ -48,13 +50,6 @@ typedef struct alloc_root_s
                 *current;  /* Current header       */
 }  alloc_root_t;
 
-/*
-**  root - Pointer to the current pool.
-*/
-
-static alloc_root_t *root;
-
-
 /*
 **  AllocHdr()
 **
@@ -91,10 +86,15 @@ static alloc_hdr_t * AllocHdr()
 alloc_handle_t * AllocInit()
 {
     alloc_handle_t *newpool;
+    alloc_root_t   *root;
 
     root = (alloc_root_t *) malloc(sizeof(alloc_root_t));
     if (root == NULL) return(NULL);
-    if ( (root->first = AllocHdr()) == NULL) return(NULL);
+    if ( (root->first = AllocHdr()) == NULL)
+    {
+        free((char *) root);
+        return(NULL);
+    }
     root->current = root->first;
     newpool = (alloc_handle_t *) root;
     return(newpool);
@@ -105,11 +105,12 @@ alloc_handle_t * AllocInit()
 **  Alloc()
 **
 **  Use as a direct replacement for malloc().  Allocates
-**  memory from the current pool.
+**  memory from the given pool.
 */
 
-char * Alloc(long size)
+char * Alloc(alloc_handle_t *pool, long size)
 {
+    alloc_root_t *root = (alloc_root_t *) pool;
     alloc_hdr_t  *hdr = root->current;
     char         *ptr;
 
@@ -152,29 +153,17 @@ char * Alloc(long size)
 }
 
 
-/*
-**  AllocSetPool()
-**
-**  Change the current pool.  Return the old pool.
-*/
-
-alloc_handle_t * AllocSetPool(alloc_handle_t *newpool)
-{
-    alloc_handle_t *old = (alloc_handle_t *) root;
-    root = (alloc_root_t *) newpool;
-    return(old);
-}
-
-
 /*
 **  AllocReset()
 **
-**  Reset the current pool for re-use.  No memory is freed,
+**  Reset a pool for re-use.  No memory is freed,
 **  so this is very fast.
 */
 
-void  AllocReset()
+void  AllocReset(alloc_handle_t *pool)
 {
+    alloc_root_t *root = (alloc_root_t *) pool;
+
     root->current = root->first;
     root->current->free = root->current->block;
 }
@@ -183,12 +172,13 @@ void  AllocReset()
 /*
 **  AllocFreePool()
 **
-**  Free the memory used by the current pool.
+**  Free the memory used by a pool.
 **  Don't use where AllocReset() could be used.
 */
 
-void  AllocFreePool()
+void  AllocFreePool(alloc_handle_t *pool)
 {
+    alloc_root_t *root = (alloc_root_t *) pool;
     alloc_hdr_t  *tmp,
                  *hdr = root->first;
 
@@ -200,5 +190,4 @@ void  AllocFreePool()
         hdr = tmp;
     }
     free((char *) root);
-    root = NULL;
 }
@@ -13,7 +13,6 @@ typedef struct
 }  alloc_handle_t;
 
 alloc_handle_t *AllocInit(void);
-char           *Alloc(long);
-alloc_handle_t *AllocSetPool(alloc_handle_t *);
-void            AllocReset(void);
-void            AllocFreePool(void);
+char           *Alloc(alloc_handle_t *, long);
+void            AllocReset(alloc_handle_t *);
+void            AllocFreePool(alloc_handle_t *);
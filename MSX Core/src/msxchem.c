@@ -19,10 +19,15 @@
 #include <math.h>
 
 #include "msxtypes.h"
+#include "msxutils.h"
 #include "rk5.h"
 #include "ros2.h"
+#include "bdf.h"
 #include "newton.h"
 #include "msxfuncs.h"                                                          //1.1.00
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 
@@ -32,69 +37,241 @@ int    MAXIT = 20;                     // Max. number of iterations used
                                        // in nonlinear equation solver
 int    NUMSIG = 3;                     // Number of significant digits in
                                        // nonlinear equation solver error
+#define QUIET_TOL  0.1                 // Fraction of Atol a skipped reaction
+                                       // step may change a species by
+
+//  Quiescence of a segment's reactions (Sseg.quiet)
+#define QUIET_NO   0                   // its reactions are integrated
+#define QUIET_TEST 1                   // its last step changed it very little
+#define QUIET_YES  2                   // its reactions can be skipped for
+                                       // a time of qlimit
+#define CHUNKS_PER_WORKER 8            // Chunks of reaction work scheduled
+                                       // per worker thread
+
+//  Local declarations
+//--------------------
+//  Chemistry work space of a single worker thread
+typedef struct
+{
+    Pseg   TheSeg;                     // Current water quality segment
+    int    TheLink;                    // Index of current link
+    int    TheNode;                    // Index of current node
+    int    TheTank;                    // Index of current tank
+    double *Yrate;                     // Rate species concentrations
+    double *Yequil;                    // Equilibrium species concentrations
+    double *HydVar;                    // Hydraulic variables of current link
+    double *F;                         // Function values
+    double *ChemC1;                    // Species concentrations
+    double **JacRE;                    // d(rate)/d(equil. species) work matrix
+    double **JacER;                    // d(equil.)/d(rate species) work matrix
+    double **JacEE;                    // d(equil.)/d(equil. species) work matrix
+    double *JacW;                      // Jacobian work vector
+    int    *JacIndx;                   // Jacobian row permutation
+    double *JacF;                      // Compiled Jacobian partial derivatives
+    double **LinA;                     // Linear rate coefficients over a time step
+    double **LinE;                     // Exact solution matrix of the linear rates
+    double **LinWork;                  // Matrix exponential work space
+    double *LinW;                      // Linear rate work vector
+    int    *LinIndx;                   // Linear rate row permutation
+    double *QuietY;                    // Quiescence test concentrations
+    double *QuietF;                    // Quiescence test reaction rates
+    long   NumReacted;                 // Segment reaction integrations
+    long   NumSkipped;                 // Segment reaction integrations skipped
+    long   NumEvals;                   // Segment reaction rate evaluations
+    Pseg   BatchSeg[MAX_BATCH];        // Pipe segments reacted together
+    int    BatchFailed;                // Batch evaluation not possible
+    double *BatchC;                    // Species concentrations of a batch
+    double *BatchCw;                   // Concentrations of evaluated segments
+    double *BatchY;                    // Rate species concentrations of a batch
+    double *BatchF;                    // Reaction rates of a batch
+    double BatchH[MAX_BATCH];          // Integration step of each segment
+    double *BatchP;                    // Pipe parameters of a batch
+    double *BatchHyd;                  // Hydraulic variables of a batch
+    double *BatchRate;                 // Compiled reaction rates of a batch
+    ExprFrame Frame;                   // Variables read by compiled expressions
+    int    NumMemo;                    // Number of memoized variables + 1
+    unsigned State;                    // Current concentration state
+    unsigned InvariantState;           // State of parameters, constants & hydraulics
+    int    HoldInvariants;             // 1 while reacting a single pipe or tank
+    double *Memo;                      // Formula species, term & shared values
+    unsigned *MemoState;               // State each memoized value belongs to
+    unsigned BatchState;               // Current batch concentration state
+    double *BatchMemo;                 // Formula species, term & shared batch values
+    unsigned *BatchMemoState;          // State each batch value belongs to
+    MSXRungeKutta Rk5;                 // Runge-Kutta integrator work space
+    MSXRosenbrock Ros2;                // Rosenbrock integrator work space
+    MSXBdf        Bdf;                 // BDF integrator work space
+    MSXNewton     Newton;              // Equilibrium solver work space
+} ChemWorker;
+
+//  A pipe or tank whose reactions are computed by a worker thread
+typedef struct
+{
+    int    task;                       // Link index of a pipe or number of
+                                       // links plus tank index of a tank
+    double cost;                       // Estimated cost of its reactions
+} ChemTask;
 
-//  Local variables
-//-----------------
-static Pseg   TheSeg;                  // Current water quality segment
-static int    TheLink;                 // Index of current link
-static int    TheNode;                 // Index of current node
-static int    TheTank;                 // Index of current tank                //1.1.00
-static int    NumSpecies;              // Total number of species
-static int    NumPipeRateSpecies;      // Number of species with pipe rates
-static int    NumTankRateSpecies;      // Number of species with tank rates
-static int    NumPipeFormulaSpecies;   // Number of species with pipe formulas
-static int    NumTankFormulaSpecies;   // Number of species with tank formulas
-static int    NumPipeEquilSpecies;     // Number of species with pipe equilibria
-static int    NumTankEquilSpecies;     // Number of species with tank equilibria
-static int    *PipeRateSpecies;        // Species governed by pipe reactions
-static int    *TankRateSpecies;        // Species governed by tank reactions
-static int    *PipeEquilSpecies;       // Species governed by pipe equilibria
-static int    *TankEquilSpecies;       // Species governed by tank equilibria
-static int    LastIndex[MAX_OBJECTS];  // Last index of given type of variable
-static double *Atol;                   // Absolute concentration tolerances
-static double *Rtol;                   // Relative concentration tolerances
-static double *Yrate;                  // Rate species concentrations
-static double *Yequil;                 // Equilibrium species concentrations
-static double HydVar[MAX_HYD_VARS];    // Values of hydraulic variables
-static double *F;                      // Function values                      //1.1.00
-static double *ChemC1;
-
-#ifdef _OPENMP
-#pragma omp threadprivate(TheSeg, TheLink, TheNode, TheTank, Yrate, Yequil, HydVar, F, ChemC1)
-#endif
+//  Chemistry system of a project (MSX->Chem)
+struct ChemSystem
+{
+    int    NumSpecies;                 // Total number of species
+    int    NumPipeRateSpecies;         // Number of species with pipe rates
+    int    NumTankRateSpecies;         // Number of species with tank rates
+    int    NumPipeFormulaSpecies;      // Number of species with pipe formulas
+    int    NumTankFormulaSpecies;      // Number of species with tank formulas
+    int    NumPipeEquilSpecies;        // Number of species with pipe equilibria
+    int    NumTankEquilSpecies;        // Number of species with tank equilibria
+    int    NumPipeLinearSpecies;       // Number of species with linear pipe rates
+    int    NumTankLinearSpecies;       // Number of species with linear tank rates
+    int    *PipeRateSpecies;           // Species governed by pipe reactions
+    int    *TankRateSpecies;           // Species governed by tank reactions
+    int    *PipeEquilSpecies;          // Species governed by pipe equilibria
+    int    *TankEquilSpecies;          // Species governed by tank equilibria
+    int    *PipeLinearSpecies;         // Species whose pipe rates are integrated exactly
+    int    *TankLinearSpecies;         // Species whose tank rates are integrated exactly
+    int    LastIndex[MAX_OBJECTS];     // Last index of given type of variable
+    double *PipeAtol;                  // Absolute tolerances of pipe rate species
+    double *PipeRtol;                  // Relative tolerances of pipe rate species
+    double *TankAtol;                  // Absolute tolerances of tank rate species
+    double *TankRtol;                  // Relative tolerances of tank rate species
+    double *CScale;                    // Largest concentration of each species
+    ExprSystem PipeSystem;             // Optimized pipe expressions
+    ExprSystem TankSystem;             // Optimized tank expressions
+    int    FirstPipeShared;            // Index of first shared pipe sub-expression
+    int    FirstTankShared;            // Index of first shared tank sub-expression
+    int    NumVars;                    // Index of last shared tank sub-expression
+    MathExpr **PipeExpr;               // Optimized pipe expression of each variable
+    MathExpr **TankExpr;               // Optimized tank expression of each variable
+    char   *PipeInvariant;             // 1 if a pipe variable only depends on
+    char   *TankInvariant;             // parameters, constants & hydraulics
+    ExprCode **PipeCode;               // Compiled pipe expression of each variable
+    ExprCode **TankCode;               // Compiled tank expression of each variable
+    double *NoParams;                  // Parameter values of non-tank nodes
+    ExprCode **PipeJacobian;           // Analytic Jacobian of pipe rates
+    ExprCode **TankJacobian;           // Analytic Jacobian of tank rates
+    MathExpr **PipeJacExpr;            // Pipe rate derivatives to be compiled
+    MathExpr **TankJacExpr;            // Tank rate derivatives to be compiled
+    MSXSparse *PipeSparse;             // Sparsity of the pipe rate Jacobian
+    MSXSparse *TankSparse;             // Sparsity of the tank rate Jacobian
+    MSXRosJacobian *TankJac;           // ROS2 Jacobian kept for each tank
+    ExprCode **PipeLinearCoeff;        // Coefficients of the linear pipe rates
+    ExprCode **TankLinearCoeff;        // Coefficients of the linear tank rates
+    int    DerivZone;                  // Zone (LINK or NODE) being differentiated
+    int    DerivErr;                   // Error flag for differentiation
+    char   *DerivState;                // 0 = not derived, 1 = in progress, 2 = done
+    MathExpr **DerivCache;             // Derivatives of formulas & terms
+    double *HydTable;                  // Hydraulic variables of each link
+    int    BatchLane[MAX_BATCH];       // Index of each segment in a batch
+    int    RatesChanged;               // 1 if hydraulics, constants or
+                                       // parameters changed since last step
+    int    NumWorkers;                 // Number of worker threads
+    ChemWorker *Worker;                // Work space of each worker thread
+    int    NumTasks;                   // Number of pipes & tanks reacted
+    ChemTask *Task;                    // Pipes & tanks in order of their cost
+    long   *TaskEvals;                 // Rate evaluations of each pipe & tank
+                                       // in the last time step
+    int    NumChunks;                  // Number of chunks of tasks
+    int    *ChunkStart;                // First task of each chunk
+    int    ErrTask;                    // First pipe or tank that failed
+    int    ErrCode;                    // and the error code it returned
+};
+typedef struct ChemSystem ChemSystem;
 
 //  Exported functions
 //--------------------
 int    MSXchem_open(MSXproject MSX);
-int    MSXchem_react(MSXproject MSX, long dt);
+int    MSXchem_react(MSXproject MSX, double dt);
 int    MSXchem_equil(MSXproject MSX, int zone, double *c);
-char*  MSXchem_getVariableStr(int i, char *s);                                 //1.1.00
+int    MSXchem_catchUp(MSXproject MSX);
+double MSXchem_getReactionRate(MSXproject MSX);
+char*  MSXchem_getPipeVariableStr(MSXproject MSX, int i, char *s);
+char*  MSXchem_getTankVariableStr(MSXproject MSX, int i, char *s);
+char*  MSXchem_getBatchVariableStr(MSXproject MSX, int i, char *s);
+MathExpr* MSXchem_getExpr(MSXproject MSX, int zone, int i);
+int    MSXchem_getJacobianSize(MSXproject MSX, int zone);
+MathExpr* MSXchem_getJacobianExpr(MSXproject MSX, int zone, int i, int j);
+void   MSXchem_getSharedRange(MSXproject MSX, int zone, int *first, int *last);
 void   MSXchem_close(MSXproject MSX);
 
 // Imported functions
 //-------------------
 int    MSXcompiler_open(MSXproject MSX);                                                 //1.1.00
-void   MSXcompiler_close(void);                                                //1.1.00
+void   MSXcompiler_close(MSXproject MSX);                                      //1.1.00
 double MSXerr_validate(MSXproject MSX, double x, int index, int element, int exprType);        //1.1.00
 
 //  Local functions
 //-----------------
+static int    openWorker(ChemWorker *wk, int m, int np);
+static int    openMemo(ChemWorker *wk, int nv);
+static void   closeWorker(ChemWorker *wk);
+static ChemWorker *getWorker(MSXproject MSX);
+static void   resetMemo(ChemWorker *wk);
+static void   holdInvariants(ChemWorker *wk);
+static void   resetBatchMemo(ChemWorker *wk);
 static void   setSpeciesChemistry(MSXproject MSX);
 static void   setTankChemistry(MSXproject MSX);
-static void   evalHydVariables(MSXproject MSX, int k);
-static int    evalPipeReactions(MSXproject MSX, int k, long dt);
-static int    evalTankReactions(MSXproject MSX, int k, long dt);
+static void   scheduleTasks(MSXproject MSX);
+static int    compareTasks(const void *a, const void *b);
+static int    reactTask(MSXproject MSX, int k, double dt);
+static void   evalHydVariables(MSXproject MSX, int k, double *hydVar);
+static void   setPipeBatchInputs(MSXproject MSX, int k);
+static int    evalPipeReactions(MSXproject MSX, int k, double dt);
+static int    evalTankReactions(MSXproject MSX, int k, double dt);
 static int    evalPipeEquil(MSXproject MSX, double *c);
 static int    evalTankEquil(MSXproject MSX, double *c);
 static void   evalPipeFormulas(MSXproject MSX, double *c);
 static void   evalTankFormulas(MSXproject MSX, double *c);
 static double getPipeVariableValue(MSXproject MSX, int i);
 static double getTankVariableValue(MSXproject MSX, int i);
-static void   getPipeDcDt(MSXproject MSX, double t, double y[], int n, double deriv[]);
+static double evalMemo(MSXproject MSX, int zone, int i);
+static int    optimizeExpressions(MSXproject MSX);
+static int    optimizeZone(MSXproject MSX, int zone, ExprSystem *sys, int first);
+static int    compileExpressions(MSXproject MSX);
+static void   deleteCode(ExprCode **code, int n);
+static int    getPipeVariableSlot(MSXproject MSX, int i, int *j);
+static int    getTankVariableSlot(MSXproject MSX, int i, int *j);
+static int    getMemoSlot(char *invariant, int i);
+static char*  getVariableStr(MSXproject MSX, int zone, int batch, int i, char *s);
+static ExprFrame *getFrame(MSXproject MSX, int zone);
 static void   getTankDcDt(MSXproject MSX, double t, double y[], int n, double deriv[]);
 static void   getPipeEquil(MSXproject MSX, double t, double y[], int n, double f[]);
 static void   getTankEquil(MSXproject MSX, double t, double y[], int n, double f[]);
 static int    isValidNumber(double x);                                         //(L.Rossman - 11/03/10)
+static ExprCode **createJacobian(MSXproject MSX, int zone, MathExpr ***jacExpr);
+static void   deleteJacobian(ExprCode **jac, int nn);
+static void   deleteJacobianExpr(MathExpr ***jac, int nn);
+static int    getCoupledEquilCount(MSXproject MSX, int zone);
+static int    getJacobianSpecies(MSXproject MSX, int zone, int n, int i);
+static int    createSparsity(MSXproject MSX, int zone, MSXSparse **sp);
+static int    createLinearRates(MSXproject MSX, int zone);
+static int    evalLinearRates(MSXproject MSX, int zone, double tstep);
+static int    setLinearCoeffs(MSXproject MSX, int zone, double tstep);
+static void   applyLinearRates(MSXproject MSX, int zone, double *c);
+static MathExpr *getSpeciesExpr(MSXproject MSX, int zone, int m);
+static int    getSpeciesExprType(MSXproject MSX, int zone, int m);
+static void   getDependencies(MSXproject MSX, int zone, MathExpr *expr,
+                              char *dep, char *visited);
+static MathExpr *getDerivative(MSXproject MSX, int ivar, int wrt);
+static int    evalJacobian(MSXproject MSX, ExprCode **jac, int zone, double y[],
+                           int n, double **a);
+static int    getTankJacobian(MSXproject MSX, double t, double y[], int n, double **a);
+static int    reactPipeBatch(MSXproject MSX, int nb, double tstep);
+static int    reactTankSeg(MSXproject MSX, int k, double tstep);
+static int    catchUpPipe(MSXproject MSX, int k);
+static int    catchUpTank(MSXproject MSX, int k);
+static void   addPipeReacted(MSXproject MSX, int k, Pseg seg);
+static void   addTankReacted(MSXproject MSX, int k, Pseg seg);
+static int    isQuiescent(MSXproject MSX, int zone, Pseg seg, double tstep);
+static void   markQuiescent(MSXproject MSX, int zone, Pseg seg);
+static double getQuietTime(MSXproject MSX, int zone, double *c);
+static void   getQuietRates(MSXproject MSX, int zone, double *c, double y[],
+                            int n, double f[]);
+static int    getPipeBatchValue(MSXproject MSX, int i, int nb, double v[]);
+static void   getPipeDcDtBatch(MSXproject MSX, int na, int lane[], double y[],
+                               int n, double deriv[]);
+static int    getPipeBatchJacobian(MSXproject MSX, int lane, double y[], int n,
+                                   double **a);
 
 
 //=============================================================================
@@ -109,69 +286,82 @@ int  MSXchem_open(MSXproject MSX)
 **
 **  Returns:
 **    an error code (0 if no error).
+**
+**  Note:
+**    all chemistry data is kept in MSX->Chem, with a separate work
+**    space for each thread that can react pipes and tanks in parallel.
 */
 {
-    int m;
+    int k, m, n, w;
     int numWallSpecies;
     int numBulkSpecies;
     int numTankExpr;
     int numPipeExpr;
     int errcode = 0;
+    ChemSystem *chem;
+    ChemWorker *wk;
 
-    // --- allocate memory
+    // --- allocate the chemistry system and its worker work spaces
 
-    PipeRateSpecies = NULL;
-    TankRateSpecies = NULL;
-    PipeEquilSpecies = NULL;
-    TankEquilSpecies = NULL;
-    Atol = NULL;
-    Rtol = NULL;
-    Yrate = NULL;
-    Yequil = NULL;
-    NumSpecies = MSX->Nobjects[SPECIES];
-    m = NumSpecies + 1;
-    PipeRateSpecies = (int*)calloc(m, sizeof(int));
-    TankRateSpecies = (int*)calloc(m, sizeof(int));
-    PipeEquilSpecies = (int*)calloc(m, sizeof(int));
-    TankEquilSpecies = (int*)calloc(m, sizeof(int));
-    Atol = (double*)calloc(m, sizeof(double));
-    Rtol = (double*)calloc(m, sizeof(double));
-    CALL(errcode, MEMCHECK(PipeRateSpecies));
-    CALL(errcode, MEMCHECK(TankRateSpecies));
-    CALL(errcode, MEMCHECK(PipeEquilSpecies));
-    CALL(errcode, MEMCHECK(TankEquilSpecies));
-    CALL(errcode, MEMCHECK(Atol));
-    CALL(errcode, MEMCHECK(Rtol));
+    chem = (ChemSystem *)calloc(1, sizeof(ChemSystem));
+    if ( chem == NULL ) return ERR_MEMORY;
+    MSX->Chem = chem;
+    chem->NumWorkers = MAX(MSX->NumThreads, 1);
+    chem->Worker = (ChemWorker *)calloc(chem->NumWorkers, sizeof(ChemWorker));
+    if ( chem->Worker == NULL ) return ERR_MEMORY;
 
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-    Yrate = (double*)calloc(m, sizeof(double));
-    Yequil = (double*)calloc(m, sizeof(double));
-    F = (double*)calloc(m, sizeof(double));                             //1.1.00
-    ChemC1 = (double*)calloc(m, sizeof(double));
-#ifdef _OPENMP
-#pragma omp critical
+    // --- allocate memory
+
+    chem->NumSpecies = MSX->Nobjects[SPECIES];
+    m = chem->NumSpecies + 1;
+    chem->PipeRateSpecies = (int*)calloc(m, sizeof(int));
+    chem->TankRateSpecies = (int*)calloc(m, sizeof(int));
+    chem->PipeEquilSpecies = (int*)calloc(m, sizeof(int));
+    chem->TankEquilSpecies = (int*)calloc(m, sizeof(int));
+    chem->PipeLinearSpecies = (int*)calloc(m, sizeof(int));
+    chem->TankLinearSpecies = (int*)calloc(m, sizeof(int));
+    chem->PipeAtol = (double*)calloc(m, sizeof(double));
+    chem->PipeRtol = (double*)calloc(m, sizeof(double));
+    chem->TankAtol = (double*)calloc(m, sizeof(double));
+    chem->TankRtol = (double*)calloc(m, sizeof(double));
+    chem->CScale = (double*)calloc(m, sizeof(double));
+    chem->HydTable = (double*)calloc((MSX->Nobjects[LINK]+1)*MAX_HYD_VARS,
+                                     sizeof(double));
+    n = MSX->Nobjects[LINK] + MSX->Nobjects[TANK];
+    chem->Task = (ChemTask*)calloc(n + 1, sizeof(ChemTask));
+    chem->TaskEvals = (long*)calloc(n + 1, sizeof(long));
+    chem->ChunkStart = (int*)calloc(n + 1, sizeof(int));
+    CALL(errcode, MEMCHECK(chem->PipeRateSpecies));
+    CALL(errcode, MEMCHECK(chem->TankRateSpecies));
+    CALL(errcode, MEMCHECK(chem->PipeEquilSpecies));
+    CALL(errcode, MEMCHECK(chem->TankEquilSpecies));
+    CALL(errcode, MEMCHECK(chem->PipeLinearSpecies));
+    CALL(errcode, MEMCHECK(chem->TankLinearSpecies));
+    CALL(errcode, MEMCHECK(chem->PipeAtol));
+    CALL(errcode, MEMCHECK(chem->PipeRtol));
+    CALL(errcode, MEMCHECK(chem->TankAtol));
+    CALL(errcode, MEMCHECK(chem->TankRtol));
+    CALL(errcode, MEMCHECK(chem->CScale));
+    CALL(errcode, MEMCHECK(chem->HydTable));
+    CALL(errcode, MEMCHECK(chem->Task));
+    CALL(errcode, MEMCHECK(chem->TaskEvals));
+    CALL(errcode, MEMCHECK(chem->ChunkStart));
+    for (w=0; w<chem->NumWorkers; w++)
     {
-#endif
-        CALL(errcode, MEMCHECK(Yrate));
-        CALL(errcode, MEMCHECK(Yequil));
-        CALL(errcode, MEMCHECK(F));
-        CALL(errcode, MEMCHECK(ChemC1));
-#ifdef _OPENMP
-    }
-#endif
-#ifdef _OPENMP
+        CALL(errcode, openWorker(&chem->Worker[w], m,
+                                 MSX->Nobjects[PARAMETER] + 1));
+        chem->Worker[w].HydVar = chem->HydTable;
     }
-#endif
     if ( errcode ) return errcode;
+    for (m=0; m<MAX_BATCH; m++) chem->BatchLane[m] = m;
 
 // --- assign species to each type of chemical expression
 
     setSpeciesChemistry(MSX);
-    numPipeExpr = NumPipeRateSpecies + NumPipeFormulaSpecies + NumPipeEquilSpecies;
-    numTankExpr = NumTankRateSpecies + NumTankFormulaSpecies + NumTankEquilSpecies;
+    numPipeExpr = chem->NumPipeRateSpecies + chem->NumPipeFormulaSpecies +
+                  chem->NumPipeEquilSpecies;
+    numTankExpr = chem->NumTankRateSpecies + chem->NumTankFormulaSpecies +
+                  chem->NumTankEquilSpecies;
 
 // --- use pipe chemistry for tanks if latter was not supplied
 
@@ -185,47 +375,164 @@ int  MSXchem_open(MSXproject MSX)
 
     numWallSpecies = 0;
     numBulkSpecies = 0;
-    for (m=1; m<=NumSpecies; m++)
+    for (m=1; m<=chem->NumSpecies; m++)
     {
         if ( MSX->Species[m].type == WALL ) numWallSpecies++;
         if ( MSX->Species[m].type == BULK ) numBulkSpecies++;
     }
-    if ( numPipeExpr != NumSpecies )       return ERR_NUM_PIPE_EXPR;
+    if ( numPipeExpr != chem->NumSpecies ) return ERR_NUM_PIPE_EXPR;
     if ( numTankExpr != numBulkSpecies   ) return ERR_NUM_TANK_EXPR;
 
-// --- open the ODE solver;
+// --- open each worker's ODE solver;
 //     arguments are max. number of ODE's,
 //     max. number of steps to be taken,
 //     1 if automatic step sizing used (or 0 if not used)
+//     and its algebraic eqn. solver
 
-    if ( MSX->Solver == RK5 )
+    m = MAX(chem->NumPipeEquilSpecies, chem->NumTankEquilSpecies);
+    for (w=0; w<chem->NumWorkers; w++)
+    {
+        wk = &chem->Worker[w];
+        if ( MSX->Solver == RK5 )
+        {
+            if ( rk5_open(&wk->Rk5, chem->NumSpecies, 1000, 1) == FALSE )
+                return ERR_INTEGRATOR_OPEN;
+        }
+        if ( MSX->Solver == ROS2 )
+        {
+            if ( ros2_open(&wk->Ros2, chem->NumSpecies, 1) == FALSE )
+                return ERR_INTEGRATOR_OPEN;
+            wk->Ros2.Reuse = (MSX->Jacobian == REUSE_JACOBIAN);
+        }
+        if ( MSX->Solver == BDF )
+        {
+            if ( bdf_open(&wk->Bdf, chem->NumSpecies) == FALSE )
+                return ERR_INTEGRATOR_OPEN;
+        }
+        if ( newton_open(&wk->Newton, m) == FALSE ) return ERR_NEWTON_OPEN;
+    }
+
+// --- assign entries to LastIndex array
+
+    chem->LastIndex[SPECIES] = MSX->Nobjects[SPECIES];
+    chem->LastIndex[TERM] = chem->LastIndex[SPECIES] + MSX->Nobjects[TERM];
+    chem->LastIndex[PARAMETER] = chem->LastIndex[TERM] + MSX->Nobjects[PARAMETER];
+    chem->LastIndex[CONSTANT] = chem->LastIndex[PARAMETER] + MSX->Nobjects[CONSTANT];
+
+// --- optimize the chemistry expressions and compile them for the
+//     expression interpreter
+
+    errcode = optimizeExpressions(MSX);
+    if ( errcode ) return errcode;
+    errcode = compileExpressions(MSX);
+    if ( errcode ) return errcode;
+    for (w=0; w<chem->NumWorkers; w++)
     {
-        if ( rk5_open(NumSpecies, 1000, 1) == FALSE )
-            return ERR_INTEGRATOR_OPEN;
+        CALL(errcode, openMemo(&chem->Worker[w], chem->NumVars + 1));
     }
-    if ( MSX->Solver == ROS2 )
+    if ( errcode ) return errcode;
+
+// --- species with linear rates are integrated exactly instead of by
+//     an ODE solver that adjusts its step size
+
+    if ( MSX->Solver != EUL )
     {
-        if ( ros2_open(NumSpecies, 1) == FALSE )
-            return ERR_INTEGRATOR_OPEN;
+        CALL(errcode, createLinearRates(MSX, LINK));
+        CALL(errcode, createLinearRates(MSX, NODE));
+        if ( errcode ) return errcode;
+        m = MAX(chem->NumPipeLinearSpecies, chem->NumTankLinearSpecies);
+        if ( m > 0 )
+        {
+            m = m + 2;
+            for (w=0; w<chem->NumWorkers; w++)
+            {
+                wk = &chem->Worker[w];
+                wk->LinA = createMatrix(m, m);
+                wk->LinE = createMatrix(m, m);
+                wk->LinWork = createMatrix(3*m, m);
+                wk->LinW = (double*)calloc(m, sizeof(double));
+                wk->LinIndx = (int*)calloc(m, sizeof(int));
+                CALL(errcode, MEMCHECK(wk->LinA));
+                CALL(errcode, MEMCHECK(wk->LinE));
+                CALL(errcode, MEMCHECK(wk->LinWork));
+                CALL(errcode, MEMCHECK(wk->LinW));
+                CALL(errcode, MEMCHECK(wk->LinIndx));
+            }
+            if ( errcode ) return errcode;
+        }
     }
 
-// --- open the algebraic eqn. solver
+// --- differentiate the rate expressions for the stiff solvers
+//     (finite differences are used where this isn't possible); the
+//     derivatives are kept for the chemistry library if it is compiled
 
-    m = MAX(NumPipeEquilSpecies, NumTankEquilSpecies);
-    if ( newton_open(m) == FALSE ) return ERR_NEWTON_OPEN;
+    if ( MSX->Solver == ROS2 || MSX->Solver == BDF )
+    {
+        chem->PipeJacobian = createJacobian(MSX, LINK,
+                             MSX->Compiler ? &chem->PipeJacExpr : NULL);
+        chem->TankJacobian = createJacobian(MSX, NODE,
+                             MSX->Compiler ? &chem->TankJacExpr : NULL);
+        if ( MSX->Compiler && (chem->PipeJacobian || chem->TankJacobian) )
+        {
+            m = (chem->NumSpecies + 1) * (chem->NumSpecies + 1);
+            for (w=0; w<chem->NumWorkers; w++)
+            {
+                chem->Worker[w].JacF = (double*)calloc(m, sizeof(double));
+                CALL(errcode, MEMCHECK(chem->Worker[w].JacF));
+            }
+            if ( errcode ) return errcode;
+        }
+        CALL(errcode, createSparsity(MSX, LINK, &chem->PipeSparse));
+        CALL(errcode, createSparsity(MSX, NODE, &chem->TankSparse));
+        if ( errcode ) return errcode;
 
-// --- assign entries to LastIndex array
+    // --- tanks keep their own Jacobians when they are reused, since
+    //     other systems are integrated between a tank's time steps
 
-    LastIndex[SPECIES] = MSX->Nobjects[SPECIES];
-    LastIndex[TERM] = LastIndex[SPECIES] + MSX->Nobjects[TERM];
-    LastIndex[PARAMETER] = LastIndex[TERM] + MSX->Nobjects[PARAMETER];
-    LastIndex[CONSTANT] = LastIndex[PARAMETER] + MSX->Nobjects[CONSTANT];
+        if ( MSX->Solver == ROS2 && MSX->Jacobian == REUSE_JACOBIAN &&
+             MSX->Nobjects[TANK] > 0 )
+        {
+            chem->TankJac = (MSXRosJacobian *)
+                calloc(MSX->Nobjects[TANK]+1, sizeof(MSXRosJacobian));
+            CALL(errcode, MEMCHECK(chem->TankJac));
+            for (k=1; k<=MSX->Nobjects[TANK] && !errcode; k++)
+            {
+                if ( !ros2_openJacobian(&chem->TankJac[k], chem->NumSpecies) )
+                    errcode = ERR_MEMORY;
+            }
+            if ( errcode ) return errcode;
+        }
+        m = MAX(getCoupledEquilCount(MSX, LINK), getCoupledEquilCount(MSX, NODE));
+        if ( m > 0 && (chem->PipeJacobian || chem->TankJacobian) )
+        {
+            m = MAX(m, chem->NumSpecies) + 1;
+            for (w=0; w<chem->NumWorkers; w++)
+            {
+                wk = &chem->Worker[w];
+                wk->JacRE = createMatrix(m, m);
+                wk->JacER = createMatrix(m, m);
+                wk->JacEE = createMatrix(m, m);
+                wk->JacW = (double*)calloc(m, sizeof(double));
+                wk->JacIndx = (int*)calloc(m, sizeof(int));
+                CALL(errcode, MEMCHECK(wk->JacRE));
+                CALL(errcode, MEMCHECK(wk->JacER));
+                CALL(errcode, MEMCHECK(wk->JacEE));
+                CALL(errcode, MEMCHECK(wk->JacW));
+                CALL(errcode, MEMCHECK(wk->JacIndx));
+            }
+            if ( errcode ) return errcode;
+        }
+    }
 
 // --- compile chemistry function dynamic library if specified                 //1.1.00
 
     if ( MSX->Compiler )
     {
         errcode = MSXcompiler_open(MSX);
+        deleteJacobianExpr(&chem->PipeJacExpr,
+                           chem->NumPipeRateSpecies + getCoupledEquilCount(MSX, LINK));
+        deleteJacobianExpr(&chem->TankJacExpr,
+                           chem->NumTankRateSpecies + getCoupledEquilCount(MSX, NODE));
         if ( errcode ) return errcode;
     }
     return 0;
@@ -242,1119 +549,4104 @@ void MSXchem_close(MSXproject MSX)
 **    MSX = the underlying MSXproject data struct.
 */
 {
-    if (MSX->Compiler)	MSXcompiler_close();                                   //1.1.00
-    if (MSX->Solver == RK5) rk5_close();
-    if (MSX->Solver == ROS2) ros2_close();
-    newton_close();
-    FREE(PipeRateSpecies);
-    FREE(TankRateSpecies);
-    FREE(PipeEquilSpecies);
-    FREE(TankEquilSpecies);
-    FREE(Atol);
-    FREE(Rtol);
-#ifdef _OPENMP
-#pragma omp parallel
+    int k, w;
+    ChemSystem *chem = MSX->Chem;
+
+    if (MSX->Compiler)	MSXcompiler_close(MSX);                                //1.1.00
+    if ( chem == NULL ) return;
+    if ( chem->Worker )
     {
-#endif
-    FREE(ChemC1);
-    FREE(Yrate);
-    FREE(Yequil);
-    FREE(F);                                                                   //1.1.00
-#ifdef _OPENMP
+        for (w=0; w<chem->NumWorkers; w++) closeWorker(&chem->Worker[w]);
+        FREE(chem->Worker);
     }
-#endif
+    deleteJacobian(chem->PipeJacobian,
+                   chem->NumPipeRateSpecies + getCoupledEquilCount(MSX, LINK));
+    deleteJacobian(chem->TankJacobian,
+                   chem->NumTankRateSpecies + getCoupledEquilCount(MSX, NODE));
+    deleteJacobianExpr(&chem->PipeJacExpr,
+                       chem->NumPipeRateSpecies + getCoupledEquilCount(MSX, LINK));
+    deleteJacobianExpr(&chem->TankJacExpr,
+                       chem->NumTankRateSpecies + getCoupledEquilCount(MSX, NODE));
+    freeSparse(chem->PipeSparse);
+    freeSparse(chem->TankSparse);
+    deleteCode(chem->PipeLinearCoeff, (chem->NumPipeLinearSpecies+1) *
+                                      (chem->NumPipeLinearSpecies+1) - 1);
+    deleteCode(chem->TankLinearCoeff, (chem->NumTankLinearSpecies+1) *
+                                      (chem->NumTankLinearSpecies+1) - 1);
+    if ( chem->TankJac )
+    {
+        for (k=1; k<=MSX->Nobjects[TANK]; k++) ros2_closeJacobian(&chem->TankJac[k]);
+        FREE(chem->TankJac);
+    }
+    deleteCode(chem->PipeCode, chem->NumVars);
+    deleteCode(chem->TankCode, chem->NumVars);
+    mathexpr_deleteSystem(&chem->PipeSystem);
+    mathexpr_deleteSystem(&chem->TankSystem);
+    FREE(chem->PipeSystem.expr);
+    FREE(chem->PipeSystem.var);
+    FREE(chem->TankSystem.expr);
+    FREE(chem->TankSystem.var);
+    FREE(chem->PipeExpr);
+    FREE(chem->TankExpr);
+    FREE(chem->PipeInvariant);
+    FREE(chem->TankInvariant);
+    FREE(chem->NoParams);
+    FREE(chem->PipeRateSpecies);
+    FREE(chem->TankRateSpecies);
+    FREE(chem->PipeEquilSpecies);
+    FREE(chem->TankEquilSpecies);
+    FREE(chem->PipeLinearSpecies);
+    FREE(chem->TankLinearSpecies);
+    FREE(chem->PipeAtol);
+    FREE(chem->PipeRtol);
+    FREE(chem->TankAtol);
+    FREE(chem->TankRtol);
+    FREE(chem->CScale);
+    FREE(chem->Task);
+    FREE(chem->TaskEvals);
+    FREE(chem->ChunkStart);
+    FREE(chem->HydTable);
+    free(chem);
+    MSX->Chem = NULL;
 }
 
 //=============================================================================
 
-int MSXchem_react(MSXproject MSX, long dt)
+int openWorker(ChemWorker *wk, int m, int np)
 /**
 **  Purpose:
-**    computes reactions in all pipes and tanks.
+**    allocates the concentration work arrays of a worker thread.
 **
 **  Input:
-**    MSX = the underlying MSXproject data struct.
-**    dt = current WQ time step (sec).
+**    wk = worker work space
+**    m = number of species + 1
+**    np = number of parameters + 1.
 **
 **  Returns:
-**    an error code or 0 if no error.
+**    an error code (0 if no error).
 */
 {
-    int k, m;
     int errcode = 0;
-
-// --- save tolerances of pipe rate species
-
-    for (k=1; k<=NumPipeRateSpecies; k++)
-    {
-        m = PipeRateSpecies[k];
-        Atol[k] = MSX->Species[m].aTol;
-        Rtol[k] = MSX->Species[m].rTol;
-    }
-
-// --- examine each link
-#ifdef _OPENMP 
-#pragma omp parallel for
-#endif
-    for (k = 1; k <= MSX->Nobjects[LINK]; k++)
-    {
-        // --- skip non-pipe links
-
-        if (MSX->Link[k].len == 0.0) continue;
-
-        // --- evaluate hydraulic variables
-
-         evalHydVariables(MSX, k);
-
-         // --- compute pipe reactions
-
-         errcode = evalPipeReactions(MSX, k, dt);
-        //if (errcode) return errcode;
-    }
-    if (errcode) return errcode;
-
-// --- save tolerances of tank rate species
-
-    for (k=1; k<=NumTankRateSpecies; k++)
-    {
-        m = TankRateSpecies[k];
-        Atol[k] = MSX->Species[m].aTol;
-        Rtol[k] = MSX->Species[m].rTol;
-    }
-
-    for (k=1; k<=MSX->Nobjects[TANK]; k++)
-    {
-    // --- skip reservoirs
-
-        if (MSX->Tank[k].a == 0.0) continue;
-
-    // --- compute tank reactions
-
-        errcode = evalTankReactions(MSX, k, dt);
-        if ( errcode ) return errcode;
-    }
+    wk->Yrate = (double*)calloc(m, sizeof(double));
+    wk->Yequil = (double*)calloc(m, sizeof(double));
+    wk->F = (double*)calloc(m, sizeof(double));                                //1.1.00
+    wk->ChemC1 = (double*)calloc(m, sizeof(double));
+    wk->BatchC = (double*)calloc(m*MAX_BATCH, sizeof(double));
+    wk->BatchCw = (double*)calloc(m*MAX_BATCH, sizeof(double));
+    wk->BatchY = (double*)calloc(m*MAX_BATCH, sizeof(double));
+    wk->BatchF = (double*)calloc(m*MAX_BATCH, sizeof(double));
+    wk->BatchP = (double*)calloc(np*MAX_BATCH, sizeof(double));
+    wk->BatchHyd = (double*)calloc(MAX_HYD_VARS*MAX_BATCH, sizeof(double));
+    wk->BatchRate = (double*)calloc(m*MAX_BATCH, sizeof(double));
+    wk->QuietY = (double*)calloc(m, sizeof(double));
+    wk->QuietF = (double*)calloc(2*m, sizeof(double));
+    CALL(errcode, MEMCHECK(wk->Yrate));
+    CALL(errcode, MEMCHECK(wk->Yequil));
+    CALL(errcode, MEMCHECK(wk->F));
+    CALL(errcode, MEMCHECK(wk->ChemC1));
+    CALL(errcode, MEMCHECK(wk->BatchC));
+    CALL(errcode, MEMCHECK(wk->BatchCw));
+    CALL(errcode, MEMCHECK(wk->BatchY));
+    CALL(errcode, MEMCHECK(wk->BatchF));
+    CALL(errcode, MEMCHECK(wk->BatchP));
+    CALL(errcode, MEMCHECK(wk->BatchHyd));
+    CALL(errcode, MEMCHECK(wk->BatchRate));
+    CALL(errcode, MEMCHECK(wk->QuietY));
+    CALL(errcode, MEMCHECK(wk->QuietF));
     return errcode;
 }
 
 //=============================================================================
 
-int MSXchem_equil(MSXproject MSX, int zone, double *c)
+int openMemo(ChemWorker *wk, int nv)
 /**
 **  Purpose:
-**    computes equilibrium concentrations for a set of chemical species.
+**    allocates the arrays a worker thread keeps variable values in.
 **
 **  Input:
-**    MSX = the underlying MSXproject data struct.
-**    zone = reaction zone (NODE or LINK)
-**    c[] = array of species concentrations
-**
-**  Output:
-**    updated value of c[].
+**    wk = worker work space
+**    nv = index of the last variable that is memoized + 1.
 **
 **  Returns:
-**    an error code or 0 if no errors.
+**    an error code (0 if no error).
 */
 {
     int errcode = 0;
-    if ( zone == LINK )
-    {
-        if ( NumPipeEquilSpecies > 0 ) errcode = evalPipeEquil(MSX, c);
-        evalPipeFormulas(MSX, c);
-    }
-    if ( zone == NODE )
-    {
-        if ( NumTankEquilSpecies > 0 ) errcode = evalTankEquil(MSX, c);
-        evalTankFormulas(MSX, c);
-    }
+    wk->Memo = (double*)calloc(nv, sizeof(double));
+    wk->MemoState = (unsigned*)calloc(nv, sizeof(unsigned));
+    wk->BatchMemo = (double*)calloc(nv*MAX_BATCH, sizeof(double));
+    wk->BatchMemoState = (unsigned*)calloc(nv, sizeof(unsigned));
+    wk->NumMemo = nv;
+    wk->State = 1;
+    wk->InvariantState = 1;
+    wk->BatchState = 1;
+    CALL(errcode, MEMCHECK(wk->Memo));
+    CALL(errcode, MEMCHECK(wk->MemoState));
+    CALL(errcode, MEMCHECK(wk->BatchMemo));
+    CALL(errcode, MEMCHECK(wk->BatchMemoState));
     return errcode;
 }
 
 //=============================================================================
 
-char* MSXchem_getVariableStr(int i, char *s)                                   //1.1.00
+void closeWorker(ChemWorker *wk)
 /**
 **  Purpose:
-**    returns a string representation of a variable used in the chemistry
-**    functions appearing in the C source code file used to compile
-**    these functions
+**    frees all memory used by a worker thread.
 **
 **  Input:
-**    i = variable's index in the LastIndex array
-**    s = string to hold variable's symbol
-**
-**  Output:
-**    returns a pointer to s
+**    wk = worker work space.
 */
 {
-// --- WQ species have index between 1 & # of species
-
-    if ( i <= LastIndex[SPECIES] ) sprintf(s, "c[%d]", i);
-
-// --- intermediate term expressions come next
-
-    else if ( i <= LastIndex[TERM] )
-    {
-        i -= LastIndex[TERM-1];
-        sprintf(s, "term(%d, c, k, p, h)", i);
-    }
-
-// --- reaction parameter indexes come after that
-
-    else if ( i <= LastIndex[PARAMETER] )
-    {
-        i -= LastIndex[PARAMETER-1];
-        sprintf(s, "p[%d]", i);
-    }
-
-// --- followed by constants
-
-    else if ( i <= LastIndex[CONSTANT] )
-    {
-        i -= LastIndex[CONSTANT-1];
-        sprintf(s, "k[%d]", i);
-    }
-
-// --- and finally by hydraulic variables
-
-    else 
-    {
-        i -= LastIndex[CONSTANT];
-        sprintf(s, "h[%d]", i);
-    }
-    return s;
+    rk5_close(&wk->Rk5);
+    ros2_close(&wk->Ros2);
+    bdf_close(&wk->Bdf);
+    newton_close(&wk->Newton);
+    FREE(wk->ChemC1);
+    FREE(wk->Yrate);
+    FREE(wk->Yequil);
+    FREE(wk->F);                                                               //1.1.00
+    FREE(wk->BatchC);
+    FREE(wk->BatchCw);
+    FREE(wk->BatchY);
+    FREE(wk->BatchF);
+    FREE(wk->BatchP);
+    FREE(wk->BatchHyd);
+    FREE(wk->BatchRate);
+    FREE(wk->QuietY);
+    FREE(wk->QuietF);
+    FREE(wk->Memo);
+    FREE(wk->MemoState);
+    FREE(wk->BatchMemo);
+    FREE(wk->BatchMemoState);
+    freeMatrix(wk->JacRE);
+    freeMatrix(wk->JacER);
+    freeMatrix(wk->JacEE);
+    FREE(wk->JacW);
+    FREE(wk->JacIndx);
+    FREE(wk->JacF);
+    wk->JacRE = NULL;
+    wk->JacER = NULL;
+    wk->JacEE = NULL;
+    freeMatrix(wk->LinA);
+    freeMatrix(wk->LinE);
+    freeMatrix(wk->LinWork);
+    FREE(wk->LinW);
+    FREE(wk->LinIndx);
+    wk->LinA = NULL;
+    wk->LinE = NULL;
+    wk->LinWork = NULL;
 }
 
 //=============================================================================
 
-void setSpeciesChemistry(MSXproject MSX)
+ChemWorker *getWorker(MSXproject MSX)
 /**
 **  Purpose:
-**    determines which species are described by reaction rate
-**    expressions, equilibrium expressions, or simple formulas.
+**    finds the work space of the calling thread.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
 **
-**  Output:
-**    updates arrays of different chemistry types.
+**  Returns:
+**    a pointer to the thread's work space.
+**
+**  Note:
+**    this is called for every variable evaluated, so the thread
+**    number is only queried when more than one worker exists.
 */
 {
-    int m;
-    NumPipeRateSpecies = 0;
-    NumPipeFormulaSpecies = 0;
-    NumPipeEquilSpecies = 0;
-    NumTankRateSpecies = 0;
-    NumTankFormulaSpecies = 0;
-    NumTankEquilSpecies = 0;
-    for (m=1; m<=NumSpecies; m++)
-    {
-        switch ( MSX->Species[m].pipeExprType )
-        {
-          case RATE:
-            NumPipeRateSpecies++;
-            PipeRateSpecies[NumPipeRateSpecies] = m;
-            break;
-
-          case FORMULA:
-            NumPipeFormulaSpecies++;
-            break;
-
-          case EQUIL:
-            NumPipeEquilSpecies++;
-            PipeEquilSpecies[NumPipeEquilSpecies] = m;
-            break;
-        }
-        switch ( MSX->Species[m].tankExprType )
-        {
-          case RATE:
-            NumTankRateSpecies++;
-            TankRateSpecies[NumTankRateSpecies] = m;
-            break;
-
-          case FORMULA:
-            NumTankFormulaSpecies++;
-            break;
-
-          case EQUIL:
-            NumTankEquilSpecies++;
-            TankEquilSpecies[NumTankEquilSpecies] = m;
-            break;
-        }
-    }
+    ChemSystem *chem = MSX->Chem;
+#ifdef _OPENMP
+    if ( chem->NumWorkers > 1 ) return &chem->Worker[omp_get_thread_num()];
+#endif
+    return chem->Worker;
 }
 
 //=============================================================================
 
-void setTankChemistry(MSXproject MSX)
+void resetMemo(ChemWorker *wk)
 /**
 **  Purpose:
-**    assigns pipe chemistry expressions to tank chemistry for
-**    each chemical species.
+**    starts a new concentration state for a worker, so that formula
+**    species and intermediate terms are evaluated again when next used.
 **
 **  Input:
-**    MSX = the underlying MSXproject data struct.
+**    wk = worker work space.
 **
-**  Output:
-**    updates arrays of different tank chemistry types.
+**  Note:
+**    must be called whenever ChemC1 (or the pipe or tank it belongs to)
+**    changes before expressions are evaluated again. Values that only
+**    depend on parameters, constants & hydraulics are kept while
+**    invariants are held (see holdInvariants).
 */
 {
-    int m;
-    for (m=1; m<=NumSpecies; m++)
-    {
-        MSX->Species[m].tankExpr = MSX->Species[m].pipeExpr;
-        MSX->Species[m].tankExprType = MSX->Species[m].pipeExprType;
-    }
-    NumTankRateSpecies = NumPipeRateSpecies;
-    for (m=1; m<=NumTankRateSpecies; m++)
-    {
-        TankRateSpecies[m] = PipeRateSpecies[m];
-    }
-    NumTankFormulaSpecies = NumPipeFormulaSpecies;
-    NumTankEquilSpecies = NumPipeEquilSpecies;
-    for (m=1; m<=NumTankEquilSpecies; m++)
+    wk->State++;
+    if ( wk->State == 0 )
     {
-        TankEquilSpecies[m] = PipeEquilSpecies[m];
+        memset(wk->MemoState, 0, wk->NumMemo*sizeof(unsigned));
+        wk->State = 1;
     }
+    if ( !wk->HoldInvariants ) wk->InvariantState = wk->State;
 }
 
 //=============================================================================
 
-void evalHydVariables(MSXproject MSX, int k)
+void holdInvariants(ChemWorker *wk)
 /**
 **  Purpose:
-**    retrieves current values of hydraulic variables for the
-**    current link being analyzed.
+**    starts reacting a new pipe or tank, whose parameters, constants &
+**    hydraulics stay the same until the next call.
 **
 **  Input:
-**    MSX = the underlying MSXproject data struct.
-**    k = link index
+**    wk = worker work space.
 **
-**  Output:
-**    updates values stored in vector HydVar[]
+**  Note:
+**    the shared sub-expressions that only depend on these are then
+**    evaluated once per pipe or tank per time step.
 */
 {
-    double dh;                         // headloss in ft
-    double diam = MSX->Link[k].diam;    // diameter in ft
-    double av;                         // area per unit volume
-
-// --- pipe diameter in user's units (ft or m)
-    HydVar[DIAMETER] = diam * MSX->Ucf[LENGTH_UNITS];
-
-// --- flow rate in user's units
-    HydVar[FLOW] = fabs(MSX->Q[k]) * MSX->Ucf[FLOW_UNITS];
-
-// --- flow velocity in ft/sec
-    if ( diam == 0.0 ) HydVar[VELOCITY] = 0.0;
-    else HydVar[VELOCITY] = fabs(MSX->Q[k]) * 4.0 / PI / SQR(diam);
-
-// --- Reynolds number
-    HydVar[REYNOLDS] = HydVar[VELOCITY] * diam / VISCOS;
-
-// --- flow velocity in user's units (ft/sec or m/sec)
-    HydVar[VELOCITY] *= MSX->Ucf[LENGTH_UNITS];
-
-// --- Darcy Weisbach friction factor
-    if ( MSX->Link[k].len == 0.0 ) HydVar[FRICTION] = 0.0;
-    else
-    {
-        dh = ABS(MSX->H[MSX->Link[k].n1] - MSX->H[MSX->Link[k].n2]);
-        HydVar[FRICTION] = 39.725*dh*pow(diam,5)/
-                           MSX->Link[k].len/SQR(MSX->Q[k]);
-    }
+    wk->HoldInvariants = 0;
+    resetMemo(wk);
+    wk->HoldInvariants = 1;
+}
 
-// --- shear velocity in user's units (ft/sec or m/sec)
-    HydVar[SHEAR] = HydVar[VELOCITY] * sqrt(HydVar[FRICTION] / 8.0);
+//=============================================================================
 
-// --- pipe surface area / volume in area_units/L
-    HydVar[AREAVOL] = 1.0;
-    if ( diam > 0.0 )
+void resetBatchMemo(ChemWorker *wk)
+/**
+**  Purpose:
+**    starts a new concentration state for a batch of pipe segments.
+**
+**  Input:
+**    wk = worker work space.
+*/
+{
+    wk->BatchState++;
+    if ( wk->BatchState == 0 )
     {
-        av  = 4.0/diam;                // ft2/ft3
-        av *= MSX->Ucf[AREA_UNITS];     // area_units/ft3
-        av /= LperFT3;                 // area_units/L
-        HydVar[AREAVOL] = av;
+        memset(wk->BatchMemoState, 0, wk->NumMemo*sizeof(unsigned));
+        wk->BatchState = 1;
     }
-
-    HydVar[ROUGHNESS] = MSX->Link[k].roughness;   /*Feng Shang, Bug ID 8,  01/29/2008*/
 }
 
 //=============================================================================
 
-int evalPipeReactions(MSXproject MSX, int k, long dt)
+int MSXchem_react(MSXproject MSX, double dt)
 /**
 **  Purpose:
-**    updates species concentrations in each WQ segment of a pipe
-**    after reactions occur over time step dt.
+**    computes reactions in all pipes and tanks.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    k = link index
-**    dt = time step (sec).
-**
-**  Output:
-**    updates values in the concentration vector C[] associated
-**    with a pipe's WQ segments.
+**    dt = current WQ time step (sec).
 **
 **  Returns:
 **    an error code or 0 if no error.
 **
-**  Re-written to accommodate compiled functions (1.1)                         //1.1.00
+**  Note:
+**    pipes and tanks are reacted together by the worker threads, which
+**    take chunks of similar cost as they become free (see scheduleTasks).
+**    An error is reported for the first pipe or tank (in index order)
+**    that fails, no matter which thread finds it.
 */
 {
-    int i, m;
-    int errcode = 0, ierr = 0;
-    double tstep = (double)dt / MSX->Ucf[RATE_UNITS];
-    double c, dh;
+    ChemSystem *chem = MSX->Chem;
+    int i, j, k, m, errtask;
+    int errcode;
 
-// --- start with the most downstream pipe segment
+// --- save tolerances of pipe & tank rate species
 
-    TheLink = k;
-    TheSeg = MSX->FirstSeg[TheLink];
-    while ( TheSeg )
+    for (k=1; k<=chem->NumPipeRateSpecies; k++)
     {
- 
-        for (m = 1; m <= NumSpecies; m++)
-        {
-            ChemC1[m] = TheSeg->c[m];
-            TheSeg->lastc[m] = TheSeg->c[m];
-        }
-        ierr = 0;
+        m = chem->PipeRateSpecies[k];
+        chem->PipeAtol[k] = MSX->Species[m].aTol;
+        chem->PipeRtol[k] = MSX->Species[m].rTol;
+    }
+    for (k=1; k<=chem->NumTankRateSpecies; k++)
+    {
+        m = chem->TankRateSpecies[k];
+        chem->TankAtol[k] = MSX->Species[m].aTol;
+        chem->TankRtol[k] = MSX->Species[m].rTol;
+    }
 
-    // --- react each reacting species over the time step
+// --- quiescent segments must be re-examined if their reaction rates
+//     could have changed
 
-        if ( dt > 0.0 )
-        {
+    chem->RatesChanged = MSX->HydChanged || MSX->CoeffChanged;
+    MSX->CoeffChanged = FALSE;
 
-        // --- place current concentrations of species that react in vector Yrate
-
-            for (i=1; i<=NumPipeRateSpecies; i++)
-            {
-                m = PipeRateSpecies[i];
-                Yrate[i] = TheSeg->c[m];
-            }
-        
-        // --- Euler integrator
-
-            if ( MSX->Solver == EUL )
-            {
-                getPipeDcDt(MSX, 0, Yrate, NumPipeRateSpecies, Yrate);
-                for (i=1; i<=NumPipeRateSpecies; i++)
-                {
-                    m = PipeRateSpecies[i];
-                    c = TheSeg->c[m] + Yrate[i]*tstep;
-                    TheSeg->c[m] = MAX(c, 0.0);
-                }
-            }
-
-        // --- other integrators
-            else
-            {
-                dh = TheSeg->hstep;
-
-            // --- Runge-Kutta integrator
+// --- evaluate hydraulic variables of each link once per hydraulic period
+//     (after reactions skipped under the old ones have caught up)
 
-                if ( MSX->Solver == RK5 )
-                    ierr = rk5_integrate(MSX, Yrate, NumPipeRateSpecies, 0, tstep,
-                                         &dh, Atol, Rtol, getPipeDcDt);
+    if ( MSX->HydChanged )
+    {
+        errcode = MSXchem_catchUp(MSX);
+        if ( errcode ) return errcode;
+        for (k = 1; k <= MSX->Nobjects[LINK]; k++)
+        {
+            evalHydVariables(MSX, k, &chem->HydTable[k*MAX_HYD_VARS]);
+        }
+        MSX->HydChanged = FALSE;
+    }
 
-            // --- Rosenbrock integrator
+// --- split the pipes & tanks into chunks of work
 
-                if ( MSX->Solver == ROS2 )
-                    ierr = ros2_integrate(MSX, Yrate, NumPipeRateSpecies, 0, tstep,
-                                          &dh, Atol, Rtol, getPipeDcDt);
+    scheduleTasks(MSX);
+    chem->ErrTask = MSX->Nobjects[LINK] + MSX->Nobjects[TANK] + 1;
+    chem->ErrCode = 0;
 
-            // --- save new concentration values of the species that reacted
+// --- react each chunk, skipping the pipes & tanks that come after
+//     one that failed
 
-                for (m=1; m<=NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
-                for (i=1; i<=NumPipeRateSpecies; i++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, k, errtask, errcode) \
+        num_threads(chem->NumWorkers) if (chem->NumWorkers > 1)
+#endif
+    for (j = 0; j < chem->NumChunks; j++)
+    {
+        for (i = chem->ChunkStart[j]; i < chem->ChunkStart[j+1]; i++)
+        {
+            k = chem->Task[i].task;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+            errtask = chem->ErrTask;
+            if ( k > errtask ) continue;
+            errcode = reactTask(MSX, k, dt);
+            if ( errcode == 0 ) continue;
+#ifdef _OPENMP
+#pragma omp critical (chem_error)
+#endif
+            {
+                if ( k < chem->ErrTask )
                 {
-                    m = PipeRateSpecies[i];
-                    TheSeg->c[m] = MAX(Yrate[i], 0.0);
+                    chem->ErrCode = errcode;
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+                    chem->ErrTask = k;
                 }
-                TheSeg->hstep = dh;
             }
-            if ( ierr < 0 ) return 
-                ERR_INTEGRATOR;
         }
+    }
 
-    // --- compute new equilibrium concentrations within segment
+// --- add up the number of segment reactions integrated & skipped
 
-        errcode = MSXchem_equil(MSX, LINK, TheSeg->c);
-        if ( errcode ) return errcode;
+    for (k=0; k<chem->NumWorkers; k++)
+    {
+        MSX->NumReacted += chem->Worker[k].NumReacted;
+        MSX->NumSkipped += chem->Worker[k].NumSkipped;
+        chem->Worker[k].NumReacted = 0;
+        chem->Worker[k].NumSkipped = 0;
+        chem->Worker[k].NumEvals = 0;
+    }
+    return chem->ErrCode;
+}
 
-    // --- move to the segment upstream of the current one
-        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-        {
-            if (MSX->Species[m].type == BULK)
-            {
-                MSX->Link[k].reacted[m] += TheSeg->v * (TheSeg->c[m] - TheSeg->lastc[m]) * LperFT3;
-            }
-            else if (MSX->Link[k].diam > 0)
-            {
-                MSX->Link[k].reacted[m] += TheSeg->v * 4.0 / MSX->Link[k].diam * MSX->Ucf[AREA_UNITS] * (TheSeg->c[m] - TheSeg->lastc[m]);
-            }
-            TheSeg->lastc[m] = TheSeg->c[m];
-        }
-        TheSeg = TheSeg->prev;
+//=============================================================================
+
+int MSXchem_catchUp(MSXproject MSX)
+/**
+**  Purpose:
+**    integrates the reactions that quiescent pipe and tank segments
+**    have skipped so far.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Note:
+**    must be called before the hydraulics, constants or parameters the
+**    reactions were skipped under change, so that they are integrated
+**    at the rates that held while they were skipped. The segments are
+**    then integrated again at their next time step before they can be
+**    skipped.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk;
+    int k, errcode = 0;
+    int nlinks = MSX->Nobjects[LINK];
+
+    if ( chem == NULL || MSX->Solver == EUL ) return 0;
+    wk = getWorker(MSX);
+    for (k = 1; k <= nlinks + MSX->Nobjects[TANK] && !errcode; k++)
+    {
+        if ( k <= nlinks ) wk->HydVar = &chem->HydTable[k*MAX_HYD_VARS];
+        else wk->HydVar = chem->HydTable;
+        holdInvariants(wk);
+        if ( k <= nlinks ) errcode = catchUpPipe(MSX, k);
+        else errcode = catchUpTank(MSX, k - nlinks);
+        wk->HoldInvariants = 0;
     }
+    MSX->NumReacted += wk->NumReacted;
+    wk->NumReacted = 0;
     return errcode;
 }
 
 //=============================================================================
 
-int evalTankReactions(MSXproject MSX, int k, long dt)
+int MSXchem_equil(MSXproject MSX, int zone, double *c)
 /**
 **  Purpose:
-**    updates species concentrations in a given storage tank
-**    after reactions occur over time step dt.
+**    computes equilibrium concentrations for a set of chemical species.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    k = tank index
-**    dt = time step (sec).
+**    zone = reaction zone (NODE or LINK)
+**    c[] = array of species concentrations
 **
 **  Output:
-**    updates values in the concentration vector Tank[k].c[]
-**    for tank k.
+**    updated value of c[].
 **
 **  Returns:
-**    an error code or 0 if no error.
-**
-**  Re-written to accommodate compiled functions (1.1)                         //1.1.00
+**    an error code or 0 if no errors.
 */
 {
-    int i, m;
-    int errcode = 0, ierr = 0;
-    double tstep = (double)dt / MSX->Ucf[RATE_UNITS];
-    double c, dh;
+    ChemSystem *chem = MSX->Chem;
+    int errcode = 0;
+    if ( zone == LINK )
+    {
+        if ( chem->NumPipeEquilSpecies > 0 ) errcode = evalPipeEquil(MSX, c);
+        evalPipeFormulas(MSX, c);
+    }
+    if ( zone == NODE )
+    {
+        if ( chem->NumTankEquilSpecies > 0 ) errcode = evalTankEquil(MSX, c);
+        evalTankFormulas(MSX, c);
+    }
+    return errcode;
+}
 
-// --- evaluate each volume segment in the tank
+//=============================================================================
 
-    TheTank = k;
-    TheNode = MSX->Tank[k].node;
-    i = MSX->Nobjects[LINK] + k;
-    TheSeg = MSX->FirstSeg[i];
-    while ( TheSeg )
+double MSXchem_getReactionRate(MSXproject MSX)
+/**
+**  Purpose:
+**    finds how fast reactions are changing the water in pipes and tanks.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    the largest rate of change |dC/dt| / (Cmax + Atol) of a rate species
+**    in any pipe or tank segment (1/sec), where Cmax is the species' largest
+**    concentration anywhere, or BIG if a rate could not be evaluated.
+**
+**  Note:
+**    the rates of each segment are evaluated once with the current
+**    hydraulics, so that fresh inflow still reacting quickly is found
+**    however little of it there is. The water at the upstream node of
+**    a pipe with flow is evaluated too, since it is the next to enter
+**    (e.g. source water reaching a network that is still clean). Scaling by Cmax rather than by the
+**    segment's own concentration keeps a species just starting to form
+**    (e.g. a reaction product entering at zero) from looking fast.
+**    The worker's current pipe, tank and hydraulic variables are
+**    restored before returning.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, j, k, l, m, n, nl, zone;
+    int nlinks = MSX->Nobjects[LINK];
+    int theLink = wk->TheLink, theTank = wk->TheTank;
+    int *rate, *linear;
+    double hydVar[MAX_HYD_VARS];
+    double *c, *cin;
+    double *y = wk->QuietY, *f = wk->QuietF;
+    double *oldHydVar = wk->HydVar;
+    double x, rmax = 0.0;
+    double *cmax = chem->CScale;
+    Pseg seg;
+
+    // --- find the scale of each species
+
+    for (m = 1; m <= chem->NumSpecies; m++) cmax[m] = 0.0;
+    for (k = 1; k <= MSX->Nobjects[NODE]; k++)
     {
-        for (m = 1; m <= NumSpecies; m++)
+        for (m = 1; m <= chem->NumSpecies; m++)
+            cmax[m] = MAX(cmax[m], fabs(MSX->Node[k].c[m]));
+    }
+    for (k = 1; k <= nlinks + MSX->Nobjects[TANK]; k++)
+    {
+        for (j = 0; j < MSX->Segs[k].count; j++)
         {
-            ChemC1[m] = TheSeg->c[m];
-            TheSeg->lastc[m] = TheSeg->c[m];
+            seg = SEG_AT(&MSX->Segs[k], j);
+            for (m = 1; m <= chem->NumSpecies; m++)
+                cmax[m] = MAX(cmax[m], fabs(seg->c[m]));
         }
-        ierr = 0;
+    }
 
-    // --- react each reacting species over the time step
+    for (k = 1; k <= nlinks + MSX->Nobjects[TANK] && rmax < BIG; k++)
+    {
+        cin = NULL;
+        if ( k <= nlinks && MSX->Link[k].len > 0.0 && MSX->Q[k] != 0.0 )
+            cin = MSX->Node[MSX->Q[k] > 0.0 ? MSX->Link[k].n1 : MSX->Link[k].n2].c;
+        if ( MSX->Segs[k].count == 0 && cin == NULL ) continue;
 
-        if ( dt > 0.0 )
+    // --- point to the rate species and hydraulics of the pipe or tank
+
+        if ( k <= nlinks )
         {
+            zone = LINK;
+            n = chem->NumPipeRateSpecies;
+            rate = chem->PipeRateSpecies;
+            nl = chem->NumPipeLinearSpecies;
+            linear = chem->PipeLinearSpecies;
+            evalHydVariables(MSX, k, hydVar);
+            wk->HydVar = hydVar;
+            setPipeBatchInputs(MSX, k);
+        }
+        else
+        {
+            zone = NODE;
+            n = chem->NumTankRateSpecies;
+            rate = chem->TankRateSpecies;
+            nl = chem->NumTankLinearSpecies;
+            linear = chem->TankLinearSpecies;
+            wk->HydVar = chem->HydTable;
+            wk->TheTank = k - nlinks;
+        }
+        if ( n + nl == 0 ) continue;
+        holdInvariants(wk);
+        if ( nl > 0 && !setLinearCoeffs(MSX, zone, 1.0) ) rmax = BIG;
 
-        // --- place current concentrations of species that react in vector Yrate
-            for (i=1; i<=NumTankRateSpecies; i++)
+    // --- find the rates of its inflow (j = -1) and of its segments
+
+        for (j = (cin != NULL ? -1 : 0); j < MSX->Segs[k].count && rmax < BIG; j++)
+        {
+            if ( j < 0 ) c = cin;
+            else
             {
-                m = TankRateSpecies[i];
-  //              Yrate[i] = MSX->Tank[k].c[m];
-                Yrate[i] = TheSeg->c[m];
+                seg = SEG_AT(&MSX->Segs[k], j);
+                c = seg->c;
             }
-
-        // --- Euler integrator
-
-            if ( MSX->Solver == EUL )
+            if ( n > 0 )
             {
-                getTankDcDt(MSX, 0, Yrate, NumTankRateSpecies, Yrate);
-                for (i=1; i<=NumTankRateSpecies; i++)
+                for (i=1; i<=n; i++) y[i] = c[rate[i]];
+                getQuietRates(MSX, zone, c, y, n, f);
+            }
+            for (i=1; i<=n+nl; i++)
+            {
+                if ( i <= n )
+                {
+                    m = rate[i];
+                    x = f[i];
+                }
+                else
                 {
-                    m = TankRateSpecies[i];
-                    c = TheSeg->c[m] + Yrate[i]*tstep;
-                    TheSeg->c[m] = MAX(c, 0.0);
+                    m = linear[i-n];
+                    x = wk->LinA[i-n][nl+1];
+                    for (l=1; l<=nl; l++) x += wk->LinA[i-n][l] * c[linear[l]];
                 }
+                if ( !isValidNumber(x) )
+                {
+                    rmax = BIG;
+                    break;
+                }
+                rmax = MAX(rmax, fabs(x) / (cmax[m] + MSX->Species[m].aTol));
             }
+        }
+        wk->HoldInvariants = 0;
+    }
 
-        // --- other integrators
-            else
-            {
-                dh = MSX->Tank[k].hstep;
-
-            // --- Runge-Kutta integrator
+    // --- restore the worker's pipe or tank
 
-                if ( MSX->Solver == RK5 )
-                    ierr = rk5_integrate(MSX, Yrate, NumTankRateSpecies, 0, tstep,
-                                         &dh, Atol, Rtol, getTankDcDt);
+    wk->HydVar = oldHydVar;
+    wk->TheLink = theLink;
+    wk->TheTank = theTank;
+    if ( theLink > 0 && oldHydVar != NULL ) setPipeBatchInputs(MSX, theLink);
+    if ( rmax >= BIG ) return BIG;
+    return rmax / MSX->Ucf[RATE_UNITS];
+}
 
-            // --- Rosenbrock integrator
+//=============================================================================
 
-                if ( MSX->Solver == ROS2 )
-                    ierr = ros2_integrate(MSX, Yrate, NumTankRateSpecies, 0, tstep,
-                                          &dh, Atol, Rtol, getTankDcDt);
+char* MSXchem_getPipeVariableStr(MSXproject MSX, int i, char *s)
+/**
+**  Purpose:
+**    returns a string representation of a variable used in the pipe
+**    chemistry functions appearing in the C source code file used to
+**    compile these functions
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable's index in the LastIndex array
+**    s = string to hold variable's symbol
+**
+**  Output:
+**    returns a pointer to s
+*/
+{
+    return getVariableStr(MSX, LINK, 0, i, s);
+}
 
-            // --- save new concentration values of the species that reacted
+//=============================================================================
 
-                for (m=1; m<=NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
-                for (i=1; i<=NumTankRateSpecies; i++)
-                {
-                    m = TankRateSpecies[i];
-                    TheSeg->c[m] = MAX(Yrate[i], 0.0);
-                }
-                TheSeg->hstep = dh;
-            }
-            if ( ierr < 0 ) return 
-                ERR_INTEGRATOR;
-        }
+char* MSXchem_getTankVariableStr(MSXproject MSX, int i, char *s)
+/**
+**  Purpose:
+**    returns a string representation of a variable used in the tank
+**    chemistry functions (see MSXchem_getPipeVariableStr).
+*/
+{
+    return getVariableStr(MSX, NODE, 0, i, s);
+}
 
-    // --- compute new equilibrium concentrations within segment
+//=============================================================================
 
-        errcode = MSXchem_equil(MSX, NODE, TheSeg->c);
-        if ( errcode ) return errcode;
+char* MSXchem_getBatchVariableStr(MSXproject MSX, int i, char *s)
+/**
+**  Purpose:
+**    returns a string representation of a variable used in the batch
+**    chemistry functions, which evaluate segment l of arrays whose rows
+**    are stride elements apart. Intermediate terms are local variables
+**    of these functions (see MSXchem_getPipeVariableStr).
+*/
+{
+    return getVariableStr(MSX, LINK, 1, i, s);
+}
 
-    // --- move to the next tank segment
-        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-        {
-            if (MSX->Species[m].type == BULK)
-            {
-                MSX->Tank[k].reacted[m] += TheSeg->v * (TheSeg->c[m] - TheSeg->lastc[m]) * LperFT3;
-            }
-            TheSeg->lastc[m] = TheSeg->c[m];
-        }
+//=============================================================================
 
-        TheSeg = TheSeg->prev;
-    }
-    return errcode;
+MathExpr* MSXchem_getExpr(MSXproject MSX, int zone, int i)
+/**
+**  Purpose:
+**    returns the optimized pipe or tank expression of a species,
+**    an intermediate term or a shared sub-expression.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = LINK for pipe or NODE for tank expressions
+**    i = variable's index in the LastIndex array (or of a shared
+**        sub-expression, see MSXchem_getSharedRange)
+**
+**  Output:
+**    returns the expression (NULL if the variable has none)
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    if ( i < 1 || i > chem->NumVars ) return NULL;
+    if ( zone == LINK ) return chem->PipeExpr[i];
+    return chem->TankExpr[i];
 }
 
 //=============================================================================
 
-int evalPipeEquil(MSXproject MSX, double *c)
+void MSXchem_getSharedRange(MSXproject MSX, int zone, int *first, int *last)
 /**
 **  Purpose:
-**    computes equilibrium concentrations for water in a pipe segment.
+**    finds the variable indexes of the shared sub-expressions of
+**    pipe or tank expressions.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    c[] = array of starting species concentrations
+**    zone = LINK for pipe or NODE for tank expressions
 **
 **  Output:
-**    c[] = array of equilibrium concentrations.
+**    first = index of the first shared sub-expression
+**    last = index of the last one (first - 1 if there are none)
 **
-**  Returns:
-**    an error code or 0 if no error.
+**  Note:
+**    each shared sub-expression only refers to those before it.
 */
 {
-    int i, m;
-    int errcode;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
-    for (i=1; i<=NumPipeEquilSpecies; i++)
+    ChemSystem *chem = MSX->Chem;
+    if ( zone == LINK )
     {
-        m = PipeEquilSpecies[i];
-        Yequil[i] = c[m];
+        *first = chem->FirstPipeShared;
+        *last = chem->FirstTankShared - 1;
     }
-    
-    errcode = newton_solve(MSX, Yequil, NumPipeEquilSpecies, MAXIT, NUMSIG,
-                           getPipeEquil);
-    if ( errcode < 0 ) return ERR_NEWTON;
-    for (i=1; i<=NumPipeEquilSpecies; i++)
+    else
     {
-        m = PipeEquilSpecies[i];
-        c[m] = Yequil[i];
-        ChemC1[m] = c[m];
+        *first = chem->FirstTankShared;
+        *last = chem->NumVars;
     }
-    return 0;
 }
 
-
 //=============================================================================
 
-int evalTankEquil(MSXproject MSX, double *c)
+int MSXchem_getJacobianSize(MSXproject MSX, int zone)
 /**
 **  Purpose:
-**    computes equilibrium concentrations for water in a tank.
+**    finds the size of the analytic Jacobian of the pipe or tank rates
+**    written to the compiled chemistry library.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    c[] = array of starting species concentrations
-**
-**  Output:
-**    c[] = array of equilibrium concentrations.
+**    zone = LINK for pipe or NODE for tank rates
 **
 **  Returns:
-**    an error code or 0 if no error.
+**    the number of rate plus coupled equilibrium species whose partial
+**    derivatives are available, or 0 if there is no analytic Jacobian.
 */
 {
-    int i, m;
-    int errcode;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
-    for (i=1; i<=NumTankEquilSpecies; i++)
-    {
-        m = TankEquilSpecies[i];
-        Yequil[i] = c[m];
-    }
-    errcode = newton_solve(MSX, Yequil, NumTankEquilSpecies, MAXIT, NUMSIG,
-                           getTankEquil);
-    if ( errcode < 0 ) return ERR_NEWTON;
-    for (i=1; i<=NumTankEquilSpecies; i++)
+    ChemSystem *chem = MSX->Chem;
+    if ( zone == LINK )
     {
-        m = TankEquilSpecies[i];
-        c[m] = Yequil[i];
-        ChemC1[m] = c[m];
+        if ( chem->PipeJacExpr == NULL ) return 0;
+        return chem->NumPipeRateSpecies + getCoupledEquilCount(MSX, LINK);
     }
-    return 0;
+    if ( chem->TankJacExpr == NULL ) return 0;
+    return chem->NumTankRateSpecies + getCoupledEquilCount(MSX, NODE);
 }
 
 //=============================================================================
 
-void evalPipeFormulas(MSXproject MSX, double *c)
+MathExpr* MSXchem_getJacobianExpr(MSXproject MSX, int zone, int i, int j)
 /**
 **  Purpose:
-**    evaluates species concentrations in a pipe segment that are simple
-**    formulas involving other known species concentrations.
+**    returns a partial derivative of the analytic Jacobian of the pipe
+**    or tank rates.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    c[] = array of current species concentrations.
+**    zone = LINK for pipe or NODE for tank rates
+**    i = row of the Jacobian (see createJacobian)
+**    j = column of the Jacobian
 **
-**  Output:
-**    c[] = array of updated concentrations.
+**  Returns:
+**    the derivative expression (NULL if it is identically zero).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int n1 = MSXchem_getJacobianSize(MSX, zone) + 1;
+    if ( zone == LINK ) return chem->PipeJacExpr[i*n1+j];
+    return chem->TankJacExpr[i*n1+j];
+}
+
+//=============================================================================
+
+char* getVariableStr(MSXproject MSX, int zone, int batch, int i, char *s)
+/**
+**  Purpose:
+**    returns the symbol of a variable in the chemistry function source
+**    code file.
 **
-**  Re-written to accommodate compiled functions (1.1)
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = LINK for pipe or NODE for tank expressions
+**    batch = 1 for the batch functions, 0 otherwise
+**    i = variable's index in the LastIndex array
+**    s = string to hold variable's symbol
+**
+**  Output:
+**    returns a pointer to s
 */
 {
-    int m;
-    double x;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
+    ChemSystem *chem = MSX->Chem;
 
-// --- use compiled functions if available
+// --- WQ species have index between 1 & # of species
 
-    if ( MSX->Compiler )
+    if ( i <= chem->LastIndex[SPECIES] )
     {
-	    MSXgetPipeFormulas(ChemC1, MSX->K, MSX->Link[TheLink].param, HydVar);
-        for (m=1; m<=NumSpecies; m++)
-        {
-            c[m] = ChemC1[m];
-        }
-    	return;
+        if ( batch ) sprintf(s, "c[%d*stride+l]", i);
+        else         sprintf(s, "c[%d]", i);
     }
 
-    for (m=1; m<=NumSpecies; m++)
+// --- intermediate term expressions come next
+
+    else if ( i <= chem->LastIndex[TERM] )
     {
-        if ( MSX->Species[m].pipeExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX, MSX->Species[m].pipeExpr, getPipeVariableValue);
-			c[m] = MSXerr_validate(MSX, x, m, LINK, FORMULA);
-        }
+        i -= chem->LastIndex[TERM-1];
+        if ( batch )             sprintf(s, "t%d", i);
+        else if ( zone == LINK ) sprintf(s, "pipeTerm(%d, c, k, p, h)", i);
+        else                     sprintf(s, "tankTerm(%d, c, k, p, h)", i);
     }
+
+// --- reaction parameter indexes come after that
+
+    else if ( i <= chem->LastIndex[PARAMETER] )
+    {
+        i -= chem->LastIndex[PARAMETER-1];
+        if ( batch ) sprintf(s, "p[%d*stride+l]", i);
+        else         sprintf(s, "p[%d]", i);
+    }
+
+// --- followed by constants
+
+    else if ( i <= chem->LastIndex[CONSTANT] )
+    {
+        i -= chem->LastIndex[CONSTANT-1];
+        sprintf(s, "k[%d]", i);
+    }
+
+// --- then by hydraulic variables
+
+    else if ( i < chem->FirstPipeShared )
+    {
+        i -= chem->LastIndex[CONSTANT];
+        if ( batch ) sprintf(s, "h[%d*stride+l]", i);
+        else         sprintf(s, "h[%d]", i);
+    }
+
+// --- and finally by shared sub-expressions (local variables of
+//     the function they are used in)
+
+    else sprintf(s, "s%d", i - chem->FirstPipeShared);
+    return s;
+}
+
+//=============================================================================
+
+void setSpeciesChemistry(MSXproject MSX)
+/**
+**  Purpose:
+**    determines which species are described by reaction rate
+**    expressions, equilibrium expressions, or simple formulas.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Output:
+**    updates arrays of different chemistry types.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int m;
+    chem->NumPipeRateSpecies = 0;
+    chem->NumPipeFormulaSpecies = 0;
+    chem->NumPipeEquilSpecies = 0;
+    chem->NumTankRateSpecies = 0;
+    chem->NumTankFormulaSpecies = 0;
+    chem->NumTankEquilSpecies = 0;
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        switch ( MSX->Species[m].pipeExprType )
+        {
+          case RATE:
+            chem->NumPipeRateSpecies++;
+            chem->PipeRateSpecies[chem->NumPipeRateSpecies] = m;
+            break;
+
+          case FORMULA:
+            chem->NumPipeFormulaSpecies++;
+            break;
+
+          case EQUIL:
+            chem->NumPipeEquilSpecies++;
+            chem->PipeEquilSpecies[chem->NumPipeEquilSpecies] = m;
+            break;
+        }
+        switch ( MSX->Species[m].tankExprType )
+        {
+          case RATE:
+            chem->NumTankRateSpecies++;
+            chem->TankRateSpecies[chem->NumTankRateSpecies] = m;
+            break;
+
+          case FORMULA:
+            chem->NumTankFormulaSpecies++;
+            break;
+
+          case EQUIL:
+            chem->NumTankEquilSpecies++;
+            chem->TankEquilSpecies[chem->NumTankEquilSpecies] = m;
+            break;
+        }
+    }
+}
+
+//=============================================================================
+
+void setTankChemistry(MSXproject MSX)
+/**
+**  Purpose:
+**    assigns pipe chemistry expressions to tank chemistry for
+**    each chemical species.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Output:
+**    updates arrays of different tank chemistry types.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int m;
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        MSX->Species[m].tankExpr = MSX->Species[m].pipeExpr;
+        MSX->Species[m].tankExprType = MSX->Species[m].pipeExprType;
+    }
+    chem->NumTankRateSpecies = chem->NumPipeRateSpecies;
+    for (m=1; m<=chem->NumTankRateSpecies; m++)
+    {
+        chem->TankRateSpecies[m] = chem->PipeRateSpecies[m];
+    }
+    chem->NumTankFormulaSpecies = chem->NumPipeFormulaSpecies;
+    chem->NumTankEquilSpecies = chem->NumPipeEquilSpecies;
+    for (m=1; m<=chem->NumTankEquilSpecies; m++)
+    {
+        chem->TankEquilSpecies[m] = chem->PipeEquilSpecies[m];
+    }
+}
+
+//=============================================================================
+
+void scheduleTasks(MSXproject MSX)
+/**
+**  Purpose:
+**    splits the pipes and tanks to be reacted into chunks of work for
+**    the worker threads.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Notes:
+**    The cost of a pipe or tank is estimated as its number of rate
+**    species times the number of its segments plus the segment rate
+**    evaluations its reactions took in the last time step. They are
+**    sorted by decreasing cost and grouped into chunks of about
+**    1/CHUNKS_PER_WORKER of a thread's share of the total cost, so the
+**    costliest ones are started first and the many cheap ones are taken
+**    a chunk at a time by whichever thread is free. A single worker
+**    reacts them all in index order.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, k, n = 0;
+    int nlinks = MSX->Nobjects[LINK];
+    double total = 0.0, target, cost = 0.0;
+    ChemTask *task = chem->Task;
+
+// --- list the pipes and tanks with their estimated costs
+
+    for (k = 1; k <= nlinks; k++)
+    {
+        if ( MSX->Link[k].len == 0.0 ) continue;
+        task[n].task = k;
+        task[n].cost = (double)(chem->NumPipeRateSpecies + 1) *
+                       (MSX->Segs[k].count + chem->TaskEvals[k]);
+        total += task[n].cost;
+        n++;
+    }
+    for (k = 1; k <= MSX->Nobjects[TANK]; k++)
+    {
+        if ( MSX->Tank[k].a == 0.0 ) continue;
+        task[n].task = nlinks + k;
+        task[n].cost = (double)(chem->NumTankRateSpecies + 1) *
+                       (MSX->Segs[nlinks+k].count + chem->TaskEvals[nlinks+k]);
+        total += task[n].cost;
+        n++;
+    }
+    chem->NumTasks = n;
+    chem->ChunkStart[0] = 0;
+    if ( chem->NumWorkers == 1 || n == 0 )
+    {
+        chem->NumChunks = (n > 0);
+        chem->ChunkStart[chem->NumChunks] = n;
+        return;
+    }
+
+// --- group them into chunks, costliest first
+
+    qsort(task, n, sizeof(ChemTask), compareTasks);
+    target = total / (chem->NumWorkers * CHUNKS_PER_WORKER);
+    chem->NumChunks = 0;
+    for (i = 0; i < n; i++)
+    {
+        if ( i == 0 || cost >= target )
+        {
+            chem->ChunkStart[chem->NumChunks++] = i;
+            cost = 0.0;
+        }
+        cost += task[i].cost;
+    }
+    chem->ChunkStart[chem->NumChunks] = n;
+}
+
+//=============================================================================
+
+int compareTasks(const void *a, const void *b)
+/**
+**  Purpose:
+**    compares two pipes or tanks for sorting by decreasing cost.
+**
+**  Input:
+**    a, b = pointers to the ChemTask of each.
+**
+**  Returns:
+**    a negative number if a comes first, a positive one if b does
+**    (pipes & tanks of equal cost stay in index order).
+*/
+{
+    const ChemTask *t1 = (const ChemTask *)a;
+    const ChemTask *t2 = (const ChemTask *)b;
+
+    if ( t1->cost > t2->cost ) return -1;
+    if ( t1->cost < t2->cost ) return 1;
+    return t1->task - t2->task;
+}
+
+//=============================================================================
+
+int reactTask(MSXproject MSX, int k, double dt)
+/**
+**  Purpose:
+**    computes reactions in a pipe or tank and records their cost.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = index of a pipe link, or number of links plus index of a tank
+**    dt = current WQ time step (sec).
+**
+**  Returns:
+**    an error code or 0 if no error.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int nlinks = MSX->Nobjects[LINK];
+    int errcode;
+    long evals = wk->NumEvals;
+
+// --- point to the pipe's hydraulic variables (tanks have none)
+
+    if ( k <= nlinks ) wk->HydVar = &chem->HydTable[k*MAX_HYD_VARS];
+    else wk->HydVar = chem->HydTable;
+
+// --- compute its reactions
+
+    holdInvariants(wk);
+    if ( k <= nlinks ) errcode = evalPipeReactions(MSX, k, dt);
+    else errcode = evalTankReactions(MSX, k - nlinks, dt);
+    wk->HoldInvariants = 0;
+    chem->TaskEvals[k] = wk->NumEvals - evals;
+    return errcode;
+}
+
+//=============================================================================
+
+void evalHydVariables(MSXproject MSX, int k, double *hydVar)
+/**
+**  Purpose:
+**    computes current values of hydraulic variables for a link.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = link index
+**    hydVar = the link's row of the hydraulic variable table
+**
+**  Output:
+**    updates values stored in vector hydVar[]
+*/
+{
+    double dh;                         // headloss in ft
+    double diam = MSX->Link[k].diam;    // diameter in ft
+    double av;                         // area per unit volume
+
+// --- pipe diameter in user's units (ft or m)
+    hydVar[DIAMETER] = diam * MSX->Ucf[LENGTH_UNITS];
+
+// --- flow rate in user's units
+    hydVar[FLOW] = fabs(MSX->Q[k]) * MSX->Ucf[FLOW_UNITS];
+
+// --- flow velocity in ft/sec
+    if ( diam == 0.0 ) hydVar[VELOCITY] = 0.0;
+    else hydVar[VELOCITY] = fabs(MSX->Q[k]) * 4.0 / PI / SQR(diam);
+
+// --- Reynolds number
+    hydVar[REYNOLDS] = hydVar[VELOCITY] * diam / VISCOS;
+
+// --- flow velocity in user's units (ft/sec or m/sec)
+    hydVar[VELOCITY] *= MSX->Ucf[LENGTH_UNITS];
+
+// --- Darcy Weisbach friction factor
+    if ( MSX->Link[k].len == 0.0 ) hydVar[FRICTION] = 0.0;
+    else
+    {
+        dh = ABS(MSX->H[MSX->Link[k].n1] - MSX->H[MSX->Link[k].n2]);
+        hydVar[FRICTION] = 39.725*dh*pow(diam,5)/
+                           MSX->Link[k].len/SQR(MSX->Q[k]);
+    }
+
+// --- shear velocity in user's units (ft/sec or m/sec)
+    hydVar[SHEAR] = hydVar[VELOCITY] * sqrt(hydVar[FRICTION] / 8.0);
+
+// --- pipe surface area / volume in area_units/L
+    hydVar[AREAVOL] = 1.0;
+    if ( diam > 0.0 )
+    {
+        av  = 4.0/diam;                // ft2/ft3
+        av *= MSX->Ucf[AREA_UNITS];     // area_units/ft3
+        av /= LperFT3;                 // area_units/L
+        hydVar[AREAVOL] = av;
+    }
+
+    hydVar[ROUGHNESS] = MSX->Link[k].roughness;   /*Feng Shang, Bug ID 8,  01/29/2008*/
+}
+
+//=============================================================================
+
+void setPipeBatchInputs(MSXproject MSX, int k)
+/**
+**  Purpose:
+**    makes a pipe the one whose segment reaction rates are evaluated.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = link index (with its hydraulic variables in wk->HydVar).
+**
+**  Note:
+**    the compiled batch rate function reads the pipe's parameters and
+**    hydraulic variables for every segment.
+*/
+{
+    ChemWorker *wk = getWorker(MSX);
+    int i, l;
+
+    wk->TheLink = k;
+    if ( MSX->Compiler && MSX->ChemLib.funcs.getPipeRatesBatch )
+    {
+        for (i=1; i<=MSX->Nobjects[PARAMETER]; i++)
+        {
+            for (l=0; l<MAX_BATCH; l++) wk->BatchP[i*MAX_BATCH+l] = MSX->Link[k].param[i];
+        }
+        for (i=1; i<MAX_HYD_VARS; i++)
+        {
+            for (l=0; l<MAX_BATCH; l++) wk->BatchHyd[i*MAX_BATCH+l] = wk->HydVar[i];
+        }
+    }
+}
+
+//=============================================================================
+
+int evalPipeReactions(MSXproject MSX, int k, double dt)
+/**
+**  Purpose:
+**    updates species concentrations in each WQ segment of a pipe
+**    after reactions occur over time step dt.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = link index
+**    dt = time step (sec).
+**
+**  Output:
+**    updates values in the concentration vector C[] associated
+**    with a pipe's WQ segments.
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Re-written to accommodate compiled functions (1.1)                         //1.1.00
+**  Segments are now reacted in batches of up to MAX_BATCH at a time.
+**  The reactions of quiescent segments are skipped (see isQuiescent).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    SsegRing *segs = &MSX->Segs[k];
+    Pseg seg, qseg[MAX_BATCH];
+    int j, l, m, nb, nq, quiet, jcatch = -1;
+    int errcode = 0, ierr = 0;
+    double tstep = dt / MSX->Ucf[RATE_UNITS];
+    double tcatch;
+
+// --- start a new system of rate equations for the pipe
+
+    if ( MSX->Solver == ROS2 ) ros2_newSystem(&wk->Ros2);
+    setPipeBatchInputs(MSX, k);
+
+// --- the exact solution of the pipe's linear rates is the same for
+//     all of its segments
+
+    if ( dt > 0.0 && chem->NumPipeLinearSpecies > 0 )
+    {
+        if ( !evalLinearRates(MSX, LINK, tstep) ) return ERR_INTEGRATOR;
+    }
+
+// --- start with the most downstream pipe segment (no segment of a pipe
+//     whose wall species are shifted between its segments by flow can be
+//     quiescent, since reactions it skipped would leave with its water)
+
+    quiet = dt > 0.0 && MSX->Solver != EUL && chem->NumPipeRateSpecies > 0 &&
+            !(MSX->HasWallSpecies && MSX->Q[k] != 0.0 && MSX->Link[k].len > 0.0);
+    j = 0;
+    while ( j < segs->count )
+    {
+
+    // --- collect the next batch of segments moving upstream, placing
+    //     quiescent ones, whose reactions are skipped, after the others
+    //     (a segment catching up on skipped reactions is reacted alone)
+
+        nb = 0;
+        nq = 0;
+        tcatch = 0.0;
+        while ( j < segs->count && nb + nq < MAX_BATCH && tcatch == 0.0 )
+        {
+            seg = SEG_AT(segs, j);
+            if ( quiet && j != jcatch && isQuiescent(MSX, LINK, seg, tstep) )
+                qseg[nq++] = seg;
+            else
+            {
+                if ( seg->qtime > 0.0 )
+                {
+                    jcatch = j;
+                    if ( nb + nq > 0 ) break;
+                    tcatch = seg->qtime;
+                }
+                wk->BatchSeg[nb++] = seg;
+            }
+            j++;
+        }
+        for (l = 0; l < nq; l++) wk->BatchSeg[nb+l] = qseg[l];
+        for (l = 0; l < nb + nq; l++)
+        {
+            wk->TheSeg = wk->BatchSeg[l];
+            for (m = 1; m <= chem->NumSpecies; m++)
+            {
+                wk->TheSeg->lastc[m] = wk->TheSeg->c[m];
+            }
+        }
+
+    // --- react each reacting species over the time step
+
+        if ( dt > 0.0 )
+        {
+            if ( chem->NumPipeRateSpecies > 0 && nb > 0 )
+            {
+                ierr = reactPipeBatch(MSX, nb, tstep + tcatch);
+                if ( ierr < 0 ) return
+                    ERR_INTEGRATOR;
+            }
+            if ( chem->NumPipeLinearSpecies > 0 )
+            {
+                for (l = 0; l < nb + nq; l++) applyLinearRates(MSX, LINK, wk->BatchSeg[l]->c);
+            }
+            wk->NumReacted += nb;
+        }
+
+        for (l = 0; l < nb + nq; l++)
+        {
+
+        // --- nothing changes in a quiescent segment without linear rates
+
+            if ( l >= nb && chem->NumPipeLinearSpecies == 0 ) continue;
+
+        // --- compute new equilibrium concentrations within segment
+
+            errcode = MSXchem_equil(MSX, LINK, wk->BatchSeg[l]->c);
+            if ( errcode ) return errcode;
+            if ( quiet && l < nb ) markQuiescent(MSX, LINK, wk->BatchSeg[l]);
+
+        // --- update the mass reacted within the segment
+
+            addPipeReacted(MSX, k, wk->BatchSeg[l]);
+        }
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+int reactPipeBatch(MSXproject MSX, int nb, double tstep)
+/**
+**  Purpose:
+**    updates species concentrations in a batch of pipe segments
+**    after reactions occur over a time step.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    nb = number of segments in BatchSeg[]
+**    tstep = time step (in rate units).
+**
+**  Output:
+**    updates values in the concentration vector C[] of each segment.
+**
+**  Returns:
+**    the value returned by the integrator (< 0 if it failed).
+**
+**  Notes:
+**    Concentrations are held by species in rows of MAX_BATCH segments
+**    (BatchC[m*MAX_BATCH + l] for species m of segment l) so that each
+**    rate expression is evaluated for the whole batch at once.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, l, m;
+    int ierr = 0;
+    double c;
+
+// --- place current concentrations of all species in BatchC
+//     and those of species that react in BatchY
+
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        for (l=0; l<nb; l++) wk->BatchC[m*MAX_BATCH+l] = wk->BatchSeg[l]->c[m];
+    }
+    for (i=1; i<=chem->NumPipeRateSpecies; i++)
+    {
+        m = chem->PipeRateSpecies[i];
+        for (l=0; l<nb; l++) wk->BatchY[i*MAX_BATCH+l] = wk->BatchSeg[l]->c[m];
+    }
+
+// --- Euler integrator
+
+    if ( MSX->Solver == EUL )
+    {
+        getPipeDcDtBatch(MSX, nb, chem->BatchLane, wk->BatchY, chem->NumPipeRateSpecies, wk->BatchF);
+        for (i=1; i<=chem->NumPipeRateSpecies; i++)
+        {
+            m = chem->PipeRateSpecies[i];
+            for (l=0; l<nb; l++)
+            {
+                c = wk->BatchSeg[l]->c[m] + wk->BatchF[i*MAX_BATCH+l]*tstep;
+                wk->BatchSeg[l]->c[m] = MAX(c, 0.0);
+            }
+        }
+        return 0;
+    }
+
+// --- other integrators
+
+    for (l=0; l<nb; l++) wk->BatchH[l] = wk->BatchSeg[l]->hstep;
+
+// --- Runge-Kutta integrator
+
+    if ( MSX->Solver == RK5 )
+        ierr = rk5_integrateBatch(MSX, &wk->Rk5, wk->BatchY, chem->NumPipeRateSpecies,
+                                  nb, 0, tstep, wk->BatchH, chem->PipeAtol, chem->PipeRtol,
+                                  getPipeDcDtBatch);
+
+// --- Rosenbrock integrator
+
+    if ( MSX->Solver == ROS2 )
+        ierr = ros2_integrateBatch(MSX, &wk->Ros2, wk->BatchY, chem->NumPipeRateSpecies,
+                                   nb, 0, tstep, wk->BatchH, chem->PipeAtol, chem->PipeRtol,
+                                   getPipeDcDtBatch,
+                                   chem->PipeJacobian ? getPipeBatchJacobian : NULL,
+                                   chem->PipeSparse);
+
+// --- BDF integrator
+
+    if ( MSX->Solver == BDF )
+        ierr = bdf_integrateBatch(MSX, &wk->Bdf, wk->BatchY, chem->NumPipeRateSpecies,
+                                  nb, 0, tstep, wk->BatchH, chem->PipeAtol, chem->PipeRtol,
+                                  getPipeDcDtBatch,
+                                  chem->PipeJacobian ? getPipeBatchJacobian : NULL,
+                                  chem->PipeSparse);
+    if ( ierr < 0 ) return ierr;
+
+// --- save new concentration values of the species that reacted
+
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        for (l=0; l<nb; l++) wk->BatchSeg[l]->c[m] = wk->BatchC[m*MAX_BATCH+l];
+    }
+    for (i=1; i<=chem->NumPipeRateSpecies; i++)
+    {
+        m = chem->PipeRateSpecies[i];
+        for (l=0; l<nb; l++) wk->BatchSeg[l]->c[m] = MAX(wk->BatchY[i*MAX_BATCH+l], 0.0);
+    }
+    for (l=0; l<nb; l++) wk->BatchSeg[l]->hstep = wk->BatchH[l];
+    return ierr;
+}
+
+//=============================================================================
+
+int reactTankSeg(MSXproject MSX, int k, double tstep)
+/**
+**  Purpose:
+**    updates species concentrations in the current tank segment
+**    (wk->TheSeg) after reactions occur over a time step.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = tank index
+**    tstep = time step (in rate units).
+**
+**  Returns:
+**    the value returned by the integrator (< 0 if it failed).
+**
+**  Note:
+**    the segment's concentrations must be in wk->ChemC1[] and those of
+**    its rate species in wk->Yrate[].
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+    int ierr = 0;
+    double dh = MSX->Tank[k].hstep;
+
+// --- Runge-Kutta integrator
+
+    if ( MSX->Solver == RK5 )
+        ierr = rk5_integrate(MSX, &wk->Rk5, wk->Yrate, chem->NumTankRateSpecies,
+                             0, tstep, &dh, chem->TankAtol, chem->TankRtol,
+                             getTankDcDt);
+
+// --- Rosenbrock integrator
+
+    if ( MSX->Solver == ROS2 )
+    {
+        if ( chem->TankJac ) ros2_swapJacobian(&wk->Ros2, &chem->TankJac[k]);
+        ierr = ros2_integrate(MSX, &wk->Ros2, wk->Yrate, chem->NumTankRateSpecies,
+                              0, tstep, &dh, chem->TankAtol, chem->TankRtol,
+                              getTankDcDt,
+                              chem->TankJacobian ? getTankJacobian : NULL,
+                              chem->TankSparse);
+        if ( chem->TankJac ) ros2_swapJacobian(&wk->Ros2, &chem->TankJac[k]);
+    }
+
+// --- BDF integrator
+
+    if ( MSX->Solver == BDF )
+        ierr = bdf_integrate(MSX, &wk->Bdf, wk->Yrate, chem->NumTankRateSpecies,
+                             0, tstep, &dh, chem->TankAtol, chem->TankRtol,
+                             getTankDcDt,
+                             chem->TankJacobian ? getTankJacobian : NULL,
+                             chem->TankSparse);
+
+// --- save new concentration values of the species that reacted
+
+    for (m=1; m<=chem->NumSpecies; m++) wk->TheSeg->c[m] = wk->ChemC1[m];
+    for (i=1; i<=chem->NumTankRateSpecies; i++)
+    {
+        m = chem->TankRateSpecies[i];
+        wk->TheSeg->c[m] = MAX(wk->Yrate[i], 0.0);
+    }
+    wk->TheSeg->hstep = dh;
+    return ierr;
+}
+
+//=============================================================================
+
+int catchUpPipe(MSXproject MSX, int k)
+/**
+**  Purpose:
+**    integrates the reactions skipped by the quiescent segments of a pipe.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = link index (with its hydraulic variables in wk->HydVar).
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Note:
+**    segments that skipped the same time are integrated in a batch.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    SsegRing *segs = &MSX->Segs[k];
+    Pseg seg;
+    int j, l, m, nb;
+    int errcode = 0, started = 0;
+    double tcatch;
+
+    if ( chem->NumPipeRateSpecies == 0 ) return 0;
+    j = 0;
+    while ( j < segs->count )
+    {
+
+    // --- collect the next batch of segments that skipped the same time
+
+        nb = 0;
+        tcatch = 0.0;
+        for ( ; j < segs->count && nb < MAX_BATCH; j++)
+        {
+            seg = SEG_AT(segs, j);
+            if ( seg->qtime <= 0.0 ) continue;
+            if ( nb > 0 && seg->qtime != tcatch ) break;
+            tcatch = seg->qtime;
+            wk->BatchSeg[nb++] = seg;
+        }
+        if ( nb == 0 ) break;
+
+    // --- react them over the time they skipped
+
+        if ( !started )
+        {
+            if ( MSX->Solver == ROS2 ) ros2_newSystem(&wk->Ros2);
+            setPipeBatchInputs(MSX, k);
+            started = 1;
+        }
+        for (l = 0; l < nb; l++)
+        {
+            seg = wk->BatchSeg[l];
+            for (m = 1; m <= chem->NumSpecies; m++) seg->lastc[m] = seg->c[m];
+        }
+        if ( reactPipeBatch(MSX, nb, tcatch) < 0 ) return ERR_INTEGRATOR;
+        wk->NumReacted += nb;
+
+    // --- have them integrated again at their next time step
+
+        for (l = 0; l < nb; l++)
+        {
+            seg = wk->BatchSeg[l];
+            errcode = MSXchem_equil(MSX, LINK, seg->c);
+            if ( errcode ) return errcode;
+            seg->qtime = 0.0;
+            seg->quiet = QUIET_NO;
+            addPipeReacted(MSX, k, seg);
+        }
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+int catchUpTank(MSXproject MSX, int k)
+/**
+**  Purpose:
+**    integrates the reactions skipped by the quiescent segments of a tank.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = tank index
+**
+**  Returns:
+**    an error code or 0 if no error.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    SsegRing *segs = &MSX->Segs[MSX->Nobjects[LINK] + k];
+    int i, j, m;
+    int errcode = 0;
+
+    if ( chem->NumTankRateSpecies == 0 ) return 0;
+    wk->TheTank = k;
+    wk->TheNode = MSX->Tank[k].node;
+    for (j = 0; j < segs->count; j++)
+    {
+        wk->TheSeg = SEG_AT(segs, j);
+        if ( wk->TheSeg->qtime <= 0.0 ) continue;
+
+    // --- react it over the time it skipped
+
+        for (m = 1; m <= chem->NumSpecies; m++)
+        {
+            wk->ChemC1[m] = wk->TheSeg->c[m];
+            wk->TheSeg->lastc[m] = wk->TheSeg->c[m];
+        }
+        for (i = 1; i <= chem->NumTankRateSpecies; i++)
+        {
+            wk->Yrate[i] = wk->TheSeg->c[chem->TankRateSpecies[i]];
+        }
+        if ( reactTankSeg(MSX, k, wk->TheSeg->qtime) < 0 ) return ERR_INTEGRATOR;
+        wk->NumReacted++;
+
+    // --- have it integrated again at its next time step
+
+        errcode = MSXchem_equil(MSX, NODE, wk->TheSeg->c);
+        if ( errcode ) return errcode;
+        wk->TheSeg->qtime = 0.0;
+        wk->TheSeg->quiet = QUIET_NO;
+        addTankReacted(MSX, k, wk->TheSeg);
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+void addPipeReacted(MSXproject MSX, int k, Pseg seg)
+/**
+**  Purpose:
+**    adds the mass reacted within a pipe segment since its concentrations
+**    were saved in lastc[] to the pipe's total, then saves the new ones.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = link index
+**    seg = a segment of the pipe
+*/
+{
+    int m;
+
+    for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
+    {
+        if (MSX->Species[m].type == BULK)
+        {
+            MSX->Link[k].reacted[m] += seg->v * (seg->c[m] - seg->lastc[m]) * LperFT3;
+        }
+        else if (MSX->Link[k].diam > 0)
+        {
+            MSX->Link[k].reacted[m] += seg->v * 4.0 / MSX->Link[k].diam * MSX->Ucf[AREA_UNITS] * (seg->c[m] - seg->lastc[m]);
+        }
+        seg->lastc[m] = seg->c[m];
+    }
+}
+
+//=============================================================================
+
+void addTankReacted(MSXproject MSX, int k, Pseg seg)
+/**
+**  Purpose:
+**    adds the mass reacted within a tank segment since its concentrations
+**    were saved in lastc[] to the tank's total, then saves the new ones.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = tank index
+**    seg = a segment of the tank
+*/
+{
+    int m;
+
+    for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
+    {
+        if (MSX->Species[m].type == BULK)
+        {
+            MSX->Tank[k].reacted[m] += seg->v * (seg->c[m] - seg->lastc[m]) * LperFT3;
+        }
+        seg->lastc[m] = seg->c[m];
+    }
+}
+
+//=============================================================================
+
+int isQuiescent(MSXproject MSX, int zone, Pseg seg, double tstep)
+/**
+**  Purpose:
+**    checks if the reactions of a pipe or tank segment can be skipped
+**    over a time step.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    seg = a pipe or tank segment
+**    tstep = time step (in rate units).
+**
+**  Returns:
+**    1 if the segment's reactions are skipped, 0 if they must be
+**    integrated over tstep plus the time seg->qtime skipped before.
+**
+**  Notes:
+**    A segment becomes a candidate when a time step changes none of its
+**    rate species by more than QUIET_TOL times its Atol (markQuiescent).
+**    Its reactions are then skipped, adding up the skipped time in qtime,
+**    until transport or mixing has changed its concentrations by more
+**    than QUIET_TOL times their Atol (which drops the negligible change
+**    the skipped reactions would have made) or qtime reaches the limit
+**    found by getQuietTime (which has the segment catch up on them).
+**    Before the hydraulics, constants or parameters change, the skipped
+**    reactions are integrated at the old rates (MSXchem_catchUp), and
+**    the limit is found again for any segment still quiescent after.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, m, nr, ne;
+    int *rate, *equil;
+    double d;
+
+    if ( seg->quiet == QUIET_NO ) return 0;
+    if ( zone == LINK )
+    {
+        nr = chem->NumPipeRateSpecies;
+        rate = chem->PipeRateSpecies;
+        ne = chem->NumPipeEquilSpecies;
+        equil = chem->PipeEquilSpecies;
+    }
+    else
+    {
+        nr = chem->NumTankRateSpecies;
+        rate = chem->TankRateSpecies;
+        ne = chem->NumTankEquilSpecies;
+        equil = chem->TankEquilSpecies;
+    }
+
+// --- a segment changed by transport or mixing is no longer quiescent
+//     (its concentrations are those it had at the end of the last time
+//     step in lastc[])
+
+    d = 0.0;
+    for (i=1; i<=nr+ne; i++)
+    {
+        m = (i <= nr) ? rate[i] : equil[i-nr];
+        d = MAX(d, fabs(seg->c[m] - seg->lastc[m]) / MSX->Species[m].aTol);
+    }
+    seg->qdrift += d;
+    if ( seg->qdrift > QUIET_TOL )
+    {
+        seg->quiet = QUIET_NO;
+        seg->qtime = 0.0;
+        return 0;
+    }
+
+// --- find how long its reactions can be skipped for
+
+    if ( seg->quiet == QUIET_YES && chem->RatesChanged ) seg->quiet = QUIET_TEST;
+    if ( seg->quiet == QUIET_TEST )
+    {
+        seg->qlimit = getQuietTime(MSX, zone, seg->c);
+        seg->qdrift = 0.0;
+        seg->quiet = QUIET_YES;
+    }
+    if ( seg->qtime + tstep > seg->qlimit ) return 0;
+    seg->qtime += tstep;
+    getWorker(MSX)->NumSkipped++;
+    return 1;
+}
+
+//=============================================================================
+
+void markQuiescent(MSXproject MSX, int zone, Pseg seg)
+/**
+**  Purpose:
+**    marks a pipe or tank segment whose reactions were just integrated
+**    as a candidate for having them skipped.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    seg = a pipe or tank segment (with its concentrations at the start
+**          of the time step in lastc[]).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, m, n;
+    int *rate;
+    double *atol;
+
+    if ( zone == LINK )
+    {
+        n = chem->NumPipeRateSpecies;
+        rate = chem->PipeRateSpecies;
+        atol = chem->PipeAtol;
+    }
+    else
+    {
+        n = chem->NumTankRateSpecies;
+        rate = chem->TankRateSpecies;
+        atol = chem->TankAtol;
+    }
+    seg->qtime = 0.0;
+    seg->qdrift = 0.0;
+    seg->quiet = QUIET_TEST;
+    for (i=1; i<=n; i++)
+    {
+        m = rate[i];
+        if ( fabs(seg->c[m] - seg->lastc[m]) > QUIET_TOL * atol[i] )
+        {
+            seg->quiet = QUIET_NO;
+            break;
+        }
+    }
+}
+
+//=============================================================================
+
+double getQuietTime(MSXproject MSX, int zone, double *c)
+/**
+**  Purpose:
+**    finds how long the reactions of a pipe or tank segment can be
+**    skipped for.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    c[] = species concentrations of the segment.
+**
+**  Returns:
+**    the time (in rate units) over which its reactions change no rate
+**    species by more than QUIET_TOL times its Atol.
+**
+**  Notes:
+**    The rates f are found at C and at C + d, where d is a step along
+**    f(C) that changes no species by more than QUIET_TOL*Atol. With
+**    F = |f(C)| (weighted by 1/Atol) and L the largest growth rate
+**    (f(C+d) - f(C))/d of any species, C changes over a time T by at
+**    most F*(exp(L*T) - 1)/L, or F*T if L <= 0, so species decaying
+**    quickly to equilibrium do not keep others from being skipped.
+**    T is also kept below QUIET_TOL/L so that the rates cannot grow much
+**    while they are skipped. Otherwise a species growing from a tiny
+**    amount could lag behind by the skipped change, which its growth
+**    would then amplify.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, n;
+    int *rate;
+    double *y = wk->QuietY, *f0 = wk->QuietF, *f1;
+    double *atol;
+    double fnorm = 0.0, lnorm = 0.0, d, s;
+    int moved = 0;
+
+    if ( zone == LINK )
+    {
+        n = chem->NumPipeRateSpecies;
+        rate = chem->PipeRateSpecies;
+        atol = chem->PipeAtol;
+    }
+    else
+    {
+        n = chem->NumTankRateSpecies;
+        rate = chem->TankRateSpecies;
+        atol = chem->TankAtol;
+    }
+    f1 = f0 + n + 1;
+
+// --- reaction rates at C
+
+    for (i=1; i<=n; i++) y[i] = c[rate[i]];
+    getQuietRates(MSX, zone, c, y, n, f0);
+    for (i=1; i<=n; i++)
+    {
+        if ( !isValidNumber(f0[i]) || atol[i] <= 0.0 ) return 0.0;
+        fnorm = MAX(fnorm, fabs(f0[i]) / atol[i]);
+    }
+    if ( fnorm == 0.0 ) return BIG;
+
+// --- reaction rates at C + d
+
+    s = QUIET_TOL / fnorm;
+    for (i=1; i<=n; i++)
+    {
+        y[i] = MAX(c[rate[i]] + s * f0[i], 0.0);
+        if ( y[i] != c[rate[i]] ) moved = 1;
+    }
+    if ( moved )
+    {
+        getQuietRates(MSX, zone, c, y, n, f1);
+        for (i=1; i<=n; i++)
+        {
+            if ( !isValidNumber(f1[i]) ) return 0.0;
+            d = y[i] - c[rate[i]];
+            if ( d != 0.0 ) lnorm = MAX(lnorm, (f1[i] - f0[i]) / d);
+        }
+    }
+    if ( lnorm <= 0.0 ) return QUIET_TOL / fnorm;
+    return MIN(log(1.0 + QUIET_TOL * lnorm / fnorm), QUIET_TOL) / lnorm;
+}
+
+//=============================================================================
+
+void getQuietRates(MSXproject MSX, int zone, double *c, double y[], int n,
+                   double f[])
+/**
+**  Purpose:
+**    finds the reaction rates of a single pipe or tank segment.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    c[] = species concentrations of the segment
+**    y[] = concentrations of its rate species
+**    n = number of rate species.
+**
+**  Output:
+**    f[] = reaction rates of the rate species.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+
+    if ( zone == LINK )
+    {
+        for (m=1; m<=chem->NumSpecies; m++) wk->BatchC[m*MAX_BATCH] = c[m];
+        for (i=1; i<=n; i++) wk->BatchY[i*MAX_BATCH] = y[i];
+        getPipeDcDtBatch(MSX, 1, chem->BatchLane, wk->BatchY, n, wk->BatchF);
+        for (i=1; i<=n; i++) f[i] = wk->BatchF[i*MAX_BATCH];
+    }
+    else
+    {
+        for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = c[m];
+        getTankDcDt(MSX, 0.0, y, n, f);
+    }
+}
+
+//=============================================================================
+
+int evalTankReactions(MSXproject MSX, int k, double dt)
+/**
+**  Purpose:
+**    updates species concentrations in a given storage tank
+**    after reactions occur over time step dt.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    k = tank index
+**    dt = time step (sec).
+**
+**  Output:
+**    updates values in the concentration vector Tank[k].c[]
+**    for tank k.
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Re-written to accommodate compiled functions (1.1)                         //1.1.00
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    SsegRing *segs = &MSX->Segs[MSX->Nobjects[LINK] + k];
+    int i, j, m, quiet, skip;
+    int errcode = 0, ierr = 0;
+    double tstep = dt / MSX->Ucf[RATE_UNITS];
+    double c, treact;
+
+// --- evaluate each volume segment in the tank
+
+    wk->TheTank = k;
+    wk->TheNode = MSX->Tank[k].node;
+    if ( dt > 0.0 && chem->NumTankLinearSpecies > 0 )
+    {
+        if ( !evalLinearRates(MSX, NODE, tstep) ) return ERR_INTEGRATOR;
+    }
+    quiet = dt > 0.0 && MSX->Solver != EUL && chem->NumTankRateSpecies > 0;
+    for (j = 0; j < segs->count; j++)
+    {
+        wk->TheSeg = SEG_AT(segs, j);
+
+    // --- skip the reactions of a quiescent segment, or have it catch
+    //     up on those it skipped before
+
+        skip = quiet && isQuiescent(MSX, NODE, wk->TheSeg, tstep);
+        treact = skip ? tstep : tstep + wk->TheSeg->qtime;
+        for (m = 1; m <= chem->NumSpecies; m++)
+        {
+            wk->ChemC1[m] = wk->TheSeg->c[m];
+            wk->TheSeg->lastc[m] = wk->TheSeg->c[m];
+        }
+        ierr = 0;
+
+    // --- react each reacting species over the time step
+
+        if ( dt > 0.0 )
+        {
+
+        // --- place current concentrations of species that react in vector Yrate
+            for (i=1; i<=chem->NumTankRateSpecies; i++)
+            {
+                m = chem->TankRateSpecies[i];
+  //              Yrate[i] = MSX->Tank[k].c[m];
+                wk->Yrate[i] = wk->TheSeg->c[m];
+            }
+
+        // --- Euler integrator
+
+            if ( MSX->Solver == EUL )
+            {
+                getTankDcDt(MSX, 0, wk->Yrate, chem->NumTankRateSpecies, wk->Yrate);
+                for (i=1; i<=chem->NumTankRateSpecies; i++)
+                {
+                    m = chem->TankRateSpecies[i];
+                    c = wk->TheSeg->c[m] + wk->Yrate[i]*tstep;
+                    wk->TheSeg->c[m] = MAX(c, 0.0);
+                }
+            }
+
+        // --- other integrators
+            else if ( chem->NumTankRateSpecies > 0 && !skip )
+            {
+                ierr = reactTankSeg(MSX, k, treact);
+            }
+            if ( ierr < 0 ) return 
+                ERR_INTEGRATOR;
+
+        // --- integrate the linear rates exactly
+
+            if ( chem->NumTankLinearSpecies > 0 )
+                applyLinearRates(MSX, NODE, wk->TheSeg->c);
+            if ( !skip ) wk->NumReacted++;
+        }
+
+    // --- nothing changes in a quiescent segment without linear rates
+
+        if ( skip && chem->NumTankLinearSpecies == 0 ) continue;
+
+    // --- compute new equilibrium concentrations within segment
+
+        errcode = MSXchem_equil(MSX, NODE, wk->TheSeg->c);
+        if ( errcode ) return errcode;
+        if ( quiet && !skip ) markQuiescent(MSX, NODE, wk->TheSeg);
+
+    // --- move to the next tank segment
+        addTankReacted(MSX, k, wk->TheSeg);
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+int evalPipeEquil(MSXproject MSX, double *c)
+/**
+**  Purpose:
+**    computes equilibrium concentrations for water in a pipe segment.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    c[] = array of starting species concentrations
+**
+**  Output:
+**    c[] = array of equilibrium concentrations.
+**
+**  Returns:
+**    an error code or 0 if no error.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+    int errcode;
+    for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = c[m];
+    for (i=1; i<=chem->NumPipeEquilSpecies; i++)
+    {
+        m = chem->PipeEquilSpecies[i];
+        wk->Yequil[i] = c[m];
+    }
+    
+    errcode = newton_solve(MSX, &wk->Newton, wk->Yequil, chem->NumPipeEquilSpecies,
+                           MAXIT, NUMSIG, getPipeEquil);
+    if ( errcode < 0 ) return ERR_NEWTON;
+    for (i=1; i<=chem->NumPipeEquilSpecies; i++)
+    {
+        m = chem->PipeEquilSpecies[i];
+        c[m] = wk->Yequil[i];
+        wk->ChemC1[m] = c[m];
+    }
+    return 0;
+}
+
+
+//=============================================================================
+
+int evalTankEquil(MSXproject MSX, double *c)
+/**
+**  Purpose:
+**    computes equilibrium concentrations for water in a tank.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    c[] = array of starting species concentrations
+**
+**  Output:
+**    c[] = array of equilibrium concentrations.
+**
+**  Returns:
+**    an error code or 0 if no error.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+    int errcode;
+    for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = c[m];
+    for (i=1; i<=chem->NumTankEquilSpecies; i++)
+    {
+        m = chem->TankEquilSpecies[i];
+        wk->Yequil[i] = c[m];
+    }
+    errcode = newton_solve(MSX, &wk->Newton, wk->Yequil, chem->NumTankEquilSpecies,
+                           MAXIT, NUMSIG, getTankEquil);
+    if ( errcode < 0 ) return ERR_NEWTON;
+    for (i=1; i<=chem->NumTankEquilSpecies; i++)
+    {
+        m = chem->TankEquilSpecies[i];
+        c[m] = wk->Yequil[i];
+        wk->ChemC1[m] = c[m];
+    }
+    return 0;
+}
+
+//=============================================================================
+
+void evalPipeFormulas(MSXproject MSX, double *c)
+/**
+**  Purpose:
+**    evaluates species concentrations in a pipe segment that are simple
+**    formulas involving other known species concentrations.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    c[] = array of current species concentrations.
+**
+**  Output:
+**    c[] = array of updated concentrations.
+**
+**  Re-written to accommodate compiled functions (1.1)
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int m;
+    for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = c[m];
+
+// --- use compiled functions if available
+
+    if ( MSX->Compiler )
+    {
+	    MSX->ChemLib.funcs.getPipeFormulas(wk->ChemC1, MSX->K, MSX->Link[wk->TheLink].param, wk->HydVar);
+        for (m=1; m<=chem->NumSpecies; m++)
+        {
+            c[m] = wk->ChemC1[m];
+        }
+    	return;
+    }
+
+    resetMemo(wk);
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        if ( MSX->Species[m].pipeExprType == FORMULA )
+        {
+			c[m] = getPipeVariableValue(MSX, m);
+        }
+    }
+}
+
+//=============================================================================
+
+void evalTankFormulas(MSXproject MSX, double *c)
+/**
+**  Purpose:
+**    evaluates species concentrations in a tank that are simple
+**    formulas involving other known species concentrations.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    c[] = array of current species concentrations.
+**
+**  Output:
+**    c[] = array of updated concentrations.
+**
+**  Re-written to accommodate compiled functions (1.1)
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int m;
+    for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = c[m];
+
+// --- use compiled functions if available 
+
+    if ( MSX->Compiler )
+    {
+	    MSX->ChemLib.funcs.getTankFormulas(wk->ChemC1, MSX->K, MSX->Link[wk->TheLink].param, wk->HydVar);
+        for (m=1; m<=chem->NumSpecies; m++)
+        {
+            c[m] = wk->ChemC1[m];
+        }
+    	return;
+    }
+
+    resetMemo(wk);
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        if ( MSX->Species[m].tankExprType == FORMULA )
+        {
+			c[m] = getTankVariableValue(MSX, m);
+        }
+    }
+}
+
+//=============================================================================
+
+double getPipeVariableValue(MSXproject MSX, int i)
+/**
+**  Purpose:
+**    finds the value of a species, a parameter, or a constant for 
+**    the pipe link being analyzed.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable index.
+**
+**  Returns:
+**    the current value of the indexed variable.
+**
+**  Note:
+**    formula species, terms and shared sub-expressions are evaluated
+**    only once for each concentration state (see evalMemo).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+
+// --- WQ species have index i between 1 & # of species
+//     and their current values are stored in vector ChemC1 
+
+    if ( i <= chem->LastIndex[SPECIES] )
+    {
+    // --- if species represented by a formula then evaluate it
+
+        if ( MSX->Species[i].pipeExprType == FORMULA )
+        {
+            return evalMemo(MSX, LINK, i);
+        }
+
+    // --- otherwise return the current concentration
+
+        else return getWorker(MSX)->ChemC1[i];
+    }
+
+// --- intermediate term expressions come next
+
+    else if ( i <= chem->LastIndex[TERM] )
+    {
+        return evalMemo(MSX, LINK, i);
+    }
+
+// --- reaction parameter indexes come after that
+
+    else if ( i <= chem->LastIndex[PARAMETER] )
+    {
+        i -= chem->LastIndex[PARAMETER-1];
+        return MSX->Link[getWorker(MSX)->TheLink].param[i];
+    }
+
+// --- followed by constants
+
+    else if ( i <= chem->LastIndex[CONSTANT] )
+    {
+        i -= chem->LastIndex[CONSTANT-1];
+        return MSX->Const[i].value;
+    }
+
+// --- then by hydraulic variables
+
+    else if ( i < chem->FirstPipeShared )
+    {
+        i -= chem->LastIndex[CONSTANT];
+        return getWorker(MSX)->HydVar[i];
+    }
+
+// --- and finally by shared sub-expressions
+
+    else if ( i < chem->FirstTankShared ) return evalMemo(MSX, LINK, i);
+    else return 0.0;
+}
+
+//=============================================================================
+
+double getTankVariableValue(MSXproject MSX, int i)
+/**
+**  Purpose:
+**    finds the value of a species, a parameter, or a constant for 
+**    the current node being analyzed.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable index.
+**
+**  Returns:
+**    the current value of the indexed variable.
+**
+**  Modified to check for NaN values (L.Rossman - 11/03/10).
+**
+**  Note:
+**    formula species, terms and shared sub-expressions are evaluated
+**    only once for each concentration state (see evalMemo).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int j;
+
+// --- WQ species have index i between 1 & # of species
+//     and their current values are stored in vector ChemC1
+
+    if ( i <= chem->LastIndex[SPECIES] )
+    {
+    // --- if species represented by a formula then evaluate it
+
+        if ( MSX->Species[i].tankExprType == FORMULA )
+        {
+            return evalMemo(MSX, NODE, i);
+        }
+
+    // --- otherwise return the current concentration
+
+        else return getWorker(MSX)->ChemC1[i];
+    }
+
+// --- intermediate term expressions come next
+
+    else if ( i <= chem->LastIndex[TERM] )
+    {
+        return evalMemo(MSX, NODE, i);
+    }
+
+// --- next come reaction parameters associated with Tank nodes
+
+    else if (i <= chem->LastIndex[PARAMETER] )
+    {
+        i -= chem->LastIndex[PARAMETER-1];
+        j = MSX->Node[getWorker(MSX)->TheNode].tank;
+        if ( j > 0 )
+        {
+            return MSX->Tank[j].param[i];
+        }
+        else return 0.0;
+    }
+
+// --- and then come constants
+
+    else if (i <= chem->LastIndex[CONSTANT] )
+    {
+        i -= chem->LastIndex[CONSTANT-1];
+        return MSX->Const[i].value;
+    }
+
+// --- tanks have no hydraulic variables but have their own
+//     shared sub-expressions
+
+    else if ( i >= chem->FirstTankShared ) return evalMemo(MSX, NODE, i);
+    else return 0.0;
+}
+
+//=============================================================================
+
+double evalMemo(MSXproject MSX, int zone, int i)
+/**
+**  Purpose:
+**    finds the value of a formula species, an intermediate term or a
+**    shared sub-expression for the pipe or tank being analyzed.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = LINK for pipe or NODE for tank expressions
+**    i = variable index.
+**
+**  Returns:
+**    the current value of the indexed variable.
+**
+**  Note:
+**    the value is only evaluated if not already known for the current
+**    concentration state, or for the current invariant state if it
+**    only depends on parameters, constants & hydraulics.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    unsigned state;
+    double x;
+
+    if ( zone == LINK )
+    {
+        state = chem->PipeInvariant[i] ? wk->InvariantState : wk->State;
+        if ( wk->MemoState[i] == state ) return wk->Memo[i];
+        x = mathexpr_run(MSX, chem->PipeCode[i], getFrame(MSX, LINK),
+                         getPipeVariableValue);
+    }
+    else
+    {
+        state = chem->TankInvariant[i] ? wk->InvariantState : wk->State;
+        if ( wk->MemoState[i] == state ) return wk->Memo[i];
+        x = mathexpr_run(MSX, chem->TankCode[i], getFrame(MSX, NODE),
+                         getTankVariableValue);
+    }
+
+// --- formula species and terms are checked for valid values
+
+    if ( i <= chem->LastIndex[SPECIES] )
+    {
+        x = MSXerr_validate(MSX, x, i, zone == LINK ? LINK : TANK, FORMULA);   //1.1.00
+    }
+    else if ( i <= chem->LastIndex[TERM] )
+    {
+        x = MSXerr_validate(MSX, x, i - chem->LastIndex[TERM-1], 0, TERM);     //1.1.00
+    }
+    wk->Memo[i] = x;
+    wk->MemoState[i] = state;
+    return x;
+}
+
+//=============================================================================
+
+int optimizeExpressions(MSXproject MSX)
+/**
+**  Purpose:
+**    folds constants and extracts shared sub-expressions from the pipe
+**    & tank expressions of all species and intermediate terms.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    shared pipe sub-expressions are given the variable indexes that
+**    follow the hydraulic variables, followed by those of tanks, so
+**    that both can be memoized by each worker like formula species
+**    and terms. Their optimized expressions are indexed by variable
+**    in PipeExpr & TankExpr (variable i+1 for expression i).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ExprSystem *sys;
+    int i, n;
+    int errcode = 0;
+
+// --- optimize pipe expressions first, then tank expressions
+
+    chem->FirstPipeShared = chem->LastIndex[CONSTANT] + MAX_HYD_VARS;
+    chem->FirstTankShared = chem->FirstPipeShared;
+    errcode = optimizeZone(MSX, LINK, &chem->PipeSystem, chem->FirstPipeShared);
+    if ( errcode ) return errcode;
+    chem->FirstTankShared = chem->FirstPipeShared + chem->PipeSystem.nshared;
+    errcode = optimizeZone(MSX, NODE, &chem->TankSystem, chem->FirstTankShared);
+    if ( errcode ) return errcode;
+    chem->NumVars = chem->FirstTankShared + chem->TankSystem.nshared - 1;
+
+// --- index the optimized expressions by variable
+
+    n = chem->NumVars + 1;
+    chem->PipeExpr = (MathExpr **)calloc(n, sizeof(MathExpr *));
+    chem->TankExpr = (MathExpr **)calloc(n, sizeof(MathExpr *));
+    chem->PipeInvariant = (char *)calloc(n, sizeof(char));
+    chem->TankInvariant = (char *)calloc(n, sizeof(char));
+    CALL(errcode, MEMCHECK(chem->PipeExpr));
+    CALL(errcode, MEMCHECK(chem->TankExpr));
+    CALL(errcode, MEMCHECK(chem->PipeInvariant));
+    CALL(errcode, MEMCHECK(chem->TankInvariant));
+    if ( errcode ) return errcode;
+
+    sys = &chem->PipeSystem;
+    for (i=0; i<sys->nexpr; i++)
+    {
+        chem->PipeExpr[i+1] = sys->opt[i];
+        chem->PipeInvariant[i+1] = sys->invariant[i];
+    }
+    for (i=0; i<sys->nshared; i++)
+    {
+        chem->PipeExpr[sys->firstShared+i] = sys->shared[i];
+        chem->PipeInvariant[sys->firstShared+i] = sys->invariant[sys->nexpr+i];
+    }
+    sys = &chem->TankSystem;
+    for (i=0; i<sys->nexpr; i++)
+    {
+        chem->TankExpr[i+1] = sys->opt[i];
+        chem->TankInvariant[i+1] = sys->invariant[i];
+    }
+    for (i=0; i<sys->nshared; i++)
+    {
+        chem->TankExpr[sys->firstShared+i] = sys->shared[i];
+        chem->TankInvariant[sys->firstShared+i] = sys->invariant[sys->nexpr+i];
+    }
+    return 0;
+}
+
+//=============================================================================
+
+int optimizeZone(MSXproject MSX, int zone, ExprSystem *sys, int first)
+/**
+**  Purpose:
+**    optimizes the expressions of all species and intermediate terms
+**    for either pipes or tanks.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct
+**    zone = LINK for pipe or NODE for tank expressions
+**    sys = set of expressions to optimize
+**    first = variable index of the first shared sub-expression.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, m;
+    int errcode = 0;
+
+    sys->nexpr = chem->NumSpecies + MSX->Nobjects[TERM];
+    sys->expr = (MathExpr **)calloc(sys->nexpr + 1, sizeof(MathExpr *));
+    sys->var = (int *)calloc(sys->nexpr + 1, sizeof(int));
+    CALL(errcode, MEMCHECK(sys->expr));
+    CALL(errcode, MEMCHECK(sys->var));
+    if ( errcode ) return errcode;
+
+// --- species expressions come first (only formulas define a variable)
+//     followed by intermediate terms
+
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        if ( zone == LINK )
+        {
+            sys->expr[m-1] = MSX->Species[m].pipeExpr;
+            if ( MSX->Species[m].pipeExprType == FORMULA ) sys->var[m-1] = m;
+        }
+        else
+        {
+            sys->expr[m-1] = MSX->Species[m].tankExpr;
+            if ( MSX->Species[m].tankExprType == FORMULA ) sys->var[m-1] = m;
+        }
+    }
+    for (i=1; i<=MSX->Nobjects[TERM]; i++)
+    {
+        sys->expr[chem->NumSpecies+i-1] = MSX->Term[i].expr;
+        sys->var[chem->NumSpecies+i-1] = chem->LastIndex[TERM-1] + i;
+    }
+    sys->firstShared = first;
+    if ( !mathexpr_optimize(MSX, sys, (zone == LINK) ? getPipeVariableSlot
+                                                     : getTankVariableSlot) )
+        return ERR_MEMORY;
+    return 0;
+}
+
+//=============================================================================
+
+int compileExpressions(MSXproject MSX)
+/**
+**  Purpose:
+**    compiles the optimized pipe & tank expressions of each species,
+**    intermediate term and shared sub-expression into register machine
+**    instructions.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    species, parameters, constants and hydraulic variables are read
+**    directly from the worker's ExprFrame (see getFrame) when compiled
+**    expressions are run, as are the memoized values of formula species,
+**    terms and shared sub-expressions when they are current.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i;
+    int errcode = 0;
+
+    chem->PipeCode = (ExprCode **)calloc(chem->NumVars+1, sizeof(ExprCode *));
+    chem->TankCode = (ExprCode **)calloc(chem->NumVars+1, sizeof(ExprCode *));
+    chem->NoParams = (double *)calloc(MSX->Nobjects[PARAMETER]+1, sizeof(double));
+    CALL(errcode, MEMCHECK(chem->PipeCode));
+    CALL(errcode, MEMCHECK(chem->TankCode));
+    CALL(errcode, MEMCHECK(chem->NoParams));
+    if ( errcode ) return errcode;
+
+    for (i=1; i<=chem->NumVars; i++)
+    {
+        if ( chem->PipeExpr[i] )
+        {
+            chem->PipeCode[i] = mathexpr_compile(MSX, chem->PipeExpr[i],
+                                                 getPipeVariableSlot);
+            CALL(errcode, MEMCHECK(chem->PipeCode[i]));
+        }
+        if ( chem->TankExpr[i] )
+        {
+            chem->TankCode[i] = mathexpr_compile(MSX, chem->TankExpr[i],
+                                                 getTankVariableSlot);
+            CALL(errcode, MEMCHECK(chem->TankCode[i]));
+        }
+    }
+    return errcode;
+}
+
+//=============================================================================
+void deleteCode(ExprCode **code, int n)
+/**
+**  Purpose:
+**    frees an array of compiled expressions.
+**
+**  Input:
+**    code = array of compiled expressions
+**    n = index of its last entry.
+*/
+{
+    int k;
+    if ( code == NULL ) return;
+    for (k=0; k<=n; k++) mathexpr_deleteCode(code[k]);
+    free(code);
+}
+
+//=============================================================================
+
+int getPipeVariableSlot(MSXproject MSX, int i, int *j)
+/**
+**  Purpose:
+**    finds where a compiled pipe expression reads a variable from.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable index.
+**
+**  Output:
+**    j = position of the variable in its ExprFrame array.
+**
+**  Returns:
+**    the kind of variable (see ExprSlotType).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+
+    if ( i <= chem->LastIndex[SPECIES] )
+    {
+        if ( MSX->Species[i].pipeExprType == FORMULA )
+            return getMemoSlot(chem->PipeInvariant, i);
+        *j = i;
+        return EXPR_SPECIES;
+    }
+    if ( i <= chem->LastIndex[TERM] ) return getMemoSlot(chem->PipeInvariant, i);
+    if ( i <= chem->LastIndex[PARAMETER] )
+    {
+        *j = i - chem->LastIndex[PARAMETER-1];
+        return EXPR_PARAM;
+    }
+    if ( i <= chem->LastIndex[CONSTANT] )
+    {
+        *j = i - chem->LastIndex[CONSTANT-1];
+        return EXPR_CONST;
+    }
+    *j = i - chem->LastIndex[CONSTANT];
+    if ( *j < MAX_HYD_VARS ) return EXPR_HYD;
+    if ( i < chem->FirstTankShared ) return getMemoSlot(chem->PipeInvariant, i);
+    return EXPR_ZERO;
+}
+
+//=============================================================================
+
+int getTankVariableSlot(MSXproject MSX, int i, int *j)
+/**
+**  Purpose:
+**    finds where a compiled tank expression reads a variable from.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable index.
+**
+**  Output:
+**    j = position of the variable in its ExprFrame array.
+**
+**  Returns:
+**    the kind of variable (see ExprSlotType).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+
+    if ( i <= chem->LastIndex[SPECIES] )
+    {
+        if ( MSX->Species[i].tankExprType == FORMULA )
+            return getMemoSlot(chem->TankInvariant, i);
+        *j = i;
+        return EXPR_SPECIES;
+    }
+    if ( i <= chem->LastIndex[TERM] ) return getMemoSlot(chem->TankInvariant, i);
+    if ( i <= chem->LastIndex[PARAMETER] )
+    {
+        *j = i - chem->LastIndex[PARAMETER-1];
+        return EXPR_PARAM;
+    }
+    if ( i <= chem->LastIndex[CONSTANT] )
+    {
+        *j = i - chem->LastIndex[CONSTANT-1];
+        return EXPR_CONST;
+    }
+    if ( i >= chem->FirstTankShared ) return getMemoSlot(chem->TankInvariant, i);
+    return EXPR_ZERO;
+}
+
+//=============================================================================
+
+int getMemoSlot(char *invariant, int i)
+/**
+**  Purpose:
+**    finds the kind of slot a memoized variable is read from.
+**
+**  Input:
+**    invariant = flags of variables that only depend on parameters,
+**                constants & hydraulics (NULL while being optimized)
+**    i = variable index.
+**
+**  Returns:
+**    EXPR_INVARIANT or EXPR_MEMO.
+*/
+{
+    if ( invariant && invariant[i] ) return EXPR_INVARIANT;
+    return EXPR_MEMO;
+}
+
+//=============================================================================
+
+ExprFrame *getFrame(MSXproject MSX, int zone)
+/**
+**  Purpose:
+**    points the current worker's ExprFrame to the variables of the
+**    pipe or tank being analyzed.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = LINK for the current pipe or NODE for the current node.
+**
+**  Returns:
+**    a pointer to the worker's ExprFrame.
+*/
+{
+    ChemWorker *wk = getWorker(MSX);
+    int j;
+
+    wk->Frame.c = wk->ChemC1;
+    wk->Frame.k = MSX->K;
+    wk->Frame.memo = wk->Memo;
+    wk->Frame.tag = wk->MemoState;
+    wk->Frame.state = wk->State;
+    wk->Frame.invariantState = wk->InvariantState;
+    if ( zone == LINK )
+    {
+        wk->Frame.p = MSX->Link[wk->TheLink].param;
+        wk->Frame.h = wk->HydVar;
+    }
+    else
+    {
+        j = MSX->Node[wk->TheNode].tank;
+        if ( j > 0 ) wk->Frame.p = MSX->Tank[j].param;
+        else         wk->Frame.p = MSX->Chem->NoParams;
+        wk->Frame.h = NULL;
+    }
+    return &wk->Frame;
+}
+
+//=============================================================================
+
+int getPipeBatchValue(MSXproject MSX, int i, int nb, double v[])
+/**
+**  Purpose:
+**    finds the values of a species, a parameter, or a constant for
+**    each pipe segment in the batch being analyzed.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    i = variable index
+**    nb = number of segments being evaluated.
+**
+**  Output:
+**    v[0..nb-1] = value of the indexed variable in each segment.
+**
+**  Returns:
+**    1 if the variable has the same value v[0] in all segments,
+**    0 otherwise.
+**
+**  Note:
+**    formula species, terms and shared sub-expressions are evaluated
+**    only once for each batch concentration state (see resetBatchMemo).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    ExprFrame frame;
+    double *memo;
+    int k, l;
+    int memoized;
+
+// --- WQ species have index i between 1 & # of species
+//     and their current values are stored in rows of BatchCw
+
+    if ( i <= chem->LastIndex[SPECIES] &&
+         MSX->Species[i].pipeExprType != FORMULA )
+    {
+        for (l=0; l<nb; l++) v[l] = wk->BatchCw[i*MAX_BATCH+l];
+        return 0;
+    }
+
+// --- formula species, intermediate terms & shared sub-expressions
+//     that depend on concentrations are evaluated unless already
+//     found for the current batch state
+
+    memoized = ( i <= chem->LastIndex[TERM] ) ||
+               ( i >= chem->FirstPipeShared && i < chem->FirstTankShared );
+    if ( memoized && !chem->PipeInvariant[i] )
+    {
+        memo = &wk->BatchMemo[i*MAX_BATCH];
+        if ( wk->BatchMemoState[i] == wk->BatchState )
+        {
+            for (l=0; l<nb; l++) v[l] = memo[l];
+            return 0;
+        }
+        frame = *getFrame(MSX, LINK);
+        frame.c = wk->BatchCw;
+        if ( !mathexpr_runBatch(MSX, chem->PipeCode[i], &frame, nb, v,
+                                getPipeBatchValue) ) wk->BatchFailed = 1;
+        if ( i <= chem->LastIndex[SPECIES] )
+        {
+            for (l=0; l<nb; l++) v[l] = MSXerr_validate(MSX, v[l], i, LINK, FORMULA);
+        }
+        else if ( i <= chem->LastIndex[TERM] )
+        {
+            k = i - chem->LastIndex[TERM-1];
+            for (l=0; l<nb; l++) v[l] = MSXerr_validate(MSX, v[l], k, 0, TERM);
+        }
+
+    // --- values are not kept if any part of the batch evaluation failed
+
+        if ( !wk->BatchFailed )
+        {
+            for (l=0; l<nb; l++) memo[l] = v[l];
+            wk->BatchMemoState[i] = wk->BatchState;
+        }
+        return 0;
+    }
+
+// --- all other variables (and those that only depend on parameters,
+//     constants & hydraulics) are the same for all segments of the pipe
+
+    v[0] = getPipeVariableValue(MSX, i);
+    return 1;
+}
+
+//=============================================================================
+
+void getPipeDcDtBatch(MSXproject MSX, int na, int lane[], double y[], int n,
+                      double deriv[])
+/**
+**  Purpose:
+**    finds reaction rates (dC/dt) for each reacting species in a batch
+**    of pipe segments.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    na = number of segments to evaluate
+**    lane[] = position of each segment in BatchC
+**    y[] = reacting species concentrations (y[i*MAX_BATCH + l] holds
+**          species i of segment lane[l])
+**    n = number of reacting species.
+**
+**  Output:
+**    deriv[] = reaction rates of each reacting species (same layout as y[]).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, l, m, j;
+    int err[MAX_BATCH];
+    double x;
+    ExprFrame frame;
+
+// --- assign species concentrations to their proper positions in
+//     the concentration rows of BatchC
+
+    wk->NumEvals += na;
+    for (i=1; i<=n; i++)
+    {
+        m = chem->PipeRateSpecies[i];
+        for (l=0; l<na; l++) wk->BatchC[m*MAX_BATCH+lane[l]] = y[i*MAX_BATCH+l];
+    }
+
+// --- update equilibrium species if full coupling in use
+
+    for (l=0; l<na; l++) err[l] = 0;
+    if ( MSX->Coupling == FULL_COUPLING )
+    {
+        for (l=0; l<na; l++)
+        {
+            for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = wk->BatchC[m*MAX_BATCH+lane[l]];
+            if ( MSXchem_equil(MSX, LINK, wk->ChemC1) > 0 ) err[l] = 1;
+            for (m=1; m<=chem->NumSpecies; m++) wk->BatchC[m*MAX_BATCH+lane[l]] = wk->ChemC1[m];
+        }
+    }
+
+// --- gather the concentrations of the segments being evaluated
+
+    for (m=1; m<=chem->NumSpecies; m++)
+    {
+        for (l=0; l<na; l++) wk->BatchCw[m*MAX_BATCH+l] = wk->BatchC[m*MAX_BATCH+lane[l]];
+    }
+    resetBatchMemo(wk);
+
+// --- use the compiled batch function if available
+
+    if ( MSX->Compiler && MSX->ChemLib.funcs.getPipeRatesBatch )
+    {
+        MSX->ChemLib.funcs.getPipeRatesBatch(na, MAX_BATCH, wk->BatchCw, MSX->K,
+                                             wk->BatchP, wk->BatchHyd, wk->BatchRate);
+        for (i=1; i<=n; i++)
+        {
+            m = chem->PipeRateSpecies[i];
+            for (l=0; l<na; l++)
+            {
+                if ( err[l] ) continue;
+                deriv[i*MAX_BATCH+l] = MSXerr_validate(MSX, wk->BatchRate[m*MAX_BATCH+l],
+                                                       m, LINK, RATE);
+            }
+        }
+    }
+
+// --- otherwise use the compiled functions one segment at a time
+
+    else if ( MSX->Compiler )
+    {
+        for (l=0; l<na; l++)
+        {
+            if ( err[l] ) continue;
+            for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = wk->BatchCw[m*MAX_BATCH+l];
+            MSX->ChemLib.funcs.getPipeRates(wk->ChemC1, MSX->K, MSX->Link[wk->TheLink].param, wk->HydVar, wk->F);
+            for (i=1; i<=n; i++)
+            {
+                m = chem->PipeRateSpecies[i];
+                deriv[i*MAX_BATCH+l] = MSXerr_validate(MSX, wk->F[m], m, LINK, RATE);
+            }
+        }
+    }
+
+// --- evaluate each pipe reaction expression one segment at a time
+//     if there are only a few segments
+
+    else if ( na < MIN_BATCH )
+    {
+        for (l=0; l<na; l++)
+        {
+            if ( err[l] ) continue;
+            for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = wk->BatchCw[m*MAX_BATCH+l];
+            resetMemo(wk);
+            for (i=1; i<=n; i++)
+            {
+                m = chem->PipeRateSpecies[i];
+                x = mathexpr_run(MSX, chem->PipeCode[m], getFrame(MSX, LINK),
+                                 getPipeVariableValue);
+                deriv[i*MAX_BATCH+l] = MSXerr_validate(MSX, x, m, LINK, RATE);
+            }
+        }
+    }
+
+// --- otherwise evaluate each expression for all segments at once
+//     (one segment at a time if the expression is too complex)
+
+    else for (i=1; i<=n; i++)
+    {
+        m = chem->PipeRateSpecies[i];
+        wk->BatchFailed = 0;
+        frame = *getFrame(MSX, LINK);
+        frame.c = wk->BatchCw;
+        if ( !mathexpr_runBatch(MSX, chem->PipeCode[m], &frame, na,
+                                &deriv[i*MAX_BATCH], getPipeBatchValue) ||
+             wk->BatchFailed )
+        {
+            for (l=0; l<na; l++)
+            {
+                for (j=1; j<=chem->NumSpecies; j++) wk->ChemC1[j] = wk->BatchCw[j*MAX_BATCH+l];
+                resetMemo(wk);
+                deriv[i*MAX_BATCH+l] = mathexpr_run(MSX, chem->PipeCode[m],
+                                                    getFrame(MSX, LINK),
+                                                    getPipeVariableValue);
+            }
+        }
+        for (l=0; l<na; l++)
+        {
+            if ( err[l] ) continue;
+            x = deriv[i*MAX_BATCH+l];
+            deriv[i*MAX_BATCH+l] = MSXerr_validate(MSX, x, m, LINK, RATE);
+        }
+    }
+
+// --- segments whose equilibrium could not be found do not react
+
+    for (l=0; l<na; l++)
+    {
+        if ( err[l] ) for (i=1; i<=n; i++) deriv[i*MAX_BATCH+l] = 0.0;
+    }
+}
+
+//=============================================================================
+
+void getTankDcDt(MSXproject MSX, double t, double y[], int n, double deriv[])
+/**
+**  Purpose:
+**    finds reaction rate (dC/dt) for each reacting species in a tank.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    t = current time (not used)
+**    y[] = vector of reacting species concentrations
+**    n = number of reacting species.
+**
+**  Output:
+**    deriv[] = vector of reaction rates of each reacting species.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+	double x;
+    (void)t;
+
+// --- assign species concentrations to their proper positions in the
+//     worker's concentration vector ChemC1
+
+    wk->NumEvals++;
+    for (i=1; i<=n; i++)
+    {
+        m = chem->TankRateSpecies[i];
+        wk->ChemC1[m] = y[i];
+    }
+
+// --- update equilibrium species if full coupling in use
+
+    if ( MSX->Coupling == FULL_COUPLING )
+    {
+        if ( MSXchem_equil(MSX, NODE, wk->ChemC1) > 0 )     // check for error condition
+        {
+            for (i=1; i<=n; i++) deriv[i] = 0.0;
+            return;
+        }
+    }
+
+// --- use compiled functions if available                                     //1.1.00
+
+    if ( MSX->Compiler )
+    {
+	    MSX->ChemLib.funcs.getTankRates(wk->ChemC1, MSX->K, MSX->Tank[wk->TheTank].param, wk->HydVar, wk->F);
+        for (i=1; i<=n; i++)
+        {
+            m = chem->TankRateSpecies[i];
+            deriv[i] = MSXerr_validate(MSX, wk->F[m], m, TANK, RATE);                   //1.1.00
+        }
+	    return;
+    }
+
+// --- evaluate each tank reaction expression
+
+    resetMemo(wk);
+    for (i=1; i<=n; i++)
+    {
+        m = chem->TankRateSpecies[i];
+		x = mathexpr_run(MSX, chem->TankCode[m], getFrame(MSX, NODE),
+		                 getTankVariableValue);
+        deriv[i] = MSXerr_validate(MSX, x, m, TANK, RATE);                          //1.1.00
+    }
+}
+
+//=============================================================================
+
+void getPipeEquil(MSXproject MSX, double t, double y[], int n, double f[])
+/**
+**  Purpose:
+**    evaluates equilibrium expressions for pipe chemistry.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    t = current time (not used)
+**    y[] = vector of equilibrium species concentrations
+**    n = number of equilibrium species.
+**
+**  Output:
+**    f[] = vector of equilibrium function values.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+	double x;
+    (void)t;
+
+// --- assign species concentrations to their proper positions in the
+//     worker's concentration vector ChemC1
+
+    for (i=1; i<=n; i++)
+    {
+        m = chem->PipeEquilSpecies[i];
+        wk->ChemC1[m] = y[i];
+    }
+
+// --- use compiled functions if available                                     //1.1.00
+
+    if ( MSX->Compiler )
+    {
+	    MSX->ChemLib.funcs.getPipeEquil(wk->ChemC1, MSX->K, MSX->Link[wk->TheLink].param, wk->HydVar, wk->F);
+        for (i=1; i<=n; i++)
+        {
+            m = chem->PipeEquilSpecies[i];
+		    f[i] = MSXerr_validate(MSX, wk->F[m], m, LINK, EQUIL);                      //1.1.00
+        }
+    	return;
+    }
+
+// --- evaluate each pipe equilibrium expression
+
+    resetMemo(wk);
+    for (i=1; i<=n; i++)
+    {
+        m = chem->PipeEquilSpecies[i];
+		x = mathexpr_run(MSX, chem->PipeCode[m], getFrame(MSX, LINK),
+		                 getPipeVariableValue);
+		f[i] = MSXerr_validate(MSX, x, m, LINK, EQUIL);                             //1.1.00
+    }
+}
+
+//=============================================================================
+
+void getTankEquil(MSXproject MSX, double t, double y[], int n, double f[])
+/**
+**  Purpose:
+**    evaluates equilibrium expressions for tank chemistry.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    t = current time (not used)
+**    y[] = vector of equilibrium species concentrations
+**    n = number of equilibrium species
+**
+**  Output:
+**    f[] = vector of equilibrium function values.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, m;
+    double x;
+    (void)t;
+
+// --- assign species concentrations to their proper positions in the
+//     worker's concentration vector ChemC1
+
+    for (i=1; i<=n; i++)
+    {
+        m = chem->TankEquilSpecies[i];
+        wk->ChemC1[m] = y[i];
+    }
+
+// --- use compiled functions if available                                     //1.1.00
+
+    if ( MSX->Compiler )
+    {
+	    MSX->ChemLib.funcs.getTankEquil(wk->ChemC1, MSX->K, MSX->Tank[wk->TheTank].param, wk->HydVar, wk->F);
+        for (i=1; i<=n; i++)
+        {
+            m = chem->TankEquilSpecies[i];
+		    f[i] = MSXerr_validate(MSX, wk->F[m], m, TANK, EQUIL);                      //1.1.00
+        }
+	    return;
+    }
+
+// --- evaluate each tank equilibrium expression
+
+    resetMemo(wk);
+    for (i=1; i<=n; i++)
+    {
+        m = chem->TankEquilSpecies[i];
+		x = mathexpr_run(MSX, chem->TankCode[m], getFrame(MSX, NODE),
+		                 getTankVariableValue);
+		f[i] = MSXerr_validate(MSX, x, m, TANK, EQUIL);                             //1.1.00
+    }
+}
+
+//=============================================================================
+
+int isValidNumber(double x)
+/**
+**  Purpose:
+**    checks that a number is neither NaN nor infinite.
+**
+**  Input:
+**    x = a number.
+**
+**  Returns:
+**    1 if x is a finite number, 0 if not.
+*/
+{
+    return ( x - x == 0.0 );
+}
+
+//=============================================================================
+
+ExprCode **createJacobian(MSXproject MSX, int zone, MathExpr ***jacExpr)
+/**
+**  Purpose:
+**    symbolically differentiates the chemistry expressions used to
+**    build the Jacobian of the rate species' reaction rates.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK for pipes or NODE for tanks)
+**    jacExpr = address that receives the derivative expressions
+**              (laid out like the returned array), or NULL if they
+**              are not needed.
+**
+**  Returns:
+**    an (N+1) x (N+1) array of compiled derivative expressions (NULL
+**    entries are identically zero), or NULL if the Jacobian must be found by finite
+**    differences instead.
+**
+**  Notes:
+**    Rows 1 to n hold the rate expressions of the n rate species and
+**    columns 1 to n the rate species they are differentiated by. With
+**    full coupling, rows & columns n+1 to N hold the same for the
+**    equilibrium expressions & species, so that the chain rule through
+**    the equilibrium system can be applied (see evalJacobian). Derivatives
+**    of intermediate terms and formula species are inlined.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, j, k, m, n, nn, n1, nvars;
+    MathExpr *expr;
+    MathExpr **jac;
+    ExprCode **code;
+
+// --- find the number of rate and (coupled) equilibrium species
+
+    n = (zone == LINK) ? chem->NumPipeRateSpecies : chem->NumTankRateSpecies;
+    if ( n == 0 ) return NULL;
+    nn = n + getCoupledEquilCount(MSX, zone);
+    n1 = nn + 1;
+
+// --- allocate the Jacobian and a cache for derivatives of formulas & terms
+
+    nvars = (chem->LastIndex[TERM] + 1) * (chem->NumSpecies + 1);
+    jac = (MathExpr **)calloc(n1*n1, sizeof(MathExpr *));
+    chem->DerivCache = (MathExpr **)calloc(nvars, sizeof(MathExpr *));
+    chem->DerivState = (char *)calloc(nvars, sizeof(char));
+    chem->DerivErr = ( !jac || !chem->DerivCache || !chem->DerivState );
+    chem->DerivZone = zone;
+
+// --- differentiate each expression w.r.t. each rate & coupled equil. species
+
+    for (i=1; i<=nn && !chem->DerivErr; i++)
+    {
+        m = getJacobianSpecies(MSX, zone, n, i);
+        if ( zone == LINK ) expr = MSX->Species[m].pipeExpr;
+        else                expr = MSX->Species[m].tankExpr;
+        for (j=1; j<=nn && !chem->DerivErr; j++)
+        {
+            if ( !mathexpr_diff(MSX, expr, getJacobianSpecies(MSX, zone, n, j),
+                                getDerivative, &jac[i*n1+j]) ) chem->DerivErr = 1;
+        }
+    }
+
+// --- free the derivative cache
+
+    if ( chem->DerivCache )
+    {
+        for (k=0; k<nvars; k++) mathexpr_delete(chem->DerivCache[k]);
+    }
+    FREE(chem->DerivCache);
+    FREE(chem->DerivState);
+
+// --- compile the derivatives for the expression interpreter
+
+    code = (ExprCode **)calloc(n1*n1, sizeof(ExprCode *));
+    if ( code == NULL ) chem->DerivErr = 1;
+    for (k=0; k<n1*n1 && !chem->DerivErr; k++)
+    {
+        if ( jac[k] == NULL ) continue;
+        if ( zone == LINK ) code[k] = mathexpr_compile(MSX, jac[k], getPipeVariableSlot);
+        else                code[k] = mathexpr_compile(MSX, jac[k], getTankVariableSlot);
+        if ( code[k] == NULL ) chem->DerivErr = 1;
+    }
+    if ( jacExpr && !chem->DerivErr ) *jacExpr = jac;
+    else deleteJacobianExpr(&jac, nn);
+    if ( chem->DerivErr )
+    {
+        deleteJacobian(code, nn);
+        return NULL;
+    }
+    return code;
+}
+
+//=============================================================================
+
+void deleteJacobian(ExprCode **jac, int nn)
+/**
+**  Purpose:
+**    frees the derivative expressions of an analytic Jacobian.
+**
+**  Input:
+**    jac = array of compiled derivative expressions
+**    nn = number of rate plus coupled equilibrium species.
+*/
+{
+    deleteCode(jac, (nn+1)*(nn+1) - 1);
+}
+
+//=============================================================================
+
+void deleteJacobianExpr(MathExpr ***jac, int nn)
+/**
+**  Purpose:
+**    frees the uncompiled derivative expressions of an analytic Jacobian.
+**
+**  Input:
+**    jac = address of the array of derivative expressions
+**    nn = number of rate plus coupled equilibrium species.
+*/
+{
+    int k;
+    if ( *jac == NULL ) return;
+    for (k=0; k<(nn+1)*(nn+1); k++) mathexpr_delete((*jac)[k]);
+    FREE(*jac);
+}
+
+//=============================================================================
+
+int getCoupledEquilCount(MSXproject MSX, int zone)
+/**
+**  Purpose:
+**    finds the number of equilibrium species that are re-computed
+**    whenever reaction rates are evaluated.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE).
+**
+**  Returns:
+**    number of equilibrium species if full coupling is used, 0 otherwise.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    if ( MSX->Coupling != FULL_COUPLING ) return 0;
+    if ( zone == LINK ) return chem->NumPipeEquilSpecies;
+    return chem->NumTankEquilSpecies;
+}
+
+//=============================================================================
+
+int getJacobianSpecies(MSXproject MSX, int zone, int n, int i)
+/**
+**  Purpose:
+**    finds the species associated with a row or column of the
+**    extended Jacobian built by createJacobian.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    n = number of rate species
+**    i = row or column index.
+**
+**  Returns:
+**    a species index.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    if ( zone == LINK )
+    {
+        if ( i <= n ) return chem->PipeRateSpecies[i];
+        return chem->PipeEquilSpecies[i-n];
+    }
+    if ( i <= n ) return chem->TankRateSpecies[i];
+    return chem->TankEquilSpecies[i-n];
+}
+
+//=============================================================================
+
+int createSparsity(MSXproject MSX, int zone, MSXSparse **sp)
+/**
+**  Purpose:
+**    finds which rate species each reaction rate depends on and creates
+**    the sparsity structure of the rate Jacobian from it.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE).
+**
+**  Output:
+**    sp = sparsity structure (NULL if there are no rate species).
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    with full coupling, a rate that depends on an equilibrium species
+**    is taken to depend on every rate species that any of the coupled
+**    equilibrium expressions depends on.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, j, k, n, n1, ne, coupled;
+    int errcode = 0;
+    char *pattern, *dep, *eqDep, *visited;
+
+    n = (zone == LINK) ? chem->NumPipeRateSpecies : chem->NumTankRateSpecies;
+    if ( n == 0 ) return 0;
+    n1 = n + 1;
+    ne = getCoupledEquilCount(MSX, zone);
+    pattern = (char *)calloc(n1*n1, sizeof(char));
+    dep = (char *)calloc(chem->NumSpecies + 1, sizeof(char));
+    eqDep = (char *)calloc(chem->NumSpecies + 1, sizeof(char));
+    visited = (char *)calloc(chem->LastIndex[TERM] + 1, sizeof(char));
+    CALL(errcode, MEMCHECK(pattern));
+    CALL(errcode, MEMCHECK(dep));
+    CALL(errcode, MEMCHECK(eqDep));
+    CALL(errcode, MEMCHECK(visited));
+    if ( !errcode )
+    {
+
+    // --- species that the coupled equilibrium expressions depend on
+
+        for (k=1; k<=ne; k++)
+        {
+            i = getJacobianSpecies(MSX, zone, n, n+k);
+            memset(visited, 0, chem->LastIndex[TERM] + 1);
+            getDependencies(MSX, zone, (zone == LINK) ? MSX->Species[i].pipeExpr
+                                                      : MSX->Species[i].tankExpr,
+                            eqDep, visited);
+        }
+
+    // --- species that each rate expression depends on
+
+        for (i=1; i<=n; i++)
+        {
+            j = getJacobianSpecies(MSX, zone, n, i);
+            memset(dep, 0, chem->NumSpecies + 1);
+            memset(visited, 0, chem->LastIndex[TERM] + 1);
+            getDependencies(MSX, zone, (zone == LINK) ? MSX->Species[j].pipeExpr
+                                                      : MSX->Species[j].tankExpr,
+                            dep, visited);
+            coupled = 0;
+            for (k=1; k<=ne; k++)
+            {
+                if ( dep[getJacobianSpecies(MSX, zone, n, n+k)] ) coupled = 1;
+            }
+            for (j=1; j<=n; j++)
+            {
+                k = getJacobianSpecies(MSX, zone, n, j);
+                pattern[i*n1+j] = dep[k] || (coupled && eqDep[k]);
+            }
+        }
+        *sp = createSparse(n, pattern);
+        CALL(errcode, MEMCHECK(*sp));
+    }
+    FREE(pattern);
+    FREE(dep);
+    FREE(eqDep);
+    FREE(visited);
+    return errcode;
+}
+
+//=============================================================================
+
+int createLinearRates(MSXproject MSX, int zone)
+/**
+**  Purpose:
+**    finds the rate species whose reaction rates are linear functions
+**    of each other only, and removes them from the rate species that
+**    the ODE solver integrates so that they can be integrated exactly.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE).
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Notes:
+**    A species qualifies if its rate depends only on qualifying species,
+**    its derivatives w.r.t. them depend on no species at all, and no
+**    other rate (nor, with full coupling, any equilibrium expression)
+**    depends on it. The qualifying species C then obey dC/dt = A*C + b,
+**    where A and b are fixed for a pipe or tank (see evalLinearRates).
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, j, k, m, n, nl, n1, ns1, nvars, changed;
+    int errcode = 0;
+    int *rate, *nrate, *linear;
+    char *isLinear, *dep, *visited;
+    MathExpr *d;
+    ExprCode **coeff = NULL;
+
+    if ( zone == LINK )
+    {
+        rate = chem->PipeRateSpecies;
+        nrate = &chem->NumPipeRateSpecies;
+        linear = chem->PipeLinearSpecies;
+    }
+    else
+    {
+        rate = chem->TankRateSpecies;
+        nrate = &chem->NumTankRateSpecies;
+        linear = chem->TankLinearSpecies;
+    }
+    n = *nrate;
+    if ( n == 0 ) return 0;
+
+// --- allocate dependency arrays and a cache for derivatives of
+//     formulas & terms
+
+    ns1 = chem->NumSpecies + 1;
+    nvars = (chem->LastIndex[TERM] + 1) * ns1;
+    isLinear = (char *)calloc(ns1, sizeof(char));
+    dep = (char *)calloc((n+1)*ns1, sizeof(char));
+    visited = (char *)calloc(chem->LastIndex[TERM] + 1, sizeof(char));
+    chem->DerivCache = (MathExpr **)calloc(nvars, sizeof(MathExpr *));
+    chem->DerivState = (char *)calloc(nvars, sizeof(char));
+    chem->DerivZone = zone;
+    chem->DerivErr = 0;
+    CALL(errcode, MEMCHECK(isLinear));
+    CALL(errcode, MEMCHECK(dep));
+    CALL(errcode, MEMCHECK(visited));
+    CALL(errcode, MEMCHECK(chem->DerivCache));
+    CALL(errcode, MEMCHECK(chem->DerivState));
+    if ( errcode ) chem->DerivErr = 1;
+
+// --- species that each rate expression depends on (row 0 holds those
+//     of the coupled equilibrium expressions, which no qualifying
+//     species can appear in)
+
+    for (i=1; i<=n && !errcode; i++)
+    {
+        memset(visited, 0, chem->LastIndex[TERM] + 1);
+        getDependencies(MSX, zone, getSpeciesExpr(MSX, zone, rate[i]),
+                        &dep[i*ns1], visited);
+        isLinear[rate[i]] = 1;
+    }
+    for (k=1; k<=getCoupledEquilCount(MSX, zone) && !errcode; k++)
+    {
+        i = getJacobianSpecies(MSX, zone, n, n+k);
+        memset(visited, 0, chem->LastIndex[TERM] + 1);
+        getDependencies(MSX, zone, getSpeciesExpr(MSX, zone, i), dep, visited);
+    }
+    for (k=1; k<ns1 && !errcode; k++)
+    {
+        if ( dep[k] ) isLinear[k] = 0;
+    }
+
+// --- drop species until the rest form a closed linear system
+
+    do
+    {
+        changed = 0;
+        for (i=1; i<=n && !errcode; i++)
+        {
+            m = rate[i];
+            for (k=1; k<ns1; k++)
+            {
+                if ( !dep[i*ns1+k] || getSpeciesExprType(MSX, zone, k) == FORMULA ) continue;
+                if ( isLinear[m] && !isLinear[k] ) isLinear[m] = 0, changed = 1;
+                if ( !isLinear[m] && isLinear[k] ) isLinear[k] = 0, changed = 1;
+            }
+        }
+        if ( changed || errcode ) continue;
+
+    // --- a rate is linear if its derivatives depend on no species
+
+        for (i=1; i<=n && !chem->DerivErr; i++)
+        {
+            if ( !isLinear[rate[i]] ) continue;
+            for (j=1; j<=n && isLinear[rate[i]] && !chem->DerivErr; j++)
+            {
+                if ( !isLinear[rate[j]] ) continue;
+                d = NULL;
+                if ( !mathexpr_diff(MSX, getSpeciesExpr(MSX, zone, rate[i]), rate[j],
+                                    getDerivative, &d) ) chem->DerivErr = 1;
+                if ( d == NULL ) continue;
+                memset(dep, 0, ns1);
+                memset(visited, 0, chem->LastIndex[TERM] + 1);
+                getDependencies(MSX, zone, d, dep, visited);
+                for (k=1; k<ns1; k++)
+                {
+                    if ( dep[k] && getSpeciesExprType(MSX, zone, k) != FORMULA )
+                    {
+                        isLinear[rate[i]] = 0;
+                        changed = 1;
+                    }
+                }
+                mathexpr_delete(d);
+            }
+        }
+    } while ( changed && !chem->DerivErr );
+
+// --- move the qualifying species to the list of linear species
+
+    nl = 0;
+    if ( !chem->DerivErr )
+    {
+        j = 0;
+        for (i=1; i<=n; i++)
+        {
+            m = rate[i];
+            if ( isLinear[m] ) linear[++nl] = m;
+            else rate[++j] = m;
+        }
+        *nrate = j;
+    }
+
+// --- compile the coefficients of the linear species in each linear rate
+
+    n1 = nl + 1;
+    if ( nl > 0 )
+    {
+        coeff = (ExprCode **)calloc(n1*n1, sizeof(ExprCode *));
+        CALL(errcode, MEMCHECK(coeff));
+    }
+    for (i=1; i<=nl && !errcode; i++)
+    {
+        for (j=1; j<=nl && !errcode; j++)
+        {
+            d = NULL;
+            if ( !mathexpr_diff(MSX, getSpeciesExpr(MSX, zone, linear[i]), linear[j],
+                                getDerivative, &d) || chem->DerivErr ) errcode = ERR_MEMORY;
+            if ( d == NULL ) continue;
+            if ( zone == LINK ) coeff[i*n1+j] = mathexpr_compile(MSX, d, getPipeVariableSlot);
+            else                coeff[i*n1+j] = mathexpr_compile(MSX, d, getTankVariableSlot);
+            CALL(errcode, MEMCHECK(coeff[i*n1+j]));
+            mathexpr_delete(d);
+        }
+    }
+    if ( zone == LINK )
+    {
+        chem->NumPipeLinearSpecies = nl;
+        chem->PipeLinearCoeff = coeff;
+    }
+    else
+    {
+        chem->NumTankLinearSpecies = nl;
+        chem->TankLinearCoeff = coeff;
+    }
+
+// --- free the work arrays
+
+    if ( chem->DerivCache )
+    {
+        for (k=0; k<nvars; k++) mathexpr_delete(chem->DerivCache[k]);
+    }
+    FREE(chem->DerivCache);
+    FREE(chem->DerivState);
+    FREE(isLinear);
+    FREE(dep);
+    FREE(visited);
+    return errcode;
+}
+
+//=============================================================================
+
+int evalLinearRates(MSXproject MSX, int zone, double tstep)
+/**
+**  Purpose:
+**    finds the exact solution of the linear rates of the current pipe
+**    or tank over a time step.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    tstep = time step (in rate units).
+**
+**  Output:
+**    the worker's LinE matrix, used by applyLinearRates.
+**
+**  Returns:
+**    1 if successful, 0 if a rate could not be evaluated.
+**
+**  Notes:
+**    The rates dC/dt = A*C + b are extended with b as an extra column
+**    of A (and a row of zeros), so that the exponential of the extended
+**    matrix times tstep holds both the decay of C and the effect of b.
+**    b is found by evaluating the rates with all linear species at 0.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int n1;
+
+    if ( !setLinearCoeffs(MSX, zone, tstep) ) return 0;
+    if ( zone == LINK ) n1 = chem->NumPipeLinearSpecies + 1;
+    else n1 = chem->NumTankLinearSpecies + 1;
+    return expMatrix(wk->LinA, n1, wk->LinE, wk->LinWork, wk->LinW, wk->LinIndx);
 }
 
 //=============================================================================
 
-void evalTankFormulas(MSXproject MSX, double *c)
+int setLinearCoeffs(MSXproject MSX, int zone, double tstep)
 /**
 **  Purpose:
-**    evaluates species concentrations in a tank that are simple
-**    formulas involving other known species concentrations.
+**    evaluates the linear rates dC/dt = A*C + b of the current pipe or
+**    tank times a time step.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    c[] = array of current species concentrations.
+**    zone = reaction zone (LINK or NODE)
+**    tstep = time step (in rate units).
 **
 **  Output:
-**    c[] = array of updated concentrations.
+**    the worker's LinA matrix, holding A*tstep with b*tstep as an
+**    extra column and a row of zeros (see evalLinearRates).
 **
-**  Re-written to accommodate compiled functions (1.1)
+**  Returns:
+**    1 if successful, 0 if a rate could not be evaluated.
 */
 {
-    int m;
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, j, nl, n1;
+    int *linear;
     double x;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
-
-// --- use compiled functions if available 
+    ExprCode **coeff, **code;
+    ExprFrame *frame;
+    double (*getValue)(MSXproject, int);
 
-    if ( MSX->Compiler )
+    if ( zone == LINK )
     {
-	    MSXgetTankFormulas(ChemC1, MSX->K, MSX->Link[TheLink].param, HydVar);
-        for (m=1; m<=NumSpecies; m++)
-        {
-            c[m] = ChemC1[m];
-        }
-    	return;
+        nl = chem->NumPipeLinearSpecies;
+        linear = chem->PipeLinearSpecies;
+        coeff = chem->PipeLinearCoeff;
+        code = chem->PipeCode;
+        getValue = getPipeVariableValue;
     }
-
-    for (m=1; m<=NumSpecies; m++)
+    else
     {
-        if ( MSX->Species[m].tankExprType == FORMULA )
+        nl = chem->NumTankLinearSpecies;
+        linear = chem->TankLinearSpecies;
+        coeff = chem->TankLinearCoeff;
+        code = chem->TankCode;
+        getValue = getTankVariableValue;
+    }
+    n1 = nl + 1;
+    for (i=1; i<=nl; i++) wk->ChemC1[linear[i]] = 0.0;
+    resetMemo(wk);
+    frame = getFrame(MSX, zone);
+    for (i=1; i<=nl; i++)
+    {
+        for (j=1; j<=nl; j++)
         {
-			x = mathexpr_eval(MSX, MSX->Species[m].tankExpr, getTankVariableValue);
-			c[m] = MSXerr_validate(MSX, x, m, TANK, FORMULA);
+            if ( coeff[i*n1+j] == NULL ) x = 0.0;
+            else x = mathexpr_run(MSX, coeff[i*n1+j], frame, getValue);
+            if ( !isValidNumber(x) ) return 0;
+            wk->LinA[i][j] = x * tstep;
         }
+        x = mathexpr_run(MSX, code[linear[i]], frame, getValue);
+        if ( !isValidNumber(x) ) return 0;
+        wk->LinA[i][n1] = x * tstep;
     }
+    for (j=1; j<=n1; j++) wk->LinA[n1][j] = 0.0;
+    return 1;
 }
 
 //=============================================================================
 
-double getPipeVariableValue(MSXproject MSX, int i)
+void applyLinearRates(MSXproject MSX, int zone, double *c)
 /**
 **  Purpose:
-**    finds the value of a species, a parameter, or a constant for 
-**    the pipe link being analyzed.
+**    integrates the linear rates of a pipe or tank segment exactly over
+**    the time step that evalLinearRates was called for.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    i = variable index.
+**    zone = reaction zone (LINK or NODE)
+**    c[] = species concentrations at the start of the time step.
 **
-**  Returns:
-**    the current value of the indexed variable.
+**  Output:
+**    c[] = concentrations of the linear species at the end of the step.
 */
 {
-	double x;
-
-// --- WQ species have index i between 1 & # of species
-//     and their current values are stored in vector ChemC1 
-
-    if ( i <= LastIndex[SPECIES] )
-    {
-    // --- if species represented by a formula then evaluate it
-
-        if ( MSX->Species[i].pipeExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX, MSX->Species[i].pipeExpr, getPipeVariableValue);
-            return MSXerr_validate(MSX, x, i, LINK, FORMULA);                       //1.1.00
-        }
-
-    // --- otherwise return the current concentration
-
-        else return ChemC1[i];
-    }
-
-// --- intermediate term expressions come next
-
-    else if ( i <= LastIndex[TERM] )
-    {
-        i -= LastIndex[TERM-1];
-		x = mathexpr_eval(MSX, MSX->Term[i].expr, getPipeVariableValue);
-        return MSXerr_validate(MSX, x, i, 0, TERM);                                 //1.1.00
-    }
-
-// --- reaction parameter indexes come after that
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int i, j, nl, n1;
+    int *linear;
+    double x;
 
-    else if ( i <= LastIndex[PARAMETER] )
+    if ( zone == LINK )
     {
-        i -= LastIndex[PARAMETER-1];
-        return MSX->Link[TheLink].param[i];
+        nl = chem->NumPipeLinearSpecies;
+        linear = chem->PipeLinearSpecies;
     }
-
-// --- followed by constants
-
-    else if ( i <= LastIndex[CONSTANT] )
+    else
     {
-        i -= LastIndex[CONSTANT-1];
-        return MSX->Const[i].value;
+        nl = chem->NumTankLinearSpecies;
+        linear = chem->TankLinearSpecies;
     }
-
-// --- and finally by hydraulic variables
-    else 
+    n1 = nl + 1;
+    for (i=1; i<=nl; i++) wk->LinW[i] = c[linear[i]];
+    for (i=1; i<=nl; i++)
     {
-        i -= LastIndex[CONSTANT];
-        if (i < MAX_HYD_VARS) return HydVar[i];
-        else return 0.0;
+        x = wk->LinE[i][n1];
+        for (j=1; j<=nl; j++) x += wk->LinE[i][j] * wk->LinW[j];
+        c[linear[i]] = MAX(x, 0.0);
     }
 }
 
 //=============================================================================
 
-double getTankVariableValue(MSXproject MSX, int i)
+MathExpr *getSpeciesExpr(MSXproject MSX, int zone, int m)
 /**
 **  Purpose:
-**    finds the value of a species, a parameter, or a constant for 
-**    the current node being analyzed.
+**    finds the pipe or tank chemistry expression of a species.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    i = variable index.
+**    zone = reaction zone (LINK or NODE)
+**    m = species index.
 **
 **  Returns:
-**    the current value of the indexed variable.
-**
-**  Modified to check for NaN values (L.Rossman - 11/03/10).
+**    the species' expression (NULL if it has none).
 */
 {
-    int j;
-	double x;
-
-// --- WQ species have index i between 1 & # of species
-//     and their current values are stored in vector ChemC1
-
-    if ( i <= LastIndex[SPECIES] )
-    {
-    // --- if species represented by a formula then evaluate it
-
-        if ( MSX->Species[i].tankExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX, MSX->Species[i].tankExpr, getTankVariableValue);
-            return MSXerr_validate(MSX, x, i, TANK, FORMULA);                       //1.1.00
-        }
-
-    // --- otherwise return the current concentration
+    if ( zone == LINK ) return MSX->Species[m].pipeExpr;
+    return MSX->Species[m].tankExpr;
+}
 
-        else return ChemC1[i];
-    }
+//=============================================================================
 
-// --- intermediate term expressions come next
+int getSpeciesExprType(MSXproject MSX, int zone, int m)
+/**
+**  Purpose:
+**    finds the type of a species' pipe or tank chemistry expression.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    m = species index.
+**
+**  Returns:
+**    the expression type (RATE, FORMULA, EQUIL or NO_EXPR).
+*/
+{
+    if ( zone == LINK ) return MSX->Species[m].pipeExprType;
+    return MSX->Species[m].tankExprType;
+}
 
-    else if ( i <= LastIndex[TERM] )
-    {
-        i -= LastIndex[TERM-1];
-		x = mathexpr_eval(MSX, MSX->Term[i].expr, getTankVariableValue);
-        return MSXerr_validate(MSX, x, i, 0, TERM);                                 //1.1.00
-    }
+//=============================================================================
 
-// --- next come reaction parameters associated with Tank nodes
+void getDependencies(MSXproject MSX, int zone, MathExpr *expr, char *dep,
+                     char *visited)
+/**
+**  Purpose:
+**    marks the species that an expression depends on, either directly
+**    or through intermediate terms and formula species.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = reaction zone (LINK or NODE)
+**    expr = the expression
+**    dep[] = 1 for each species already found
+**    visited[] = 1 for each term or formula species already examined.
+**
+**  Output:
+**    dep[] = 1 for each species the expression depends on.
+*/
+{
+    ChemSystem *chem = MSX->Chem;
+    int i, type;
+    MathExpr *sub;
 
-    else if (i <= LastIndex[PARAMETER] )
+    for (i=1; i<=chem->LastIndex[TERM]; i++)
     {
-        i -= LastIndex[PARAMETER-1];
-        j = MSX->Node[TheNode].tank;
-        if ( j > 0 )
+        if ( visited[i] || !mathexpr_usesVariable(expr, i) ) continue;
+        if ( i <= chem->LastIndex[SPECIES] )
         {
-            return MSX->Tank[j].param[i];
+            dep[i] = 1;
+            if ( zone == LINK )
+            {
+                type = MSX->Species[i].pipeExprType;
+                sub = MSX->Species[i].pipeExpr;
+            }
+            else
+            {
+                type = MSX->Species[i].tankExprType;
+                sub = MSX->Species[i].tankExpr;
+            }
+            if ( type != FORMULA ) continue;
         }
-        else return 0.0;
+        else sub = MSX->Term[i - chem->LastIndex[SPECIES]].expr;
+        visited[i] = 1;
+        getDependencies(MSX, zone, sub, dep, visited);
     }
-
-// --- and then come constants
-
-    else if (i <= LastIndex[CONSTANT] )
-    {
-        i -= LastIndex[CONSTANT-1];
-        return MSX->Const[i].value;
-    }
-    else return 0.0;
 }
 
 //=============================================================================
 
-void getPipeDcDt(MSXproject MSX, double t, double y[], int n, double deriv[])
+MathExpr *getDerivative(MSXproject MSX, int ivar, int wrt)
 /**
 **  Purpose:
-**    finds reaction rate (dC/dt) for each reacting species in a pipe.
+**    finds the derivative of a formula species or an intermediate term
+**    with respect to a species while building an analytic Jacobian.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    t = current time (not used)
-**    y[] = vector of reacting species concentrations
-**    n = number of reacting species.
+**    ivar = variable index
+**    wrt = index of the species to differentiate with respect to.
 **
-**  Output:
-**    deriv[] = vector of reaction rates of each reacting species.
+**  Returns:
+**    the derivative expression (NULL if it is identically zero).
 */
 {
-    int i, m;
-	double x;
-
-// --- assign species concentrations to their proper positions in the global
-//     concentration vector ChemC1
+    ChemSystem *chem = MSX->Chem;
+    int k;
+    MathExpr *expr;
 
-    for (i=1; i<=n; i++)
-    {
-        m = PipeRateSpecies[i];
-        ChemC1[m] = y[i];
-    }
-
-// --- update equilibrium species if full coupling in use
+// --- only formula species and terms depend on other species
 
-    if ( MSX->Coupling == FULL_COUPLING )
+    if ( chem->DerivErr || ivar > chem->LastIndex[TERM] ) return NULL;
+    if ( ivar <= chem->LastIndex[SPECIES] )
     {
-        if ( MSXchem_equil(MSX, LINK, ChemC1) > 0 )     // check for error condition
+        if ( chem->DerivZone == LINK )
         {
-            for (i=1; i<=n; i++) deriv[i] = 0.0;
-            return;
+            if ( MSX->Species[ivar].pipeExprType != FORMULA ) return NULL;
+            expr = MSX->Species[ivar].pipeExpr;
         }
-    }
-
-// --- use compiled functions if available                                     //1.1.00
-
-    if ( MSX->Compiler )
-    {
-	    MSXgetPipeRates(ChemC1, MSX->K, MSX->Link[TheLink].param, HydVar, F);
-        for (i=1; i<=n; i++)
+        else
         {
-            m = PipeRateSpecies[i];
-            deriv[i] = MSXerr_validate(MSX, F[m], m, LINK, RATE);                   //1.1.00
+            if ( MSX->Species[ivar].tankExprType != FORMULA ) return NULL;
+            expr = MSX->Species[ivar].tankExpr;
         }
-	    return;
     }
+    else expr = MSX->Term[ivar - chem->LastIndex[SPECIES]].expr;
 
-// --- evaluate each pipe reaction expression
+// --- differentiate the expression once and save it in the cache
+//     (a derivative already in progress signals a circular reference)
 
-    for (i=1; i<=n; i++)
+    k = ivar * (chem->NumSpecies + 1) + wrt;
+    if ( chem->DerivState[k] == 2 ) return chem->DerivCache[k];
+    if ( chem->DerivState[k] == 1 )
     {
-        m = PipeRateSpecies[i];
-		x = mathexpr_eval(MSX, MSX->Species[m].pipeExpr, getPipeVariableValue);
-        deriv[i] = MSXerr_validate(MSX, x, m, LINK, RATE);                          //1.1.00
+        chem->DerivErr = 1;
+        return NULL;
     }
+    chem->DerivState[k] = 1;
+    if ( !mathexpr_diff(MSX, expr, wrt, getDerivative, &chem->DerivCache[k]) )
+        chem->DerivErr = 1;
+    chem->DerivState[k] = 2;
+    return chem->DerivCache[k];
 }
 
 //=============================================================================
 
-void getTankDcDt(MSXproject MSX, double t, double y[], int n, double deriv[])
+int evalJacobian(MSXproject MSX, ExprCode **jac, int zone, double y[], int n,
+                 double **a)
 /**
 **  Purpose:
-**    finds reaction rate (dC/dt) for each reacting species in a tank.
+**    evaluates the analytic Jacobian of a set of reaction rates.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    t = current time (not used)
+**    jac = compiled derivative expressions built by createJacobian
+**    zone = reaction zone (LINK or NODE)
 **    y[] = vector of reacting species concentrations
 **    n = number of reacting species.
 **
 **  Output:
-**    deriv[] = vector of reaction rates of each reacting species.
+**    a[1..n][1..n] = Jacobian matrix of the reaction rates.
+**
+**  Returns:
+**    1 if successful, 0 if a derivative could not be evaluated.
+**
+**  Notes:
+**    With full coupling the equilibrium species E are implicit functions
+**    of the rate species C through G(C,E) = 0, so the total Jacobian of
+**    the rates R is dR/dC - dR/dE * inv(dG/dE) * dG/dC.
 */
 {
-    int i, m;
-	double x;
-
-// --- assign species concentrations to their proper positions in the global
-//     concentration vector ChemC1
+    ChemWorker *wk = getWorker(MSX);
+    int i, j, k, ne, n1;
+    double x;
+    double *params;
+    ExprCode *code;
+    ExprFrame *frame;
+    double (*getValue)(MSXproject, int);
+    MSXGETRATES getJacobian = NULL;
+
+// --- assign species concentrations to their proper positions in the
+//     worker's concentration vector ChemC1 and update the coupled equilibrium species
+
+    for (i=1; i<=n; i++) wk->ChemC1[getJacobianSpecies(MSX, zone, n, i)] = y[i];
+    ne = getCoupledEquilCount(MSX, zone);
+    if ( ne > 0 && MSXchem_equil(MSX, zone, wk->ChemC1) > 0 ) return 0;
+    getValue = (zone == LINK) ? getPipeVariableValue : getTankVariableValue;
+    resetMemo(wk);
+    frame = getFrame(MSX, zone);
+    n1 = n + ne + 1;
+
+// --- evaluate all partial derivatives at once with the compiled
+//     chemistry library if it has them
 
-    for (i=1; i<=n; i++)
+    if ( MSX->Compiler )
     {
-        m = TankRateSpecies[i];
-        ChemC1[m] = y[i];
+        if ( zone == LINK )
+        {
+            getJacobian = MSX->ChemLib.funcs.getPipeJacobian;
+            params = MSX->Link[wk->TheLink].param;
+        }
+        else
+        {
+            getJacobian = MSX->ChemLib.funcs.getTankJacobian;
+            params = MSX->Tank[wk->TheTank].param;
+        }
+        if ( getJacobian ) getJacobian(wk->ChemC1, MSX->K, params, wk->HydVar, wk->JacF);
     }
 
-// --- update equilibrium species if full coupling in use
+// --- evaluate each partial derivative
 
-    if ( MSX->Coupling == FULL_COUPLING )
+    for (i=1; i<n1; i++)
     {
-        if ( MSXchem_equil(MSX, NODE, ChemC1) > 0 )     // check for error condition
+        for (j=1; j<n1; j++)
         {
-            for (i=1; i<=n; i++) deriv[i] = 0.0;
-            return;
+            code = jac[i*n1+j];
+            if ( getJacobian ) x = wk->JacF[i*n1+j];
+            else if ( code == NULL ) x = 0.0;
+            else x = mathexpr_run(MSX, code, frame, getValue);
+            if ( !isValidNumber(x) ) return 0;
+            if ( i <= n )
+            {
+                if ( j <= n ) a[i][j] = x;
+                else          wk->JacRE[i][j-n] = x;
+            }
+            else
+            {
+                if ( j <= n ) wk->JacER[i-n][j] = x;
+                else          wk->JacEE[i-n][j-n] = x;
+            }
         }
     }
+    if ( ne == 0 ) return 1;
 
-// --- use compiled functions if available                                     //1.1.00
+// --- apply the chain rule through the equilibrium system
 
-    if ( MSX->Compiler )
+    if ( !factorize(wk->JacEE, ne, wk->JacW, wk->JacIndx) ) return 0;
+    for (j=1; j<=n; j++)
     {
-	    MSXgetTankRates(ChemC1, MSX->K, MSX->Tank[TheTank].param, HydVar, F);
+        for (k=1; k<=ne; k++) wk->JacW[k] = wk->JacER[k][j];
+        solve(wk->JacEE, ne, wk->JacIndx, wk->JacW);
         for (i=1; i<=n; i++)
         {
-            m = TankRateSpecies[i];
-            deriv[i] = MSXerr_validate(MSX, F[m], m, TANK, RATE);                   //1.1.00
+            x = 0.0;
+            for (k=1; k<=ne; k++) x += wk->JacRE[i][k] * wk->JacW[k];
+            a[i][j] -= x;
         }
-	    return;
-    }
-
-// --- evaluate each tank reaction expression
-
-    for (i=1; i<=n; i++)
-    {
-        m = TankRateSpecies[i];
-		x = mathexpr_eval(MSX, MSX->Species[m].tankExpr, getTankVariableValue);
-        deriv[i] = MSXerr_validate(MSX, x, m, TANK, RATE);                          //1.1.00
     }
+    return 1;
 }
 
 //=============================================================================
 
-void getPipeEquil(MSXproject MSX, double t, double y[], int n, double f[])
+int getTankJacobian(MSXproject MSX, double t, double y[], int n, double **a)
 /**
 **  Purpose:
-**    evaluates equilibrium expressions for pipe chemistry.
+**    evaluates the analytic Jacobian of the tank reaction rates.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
 **    t = current time (not used)
-**    y[] = vector of equilibrium species concentrations
-**    n = number of equilibrium species.
+**    y[] = vector of reacting species concentrations
+**    n = number of reacting species.
 **
 **  Output:
-**    f[] = vector of equilibrium function values.
+**    a[1..n][1..n] = Jacobian matrix of the reaction rates.
+**
+**  Returns:
+**    1 if successful, 0 if a derivative could not be evaluated.
 */
 {
-    int i, m;
-	double x;
-
-// --- assign species concentrations to their proper positions in the global
-//     concentration vector ChemC1
-
-    for (i=1; i<=n; i++)
-    {
-        m = PipeEquilSpecies[i];
-        ChemC1[m] = y[i];
-    }
-
-// --- use compiled functions if available                                     //1.1.00
-
-    if ( MSX->Compiler )
-    {
-	    MSXgetPipeEquil(ChemC1, MSX->K, MSX->Link[TheLink].param, HydVar, F);
-        for (i=1; i<=n; i++)
-        {
-            m = PipeEquilSpecies[i];
-		    f[i] = MSXerr_validate(MSX, F[m], m, LINK, EQUIL);                      //1.1.00
-        }
-    	return;
-    }
-
-// --- evaluate each pipe equilibrium expression
-
-    for (i=1; i<=n; i++)
-    {
-        m = PipeEquilSpecies[i];
-		x = mathexpr_eval(MSX, MSX->Species[m].pipeExpr, getPipeVariableValue);
-		f[i] = MSXerr_validate(MSX, x, m, LINK, EQUIL);                             //1.1.00
-    }
+    ChemSystem *chem = MSX->Chem;
+    (void)t;
+    return evalJacobian(MSX, chem->TankJacobian, NODE, y, n, a);
 }
 
 //=============================================================================
 
-void getTankEquil(MSXproject MSX, double t, double y[], int n, double f[])
+int getPipeBatchJacobian(MSXproject MSX, int lane, double y[], int n, double **a)
 /**
 **  Purpose:
-**    evaluates equilibrium expressions for tank chemistry.
+**    evaluates the analytic Jacobian of the pipe reaction rates for
+**    one segment of a batch.
 **
 **  Input:
 **    MSX = the underlying MSXproject data struct.
-**    t = current time (not used)
-**    y[] = vector of equilibrium species concentrations
-**    n = number of equilibrium species
+**    lane = position of the segment in BatchC
+**    y[] = vector of reacting species concentrations
+**    n = number of reacting species.
 **
 **  Output:
-**    f[] = vector of equilibrium function values.
+**    a[1..n][1..n] = Jacobian matrix of the reaction rates.
+**
+**  Returns:
+**    1 if successful, 0 if a derivative could not be evaluated.
 */
 {
-    int i, m;
-    double x;
-
-// --- assign species concentrations to their proper positions in the global
-//     concentration vector ChemC1
-
-    for (i=1; i<=n; i++)
-    {
-        m = TankEquilSpecies[i];
-        ChemC1[m] = y[i];
-    }
-
-// --- use compiled functions if available                                     //1.1.00
-
-    if ( MSX->Compiler )
-    {
-	    MSXgetTankEquil(ChemC1, MSX->K, MSX->Tank[TheTank].param, HydVar, F);
-        for (i=1; i<=n; i++)
-        {
-            m = TankEquilSpecies[i];
-		    f[i] = MSXerr_validate(MSX, F[m], m, TANK, EQUIL);                      //1.1.00
-        }
-	    return;
-    }
-
-// --- evaluate each tank equilibrium expression
-
-    for (i=1; i<=n; i++)
-    {
-        m = TankEquilSpecies[i];
-		x = mathexpr_eval(MSX, MSX->Species[m].tankExpr, getTankVariableValue);
-		f[i] = MSXerr_validate(MSX, x, m, TANK, EQUIL);                             //1.1.00
-    }
+    ChemSystem *chem = MSX->Chem;
+    ChemWorker *wk = getWorker(MSX);
+    int m, ok;
+    for (m=1; m<=chem->NumSpecies; m++) wk->ChemC1[m] = wk->BatchC[m*MAX_BATCH+lane];
+    ok = evalJacobian(MSX, chem->PipeJacobian, LINK, y, n, a);
+    for (m=1; m<=chem->NumSpecies; m++) wk->BatchC[m*MAX_BATCH+lane] = wk->ChemC1[m];
+    return ok;
 }
 
 //=============================================================================
@@ -30,28 +30,69 @@
   #define WINDOWS
 #endif
 
-//  Local variables
-//-----------------
-char *Fname;                 // Prefix used for all file names
-char TempName[L_tmpnam];
-char srcFile[MAXFNAME];      // Name of source code file
-char objFile[MAXFNAME];      // Name of object file
-char libFile[MAXFNAME];      // Name of library file
-int  Compiled;               // Flag for compilation step
+#ifdef WINDOWS
+  #include <direct.h>
+  #define DIRSEP     '\\'
+  #define LIBEXT     ".dll"
+#else
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #define DIRSEP     '/'
+  #define LIBEXT     ".so"
+#endif
+
+// --- commands used to compile & link the chemistry library
+//     (they are hashed along with the source code, so that changing
+//     them invalidates libraries in the cache)
+
+#ifdef WINDOWS
+  #define VC_COMPILE "CL /O2 /LD /nologo /Fe\"%s\" %s"
+  #define GC_COMPILE "gcc -c -O3 -fopenmp-simd %s"
+  #define GC_LINK    "gcc -lm -shared -o \"%s\" %s"
+  #define COMMANDS   VC_COMPILE GC_COMPILE GC_LINK
+#else
+  #define GC_COMPILE "gcc -c -fPIC -O3 -fopenmp-simd %s"
+  #define GC_LINK    "gcc -lm -shared -o \"%s\" %s"
+  #define COMMANDS   GC_COMPILE GC_LINK
+#endif
 
+// --- longest symbol written for a variable (e.g. pipeTerm(12, c, k, p, h))
+
+#define MAX_VARIABLE_STR 32
 
 //  Imported functions
 //--------------------
-char * MSXchem_getVariableStr(int i, char *s);
+char * MSXchem_getPipeVariableStr(MSXproject MSX, int i, char *s);
+char * MSXchem_getTankVariableStr(MSXproject MSX, int i, char *s);
+char * MSXchem_getBatchVariableStr(MSXproject MSX, int i, char *s);
+MathExpr * MSXchem_getExpr(MSXproject MSX, int zone, int i);
+void   MSXchem_getSharedRange(MSXproject MSX, int zone, int *first, int *last);
+int    MSXchem_getJacobianSize(MSXproject MSX, int zone);
+MathExpr * MSXchem_getJacobianExpr(MSXproject MSX, int zone, int i, int j);
 
 //  Exported functions
 //--------------------
 int  MSXcompiler_open(MSXproject MSX);
-void MSXcompiler_close(void);
+void MSXcompiler_close(MSXproject MSX);
 
 //  Local functions
 //-----------------
 static void  writeSrcFile(MSXproject MSX, FILE* f);
+static int   getCacheFile(MSXproject MSX);
+static int   getCacheDir(char *dir);
+static int   makeCacheDir(char *dir);
+static int   cacheLibrary(MSXproject MSX);
+static int   hashFile(char *fname, char *text, char *key);
+static int   compileLibrary(MSXproject MSX);
+static void  writeTermFunction(MSXproject MSX, FILE* f, int zone);
+static void  writeSpeciesFunction(MSXproject MSX, FILE* f, int zone, int type);
+static void  writeShared(MSXproject MSX, FILE* f, int zone, int var[], int n);
+static void  writeJacobianFunction(MSXproject MSX, FILE* f, int zone);
+static void  writeBatchFunction(MSXproject MSX, FILE* f, int zone, int type,
+                                char *name);
+static void  writeBatchLocals(MSXproject MSX, FILE* f, int zone, int var[], int n);
+static void  markBatchLocal(MSXproject MSX, int zone, int v, char *used,
+                            int *order, int *count);
 
 //=============================================================================
 
@@ -66,120 +107,416 @@ int MSXcompiler_open(MSXproject MSX)
 **
 **  Returns:
 **    an error code (0 if no error).
+**
+**  Note:
+**    compiled libraries are kept in a cache directory under a name
+**    made from a hash of their source code, so that a model whose
+**    chemistry was compiled before (by any of the user's processes)
+**    is only loaded. The cache directory is named by the MSX_CACHE_DIR
+**    environment variable (caching is turned off if it is empty) and
+**    defaults to an epanetmsx directory in the user's cache directory.
+**    A library is always compiled under its temporary name and is used
+**    from there if it cannot be placed in the cache.
 */
 {
-    char cmd[256];
     FILE* f;
     int   err;
+    Scompiler *lib = &MSX->ChemLib;
 
 // --- initialize
 
-    Fname = NULL;
-    Compiled = FALSE;
+    lib->fname = NULL;
+    lib->compiled = FALSE;
+    lib->cached = FALSE;
+    lib->cacheFile[0] = '\0';
 
 // --- get the name of a temporary file with directory path stripped from it
 //     and replace any '.' characters in it (for the Borland compiler to work)
 
-    Fname = MSXutils_getTempName(TempName) ;
+    lib->fname = MSXutils_getTempName(lib->tempName) ;
 
 // --- assign names to source code and compiled files
 
-    strcpy(srcFile, Fname);
-    strcat(srcFile, ".c");
-    strcpy(objFile, Fname);
-    strcat(objFile, ".o");
+    strcpy(lib->srcFile, lib->fname);
+    strcat(lib->srcFile, ".c");
+    strcpy(lib->objFile, lib->fname);
+    strcat(lib->objFile, ".o");
 #ifdef WINDOWS
-    strcpy(libFile, Fname);
-    strcat(libFile, ".dll");
+    strcpy(lib->libFile, lib->fname);
+    strcat(lib->libFile, ".dll");
 #else
-    strcpy(libFile, "lib");
-    strcat(libFile, Fname);
-    strcat(libFile, ".so");
+    // --- dlopen() only looks in the current directory given a path
+    strcpy(lib->libFile, "./lib");
+    strcat(lib->libFile, lib->fname);
+    strcat(lib->libFile, ".so");
 #endif
 
 // --- write the chemistry functions to the source code file
 
-    f = fopen(srcFile, "wt");
+    f = fopen(lib->srcFile, "wt");
     if ( f == NULL ) return ERR_COMPILE_FAILED;
     writeSrcFile(MSX, f);
     fclose(f);
 
+// --- use a library compiled from the same source if the cache has one
+
+    if ( getCacheFile(MSX) )
+    {
+        if ( MSXfuncs_load(&lib->funcs, lib->cacheFile) == 0 )
+        {
+            strcpy(lib->libFile, lib->cacheFile);
+            lib->compiled = TRUE;
+            lib->cached = TRUE;
+            return 0;
+        }
+    }
+
 // --- compile the source code file to a dynamic link library file
 
+    err = compileLibrary(MSX);
+    if ( err == ERR_COMPILE_FAILED ) return err;
+    lib->compiled = (err == 0);                                                // ttaxon - 9/7/10
+
+// --- copy the library into the cache
+
+    if ( lib->compiled && lib->cacheFile[0] != '\0' && cacheLibrary(MSX) )
+    {
+        remove(lib->libFile);
+        strcpy(lib->libFile, lib->cacheFile);
+        lib->cached = TRUE;
+    }
+
+// --- load the compiled chemistry functions from the library file
+
+    if ( lib->compiled)                                                        // ttaxon - 9/7/10
+    {
+        err = MSXfuncs_load(&lib->funcs, lib->libFile);
+        if ( err == 1 ) return ERR_COMPILE_FAILED;
+        if ( err == 2 ) return ERR_COMPILED_LOAD;
+    }
+    else                                                                       // ttaxon - 9/7/10   
+    {
+        MSXcompiler_close(MSX); 
+        return ERR_COMPILE_FAILED; 
+    } 
+    return 0;
+}
+
+//=============================================================================
+
+void MSXcompiler_close(MSXproject MSX)
+/**
+**  Purpose:
+**    frees resources used to load chemistry functions from the shared
+**    library and deletes all files used to compile and link the library
+**    (except a library that was placed in the cache).
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    none.
+*/
+{
+    Scompiler *lib = &MSX->ChemLib;
+    if ( lib->compiled ) MSXfuncs_free(&lib->funcs);
+    lib->compiled = FALSE;
+    if ( lib->fname )
+    {
+#ifdef WINDOWS
+        // --- delete all files created from compilation
+        //     (VC++ creates more than just an obj and dll file)
+        char cmd[MAXFNAME+32];
+        if ( snprintf(cmd, sizeof(cmd), "cmd /c del %s.*", lib->fname)
+             < (int)sizeof(cmd) ) MSXfuncs_run(cmd);
+        if ( !lib->cached ) remove(lib->libFile);
+#else
+        remove(lib->tempName);
+        remove(lib->srcFile);
+        remove(lib->objFile);
+        if ( !lib->cached ) remove(lib->libFile);
+#endif
+    }
+    lib->fname = NULL;
+    lib->cached = FALSE;
+}
+
+//=============================================================================
+
+int compileLibrary(MSXproject MSX)
+/**
+**  Purpose:
+**    compiles the chemistry function source code file into a dynamic
+**    link library file
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    0 if the library was built, ERR_COMPILE_FAILED if the compiler
+**    is not supported or a command would not fit its buffer, or the
+**    status of the failed compiler command.
+*/
+{
+    char cmd[2*MAXFNAME+64];
+    int  err;
+    Scompiler *lib = &MSX->ChemLib;
+
 #ifdef WINDOWS
     if ( MSX->Compiler == VC )
     {
-	sprintf(cmd, "CL /O2 /LD /nologo %s", srcFile);
+        if ( snprintf(cmd, sizeof(cmd), VC_COMPILE, lib->libFile,
+                      lib->srcFile) >= (int)sizeof(cmd) ) return ERR_COMPILE_FAILED;
         err = MSXfuncs_run(cmd);
     }
 
     else if ( MSX->Compiler == GC )
     {
-	sprintf(cmd, "gcc -c -O3 %s", srcFile);
-	err = MSXfuncs_run(cmd);
-	sprintf(cmd, "gcc -lm -shared -o %s %s", libFile, objFile);
-	err = MSXfuncs_run(cmd);
+        if ( snprintf(cmd, sizeof(cmd), GC_COMPILE, lib->srcFile)
+             >= (int)sizeof(cmd) ) return ERR_COMPILE_FAILED;
+        err = MSXfuncs_run(cmd);
+        if ( snprintf(cmd, sizeof(cmd), GC_LINK, lib->libFile, lib->objFile)
+             >= (int)sizeof(cmd) ) return ERR_COMPILE_FAILED;
+        err = MSXfuncs_run(cmd);
     }
     else return ERR_COMPILE_FAILED;
 #else
     if ( MSX->Compiler == GC )
     {
-        sprintf(cmd, "gcc -c -fPIC -O3 %s", srcFile);
+        if ( snprintf(cmd, sizeof(cmd), GC_COMPILE, lib->srcFile)
+             >= (int)sizeof(cmd) ) return ERR_COMPILE_FAILED;
         err = system(cmd);
-        sprintf(cmd, "gcc -lm -shared -o %s %s", libFile, objFile);
+        if ( snprintf(cmd, sizeof(cmd), GC_LINK, lib->libFile, lib->objFile)
+             >= (int)sizeof(cmd) ) return ERR_COMPILE_FAILED;
         err = system(cmd);
     }
     else return ERR_COMPILE_FAILED;
 #endif
-    Compiled = (err == 0);                                                     // ttaxon - 9/7/10
+    return err;
+}
 
-// --- load the compiled chemistry functions from the library file
+//=============================================================================
+
+int getCacheFile(MSXproject MSX)
+/**
+**  Purpose:
+**    finds the name the compiled chemistry library has in the cache
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Output:
+**    lib->cacheFile = name of the library in the cache
+**
+**  Returns:
+**    1 if the cache can be used, 0 if not.
+*/
+{
+    char dir[MAXFNAME];
+    char text[256];
+    char key[20];
+    Scompiler *lib = &MSX->ChemLib;
+
+    if ( !getCacheDir(dir) ) return 0;
+
+// --- the key hashes the compiler, its commands and the source code
 
-    if ( Compiled)                                                             // ttaxon - 9/7/10
+    sprintf(text, "%d %s", MSX->Compiler, COMMANDS);
+    if ( !hashFile(lib->srcFile, text, key) ) return 0;
+    if ( snprintf(lib->cacheFile, MAXFNAME, "%s%cmsx%s%s", dir, DIRSEP,
+                  key, LIBEXT) >= MAXFNAME )
     {
-        err = MSXfuncs_load(libFile);
-        if ( err == 1 ) return ERR_COMPILE_FAILED;
-        if ( err == 2 ) return ERR_COMPILED_LOAD;
+        lib->cacheFile[0] = '\0';
+        return 0;
     }
-    else                                                                       // ttaxon - 9/7/10   
+    return 1;
+}
+
+//=============================================================================
+
+int cacheLibrary(MSXproject MSX)
+/**
+**  Purpose:
+**    copies the compiled library into the cache
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    1 if the cache holds the library, 0 if not.
+**
+**  Note:
+**    the library is copied to a file named after the (unique) source
+**    file and then renamed, so that several processes can populate the
+**    cache at the same time without ever loading a partly written
+**    library. On Windows the rename fails if another process has
+**    already put the same library there, which is then used.
+*/
+{
+    char tmpFile[MAXFNAME];
+    char buf[4096];
+    char *base;
+    size_t n;
+    int ok = 1;
+    FILE *in, *out;
+    Scompiler *lib = &MSX->ChemLib;
+
+    base = strrchr(lib->fname, DIRSEP);
+    if ( base ) base++;
+    else base = lib->fname;
+    if ( snprintf(tmpFile, MAXFNAME, "%s.%s", lib->cacheFile, base)
+         >= MAXFNAME ) return 0;
+
+// --- copy the library
+
+    in = fopen(lib->libFile, "rb");
+    if ( in == NULL ) return 0;
+    out = fopen(tmpFile, "wb");
+    if ( out == NULL )
     {
-        MSXcompiler_close(); 
-        return ERR_COMPILE_FAILED; 
-    } 
-    return 0;
+        fclose(in);
+        return 0;
+    }
+    while ( (n = fread(buf, 1, sizeof(buf), in)) > 0 )
+    {
+        if ( fwrite(buf, 1, n, out) != n ) ok = 0;
+    }
+    if ( ferror(in) ) ok = 0;
+    fclose(in);
+    if ( fclose(out) != 0 ) ok = 0;
+
+// --- move it into place
+
+    if ( ok ) rename(tmpFile, lib->cacheFile);
+    remove(tmpFile);
+    if ( !ok ) return 0;
+    in = fopen(lib->cacheFile, "rb");
+    if ( in == NULL ) return 0;
+    fclose(in);
+    return 1;
 }
 
 //=============================================================================
 
-void MSXcompiler_close()
+int getCacheDir(char *dir)
 /**
 **  Purpose:
-**    frees resources used to load chemistry functions from the shared
-**    library and deletes all files used to compile and link the library.
+**    finds (and creates if needed) the compiled library cache directory
 **
 **  Input:
-**    none
+**    dir = string (of size MAXFNAME) to hold the directory's name
 **
 **  Returns:
-**    none.
+**    1 if a cache directory is used, 0 if not.
+**
+**  Note:
+**    libraries in the cache are loaded without being compiled, so the
+**    cache must belong to the user: the default one lies in the user's
+**    own directories (%LOCALAPPDATA% on Windows, $XDG_CACHE_HOME or
+**    $HOME/.cache elsewhere) and, outside Windows, any cache directory
+**    is refused unless the user owns it and no one else can write to it.
 */
 {
-    char cmd[256];
-    if ( Compiled ) MSXfuncs_free();
-    if ( Fname )
+    char *s = getenv("MSX_CACHE_DIR");
+
+    if ( s != NULL )
+    {
+        if ( *s == '\0' || strlen(s) >= MAXFNAME - 80 ) return 0;
+        strcpy(dir, s);
+    }
+    else
     {
 #ifdef WINDOWS
-        // --- delete all files created from compilation
-        //     (VC++ creates more than just an obj and dll file)
-        sprintf(cmd, "cmd /c del %s.*", Fname);
-        MSXfuncs_run(cmd);
+        s = getenv("LOCALAPPDATA");
+        if ( s == NULL || *s == '\0' ) return 0;
+        if ( strlen(s) >= MAXFNAME - 80 ) return 0;
+        sprintf(dir, "%s%cepanetmsx", s, DIRSEP);
 #else
-        remove(TempName);
-        remove(srcFile);
-        remove(objFile);
-        remove(libFile);
+        s = getenv("XDG_CACHE_HOME");
+        if ( s != NULL && *s == '/' )
+        {
+            if ( strlen(s) >= MAXFNAME - 80 ) return 0;
+            strcpy(dir, s);
+        }
+        else
+        {
+            s = getenv("HOME");
+            if ( s == NULL || *s != '/' ) return 0;
+            if ( strlen(s) >= MAXFNAME - 80 ) return 0;
+            sprintf(dir, "%s%c.cache", s, DIRSEP);
+        }
+        mkdir(dir, 0700);
+        strcat(dir, "/epanetmsx");
 #endif
     }
+    return makeCacheDir(dir);
+}
+
+//=============================================================================
+
+int makeCacheDir(char *dir)
+/**
+**  Purpose:
+**    creates a cache directory if it does not exist yet
+**
+**  Input:
+**    dir = name of the directory
+**
+**  Returns:
+**    1 if the directory can be used, 0 if not.
+*/
+{
+#ifdef WINDOWS
+    _mkdir(dir);
+    return 1;
+#else
+    struct stat st;
+
+    mkdir(dir, 0700);
+    if ( lstat(dir, &st) != 0 ) return 0;
+    if ( !S_ISDIR(st.st_mode) ) return 0;
+    if ( st.st_uid != geteuid() ) return 0;
+    if ( st.st_mode & (S_IWGRP | S_IWOTH) ) return 0;
+    return 1;
+#endif
+}
+
+//=============================================================================
+
+int hashFile(char *fname, char *text, char *key)
+/**
+**  Purpose:
+**    hashes the contents of a file
+**
+**  Input:
+**    fname = name of the file
+**    text = text to hash before the file's contents
+**
+**  Output:
+**    key = 64-bit FNV-1a hash as 16 hexadecimal digits (plus a null)
+**
+**  Returns:
+**    1 if successful, 0 if the file could not be read.
+*/
+{
+    FILE* f;
+    unsigned long long h = 14695981039346656037ULL;
+    char *s;
+    int c;
+
+    for (s = text; *s != '\0'; s++)
+    {
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+    f = fopen(fname, "rb");
+    if ( f == NULL ) return 0;
+    while ( (c = fgetc(f)) != EOF )
+    {
+        h = (h ^ (unsigned char)c) * 1099511628211ULL;
+    }
+    fclose(f);
+    sprintf(key, "%08x%08x", (unsigned)(h >> 32), (unsigned)(h & 0xffffffffu));
+    return 1;
 }
 
 //=============================================================================
@@ -197,20 +534,30 @@ void  writeSrcFile(MSXproject MSX, FILE* f)
 **    none.
 **
 **  Note: this function uses mathexpr_getStr() from mathexpr.c to
-**        reconstruct math expressions that were previously parsed
-**        into a stack of atomic terms by mathexpr_create(). The
-**        mathexpr_getStr function calls MSXchem_getVariableStr (in 
+**        reconstruct the optimized math expressions kept by msxchem.c
+**        (see MSXchem_getExpr). The mathexpr_getStr function calls
+**        MSXchem_getPipeVariableStr or MSXchem_getTankVariableStr (in
 **        msxchem.c) to return a symbol for a particular variable that
 **        is used in the reconstucted expression in place of the
 **        variable's original name. For example, if NH3 were the name
 **        of the 2nd chemical species, then in the source code written
 **        here it would be denoted as c[2]; the third hydraulic variable,
 **        Velocity, would appear as h[3]. Similar notation is used for
-**        constants (k[]) and parameters (p[]).
+**        constants (k[]) and parameters (p[]). Sub-expressions shared
+**        by several expressions are written as local variables (s0, s1,
+**        ...) of each function that uses them.
+**
+**        When the Rosenbrock solver is used the analytic Jacobians of
+**        the pipe and tank rates are written as well (see
+**        writeJacobianFunction).
+**
+**        Each function also has a batch version that evaluates n pipe
+**        or tank segments in a loop the compiler can vectorize. Its
+**        arrays hold the value of variable i for segment l at
+**        [i*stride+l] (e.g. c[2*stride+l]) and intermediate terms are
+**        written as local variables (t1, t2, ...) of the loop.
 */
 {
-    int i;
-    char e[1024];
     char headers[] =
 
 " /*  Machine Generated EPANET-MSX File - Do Not Edit */ \n\n"
@@ -239,7 +586,16 @@ void  writeSrcFile(MSXproject MSX, FILE* f)
 " void  DLLEXPORT  MSXgetTankEquil(double *, double *, double *, double *, double *); \n"
 " void  DLLEXPORT  MSXgetPipeFormulas(double *, double *, double *, double *); \n"
 " void  DLLEXPORT  MSXgetTankFormulas(double *, double *, double *, double *); \n"
-" double term(int, double *, double *, double *, double *); \n";
+" void  DLLEXPORT  MSXgetPipeJacobian(double *, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetTankJacobian(double *, double *, double *, double *, double *); \n"
+" double pipeTerm(int, double *, double *, double *, double *); \n"
+" double tankTerm(int, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetPipeRatesBatch(int, int, double *, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetTankRatesBatch(int, int, double *, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetPipeEquilBatch(int, int, double *, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetTankEquilBatch(int, int, double *, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetPipeFormulasBatch(int, int, double *, double *, double *, double *); \n"
+" void  DLLEXPORT  MSXgetTankFormulasBatch(int, int, double *, double *, double *, double *); \n";
 
     char mathFuncs[] = 
 
@@ -271,90 +627,454 @@ void  writeSrcFile(MSXproject MSX, FILE* f)
 
 // --- write term functions
 
-    fprintf(f,
-"\n double term(int i, double c[], double k[], double p[], double h[])\n { \n");
-    if ( MSX->Nobjects[TERM] > 0 )
-    {
-       fprintf(f, "     switch(i) { \n");
-        for (i=1; i<=MSX->Nobjects[TERM]; i++)
-        {
-            fprintf(f, "     case %d: return %s; \n",
-            i, mathexpr_getStr(MSX->Term[i].expr, e, MSXchem_getVariableStr));
-        }
-        fprintf(f, "     } \n");
-    }
-    fprintf(f, "     return 0.0; \n }\n");
+    writeTermFunction(MSX, f, LINK);
+    writeTermFunction(MSX, f, NODE);
 
 // --- write pipe rate functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetPipeRates(double c[], double k[], double p[], double h[], double f[])\n { \n");
-    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
-    {
-        if ( MSX->Species[i].pipeExprType == RATE )
-            fprintf(f, "     f[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].pipeExpr, e,
-                MSXchem_getVariableStr));
-    }
+    writeSpeciesFunction(MSX, f, LINK, RATE);
     fprintf(f, " }\n");
     
 // --- write tank rate functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetTankRates(double c[], double k[], double p[], double h[], double f[])\n { \n");
-    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
-    {
-        if ( MSX->Species[i].tankExprType == RATE )
-            fprintf(f, "     f[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].tankExpr, e,
-                MSXchem_getVariableStr));
-    }
+    writeSpeciesFunction(MSX, f, NODE, RATE);
     fprintf(f, " }\n");
 
 // --- write pipe equilibrium functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetPipeEquil(double c[], double k[], double p[], double h[], double f[])\n { \n");
-    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
-    {
-        if ( MSX->Species[i].pipeExprType == EQUIL )
-            fprintf(f, "     f[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].pipeExpr, e,
-                MSXchem_getVariableStr));
-    }
+    writeSpeciesFunction(MSX, f, LINK, EQUIL);
     fprintf(f, " }\n");
     
 // --- write tank equilibrium functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetTankEquil(double c[], double k[], double p[], double h[], double f[])\n { \n");
-    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
-    {
-        if ( MSX->Species[i].tankExprType == EQUIL )
-            fprintf(f, "     f[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].tankExpr, e,
-                MSXchem_getVariableStr));
-    }
+    writeSpeciesFunction(MSX, f, NODE, EQUIL);
     fprintf(f, " }\n");
 
 // --- write pipe formula functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetPipeFormulas(double c[], double k[],  double p[], double h[])\n { \n");
-    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
-    {
-        if ( MSX->Species[i].pipeExprType == FORMULA )
-            fprintf(f, "     c[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].pipeExpr, e,
-                MSXchem_getVariableStr));
-    }
+    writeSpeciesFunction(MSX, f, LINK, FORMULA);
     fprintf(f, " }\n");
     
 // --- write tank formula functions
 
     fprintf(f,
 "\n void DLLEXPORT MSXgetTankFormulas(double c[], double k[], double p[], double h[])\n { \n");
+    writeSpeciesFunction(MSX, f, NODE, FORMULA);
+    fprintf(f, " }\n");
+
+// --- write the Jacobians of the pipe & tank rates
+
+    writeJacobianFunction(MSX, f, LINK);
+    writeJacobianFunction(MSX, f, NODE);
+
+// --- write the batch versions of these functions
+
+    writeBatchFunction(MSX, f, LINK, RATE, "MSXgetPipeRatesBatch");
+    writeBatchFunction(MSX, f, NODE, RATE, "MSXgetTankRatesBatch");
+    writeBatchFunction(MSX, f, LINK, EQUIL, "MSXgetPipeEquilBatch");
+    writeBatchFunction(MSX, f, NODE, EQUIL, "MSXgetTankEquilBatch");
+    writeBatchFunction(MSX, f, LINK, FORMULA, "MSXgetPipeFormulasBatch");
+    writeBatchFunction(MSX, f, NODE, FORMULA, "MSXgetTankFormulasBatch");
+    fprintf(f, "\n");
+}
+
+//=============================================================================
+
+void  writeTermFunction(MSXproject MSX, FILE* f, int zone)
+/**
+**  Purpose:
+**    writes the function that evaluates intermediate terms of pipe
+**    or tank expressions to the chemistry function source code file
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**
+**  Returns:
+**    none.
+*/
+{
+    int i, v;
+    char e[1024];
+    char * (*getVariableStr) (MSXproject, int, char *);
+
+    getVariableStr = (zone == LINK) ? MSXchem_getPipeVariableStr
+                                    : MSXchem_getTankVariableStr;
+    fprintf(f, "\n double %s(int i, double c[], double k[], double p[], double h[])\n { \n",
+            (zone == LINK) ? "pipeTerm" : "tankTerm");
+    if ( MSX->Nobjects[TERM] > 0 )
+    {
+        fprintf(f, "     switch(i) { \n");
+        for (i=1; i<=MSX->Nobjects[TERM]; i++)
+        {
+            v = MSX->Nobjects[SPECIES] + i;
+            fprintf(f, "     case %d: { \n", i);
+            writeShared(MSX, f, zone, &v, 1);
+            fprintf(f, "     return %s; } \n",
+                    mathexpr_getStr(MSX, MSXchem_getExpr(MSX, zone, v), e, getVariableStr));
+        }
+        fprintf(f, "     } \n");
+    }
+    fprintf(f, "     return 0.0; \n }\n");
+}
+
+//=============================================================================
+
+void  writeSpeciesFunction(MSXproject MSX, FILE* f, int zone, int type)
+/**
+**  Purpose:
+**    writes the body of a function that evaluates the pipe or tank
+**    expressions of a given type to the chemistry function source
+**    code file
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**    type = RATE, EQUIL or FORMULA
+**
+**  Returns:
+**    none.
+**
+**  Note: rates & equilibria are assigned to f[], formulas to c[].
+*/
+{
+    int i, n, t;
+    int *var;
+    char e[1024];
+    char * (*getVariableStr) (MSXproject, int, char *);
+
+    getVariableStr = (zone == LINK) ? MSXchem_getPipeVariableStr
+                                    : MSXchem_getTankVariableStr;
+    var = (int *)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(int));
+    if ( var == NULL ) return;
+
+// --- find the species whose expressions are of the given type
+
+    n = 0;
     for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
     {
-        if ( MSX->Species[i].tankExprType == FORMULA )
-            fprintf(f, "     c[%d] = %s; \n", i, mathexpr_getStr(MSX->Species[i].tankExpr, e,
-                MSXchem_getVariableStr));
+        t = (zone == LINK) ? MSX->Species[i].pipeExprType
+                           : MSX->Species[i].tankExprType;
+        if ( t == type ) var[n++] = i;
+    }
+
+// --- write the sub-expressions they share followed by the expressions
+
+    writeShared(MSX, f, zone, var, n);
+    for (i=0; i<n; i++)
+    {
+        fprintf(f, "     %s[%d] = %s; \n", (type == FORMULA) ? "c" : "f", var[i],
+                mathexpr_getStr(MSX, MSXchem_getExpr(MSX, zone, var[i]), e, getVariableStr));
+    }
+    free(var);
+}
+
+//=============================================================================
+
+void  writeShared(MSXproject MSX, FILE* f, int zone, int var[], int n)
+/**
+**  Purpose:
+**    writes the shared sub-expressions used by a set of expressions
+**    as local variables of the function that evaluates them
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**    var = indexes of the variables whose expressions are evaluated
+**    n = number of variables
+**
+**  Returns:
+**    none.
+*/
+{
+    int i, j, first, last;
+    char e[1024];
+    char s[32];
+    char *used;
+    MathExpr *expr;
+    char * (*getVariableStr) (MSXproject, int, char *);
+
+    MSXchem_getSharedRange(MSX, zone, &first, &last);
+    if ( last < first ) return;
+    used = (char *)calloc(last - first + 1, sizeof(char));
+    if ( used == NULL ) return;
+    getVariableStr = (zone == LINK) ? MSXchem_getPipeVariableStr
+                                    : MSXchem_getTankVariableStr;
+
+// --- mark the shared sub-expressions used directly by the expressions
+
+    for (i=0; i<n; i++)
+    {
+        expr = MSXchem_getExpr(MSX, zone, var[i]);
+        for (j=first; j<=last; j++)
+        {
+            if ( mathexpr_usesVariable(expr, j) ) used[j-first] = 1;
+        }
+    }
+
+// --- and those used by other shared sub-expressions (which only
+//     refer to those before them)
+
+    for (j=last; j>=first; j--)
+    {
+        if ( !used[j-first] ) continue;
+        expr = MSXchem_getExpr(MSX, zone, j);
+        for (i=first; i<j; i++)
+        {
+            if ( mathexpr_usesVariable(expr, i) ) used[i-first] = 1;
+        }
+    }
+
+// --- write them in order as local variables
+
+    for (j=first; j<=last; j++)
+    {
+        if ( !used[j-first] ) continue;
+        fprintf(f, "     double %s = %s; \n", getVariableStr(MSX, j, s),
+                mathexpr_getStr(MSX, MSXchem_getExpr(MSX, zone, j), e, getVariableStr));
+    }
+    free(used);
+}
+
+//=============================================================================
+
+void  writeJacobianFunction(MSXproject MSX, FILE* f, int zone)
+/**
+**  Purpose:
+**    writes the function that evaluates the analytic Jacobian of the
+**    pipe or tank rates to the chemistry function source code file
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**
+**  Returns:
+**    none.
+**
+**  Note: the partial derivative of row i and column j of the Jacobian
+**        built by msxchem.c is assigned to f[i*(nn+1)+j], where nn is
+**        the number of rate species plus any equilibrium species that
+**        are coupled to them (the chain rule through the equilibrium
+**        system is applied by msxchem.c). The function does nothing
+**        if there is no analytic Jacobian, and is not written at all
+**        if a derivative is too long to be written (msxchem.c then
+**        evaluates the Jacobian itself).
+*/
+{
+    int i, j, nn;
+    MathExpr *expr;
+    char e[1024];
+    char * (*getVariableStr) (MSXproject, int, char *);
+
+    getVariableStr = (zone == LINK) ? MSXchem_getPipeVariableStr
+                                    : MSXchem_getTankVariableStr;
+    nn = MSXchem_getJacobianSize(MSX, zone);
+    for (i=1; i<=nn; i++)
+    {
+        for (j=1; j<=nn; j++)
+        {
+            expr = MSXchem_getJacobianExpr(MSX, zone, i, j);
+            if ( !mathexpr_fitsStr(expr, MAX_VARIABLE_STR) ) return;
+        }
+    }
+    fprintf(f,
+"\n void DLLEXPORT %s(double c[], double k[], double p[], double h[], double f[])\n { \n",
+            (zone == LINK) ? "MSXgetPipeJacobian" : "MSXgetTankJacobian");
+    for (i=1; i<=nn; i++)
+    {
+        for (j=1; j<=nn; j++)
+        {
+            expr = MSXchem_getJacobianExpr(MSX, zone, i, j);
+            if ( expr == NULL ) fprintf(f, "     f[%d] = 0.0; \n", i*(nn+1)+j);
+            else fprintf(f, "     f[%d] = %s; \n", i*(nn+1)+j,
+                         mathexpr_getStr(MSX, expr, e, getVariableStr));
+        }
     }
     fprintf(f, " }\n");
-    fprintf(f, "\n");
+}
+
+//=============================================================================
+
+void  writeBatchFunction(MSXproject MSX, FILE* f, int zone, int type,
+                         char *name)
+/**
+**  Purpose:
+**    writes a function that evaluates the pipe or tank expressions of
+**    a given type for a batch of segments to the chemistry function
+**    source code file
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**    type = RATE, EQUIL or FORMULA
+**    name = name of the function
+**
+**  Returns:
+**    none.
+**
+**  Note: as in writeSpeciesFunction, rates & equilibria are assigned
+**        to f[] and formulas to c[]. Since a formula may use species
+**        assigned by the formulas before it, each formula gets the
+**        terms it uses evaluated just before it.
+*/
+{
+    int i, n, t;
+    int *var;
+    char e[1024];
+
+    var = (int *)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(int));
+    if ( var == NULL ) return;
+
+// --- find the species whose expressions are of the given type
+
+    n = 0;
+    for (i=1; i<=MSX->Nobjects[SPECIES]; i++)
+    {
+        t = (zone == LINK) ? MSX->Species[i].pipeExprType
+                           : MSX->Species[i].tankExprType;
+        if ( t == type ) var[n++] = i;
+    }
+
+// --- write the function's heading and segment loop
+
+    if ( type == FORMULA ) fprintf(f,
+"\n void DLLEXPORT %s(int n, int stride, double c[], double k[], double p[], double h[])\n { \n",
+        name);
+    else fprintf(f,
+"\n void DLLEXPORT %s(int n, int stride, double c[], double k[], double p[], double h[], double f[])\n { \n",
+        name);
+    fprintf(f, "     int l; \n");
+    if ( n > 0 )
+    {
+        fprintf(f, " #pragma omp simd \n");
+        fprintf(f, "     for (l=0; l<n; l++) { \n");
+
+// --- write the local variables and the expressions
+
+        if ( type != FORMULA ) writeBatchLocals(MSX, f, zone, var, n);
+        for (i=0; i<n; i++)
+        {
+            if ( type == FORMULA )
+            {
+                fprintf(f, "     { \n");
+                writeBatchLocals(MSX, f, zone, &var[i], 1);
+            }
+            fprintf(f, "     %s[%d*stride+l] = %s; \n",
+                    (type == FORMULA) ? "c" : "f", var[i],
+                    mathexpr_getStr(MSX, MSXchem_getExpr(MSX, zone, var[i]), e,
+                                    MSXchem_getBatchVariableStr));
+            if ( type == FORMULA ) fprintf(f, "     } \n");
+        }
+        fprintf(f, "     } \n");
+    }
+    fprintf(f, " }\n");
+    free(var);
+}
+
+//=============================================================================
+
+void  writeBatchLocals(MSXproject MSX, FILE* f, int zone, int var[], int n)
+/**
+**  Purpose:
+**    writes the intermediate terms and shared sub-expressions used by
+**    a set of expressions as local variables of a batch function's loop
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    f = pointer to the source code file
+**    zone = LINK for pipe or NODE for tank expressions
+**    var = indexes of the variables whose expressions are evaluated
+**    n = number of variables
+**
+**  Returns:
+**    none.
+**
+**  Note: the locals are written so that each comes after the ones
+**        its expression uses.
+*/
+{
+    int i, count, first, last;
+    int *order;
+    char *used;
+    char e[1024];
+    char s[32];
+
+    MSXchem_getSharedRange(MSX, zone, &first, &last);
+    if ( last < first ) last = first - 1;
+    used = (char *)calloc(last + 1, sizeof(char));
+    order = (int *)calloc(last + 1, sizeof(int));
+    if ( used != NULL && order != NULL )
+    {
+        count = 0;
+        for (i=0; i<n; i++)
+        {
+            markBatchLocal(MSX, zone, var[i], used, order, &count);
+        }
+        for (i=0; i<count; i++)
+        {
+            fprintf(f, "     double %s = %s; \n",
+                    MSXchem_getBatchVariableStr(MSX, order[i], s),
+                    mathexpr_getStr(MSX, MSXchem_getExpr(MSX, zone, order[i]), e,
+                                    MSXchem_getBatchVariableStr));
+        }
+    }
+    free(used);
+    free(order);
+}
+
+//=============================================================================
+
+void  markBatchLocal(MSXproject MSX, int zone, int v, char *used,
+                     int *order, int *count)
+/**
+**  Purpose:
+**    adds the intermediate terms and shared sub-expressions used by a
+**    variable's expression to the list of local variables of a batch
+**    function's loop
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**    zone = LINK for pipe or NODE for tank expressions
+**    v = index of the variable
+**    used = flags of the variables already in the list
+**    order = list of local variables
+**    count = number of variables in the list
+**
+**  Returns:
+**    none.
+*/
+{
+    int i, first, last, firstTerm, lastTerm;
+    MathExpr *expr = MSXchem_getExpr(MSX, zone, v);
+
+    if ( expr == NULL ) return;
+    MSXchem_getSharedRange(MSX, zone, &first, &last);
+    firstTerm = MSX->Nobjects[SPECIES] + 1;
+    lastTerm = MSX->Nobjects[SPECIES] + MSX->Nobjects[TERM];
+
+// --- add the locals this expression uses before the variable itself
+
+    for (i=firstTerm; i<=last; i++)
+    {
+        if ( i > lastTerm && i < first ) continue;
+        if ( used[i] || !mathexpr_usesVariable(expr, i) ) continue;
+        used[i] = 1;
+        markBatchLocal(MSX, zone, i, used, order, count);
+        order[(*count)++] = i;
+    }
 }
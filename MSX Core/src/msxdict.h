@@ -22,15 +22,19 @@ static char *MsxSectWords[] = {"[TITLE", "[SPECIE",  "[COEFF",  "[TERM",
                                "[REPORT", NULL};
 static char *ReportWords[]  = {"NODE", "LINK", "SPECIE", "FILE", "PAGESIZE", NULL};
 static char *OptionTypeWords[] = {"AREA_UNITS", "RATE_UNITS", "SOLVER", "COUPLING",
-                                  "TIMESTEP", "RTOL", "ATOL", "COMPILER", NULL};  //1.1.00
+                                  "TIMESTEP", "RTOL", "ATOL", "COMPILER",         //1.1.00
+                                  "JACOBIAN", "SPLITTING", "STEPPING", NULL};
 static char *CompilerWords[]   = {"NONE", "VC", "GC", NULL};                      //1.1.00
 static char *SourceTypeWords[] = {"CONC", "MASS", "SETPOINT", "FLOW", NULL};      //(FS-01/10/2008 To fix bug 11)
 static char *MixingTypeWords[] = {"MIXED", "2COMP", "FIFO", "LIFO", NULL};
 static char *MassUnitsWords[]  = {"MG", "UG", "MOLE", "MMOL", NULL};
 static char *AreaUnitsWords[]  = {"FT2", "M2", "CM2", NULL};
 static char *TimeUnitsWords[]  = {"SEC", "MIN", "HR", "DAY", NULL};
-static char *SolverTypeWords[] = {"EUL", "RK5", "ROS2", NULL};
+static char *SolverTypeWords[] = {"EUL", "RK5", "ROS2", "BDF", NULL};
 static char *CouplingWords[]   = {"NONE", "FULL", NULL};
+static char *JacobianWords[]   = {"UPDATE", "REUSE", NULL};
+static char *SplittingWords[]  = {"LIE", "STRANG", NULL};
+static char *SteppingWords[]   = {"FIXED", "ADAPTIVE", NULL};
 static char *ExprTypeWords[]   = {"", "RATE", "FORMULA", "EQUIL", NULL};
 static char *HydVarWords[]     = {"", "D", "Q", "U", "Re",
                                   "Us", "Ff", "Av", "Kc", NULL};	/*Feng Shang 01/29/2008*/
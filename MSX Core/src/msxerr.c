@@ -20,8 +20,6 @@
 
 //  Local variables
 //-----------------
-static int   mathError;                // math error flag
-static char  mathErrorMsg[1024];       // math error message
 static char* elementTxt[] =            // see ObjectType in msxtypes.h
     {"", "pipe", "tank"};
 static char* exprTypeTxt[] =           // see ExpressionType in msxtypes.h
@@ -30,36 +28,45 @@ static char* exprTypeTxt[] =           // see ExpressionType in msxtypes.h
 
 //=============================================================================
 
-void MSXerr_clearMathError()
+void MSXerr_clearMathError(MSXproject MSX)
 /**
 **  Purpose:
 **    clears the math error flag.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
 */
 {
-	mathError = 0;
-	strcpy(mathErrorMsg, "");
+	MSX->MathError = 0;
+	strcpy(MSX->MathErrorMsg, "");
 }
 
 //=============================================================================
 
-int  MSXerr_mathError()
+int  MSXerr_mathError(MSXproject MSX)
 /**
 **  Purpose:
 **    returns the current state of the math error flag.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
 */
 {
-    return mathError;
+    return MSX->MathError;
 }
 
 //=============================================================================
 
-void MSXerr_writeMathErrorMsg()
+void MSXerr_writeMathErrorMsg(MSXproject MSX)
 /**
 **  Purpose:
 **    writes math error message to the screen.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
 */
 {
-	printf("%s\n", mathErrorMsg);
+	printf("%s\n", MSX->MathErrorMsg);
 }
 
 //=============================================================================
@@ -82,26 +89,33 @@ double  MSXerr_validate(MSXproject MSX, double x, int index, int element, int ex
 	// return x if it's a valid number
 	if (x == x) return x;
 
-	// return 0 if the math error flag has previously been set
-	// (we only want the first math error identified since others
-	//  may have propagated from it)
-	if (mathError) return 0.0;
-
-	// construct a math error message
-	if ( exprType == TERM )
+	// only one thread reacting pipes and tanks may write the message
+#ifdef _OPENMP
+#pragma omp critical (msx_math_error)
+#endif
 	{
-		sprintf(mathErrorMsg,
-		"Ilegal math operation occurred for term:\n  %s",
-		MSX->Term[index].id);
+		// skip the message if the math error flag has previously been set
+		// (we only want the first math error identified since others
+		//  may have propagated from it)
+		if (!MSX->MathError)
+		{
+			// construct a math error message
+			if ( exprType == TERM )
+			{
+				sprintf(MSX->MathErrorMsg,
+				"Ilegal math operation occurred for term:\n  %s",
+				MSX->Term[index].id);
+			}
+			else
+			{
+				sprintf(MSX->MathErrorMsg,
+				"Ilegal math operation occurred in %s %s expression for specie:\n  %s",
+				elementTxt[element], exprTypeTxt[exprType], MSX->Species[index].id);
+			}
+
+			// set the math error flag
+			MSX->MathError = 1;
+		}
 	}
-	else
-	{
-		sprintf(mathErrorMsg,
-		"Ilegal math operation occurred in %s %s expression for specie:\n  %s",
-		elementTxt[element], exprTypeTxt[exprType], MSX->Species[index].id);
-	}
-
-	// set the math error flag and return 0
-	mathError = 1;
 	return 0.0;
 }
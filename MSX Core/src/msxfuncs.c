@@ -26,22 +26,25 @@
 
 #ifdef WINDOWS
 #include <windows.h>
-HMODULE hDLL;
+#include <io.h>
 #else
   #include <dlfcn.h>
-  void *hDLL; 
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
 #endif
 
 #include "msxfuncs.h"
 
 //=============================================================================
 
-int MSXfuncs_load(char * libName)
+int MSXfuncs_load(MSXchemFuncs *funcs, char * libName)
 /**
 **  Purpose:
 **    loads compiled chemistry functions from a named library
 **
 **  Input:
+**    funcs = table that receives the loaded functions
 **    libName = path to shared library
 **
 **  Returns:
@@ -50,34 +53,51 @@ int MSXfuncs_load(char * libName)
 {
 
 #ifdef WINDOWS
-	hDLL = LoadLibraryA(libName);
+    HMODULE hDLL = LoadLibraryA(libName);
 	if (hDLL == NULL) return 1;
+    funcs->hLib = (void *)hDLL;
 
-	MSXgetPipeRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetPipeRates");
-    MSXgetTankRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetTankRates");
-    MSXgetPipeEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetPipeEquil");
-    MSXgetTankEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetTankEquil");
-    MSXgetPipeFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetPipeFormulas");
-    MSXgetTankFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetTankFormulas");
+	funcs->getPipeRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetPipeRates");
+    funcs->getTankRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetTankRates");
+    funcs->getPipeEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetPipeEquil");
+    funcs->getTankEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetTankEquil");
+    funcs->getPipeFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetPipeFormulas");
+    funcs->getTankFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetTankFormulas");
+    funcs->getPipeJacobian = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetPipeJacobian");
+    funcs->getTankJacobian = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetTankJacobian");
+    funcs->getPipeRatesBatch    = (MSXGETRATESBATCH)    GetProcAddress(hDLL, "MSXgetPipeRatesBatch");
+    funcs->getTankRatesBatch    = (MSXGETRATESBATCH)    GetProcAddress(hDLL, "MSXgetTankRatesBatch");
+    funcs->getPipeEquilBatch    = (MSXGETRATESBATCH)    GetProcAddress(hDLL, "MSXgetPipeEquilBatch");
+    funcs->getTankEquilBatch    = (MSXGETRATESBATCH)    GetProcAddress(hDLL, "MSXgetTankEquilBatch");
+    funcs->getPipeFormulasBatch = (MSXGETFORMULASBATCH) GetProcAddress(hDLL, "MSXgetPipeFormulasBatch");
+    funcs->getTankFormulasBatch = (MSXGETFORMULASBATCH) GetProcAddress(hDLL, "MSXgetTankFormulasBatch");
 
 #else
-    hDLL = dlopen(libName, RTLD_LAZY);
+    void *hDLL = dlopen(libName, RTLD_LAZY);
     if (hDLL == NULL) return 1;
+    funcs->hLib = hDLL;
 	
-    MSXgetPipeRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetPipeRates");
-    MSXgetTankRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetTankRates");
-    MSXgetPipeEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetPipeEquil");
-    MSXgetTankEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetTankEquil");
-    MSXgetPipeFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetPipeFormulas");
-    MSXgetTankFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetTankFormulas");
+    funcs->getPipeRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetPipeRates");
+    funcs->getTankRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetTankRates");
+    funcs->getPipeEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetPipeEquil");
+    funcs->getTankEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetTankEquil");
+    funcs->getPipeFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetPipeFormulas");
+    funcs->getTankFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetTankFormulas");
+    funcs->getPipeJacobian = (MSXGETRATES)    dlsym(hDLL, "MSXgetPipeJacobian");
+    funcs->getTankJacobian = (MSXGETRATES)    dlsym(hDLL, "MSXgetTankJacobian");
+    funcs->getPipeRatesBatch    = (MSXGETRATESBATCH)    dlsym(hDLL, "MSXgetPipeRatesBatch");
+    funcs->getTankRatesBatch    = (MSXGETRATESBATCH)    dlsym(hDLL, "MSXgetTankRatesBatch");
+    funcs->getPipeEquilBatch    = (MSXGETRATESBATCH)    dlsym(hDLL, "MSXgetPipeEquilBatch");
+    funcs->getTankEquilBatch    = (MSXGETRATESBATCH)    dlsym(hDLL, "MSXgetTankEquilBatch");
+    funcs->getPipeFormulasBatch = (MSXGETFORMULASBATCH) dlsym(hDLL, "MSXgetPipeFormulasBatch");
+    funcs->getTankFormulasBatch = (MSXGETFORMULASBATCH) dlsym(hDLL, "MSXgetTankFormulasBatch");
 #endif
 
-    if (NULL == MSXgetPipeRates || NULL == MSXgetTankRates ||
-        NULL == MSXgetPipeEquil || NULL == MSXgetTankEquil ||
-        NULL == MSXgetPipeFormulas || NULL == MSXgetTankFormulas)
+    if (NULL == funcs->getPipeRates || NULL == funcs->getTankRates ||
+        NULL == funcs->getPipeEquil || NULL == funcs->getTankEquil ||
+        NULL == funcs->getPipeFormulas || NULL == funcs->getTankFormulas)
     {
-        MSXfuncs_free();
-        hDLL = NULL;
+        MSXfuncs_free(funcs);
         return 2;
     }
     return 0;
@@ -85,23 +105,24 @@ int MSXfuncs_load(char * libName)
 
 //=============================================================================
 
-void MSXfuncs_free()
+void MSXfuncs_free(MSXchemFuncs *funcs)
 /**
 **  Purpose:
 **    frees the handle to the shared function library
 **
 **  Input:
-**    none
+**    funcs = table of loaded functions
 **
 **  Returns:
 **    none
 */
 {
 #ifdef WINDOWS
-    if (hDLL) FreeLibrary(hDLL);
+    if (funcs->hLib) FreeLibrary((HMODULE)funcs->hLib);
 #else
-    if (hDLL) dlclose(hDLL);
+    if (funcs->hLib) dlclose(funcs->hLib);
 #endif
+    funcs->hLib = NULL;
 }
 
 //=============================================================================
@@ -164,3 +185,117 @@ int MSXfuncs_run(char* cmdLine)
 #endif
 }
 
+
+//=============================================================================
+
+char* MSXfuncs_mapFile(FILE *f, size_t *size, void **handle)
+/**
+**  Purpose:
+**    maps the entire contents of an open file into memory
+**
+**  Input:
+**    f = pointer to an open file
+**
+**  Output:
+**    size = size of the mapped view (bytes)
+**    handle = file mapping handle needed to unmap the view
+**
+**  Returns:
+**    a pointer to the start of the mapped view (or NULL if the
+**    file could not be mapped)
+**
+**  Note:
+**    the view is copy-on-write, so writing to it never changes the file.
+*/
+{
+#ifdef WINDOWS
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(f));
+    HANDLE hMap;
+    LARGE_INTEGER n;
+    char *view;
+
+    *handle = NULL;
+    if (hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hFile, &n)) return NULL;
+    if (n.QuadPart <= 0 || (unsigned long long)n.QuadPart > (size_t)-1) return NULL;
+    hMap = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (hMap == NULL) return NULL;
+    view = (char *)MapViewOfFile(hMap, FILE_MAP_COPY, 0, 0, 0);
+    if (view == NULL)
+    {
+        CloseHandle(hMap);
+        return NULL;
+    }
+    *size = (size_t)n.QuadPart;
+    *handle = (void *)hMap;
+    return view;
+
+#else
+    struct stat st;
+    void *view;
+
+    *handle = NULL;
+    if (fstat(fileno(f), &st) != 0) return NULL;
+    if (st.st_size <= 0 || (unsigned long long)st.st_size > (size_t)-1) return NULL;
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fileno(f), 0);
+    if (view == MAP_FAILED) return NULL;
+    posix_madvise(view, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    *size = (size_t)st.st_size;
+    return (char *)view;
+#endif
+}
+
+//=============================================================================
+
+void MSXfuncs_unmapFile(char *view, size_t size, void *handle)
+/**
+**  Purpose:
+**    releases a view created by MSXfuncs_mapFile
+**
+**  Input:
+**    view = start of the mapped view
+**    size = size of the mapped view (bytes)
+**    handle = file mapping handle
+**
+**  Returns:
+**    none
+*/
+{
+    if (view == NULL) return;
+#ifdef WINDOWS
+    UnmapViewOfFile(view);
+    if (handle) CloseHandle((HANDLE)handle);
+#else
+    (void)handle;
+    munmap(view, size);
+#endif
+}
+
+//=============================================================================
+
+void MSXfuncs_prefetch(char *p, size_t len)
+/**
+**  Purpose:
+**    asks the operating system to start reading a range of a mapped
+**    view in the background
+**
+**  Input:
+**    p = start of the range
+**    len = length of the range (bytes)
+**
+**  Returns:
+**    none
+*/
+{
+#ifdef WINDOWS
+    // --- sequential read-ahead of the mapped view is left to the OS
+    (void)p;
+    (void)len;
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t skip = (size_t)p % page;
+
+    if (len == 0) return;
+    posix_madvise(p - skip, len + skip, POSIX_MADV_WILLNEED);
+#endif
+}
@@ -12,24 +12,49 @@
 #ifndef MSXFUNCS_H
 #define MSXFUNCS_H
 
+#include <stdio.h>
+
 // Define pointers for each group of chemistry functions
 typedef void (*MSXGETRATES)(double *, double *, double * , double *, double *);
 typedef void (*MSXGETEQUIL)(double *, double *, double * , double *, double *);
 typedef void (*MSXGETFORMULAS)(double *, double *, double *, double *);
 
-// Declare each chemistry function
-MSXGETRATES    MSXgetPipeRates;
-MSXGETRATES    MSXgetTankRates;
-MSXGETEQUIL    MSXgetPipeEquil;
-MSXGETEQUIL    MSXgetTankEquil;
-MSXGETFORMULAS MSXgetPipeFormulas;
-MSXGETFORMULAS MSXgetTankFormulas;
+// Pointers to the batch versions of the rate & equilibrium functions
+// (which evaluate n segments whose values are stride elements apart)
+// and of the formula functions
+typedef void (*MSXGETRATESBATCH)(int, int, double *, double *, double *, double *, double *);
+typedef void (*MSXGETFORMULASBATCH)(int, int, double *, double *, double *, double *);
+
+// Each chemistry function loaded from a library
+typedef struct
+{
+    void*          hLib;               // handle of the shared library
+    MSXGETRATES    getPipeRates;
+    MSXGETRATES    getTankRates;
+    MSXGETEQUIL    getPipeEquil;
+    MSXGETEQUIL    getTankEquil;
+    MSXGETFORMULAS getPipeFormulas;
+    MSXGETFORMULAS getTankFormulas;
+    MSXGETRATES    getPipeJacobian;    // the functions that follow are
+    MSXGETRATES    getTankJacobian;    // optional (NULL if not in the library)
+    MSXGETRATESBATCH    getPipeRatesBatch;
+    MSXGETRATESBATCH    getTankRatesBatch;
+    MSXGETRATESBATCH    getPipeEquilBatch;
+    MSXGETRATESBATCH    getTankEquilBatch;
+    MSXGETFORMULASBATCH getPipeFormulasBatch;
+    MSXGETFORMULASBATCH getTankFormulasBatch;
+} MSXchemFuncs;
 
 // Functions that load and free the chemistry functions
-int  MSXfuncs_load(char *);
-void MSXfuncs_free(void);
+int  MSXfuncs_load(MSXchemFuncs *, char *);
+void MSXfuncs_free(MSXchemFuncs *);
 
 // Function that executes a command line program
 int MSXfuncs_run(char * );
 
+// Functions that map an open file into memory
+char* MSXfuncs_mapFile(FILE *, size_t *, void **);
+void  MSXfuncs_unmapFile(char *, size_t, void *);
+void  MSXfuncs_prefetch(char *, size_t);
+
 #endif
@@ -22,19 +22,15 @@
 #include "msxdict.h"
 #include "msxutils.h"
 
-//  Local variables
-//-----------------
-alloc_handle_t  *HashPool;           // Memory pool for hash tables
-HTtable  *Htable[MAX_OBJECTS];       // Hash tables for object ID names
-
 //=============================================================================
 
-int addObject(int type, char *id, int n)
+int addObject(MSXproject MSX, int type, char *id, int n)
 /**
 **  Purpose:
 **    adds an object ID to the project's hash tables.
 **
 **  Input:
+**    MSX = the underlying MSXproject data struct.
 **    type = object type
 **    id   = object ID string
 **    n    = object index.
@@ -49,30 +45,31 @@ int addObject(int type, char *id, int n)
 
 // --- do nothing if object already exists in a hash table
 
-    if ( findObject(type, id) > 0 ) return 0;
+    if ( findObject(MSX, type, id) > 0 ) return 0;
 
 // --- use memory from the hash tables' common memory pool to store
 //     a copy of the object's ID string
 
     len = (int) strlen(id) + 1;
-    newID = (char *) Alloc(len*sizeof(char));
+    newID = (char *) Alloc(MSX->HashPool, len*sizeof(char));
     strcpy(newID, id);
 
 // --- insert object's ID into the hash table for that type of object
 
-    result = (int) HTinsert(Htable[type], newID, n);
+    result = (int) HTinsert(MSX->Htable[type], newID, n);
     if ( result == 0 ) result = -1;
     return result;
 }
 
 //=============================================================================
 
-int findObject(int type, char *id)
+int findObject(MSXproject MSX, int type, char *id)
 /**
 **  Purpose:
 **    uses hash table to find index of an object with a given ID.
 **
 **  Input:
+**    MSX = the underlying MSXproject data struct.
 **    type = object type
 **    id   = object ID.
 **
@@ -80,17 +77,18 @@ int findObject(int type, char *id)
 **    index of object with given ID, or -1 if ID not found.
 */
 {
-    return HTfind(Htable[type], id);
+    return HTfind(MSX->Htable[type], id);
 }
 
 //=============================================================================
 
-char * findID(int type, char *id)
+char * findID(MSXproject MSX, int type, char *id)
 /**
 **  Purpose:
 **    uses hash table to find address of given string entry.
 **
 **  Input:
+**    MSX = the underlying MSXproject data struct.
 **    type = object type
 **    id   = ID name being sought.
 **
@@ -98,18 +96,18 @@ char * findID(int type, char *id)
 **    pointer to location where object's ID string is stored.
 */
 {
-    return HTfindKey(Htable[type], id);
+    return HTfindKey(MSX->Htable[type], id);
 }
 
 //=============================================================================
 
-int createHashTables()
+int createHashTables(MSXproject MSX)
 /**
 **  Purpose:
 **    allocates memory for object ID hash tables.
 **
 **  Input:
-**    none.
+**    MSX = the underlying MSXproject data struct.
 **
 **  Returns:
 **    an error code (0 if no error).
@@ -120,26 +118,26 @@ int createHashTables()
 
     for (j = 0; j < MAX_OBJECTS ; j++)
     {
-         Htable[j] = HTcreate();
-         if ( Htable[j] == NULL ) return ERR_MEMORY;
+         MSX->Htable[j] = HTcreate();
+         if ( MSX->Htable[j] == NULL ) return ERR_MEMORY;
     }
 
 // --- initialize the memory pool used to store object ID's
 
-    HashPool = AllocInit();
-    if ( HashPool == NULL ) return ERR_MEMORY;
+    MSX->HashPool = AllocInit();
+    if ( MSX->HashPool == NULL ) return ERR_MEMORY;
     return 0;
 }
 
 //=============================================================================
 
-void deleteHashTables()
+void deleteHashTables(MSXproject MSX)
 /**
 **  Purpose:
 **    frees memory allocated for object ID hash tables.
 **
 **  Input:
-**    none.
+**    MSX = the underlying MSXproject data struct.
 */
 {
     int j;
@@ -148,15 +146,16 @@ void deleteHashTables()
 
     for (j = 0; j < MAX_OBJECTS; j++)
     {
-        if ( Htable[j] != NULL ) HTfree(Htable[j]);
+        if ( MSX->Htable[j] != NULL ) HTfree(MSX->Htable[j]);
+        MSX->Htable[j] = NULL;
     }
 
 // --- free the object ID memory pool
 
-    if ( HashPool )
+    if ( MSX->HashPool )
     {
-        AllocSetPool(HashPool);
-        AllocFreePool();
+        AllocFreePool(MSX->HashPool);
+        MSX->HashPool = NULL;
     }
 }
 
@@ -178,9 +177,7 @@ int setDefaults(MSXproject MSX)
     MSX->HydFile.mode = USED_FILE;
     MSX->OutFile.file = NULL;
     MSX->OutFile.mode = SCRATCH_FILE;
-    MSX->TmpOutFile.file = NULL;
     MSXutils_getTempName(MSX->OutFile.name);                                    //1.1.00
-    MSXutils_getTempName(MSX->TmpOutFile.name);                                 //1.1.00
     strcpy(MSX->RptFile.name, "");
     strcpy(MSX->Title, "");
     MSX->Rptflag = 0;
@@ -193,6 +190,9 @@ int setDefaults(MSXproject MSX)
     MSX->DefAtol = 0.01;
     MSX->Solver = EUL;
     MSX->Coupling = NO_COUPLING;
+    MSX->Jacobian = UPDATE_JACOBIAN;
+    MSX->Splitting = LIE_SPLITTING;
+    MSX->Stepping = FIXED_STEPPING;
     MSX->Compiler = NO_COMPILER;                                                //1.1.00
     MSX->AreaUnits = FT2;
     MSX->RateUnits = DAYS;
@@ -240,13 +240,13 @@ int getVariableCode(MSXproject MSX, char *id)
 **    and proceeding through each Species, Term, Parameter and Constant.
 */
 {
-    int j = findObject(SPECIES, id);
+    int j = findObject(MSX, SPECIES, id);
     if ( j >= 1 ) return j;
-    j = findObject(TERM, id);
+    j = findObject(MSX, TERM, id);
     if ( j >= 1 ) return MSX->Nobjects[SPECIES] + j;
-    j = findObject(PARAMETER, id);
+    j = findObject(MSX, PARAMETER, id);
     if ( j >= 1 ) return MSX->Nobjects[SPECIES] + MSX->Nobjects[TERM] + j;
-    j = findObject(CONSTANT, id);
+    j = findObject(MSX, CONSTANT, id);
     if ( j >= 1 ) return MSX->Nobjects[SPECIES] + MSX->Nobjects[TERM] + 
                          MSX->Nobjects[PARAMETER] + j;
     j = MSXutils_findmatch(id, HydVarWords);
@@ -700,7 +700,7 @@ int finishInit(MSXproject MSX)
         s = NULL;
         for (int j=0; j<n; j++)
         {                                                                          //1.1.00
-            k = findObject(TERM, Tokens[j]);                                  //1.1.00
+            k = findObject(MSX, TERM, Tokens[j]);                                  //1.1.00
             if ( k > 0 ) TermArray[i][k] = 1.0;                                    //1.1.00
         }
         free(f);
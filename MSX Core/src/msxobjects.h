@@ -15,11 +15,11 @@
 // Opaque Project pointer
 typedef struct Project *MSXproject;
 
-int addObject(int type, char *id, int n);
-int findObject(int type, char *id);
-char * findID(int type, char *id);
-int createHashTables();
-void deleteHashTables();
+int addObject(MSXproject MSX, int type, char *id, int n);
+int findObject(MSXproject MSX, int type, char *id);
+char * findID(MSXproject MSX, int type, char *id);
+int createHashTables(MSXproject MSX);
+void deleteHashTables(MSXproject MSX);
 int setDefaults(MSXproject MSX);
 int getVariableCode(MSXproject MSX, char *id);
 int  buildadjlists(MSXproject MSX);
@@ -20,6 +20,10 @@
 #include "msxtypes.h"
 #include "msxutils.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // Macros to identify upstream & downstream nodes of a link
 // under the current flow and to compute link volume
 //
@@ -29,12 +33,33 @@
 
 // Stagnant flow tolerance
 const double Q_STAGNANT = 0.005 / GPMperCFS;     // 0.005 gpm = 1.114e-5 cfs
+
+// Least routing work (in junctions) of a topological level worth routing
+// in parallel, and the work of routing a tank or reservoir (which also
+// mixes it and finds its equilibrium) compared to a junction
+#define   MIN_LEVEL_WORK  64
+#define   TANK_NODE_WORK  8
+
+// Largest fraction of a species' peak concentration by which reactions may
+// change a pipe or tank segment over an adaptive quality step (an estimate
+// of its local splitting error)
+#define   MAX_REACT_CHANGE 0.01
+
+// Largest Courant number (step over travel time) of a pipe with flow over an
+// adaptive quality step (node quality mixes a step's outflow, so its error
+// grows with the fraction of a pipe that flows out in one step)
+#define   MAX_COURANT      0.01
+
+// Number of segment slots first given to a pipe or tank (a power of 2)
+#define   MIN_SEG_SLOTS   4
+
 //  Imported functions
 //--------------------
 int    MSXchem_open(MSXproject MSX);
 void   MSXchem_close(MSXproject MSX);
-int    MSXchem_react(MSXproject MSX, long dt);
+int    MSXchem_react(MSXproject MSX, double dt);
 int    MSXchem_equil(MSXproject MSX, int zone, double *c);
+double MSXchem_getReactionRate(MSXproject MSX);
 
 extern void   MSXtank_mix1(MSXproject MSX, int i, double vin, double *massin, double vnet);
 extern void   MSXtank_mix2(MSXproject MSX, int i, double vin, double *massin, double vnet);
@@ -42,9 +67,9 @@ extern void   MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, do
 extern void   MSXtank_mix4(MSXproject MSX, int i, double vIn, double *massin, double vnet);
 
 
-void   MSXerr_clearMathError(void);                                            //1.1.00
-int    MSXerr_mathError(void);                                                 //1.1.00
-char*  MSXerr_writeMathErrorMsg(void);                                         //1.1.00
+void   MSXerr_clearMathError(MSXproject MSX);                                  //1.1.00
+int    MSXerr_mathError(MSXproject MSX);                                       //1.1.00
+void   MSXerr_writeMathErrorMsg(MSXproject MSX);                               //1.1.00
 
 //  Exported functions
 //--------------------
@@ -55,33 +80,45 @@ int    MSXqual_close(MSXproject MSX);
 double MSXqual_getNodeQual(MSXproject MSX, int j, int m);
 double MSXqual_getLinkQual(MSXproject MSX, int k, int m);
 int    MSXqual_isSame(MSXproject MSX, double c1[], double c2[]);
-void   MSXqual_removeSeg(MSXproject MSX, Pseg seg);
-Pseg   MSXqual_getFreeSeg(MSXproject MSX, double v, double c[]);
-void   MSXqual_addSeg(MSXproject MSX, int k, Pseg seg);
+void   MSXqual_shiftSegWallQual(MSXproject MSX, int k, long dt);
+Pseg   MSXqual_addSeg(MSXproject MSX, int k, double v, double c[]);
+void   MSXqual_removeFirstSeg(MSXproject MSX, int k);
+void   MSXqual_removeLastSeg(MSXproject MSX, int k);
 void   MSXqual_reversesegs(MSXproject MSX, int k);
+SqualWorker* MSXqual_getWorker(MSXproject MSX);
+void   MSXqual_releaseHydFile(MSXproject MSX);
 
 //  Local functions
 //-----------------
+static void   mapHydFile(MSXproject MSX);
 static int    getHydVars(MSXproject MSX);
 static int    transport(MSXproject MSX, long tstep);
 static void   initSegs(MSXproject MSX);
 static int    flowdirchanged(MSXproject MSX);
 static void   advectSegs(MSXproject MSX, long dt);
 static void   getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg seg);
-static void   shiftSegWallQual(MSXproject MSX, int k, long dt);
 static void   sourceInput(MSXproject MSX, int n, double vout, long dt);
 static void   addSource(MSXproject MSX, int n, Psource source, double v, long dt);
 static double getSourceQual(MSXproject MSX, Psource source);
 static void   removeAllSegs(MSXproject MSX, int k);
+static int    growSegs(MSXproject MSX, SsegRing *segs);
+static int    openWorkers(MSXproject MSX);
+static void   closeWorkers(MSXproject MSX);
 
 static void topological_transport(MSXproject MSX, long dt);
+static void transportNode(MSXproject MSX, int n, long dt);
 static void findnodequal(MSXproject MSX, int n, double volin, double* massin, double volout, long tstep);
 static void noflowqual(MSXproject MSX, int n);
 static void evalnodeinflow(MSXproject MSX, int, long, double*, double*);
 static void evalnodeoutflow(MSXproject MSX, int k, double* upnodequal, long tstep);
 static int sortNodes(MSXproject MSX);
+static int levelNodes(MSXproject MSX);
+static int splitLevel(MSXproject MSX, int first, int last, int t, int nt);
 static int selectnonstacknode(MSXproject MSX, int numsorted, int* indegree);
 static void findstoredmass(MSXproject MSX, double* mass);
+static void setAdaptiveStep(MSXproject MSX);
+static long getQualStep(MSXproject MSX);
+static int  reactPending(MSXproject MSX);
 
 //=============================================================================
 
@@ -95,7 +132,7 @@ int  MSXqual_open(MSXproject MSX)
 */
 {
     int errcode = 0;
-    int n;
+    int n, k;
 
     // --- set flags
 
@@ -107,23 +144,26 @@ int  MSXqual_open(MSXproject MSX)
     // --- initialize array pointers to null
 
     MSX->C1 = NULL;
-    MSX->FirstSeg = NULL;
-    MSX->LastSeg = NULL;
+    MSX->Segs = NULL;
     MSX->NewSeg = NULL;
     MSX->FlowDir = NULL;
-    MSX->MassIn = NULL;
+    MSX->LevelStart = NULL;
+    MSX->SortedWork = NULL;
+    MSX->QualWorker = NULL;
 
+    // --- set the number of threads shared by routing and reactions
+
+#ifdef _OPENMP
+    MSX->NumThreads = omp_get_max_threads();
+#else
+    MSX->NumThreads = 1;
+#endif
 
     // --- open the chemistry system
 
     errcode = MSXchem_open(MSX);
     if (errcode > 0) return errcode;
 
-    // --- allocate a memory pool for pipe segments
-
-    MSX->QualPool = AllocInit();
-    if (MSX->QualPool == NULL) return ERR_MEMORY;
-
 // --- allocate memory used for species concentrations
 
     MSX->C1 = (double *) calloc(MSX->Nobjects[SPECIES]+1, sizeof(double));
@@ -134,13 +174,17 @@ int  MSXqual_open(MSXproject MSX)
     MSX->MassBalance.reacted = (double*)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(double));
     MSX->MassBalance.final   = (double*)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(double));
     MSX->MassBalance.ratio   = (double*)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(double));
-// --- allocate memory used for pointers to the first, last,
-//     and new WQ segments in each link and tank
+// --- allocate memory used for the WQ segments in each link and
+//     tank and for the new segment entering each link
 
     n = MSX->Nobjects[LINK] + MSX->Nobjects[TANK] + 1;
-    MSX->FirstSeg = (Pseg *) calloc(n, sizeof(Pseg));
-    MSX->LastSeg  = (Pseg *) calloc(n, sizeof(Pseg));
-    MSX->NewSeg = (Pseg *) calloc(n, sizeof(Pseg));
+    MSX->Segs = (SsegRing *) calloc(n, sizeof(SsegRing));
+    MSX->NewSeg = (struct Sseg *) calloc(MSX->Nobjects[LINK] + 1, sizeof(struct Sseg));
+    if (MSX->NewSeg) for (k = 1; k <= MSX->Nobjects[LINK]; k++)
+    {
+        MSX->NewSeg[k].c = (double *) calloc(MSX->Nobjects[SPECIES]+1, sizeof(double));
+        CALL(errcode, MEMCHECK(MSX->NewSeg[k].c));
+    }
 
 // --- allocate memory used for flow direction in each link
 
@@ -150,23 +194,23 @@ int  MSXqual_open(MSXproject MSX)
 //     inflows to each node
 
     n        = MSX->Nobjects[NODE] + 1;
-  
-    MSX->MassIn   = (double *) calloc(MSX->Nobjects[SPECIES]+1, sizeof(double));
-    MSX->SourceIn = (double*)calloc(MSX->Nobjects[SPECIES] + 1, sizeof(double));
+    CALL(errcode, openWorkers(MSX));
 
-    // Allocate memory for topologically sorted nodes
+    // Allocate memory for topologically sorted nodes and the
+    // start of each level they are grouped into
     MSX->SortedNodes = (int*)calloc(n, sizeof(int));
+    MSX->LevelStart = (int*)calloc(n + 1, sizeof(int));
+    MSX->SortedWork = (int*)calloc(n, sizeof(int));
 
 // --- check for successful memory allocation
 
     CALL(errcode, MEMCHECK(MSX->C1));
-    CALL(errcode, MEMCHECK(MSX->FirstSeg));
-    CALL(errcode, MEMCHECK(MSX->LastSeg));
+    CALL(errcode, MEMCHECK(MSX->Segs));
     CALL(errcode, MEMCHECK(MSX->NewSeg));
     CALL(errcode, MEMCHECK(MSX->FlowDir));
-    CALL(errcode, MEMCHECK(MSX->MassIn));
-    CALL(errcode, MEMCHECK(MSX->SourceIn));
     CALL(errcode, MEMCHECK(MSX->SortedNodes));
+    CALL(errcode, MEMCHECK(MSX->LevelStart));
+    CALL(errcode, MEMCHECK(MSX->SortedWork));
     CALL(errcode, MEMCHECK(MSX->MassBalance.initial));
     CALL(errcode, MEMCHECK(MSX->MassBalance.inflow));
     CALL(errcode, MEMCHECK(MSX->MassBalance.outflow));
@@ -253,21 +297,32 @@ int  MSXqual_init(MSXproject MSX)
     if ( n > 0 ) MSX->Rptflag = 1;
     if ( MSX->Rptflag ) MSX->Saveflag = 1;
 
-// --- reset memory pool
+// --- empty the segments of each link & tank
 
-    AllocSetPool(MSX->QualPool);
-    MSX->FreeSeg = NULL;
-    AllocReset();
+    for (i = 1; i <= MSX->Nobjects[LINK] + MSX->Nobjects[TANK]; i++)
+    {
+        MSX->Segs[i].first = 0;
+        MSX->Segs[i].count = 0;
+    }
 
-// --- re-position hydraulics file
+// --- re-position hydraulics file (memory-mapping it if possible)
 
-    if (MSX->HydFile.file != NULL) 
+    if (MSX->HydFile.file != NULL)
+    {
         fseek(MSX->HydFile.file, MSX->HydOffset, SEEK_SET);
+        if (MSX->HydMap.view == NULL) mapHydFile(MSX);
+        MSX->HydMap.pos = MSX->HydOffset;
+    }
 
 // --- set elapsed times to zero
 
     MSX->Htime = 0;                         //Hydraulic solution time
+    MSX->HydChanged = TRUE;                 //Link hydraulic variables stale
+    MSX->NumReacted = 0;                    //Segment reaction counts
+    MSX->NumSkipped = 0;
     MSX->Qtime = 0;                         //Quality routing time
+    MSX->Qdt = MSX->Qstep;                  //Quality time step in use
+    MSX->Treact = 0.0;                      //Pending Strang reaction time
     MSX->Rtime = MSX->Rstart;                //Reporting time
     MSX->Nperiods = 0;                      //Number fo reporting periods
 
@@ -305,15 +360,17 @@ int MSXqual_step(MSXproject MSX, long *t, long *tleft)
 **      513 = can't integrate reaction rates
 */
 {
-    long dt, hstep, tstep;
+    long dt, hstep, tstep, tstart;
     int  k, errcode = 0, flowchanged;
     int m;
     double smassin, smassout, sreacted;
-// --- set the shared memory pool to the water quality pool
-//     and the overall time step to nominal WQ time step
+// --- set the overall time step to nominal WQ time step (or in adaptive
+//     mode to one chosen for the hydraulics last set or retrieved)
 
-    AllocSetPool(MSX->QualPool);
-    tstep = MSX->Qstep;
+    if (MSX->Stepping == FIXED_STEPPING) MSX->Qdt = MSX->Qstep;
+    else if (MSX->HydChanged) setAdaptiveStep(MSX);
+    tstep = getQualStep(MSX);
+    tstart = MSX->Qtime;
 
 // --- repeat until the end of the time step
 
@@ -335,9 +392,11 @@ int MSXqual_step(MSXproject MSX, long *t, long *tleft)
             if ( dt > 0 ) CALL(errcode, transport(MSX, dt));
             MSX->Qtime += dt;
 
-        // --- retrieve new hydraulic solution
+        // --- retrieve new hydraulic solution (after finishing any
+        //     reactions still pending under the old one)
             if (MSX->Qtime == MSX->Htime)
             {
+                CALL(errcode, reactPending(MSX));
                 if (MSX->HydFile.file != NULL) CALL(errcode, getHydVars(MSX));
                 else MSX->Htime = MSX->Htime + MSX->Hstep;
                 if (MSX->Qtime < MSX->Dur)
@@ -356,6 +415,13 @@ int MSXqual_step(MSXproject MSX, long *t, long *tleft)
                     {
                         CALL(errcode, sortNodes(MSX));
                     }
+
+                    // --- choose a new time step in adaptive mode
+                    if (MSX->Stepping == ADAPTIVE_STEPPING && MSX->HydChanged)
+                    {
+                        setAdaptiveStep(MSX);
+                        if (MSX->Qtime == tstart) tstep = getQualStep(MSX);
+                    }
                 }
             }
 
@@ -375,6 +441,13 @@ int MSXqual_step(MSXproject MSX, long *t, long *tleft)
         if (MSX->OutOfMemory) errcode = ERR_MEMORY;
     } while (!errcode && tstep > 0);
 
+// --- finish any pending reactions before results can be reported
+
+    if (MSX->Qtime >= MSX->Dur ||
+        (MSX->Qtime >= MSX->Rstart && MSX->Rstep > 0 &&
+         (MSX->Qtime - MSX->Rstart) % MSX->Rstep == 0))
+        CALL(errcode, reactPending(MSX));
+
 // --- update the current time into the simulation and the amount remaining
 
     *t = MSX->Qtime;
@@ -487,14 +560,14 @@ double  MSXqual_getLinkQual(MSXproject MSX, int k, int m)
 {
     double  vsum = 0.0,
             msum = 0.0;
+    int     i;
     Pseg    seg;
 
-    seg = MSX->FirstSeg[k];
-    while (seg != NULL)
+    for (i = 0; i < MSX->Segs[k].count; i++)
     {
+        seg = SEG_AT(&MSX->Segs[k], i);
         vsum += seg->v;
         msum += (seg->c[m])*(seg->v);
-        seg = seg->prev;
     }
     if (vsum > 0.0) return(msum/vsum);
     else
@@ -519,22 +592,31 @@ int MSXqual_close(MSXproject MSX)
 */
 {
     int errcode = 0;
+    int k;
     if (!MSX->ProjectOpened) return 0;
     MSXchem_close(MSX);
+    MSXqual_releaseHydFile(MSX);
 
     FREE(MSX->C1);
-    FREE(MSX->FirstSeg);
-    FREE(MSX->LastSeg);
-    FREE(MSX->NewSeg);
-    FREE(MSX->FlowDir);
-    FREE(MSX->SortedNodes);
-    FREE(MSX->MassIn);
-    FREE(MSX->SourceIn);
-    if ( MSX->QualPool)
+    if (MSX->Segs)
+    {
+        for (k = 1; k <= MSX->Nobjects[LINK] + MSX->Nobjects[TANK]; k++)
+        {
+            FREE(MSX->Segs[k].seg);
+            FREE(MSX->Segs[k].cblock);
+        }
+        FREE(MSX->Segs);
+    }
+    if (MSX->NewSeg)
     {
-        AllocSetPool(MSX->QualPool);
-        AllocFreePool();
+        for (k = 1; k <= MSX->Nobjects[LINK]; k++) FREE(MSX->NewSeg[k].c);
+        FREE(MSX->NewSeg);
     }
+    FREE(MSX->FlowDir);
+    FREE(MSX->SortedNodes);
+    FREE(MSX->LevelStart);
+    FREE(MSX->SortedWork);
+    closeWorkers(MSX);
     FREE(MSX->MassBalance.initial);
     FREE(MSX->MassBalance.inflow);
     FREE(MSX->MassBalance.outflow);
@@ -572,6 +654,63 @@ int  MSXqual_isSame(MSXproject MSX, double c1[], double c2[])
 }
 
 
+//=============================================================================
+
+void  mapHydFile(MSXproject MSX)
+/**
+**   Purpose:
+**     memory-maps the hydraulics file so that each hydraulic period
+**     can be used in place rather than read into the D, H & Q arrays.
+**
+**   Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**   NOTE:
+**     if the file can't be mapped getHydVars reads it with fread.
+*/
+{
+    ShydMap *map = &MSX->HydMap;
+
+    map->view = MSXfuncs_mapFile(MSX->HydFile.file, &map->size, &map->handle);
+    if (map->view == NULL) return;
+    map->D = MSX->D;
+    map->H = MSX->H;
+    map->Q = MSX->Q;
+}
+
+//=============================================================================
+
+void  MSXqual_releaseHydFile(MSXproject MSX)
+/**
+**   Purpose:
+**     unmaps the hydraulics file, copying the current hydraulic
+**     solution back into the project's own D, H & Q arrays.
+**
+**   Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**   NOTE:
+**     must be called before the hydraulics file is closed or replaced.
+*/
+{
+    ShydMap *map = &MSX->HydMap;
+    int nNodes = MSX->Nobjects[NODE];
+    int nLinks = MSX->Nobjects[LINK];
+
+    if (map->view == NULL) return;
+    if (MSX->D != map->D)
+    {
+        memcpy(map->D+1, MSX->D+1, nNodes*sizeof(REAL4));
+        memcpy(map->H+1, MSX->H+1, nNodes*sizeof(REAL4));
+        memcpy(map->Q+1, MSX->Q+1, nLinks*sizeof(REAL4));
+        MSX->D = map->D;
+        MSX->H = map->H;
+        MSX->Q = map->Q;
+    }
+    MSXfuncs_unmapFile(map->view, map->size, map->handle);
+    memset(map, 0, sizeof(ShydMap));
+}
+
 //=============================================================================
 
 int  getHydVars(MSXproject MSX)
@@ -590,39 +729,76 @@ int  getHydVars(MSXproject MSX)
 **     A hydraulic solution consists of the current time
 **     (hydtime), nodal demands (D) and heads (H), link
 **     flows (Q), and link status values and settings (which are not used).
+**
+**     When the file is memory-mapped D, H & Q are pointed at the period's
+**     values inside the mapped view instead of being copied, and the
+**     operating system is asked to start reading the next period.
 */
 {
     int  errcode = 0;
     long hydtime, hydstep;
     INT4 n;
+    ShydMap *map = &MSX->HydMap;
+    size_t nNodes = MSX->Nobjects[NODE];
+    size_t nLinks = MSX->Nobjects[LINK];
+    size_t len = (2 + 2*nNodes + 3*nLinks) * sizeof(INT4);
+    REAL4 *r;
 
-// --- read hydraulic time, demands, heads, and flows from the file
+// --- use the hydraulic period in place if the file is mapped
 
-    if (fread(&n, sizeof(INT4), 1, MSX->HydFile.file) < 1)
-        return ERR_READ_HYD_FILE;
-    hydtime = (long)n;
-    n = MSX->Nobjects[NODE];
-    if (fread(MSX->D+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
-    if (fread(MSX->H+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
-    n = MSX->Nobjects[LINK];
-    if (fread(MSX->Q+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
+    if (map->view != NULL)
+    {
+        if (map->pos + len > map->size) return ERR_READ_HYD_FILE;
+        r = (REAL4 *)(map->view + map->pos);
+        memcpy(&n, r, sizeof(INT4));
+        hydtime = (long)n;
 
-// --- skip over link status and settings
+    // --- element 0 of each array overlays the preceding field,
+    //     which is never accessed
 
-    fseek(MSX->HydFile.file, 2*n*sizeof(REAL4), SEEK_CUR);
+        MSX->D = r;
+        MSX->H = r + nNodes;
+        MSX->Q = r + 2*nNodes;
 
-// --- read time step until next hydraulic event
+    // --- skip over link status and settings to the time step
 
-    if (fread(&n, sizeof(INT4), 1, MSX->HydFile.file) < 1)
-        return ERR_READ_HYD_FILE;
-    hydstep = (long)n;
+        memcpy(&n, r + 2*nNodes + 3*nLinks + 1, sizeof(INT4));
+        hydstep = (long)n;
+        map->pos += len;
+        MSXfuncs_prefetch(map->view + map->pos, MIN(len, map->size - map->pos));
+    }
+
+// --- otherwise read hydraulic time, demands, heads, and flows from the file
+
+    else
+    {
+        if (fread(&n, sizeof(INT4), 1, MSX->HydFile.file) < 1)
+            return ERR_READ_HYD_FILE;
+        hydtime = (long)n;
+        n = MSX->Nobjects[NODE];
+        if (fread(MSX->D+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
+            return ERR_READ_HYD_FILE;
+        if (fread(MSX->H+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
+            return ERR_READ_HYD_FILE;
+        n = MSX->Nobjects[LINK];
+        if (fread(MSX->Q+1, sizeof(REAL4), n, MSX->HydFile.file) < (unsigned)n)
+            return ERR_READ_HYD_FILE;
+
+    // --- skip over link status and settings
+
+        fseek(MSX->HydFile.file, 2*n*sizeof(REAL4), SEEK_CUR);
+
+    // --- read time step until next hydraulic event
+
+        if (fread(&n, sizeof(INT4), 1, MSX->HydFile.file) < 1)
+            return ERR_READ_HYD_FILE;
+        hydstep = (long)n;
+    }
 
 // --- update elapsed time until next hydraulic event
 
     MSX->Htime = hydtime + hydstep;
+    MSX->HydChanged = TRUE;
 
 /*
     if (MSX->Qtime < MSX->Dur)
@@ -653,39 +829,81 @@ int  transport(MSXproject MSX, long tstep)
 **
 **  Returns:
 **    an error code or 0 if no error.
+**
+**  Note:
+**    with Strang splitting, species react for half of each quality
+**    time step before and after being transported. The second half of
+**    one step is left pending in MSX->Treact and reacted together with
+**    the first half of the next, even across calls, until reactPending
+**    finishes it at a hydraulic event, a reporting time or the end of
+**    the simulation.
 */
 {
     long qtime, dt;
+    double treact;
     int  errcode = 0;
 
 // --- repeat until time step is exhausted
 
-    MSXerr_clearMathError();                // clear math error flag           //1.1.00
+    MSXerr_clearMathError(MSX);             // clear math error flag           //1.1.00
     qtime = 0;
     while (!MSX->OutOfMemory &&
            !errcode &&
            qtime < tstep)
-    {                                       // Qstep is nominal quality time step
-        dt = MIN(MSX->Qstep, tstep-qtime);   // get actual time step
+    {                                       // Qdt is quality time step in use
+        dt = MIN(MSX->Qdt, tstep-qtime);     // get actual time step
         qtime += dt;                        // update amount of input tstep taken
-        errcode = MSXchem_react(MSX, dt);        // react species in each pipe & tank
+        if (MSX->Splitting == STRANG_SPLITTING) treact = MSX->Treact + 0.5 * dt;
+        else treact = dt;
+        errcode = MSXchem_react(MSX, treact);    // react species in each pipe & tank
         if ( errcode ) return errcode;
         advectSegs(MSX, dt);                     // advect segments in each pipe
 
         topological_transport(MSX, dt);          //replace accumulate, updateNodes, sourceInput and release
 
-		if (MSXerr_mathError())             // check for any math error        //1.1.00
+        if (MSX->Splitting == STRANG_SPLITTING) MSX->Treact = 0.5 * dt;
+		if (MSXerr_mathError(MSX))          // check for any math error        //1.1.00
 		{
-			MSXerr_writeMathErrorMsg();
+			MSXerr_writeMathErrorMsg(MSX);
 			errcode = ERR_ILLEGAL_MATH;
 		}
         
    }
+
    return errcode;
 }
 
 //=============================================================================
 
+int  reactPending(MSXproject MSX)
+/**
+**  Purpose:
+**    reacts species over the second half of the last quality time
+**    step when Strang splitting has left it pending.
+**
+**  Input:
+**    MSX = the underlying MSXproject data struct.
+**
+**  Returns:
+**    an error code or 0 if no error.
+*/
+{
+    int errcode;
+
+    if (MSX->Treact <= 0.0) return 0;
+    MSXerr_clearMathError(MSX);
+    errcode = MSXchem_react(MSX, MSX->Treact);
+    MSX->Treact = 0.0;
+    if ( !errcode && MSXerr_mathError(MSX) )
+    {
+        MSXerr_writeMathErrorMsg(MSX);
+        errcode = ERR_ILLEGAL_MATH;
+    }
+    return errcode;
+}
+
+//=============================================================================
+
 void  initSegs(MSXproject MSX)
 /**
 **   Purpose:
@@ -713,9 +931,8 @@ void  initSegs(MSXproject MSX)
 
     // --- start with no segments
 
-        MSX->LastSeg[k] = NULL;
-        MSX->FirstSeg[k] = NULL;
-        MSX->NewSeg[k] = NULL;
+        MSX->Segs[k].first = 0;
+        MSX->Segs[k].count = 0;
 
     // --- use quality of downstream node for BULK species
     //     if no initial link quality supplied
@@ -735,7 +952,7 @@ void  initSegs(MSXproject MSX)
 
         MSXchem_equil(MSX, LINK, MSX->C1);
         v = LINKVOL(k);
-        if ( v > 0.0 ) MSXqual_addSeg(MSX, k, MSXqual_getFreeSeg(MSX, v, MSX->C1));
+        if ( v > 0.0 ) MSXqual_addSeg(MSX, k, v, MSX->C1);
     }
 
 // --- initialize segments in tanks
@@ -752,8 +969,8 @@ void  initSegs(MSXproject MSX)
         for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
             MSX->C1[m] = MSX->Node[k].c0[m];
         k = MSX->Nobjects[LINK] + j;
-        MSX->LastSeg[k] = NULL;
-        MSX->FirstSeg[k] = NULL;
+        MSX->Segs[k].first = 0;
+        MSX->Segs[k].count = 0;
 
         MSXchem_equil(MSX, NODE, MSX->C1);
 
@@ -762,9 +979,9 @@ void  initSegs(MSXproject MSX)
         if (MSX->Tank[j].mixModel == MIX2)
         {
             v = MAX(0, MSX->Tank[j].v - MSX->Tank[j].vMix);
-            MSXqual_addSeg(MSX, k, MSXqual_getFreeSeg(MSX, v, MSX->C1));
+            MSXqual_addSeg(MSX, k, v, MSX->C1);
             v = MSX->Tank[j].v - v;
-            MSXqual_addSeg(MSX, k, MSXqual_getFreeSeg(MSX, v, MSX->C1));
+            MSXqual_addSeg(MSX, k, v, MSX->C1);
         }
 
     // --- add one segment for all other models
@@ -772,7 +989,7 @@ void  initSegs(MSXproject MSX)
         else
         {
             v = MSX->Tank[j].v;
-            MSXqual_addSeg(MSX, k, MSXqual_getFreeSeg(MSX, v, MSX->C1));
+            MSXqual_addSeg(MSX, k, v, MSX->C1);
         }
     }
 
@@ -842,16 +1059,11 @@ void advectSegs(MSXproject MSX, long dt)
     {
     // --- zero out WQ in new segment to be added at entrance of link
 
-        for (m=1; m<=MSX->Nobjects[SPECIES]; m++) MSX->C1[m] = 0.0;
-
-    // --- get a free segment to add to entrance of link
-
-        MSX->NewSeg[k] = MSXqual_getFreeSeg(MSX, 0.0, MSX->C1);
+        for (m=1; m<=MSX->Nobjects[SPECIES]; m++) MSX->NewSeg[k].c[m] = 0.0;
 
     // --- skip zero-length links (pumps & valves) & no-flow links
 
-        if ( MSX->NewSeg[k] == NULL ||
-             MSX->Link[(k)].len == 0.0 || MSX->Q[k] == 0.0 ) continue;
+        if ( MSX->Link[(k)].len == 0.0 || MSX->Q[k] == 0.0 ) continue;
 
     // --- find conc. of wall species in new segment to be added
     //     and adjust conc. of wall species to reflect shifted
@@ -859,8 +1071,8 @@ void advectSegs(MSXproject MSX, long dt)
 
         if ( MSX->HasWallSpecies )
         {
-            getNewSegWallQual(MSX, k, dt, MSX->NewSeg[k]);
-            shiftSegWallQual(MSX, k, dt);
+            getNewSegWallQual(MSX, k, dt, &MSX->NewSeg[k]);
+            MSXqual_shiftSegWallQual(MSX, k, dt);
         }
     }
 }
@@ -884,7 +1096,7 @@ void getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg newseg)
 */
 {
     Pseg  seg;
-    int   m;
+    int   i, m;
     double v, vin, vsum, vadded, vleft;
 
 // --- get volume of inflow to link
@@ -896,7 +1108,7 @@ void getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg newseg)
 
 // --- start at last (most upstream) existing WQ segment
 
-	seg = MSX->LastSeg[k];
+	i = MSX->Segs[k].count - 1;
 	vsum = 0.0;
     vleft = vin;
     for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
@@ -906,11 +1118,12 @@ void getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg newseg)
 
 // --- repeat while some inflow volume still remains
 
-    while ( vleft > 0.0 && seg != NULL )
+    while ( vleft > 0.0 && i >= 0 )
     {
 
     // --- find volume added by this segment
 
+        seg = SEG_AT(&MSX->Segs[k], i);
         vadded = seg->v;
         if ( vadded > vleft ) vadded = vleft;
 
@@ -928,7 +1141,7 @@ void getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg newseg)
 
     // --- move to next downstream WQ segment
 
-        seg = seg->next;
+        i--;
     }
 
 // --- convert mass of wall species in new segment to concentration
@@ -944,7 +1157,7 @@ void getNewSegWallQual(MSXproject MSX, int k, long dt, Pseg newseg)
 
 //=============================================================================
 
-void shiftSegWallQual(MSXproject MSX, int k, long dt)
+void MSXqual_shiftSegWallQual(MSXproject MSX, int k, long dt)
 /**
 **  Purpose:
 **    recomputes wall species concentrations in segments that remain
@@ -954,10 +1167,17 @@ void shiftSegWallQual(MSXproject MSX, int k, long dt)
 **    MSX = the underlying MSXproject data struct.
 **    k = link index
 **    dt = current WQ time step (sec)
+**
+**  Note:
+**    each segment's new position starts where the previous one's
+**    ended, so the search for the segments it now overlaps resumes
+**    from the segment where the previous search stopped rather than
+**    from the upstream end of the pipe.
 */
 {
-    Pseg  seg1, seg2;
-    int   m;
+    SsegRing *segs = &MSX->Segs[k];
+    Pseg  seg1, seg2 = NULL;
+    int   i1, i2, m, added;
     double v, vin, vstart, vend, vcur, vsum;
 
 // --- find volume of water displaced in pipe
@@ -970,10 +1190,19 @@ void shiftSegWallQual(MSXproject MSX, int k, long dt)
 
     vstart = vin;
 
+// --- start the overlap search at the upstream end, where vsum is the
+//     volume from there to the downstream end of segment i2 once it
+//     has been added
+
+    i2 = segs->count - 1;
+    vsum = 0.0;
+    added = FALSE;
+
 // --- examine each segment, from upstream to downstream
 
-    for( seg1 = MSX->LastSeg[k]; seg1 != NULL; seg1 = seg1->next )
+    for( i1 = segs->count - 1; i1 >= 0; i1-- )
     {
+        seg1 = SEG_AT(segs, i1);
 
         // --- initialize a "mixture" WQ
 
@@ -987,14 +1216,23 @@ void shiftSegWallQual(MSXproject MSX, int k, long dt)
         vend = vstart + seg1->v;   //
         if (vend > v) vend = v;
         vcur = vstart;
-        vsum = 0;
 
     // --- find volume taken up by the segment after it moves down the pipe
+    //     (segments passed over by earlier searches end above vstart)
 
-        for (seg2 = MSX->LastSeg[k]; seg2 != NULL; seg2 = seg2->next)
+        while ( i2 >= 0 )
         {
-            if ( seg2->v == 0.0 ) continue;
-            vsum += seg2->v;
+            seg2 = SEG_AT(segs, i2);
+            if ( !added )
+            {
+                if ( seg2->v == 0.0 )
+                {
+                    i2--;
+                    continue;
+                }
+                vsum += seg2->v;
+                added = TRUE;
+            }
             if ( vsum >= vstart && vsum <= vend )  //DS end of seg2 is between vstart and vend 
             {
                 for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
@@ -1005,7 +1243,10 @@ void shiftSegWallQual(MSXproject MSX, int k, long dt)
                 vcur = vsum;
             }
             if ( vsum >= vend ) break;  //DS of seg2 is at DS of vend 
+            i2--;
+            added = FALSE;
         }
+        if ( i2 < 0 ) seg2 = NULL;
 
     // --- update the wall species concentrations in the segment
 
@@ -1041,6 +1282,7 @@ void sourceInput(MSXproject MSX, int n, double volout, long dt)
     int m;
     double  qout, qcutoff;
     Psource source;
+    SqualWorker *wk;
 
 // --- establish a flow cutoff which indicates no outflow from a node
 
@@ -1060,8 +1302,9 @@ void sourceInput(MSXproject MSX, int n, double volout, long dt)
     if (qout <= qcutoff) return;
 
     // --- add contribution of each source species
+    wk = MSXqual_getWorker(MSX);
     for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-        MSX->SourceIn[m] = 0.0;   
+        wk->SourceIn[m] = 0.0;   
     while (source)
     {
         addSource(MSX, n, source, volout, dt);
@@ -1072,7 +1315,7 @@ void sourceInput(MSXproject MSX, int n, double volout, long dt)
  
     for (m = 1; m <= MSX->Nobjects[m]; m++)
     {
-        MSX->MassBalance.inflow[m] += MSX->SourceIn[m] * LperFT3;
+        wk->MassInflow[m] += wk->SourceIn[m] * LperFT3;
     }
 }
 
@@ -1146,7 +1389,7 @@ void addSource(MSXproject MSX, int n, Psource source, double volout, long dt)
 
     // --- adjust nodal concentration to reflect source addition
         MSX->Node[n].c[m] += massadded / volout;
-        MSX->SourceIn[m] += massadded;
+        MSXqual_getWorker(MSX)->SourceIn[m] += massadded;
     }
 }
 
@@ -1174,20 +1417,28 @@ double  getSourceQual(MSXproject MSX, Psource source)
     i = source->pat;
     if (i == 0) return(c);
     k = ((MSX->Qtime + MSX->Pstart) / MSX->Pstep) % MSX->Pattern[i].length;
-    if (k != MSX->Pattern[i].interval)
+
+// --- the pattern's position may be shared with sources at other nodes
+
+#ifdef _OPENMP
+#pragma omp critical (MSXqual_pattern)
+#endif
     {
-        if ( k < MSX->Pattern[i].interval )
-        {
-            MSX->Pattern[i].current = MSX->Pattern[i].first;
-            MSX->Pattern[i].interval = 0;
-        }
-        while (MSX->Pattern[i].current && MSX->Pattern[i].interval < k)
+        if (k != MSX->Pattern[i].interval)
         {
-             MSX->Pattern[i].current = MSX->Pattern[i].current->next;
-             MSX->Pattern[i].interval++;
+            if ( k < MSX->Pattern[i].interval )
+            {
+                MSX->Pattern[i].current = MSX->Pattern[i].first;
+                MSX->Pattern[i].interval = 0;
+            }
+            while (MSX->Pattern[i].current && MSX->Pattern[i].interval < k)
+            {
+                 MSX->Pattern[i].current = MSX->Pattern[i].current->next;
+                 MSX->Pattern[i].interval++;
+            }
         }
+        if (MSX->Pattern[i].current) f = MSX->Pattern[i].current->value;
     }
-    if (MSX->Pattern[i].current) f = MSX->Pattern[i].current->value;
     return c*f;
 }
 
@@ -1203,83 +1454,227 @@ void  removeAllSegs(MSXproject MSX, int k)
 **     k = link index.
 */
 {
-    Pseg seg;
-    seg = MSX->FirstSeg[k];
-    while (seg != NULL)
+    MSX->Segs[k].first = 0;
+    MSX->Segs[k].count = 0;
+}
+
+int openWorkers(MSXproject MSX)
+/**
+**   Purpose:
+**     allocates the transport work space of each thread.
+**
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+**
+**   Returns:
+**     an error code (0 if no errors).
+**
+**   Note:
+**     the first worker accumulates mass balance terms directly into
+**     the project's totals so a single thread adds them in the same
+**     order as a serial run; other workers keep partial sums that
+**     are added to the totals after each transport step.
+*/
+{
+    int w, n;
+    int errcode = 0;
+    SqualWorker *wk;
+
+    MSX->QualWorker = (SqualWorker *)calloc(MSX->NumThreads, sizeof(SqualWorker));
+    if (MSX->QualWorker == NULL) return ERR_MEMORY;
+    n = MSX->Nobjects[SPECIES] + 1;
+    for (w = 0; w < MSX->NumThreads; w++)
     {
-        MSX->FirstSeg[k] = seg->prev;
-        MSXqual_removeSeg(MSX, seg);
-        seg = MSX->FirstSeg[k];
+        wk = &MSX->QualWorker[w];
+        wk->C1 = (double *)calloc(n, sizeof(double));
+        wk->MassIn = (double *)calloc(n, sizeof(double));
+        wk->SourceIn = (double *)calloc(n, sizeof(double));
+        CALL(errcode, MEMCHECK(wk->C1));
+        CALL(errcode, MEMCHECK(wk->MassIn));
+        CALL(errcode, MEMCHECK(wk->SourceIn));
+        if (w == 0)
+        {
+            wk->MassInflow = MSX->MassBalance.inflow;
+            wk->MassOutflow = MSX->MassBalance.outflow;
+        }
+        else
+        {
+            wk->MassInflow = (double *)calloc(n, sizeof(double));
+            wk->MassOutflow = (double *)calloc(n, sizeof(double));
+            CALL(errcode, MEMCHECK(wk->MassInflow));
+            CALL(errcode, MEMCHECK(wk->MassOutflow));
+        }
     }
-    MSX->LastSeg[k] = NULL;
+    return errcode;
 }
 
-void topological_transport(MSXproject MSX, long dt)
-{
-    int j, n, k, m;
-    double volin, volout; 
-    Padjlist  alink;
+//=============================================================================
 
+void closeWorkers(MSXproject MSX)
+/**
+**   Purpose:
+**     frees the transport work space of each thread.
+**
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+*/
+{
+    int w;
+    SqualWorker *wk;
 
-    // Analyze each node in topological order
-    for (j = 1; j <= MSX->Nobjects[NODE]; j++)
+    if (MSX->QualWorker == NULL) return;
+    for (w = 0; w < MSX->NumThreads; w++)
     {
-        // ... index of node to be processed
-        n = MSX->SortedNodes[j];
+        wk = &MSX->QualWorker[w];
+        FREE(wk->C1);
+        FREE(wk->MassIn);
+        FREE(wk->SourceIn);
+        if (w > 0)
+        {
+            FREE(wk->MassInflow);
+            FREE(wk->MassOutflow);
+        }
+    }
+    FREE(MSX->QualWorker);
+}
+
+//=============================================================================
+
+void topological_transport(MSXproject MSX, long dt)
+/**
+**--------------------------------------------------------------
+**   Input:   MSX = the underlying MSXproject data struct.
+**            dt = current WQ time step (sec)
+**   Output:  none
+**   Purpose: routes flow through the network's nodes one
+**            topological level at a time.
+**   Note:    nodes within a level share no links, so no two of
+**            them (tanks included) draw on the same inflow and
+**            they can be processed in parallel while every link
+**            still sees its upstream node before its downstream
+**            one. Each thread routes a contiguous
+**            share of a level's work, where tanks count for more
+**            than junctions (see splitLevel).
+**--------------------------------------------------------------
+*/
+{
+    int j, l, m, w, first, last;
+    SqualWorker *wk;
 
-        // ... zero out mass & flow volumes for this node
-        volin = 0.0;
-        volout = 0.0;
-        memset(MSX->MassIn, 0, (MSX->Nobjects[SPECIES] + 1) * sizeof(double));
-        memset(MSX->SourceIn, 0, (MSX->Nobjects[SPECIES] + 1) * sizeof(double));
+    // Analyze each level of nodes in topological order
+    for (l = 1; l <= MSX->NumLevels; l++)
+    {
+        first = MSX->LevelStart[l];
+        last = MSX->LevelStart[l + 1] - 1;
 
-        // ... examine each link with flow into the node
-        for (alink = MSX->Adjlist[n]; alink != NULL; alink = alink->next)
+        // ... levels with little work are processed by a single thread
+#ifdef _OPENMP
+        if (MSX->NumThreads > 1 &&
+            MSX->SortedWork[last] - MSX->SortedWork[first - 1] >= MIN_LEVEL_WORK)
         {
-            // ... k is index of next link incident on node n
-            k = alink->link;
-
-            // ... link has flow into node - add it to node's inflow
-            //     (m is index of link's downstream node)
-            m = MSX->Link[k].n2;
-            if (MSX->FlowDir[k] < 0) m = MSX->Link[k].n1;
-            if (m == n)
+#pragma omp parallel num_threads(MSX->NumThreads) private(j)
             {
-                evalnodeinflow(MSX, k, dt, &volin, MSX->MassIn);
+                int t = omp_get_thread_num();
+                int nt = omp_get_num_threads();
+                int end = splitLevel(MSX, first, last, t + 1, nt);
+                for (j = splitLevel(MSX, first, last, t, nt); j < end; j++)
+                {
+                    transportNode(MSX, MSX->SortedNodes[j], dt);
+                }
             }
-
-            // ... link has flow out of node - add it to node's outflow
-            else volout += fabs(MSX->Q[k]);
+            continue;
+        }
+#endif
+        for (j = first; j <= last; j++)
+        {
+            transportNode(MSX, MSX->SortedNodes[j], dt);
         }
+    }
 
-        // ... if node is a junction, add on any external outflow (e.g., demands)
-        if (MSX->Node[n].tank == 0)
+    // Add the mass balance terms accumulated by the other threads
+    // to the project's totals in a fixed order
+    for (w = 1; w < MSX->NumThreads; w++)
+    {
+        wk = &MSX->QualWorker[w];
+        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
         {
-            volout += fmax(0.0, MSX->D[n]);
+            MSX->MassBalance.inflow[m] += wk->MassInflow[m];
+            MSX->MassBalance.outflow[m] += wk->MassOutflow[m];
+            wk->MassInflow[m] = 0.0;
+            wk->MassOutflow[m] = 0.0;
         }
+    }
+}
 
-        // ... convert from outflow rate to volume
-        volout *= dt;
+//=============================================================================
 
-        // ... find the concentration of flow leaving the node
-        findnodequal(MSX, n, volin, MSX->MassIn, volout, dt);
+void transportNode(MSXproject MSX, int n, long dt)
+/**
+**--------------------------------------------------------------
+**   Input:   MSX = the underlying MSXproject data struct.
+**            n = node index
+**            dt = current WQ time step (sec)
+**   Output:  none
+**   Purpose: mixes the flow entering a node over a time step
+**            and releases it into the node's outflow links.
+**--------------------------------------------------------------
+*/
+{
+    int k, m;
+    double volin, volout;
+    Padjlist  alink;
+    SqualWorker *wk = MSXqual_getWorker(MSX);
 
-        // ... examine each link with flow out of the node
-        for (alink = MSX->Adjlist[n]; alink != NULL; alink = alink->next)
+    // ... zero out mass & flow volumes for this node
+    volin = 0.0;
+    volout = 0.0;
+    memset(wk->MassIn, 0, (MSX->Nobjects[SPECIES] + 1) * sizeof(double));
+    memset(wk->SourceIn, 0, (MSX->Nobjects[SPECIES] + 1) * sizeof(double));
+
+    // ... examine each link with flow into the node
+    for (alink = MSX->Adjlist[n]; alink != NULL; alink = alink->next)
+    {
+        // ... k is index of next link incident on node n
+        k = alink->link;
+
+        // ... link has flow into node - add it to node's inflow
+        //     (m is index of link's downstream node)
+        m = MSX->Link[k].n2;
+        if (MSX->FlowDir[k] < 0) m = MSX->Link[k].n1;
+        if (m == n)
         {
-            // ... link k incident on node n has upstream node m equal to n
-            k = alink->link;
-            m = MSX->Link[k].n1;
-            if (MSX->FlowDir[k] < 0) m = MSX->Link[k].n2;
-            if (m == n)
-            {
-                // ... send flow at new node concen. into link
-                evalnodeoutflow(MSX, k, MSX->Node[n].c, dt);
-            }
+            evalnodeinflow(MSX, k, dt, &volin, wk->MassIn);
         }
-        
+
+        // ... link has flow out of node - add it to node's outflow
+        else volout += fabs(MSX->Q[k]);
     }
 
+    // ... if node is a junction, add on any external outflow (e.g., demands)
+    if (MSX->Node[n].tank == 0)
+    {
+        volout += fmax(0.0, MSX->D[n]);
+    }
+
+    // ... convert from outflow rate to volume
+    volout *= dt;
+
+    // ... find the concentration of flow leaving the node
+    findnodequal(MSX, n, volin, wk->MassIn, volout, dt);
+
+    // ... examine each link with flow out of the node
+    for (alink = MSX->Adjlist[n]; alink != NULL; alink = alink->next)
+    {
+        // ... link k incident on node n has upstream node m equal to n
+        k = alink->link;
+        m = MSX->Link[k].n1;
+        if (MSX->FlowDir[k] < 0) m = MSX->Link[k].n2;
+        if (m == n)
+        {
+            // ... send flow at new node concen. into link
+            evalnodeoutflow(MSX, k, MSX->Node[n].c, dt);
+        }
+    }
 }
 
 //=============================================================================
@@ -1311,11 +1706,11 @@ void evalnodeoutflow(MSXproject MSX, int k, double * upnodequal, long tstep)
     for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
     {
         if (MSX->Species[m].type == BULK)
-            MSX->NewSeg[k]->c[m] = upnodequal[m];
+            MSX->NewSeg[k].c[m] = upnodequal[m];
     }
 
     // ... case where link has a last (most upstream) segment
-    seg = MSX->LastSeg[k];
+    seg = LAST_SEG(&MSX->Segs[k]);
 
     if (seg)
     {
@@ -1330,25 +1725,20 @@ void evalnodeoutflow(MSXproject MSX, int k, double * upnodequal, long tstep)
                    seg->c[m] = (seg->c[m]*seg->v+upnodequal[m]*v)/(seg->v+v);
             }
             seg->v += v;
-
-            MSXqual_removeSeg(MSX, MSX->NewSeg[k]);
         }
 
         // --- otherwise add the new seg to the end of the link
 
         else
         {
-            MSX->NewSeg[k]->v = v;
-
-            MSXqual_addSeg(MSX, k, MSX->NewSeg[k]);
+            MSXqual_addSeg(MSX, k, v, MSX->NewSeg[k].c);
         }
 
     }
     // ... link has no segments so add one
     else
     {
-        MSX->NewSeg[k]->v = v;
-        MSXqual_addSeg(MSX, k, MSX->NewSeg[k]);
+        MSXqual_addSeg(MSX, k, v, MSX->NewSeg[k].c);
     }
 }
 
@@ -1381,7 +1771,7 @@ void  evalnodeinflow(MSXproject MSX, int k, long tstep, double* volin, double* m
     // node, removing segments once their full volume is consumed
     while (v > 0.0)
     {
-        seg = MSX->FirstSeg[k];
+        seg = FIRST_SEG(&MSX->Segs[k]);
         if (!seg) break;
 
         // ... volume transported from first segment is smaller of
@@ -1401,12 +1791,7 @@ void  evalnodeinflow(MSXproject MSX, int k, long tstep, double* volin, double* m
         if (v >= 0.0 && vseg >= seg->v)
         {
             // ... replace this leading segment with the one behind it
-            MSX->FirstSeg[k] = seg->prev;
-            if (MSX->FirstSeg[k] == NULL) MSX->LastSeg[k] = NULL;
-
-            // ... recycle the used up segment
-            seg->prev = MSX->FreeSeg;
-            MSX->FreeSeg = seg;
+            MSXqual_removeFirstSeg(MSX, k);
         }
 
         // ... otherwise just reduce this segment's volume
@@ -1432,6 +1817,8 @@ void findnodequal(MSXproject MSX, int n, double volin, double* massin, double vo
     */
 {
     int m, j;
+    SqualWorker *wk = MSXqual_getWorker(MSX);
+
     // Node is a junction - update its water quality
     j = MSX->Node[n].tank;
     if (j <= 0)
@@ -1466,8 +1853,8 @@ void findnodequal(MSXproject MSX, int n, double volin, double* massin, double vo
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
             {
                
-                MSX->MassBalance.inflow[m] += MSX->Node[n].c[m] * volout * LperFT3;
-                MSX->MassBalance.outflow[m] += massin[m];
+                wk->MassInflow[m] += MSX->Node[n].c[m] * volout * LperFT3;
+                wk->MassOutflow[m] += massin[m];
             }
         }
 
@@ -1479,11 +1866,11 @@ void findnodequal(MSXproject MSX, int n, double volin, double* massin, double vo
             {
                 for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
                 {
-                    MSX->C1[m] = massin[m] / volin / LperFT3;
+                    wk->C1[m] = massin[m] / volin / LperFT3;
                 }
             }
             else for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-                MSX->C1[m] = 0.0;
+                wk->C1[m] = 0.0;
             switch (MSX->Tank[j].mixModel)
             {
             case MIX1: MSXtank_mix1(MSX, j, volin, massin, volin-volout);
@@ -1509,7 +1896,7 @@ void findnodequal(MSXproject MSX, int n, double volin, double* massin, double vo
     {
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
             if(MSX->Species[m].type == BULK)
-                MSX->MassBalance.outflow[m] += MAX(0.0, MSX->D[n]) * tstep * MSX->Node[n].c[m]*LperFT3;
+                wk->MassOutflow[m] += MAX(0.0, MSX->D[n]) * tstep * MSX->Node[n].c[m]*LperFT3;
     }
 }
 
@@ -1617,11 +2004,128 @@ int sortNodes(MSXproject MSX)
     if (numsorted < MSX->Nobjects[NODE]) errcode = 120;
     FREE(indegree);
     FREE(stack);
+
+    // Group the sorted nodes into levels that can be routed in parallel
+    if (!errcode) errcode = levelNodes(MSX);
+    return errcode;
+}
+
+//=============================================================================
+
+int levelNodes(MSXproject MSX)
+/**
+**--------------------------------------------------------------
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+**   Output:  returns an error code
+**   Purpose: re-orders the topologically sorted nodes into
+**            levels, where a node's level is one more than that
+**            of any adjacent node sorted ahead of it.
+**   Note:    every link, including those with negligible flow,
+**            joins nodes of different levels, so the nodes of a
+**            level share no links and each link is still visited
+**            in the same order as in the original sort.
+**--------------------------------------------------------------
+*/
+{
+    int j, l, m, n;
+    int* position = NULL;
+    int* level = NULL;
+    int* order = NULL;
+    int errcode = 0;
+    Padjlist  alink;
+
+    position = (int*)calloc(MSX->Nobjects[NODE] + 1, sizeof(int));
+    level = (int*)calloc(MSX->Nobjects[NODE] + 1, sizeof(int));
+    order = (int*)calloc(MSX->Nobjects[NODE] + 1, sizeof(int));
+    if (position && level && order)
+    {
+        // Find each node's position in sorted order
+        for (j = 1; j <= MSX->Nobjects[NODE]; j++)
+            position[MSX->SortedNodes[j]] = j;
+
+        // Assign levels in sorted order
+        MSX->NumLevels = 0;
+        for (j = 1; j <= MSX->Nobjects[NODE]; j++)
+        {
+            n = MSX->SortedNodes[j];
+            l = 1;
+            for (alink = MSX->Adjlist[n]; alink != NULL; alink = alink->next)
+            {
+                // ... m is the node of the link opposite to node n
+                m = alink->node;
+                if (position[m] < j && level[m] >= l) l = level[m] + 1;
+            }
+            level[n] = l;
+            MSX->NumLevels = MAX(MSX->NumLevels, l);
+        }
+
+        // Count the nodes in each level and find where each one starts
+        memset(MSX->LevelStart, 0, (MSX->Nobjects[NODE] + 2) * sizeof(int));
+        for (n = 1; n <= MSX->Nobjects[NODE]; n++) MSX->LevelStart[level[n] + 1]++;
+        MSX->LevelStart[1] = 1;
+        for (l = 1; l <= MSX->NumLevels; l++)
+            MSX->LevelStart[l + 1] += MSX->LevelStart[l];
+
+        // Place the nodes of each level in their original sorted order
+        // (position is re-used as the next free slot of each level)
+        for (l = 1; l <= MSX->NumLevels; l++) position[l] = MSX->LevelStart[l];
+        for (j = 1; j <= MSX->Nobjects[NODE]; j++)
+        {
+            n = MSX->SortedNodes[j];
+            order[position[level[n]]++] = n;
+        }
+        memcpy(MSX->SortedNodes, order, (MSX->Nobjects[NODE] + 1) * sizeof(int));
+
+        // Add up the routing work of the sorted nodes
+        MSX->SortedWork[0] = 0;
+        for (j = 1; j <= MSX->Nobjects[NODE]; j++)
+        {
+            n = MSX->SortedNodes[j];
+            MSX->SortedWork[j] = MSX->SortedWork[j - 1] +
+                                 (MSX->Node[n].tank > 0 ? TANK_NODE_WORK : 1);
+        }
+    }
+    else errcode = 101;
+    FREE(position);
+    FREE(level);
+    FREE(order);
     return errcode;
 }
 
 //=============================================================================
 
+int splitLevel(MSXproject MSX, int first, int last, int t, int nt)
+/**
+**--------------------------------------------------------------
+**   Input:   MSX = the underlying MSXproject data struct.
+**            first = position of a level's first sorted node
+**            last = position of its last sorted node
+**            t = index of a thread (0 to nt)
+**            nt = number of threads
+**   Output:  returns the position of the first node routed by
+**            thread t (or last + 1 if t = nt)
+**   Purpose: splits the nodes of a level into nt contiguous
+**            shares of about the same routing work.
+**--------------------------------------------------------------
+*/
+{
+    int lo = first, hi = last + 1, mid;
+    int base = MSX->SortedWork[first - 1];
+    double share = (double)(MSX->SortedWork[last] - base) * t / nt;
+
+    // Find the first node with at least the work of t shares before it
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (MSX->SortedWork[mid - 1] - base >= share) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+//=============================================================================
+
 int selectnonstacknode(MSXproject MSX, int numsorted, int* indegree)
 /**
 **--------------------------------------------------------------
@@ -1698,19 +2202,19 @@ void  noflowqual(MSXproject MSX, int n)
         if (MSX->Link[k].n2 == n && dir >= 0) inflow = TRUE;
         else if (MSX->Link[k].n1 == n && dir < 0)  inflow = TRUE;
         else inflow = FALSE;
-        if (inflow == TRUE && MSX->FirstSeg[k] != NULL)
+        if (inflow == TRUE && MSX->Segs[k].count > 0)
         {
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-                MSX->Node[n].c[m] += MSX->FirstSeg[k]->c[m];
+                MSX->Node[n].c[m] += FIRST_SEG(&MSX->Segs[k])->c[m];
             kount++;
         }
 
         // Node n is link's upstream node - add quality
         // of link's last segment to average
-        else if (inflow == FALSE && MSX->LastSeg[k] != NULL)
+        else if (inflow == FALSE && MSX->Segs[k].count > 0)
         {
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-                MSX->Node[n].c[m] += MSX->LastSeg[k]->c[m];
+                MSX->Node[n].c[m] += LAST_SEG(&MSX->Segs[k])->c[m];
             kount++;
         }
     }
@@ -1733,7 +2237,7 @@ void findstoredmass(MSXproject MSX, double * mass)
 */
 {
 
-    int    i, k, m;
+    int    i, j, k, m;
     Pseg   seg;
 
     for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
@@ -1745,9 +2249,9 @@ void findstoredmass(MSXproject MSX, double * mass)
     for (k = 1; k <= MSX->Nobjects[LINK]; k++)
     {
         // Sum up the quality and volume in each segment of the link
-        seg = MSX->FirstSeg[k];
-        while (seg != NULL)
+        for (j = 0; j < MSX->Segs[k].count; j++)
         {
+            seg = SEG_AT(&MSX->Segs[k], j);
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
             {
                 if (MSX->Species[m].type == BULK)
@@ -1755,7 +2259,6 @@ void findstoredmass(MSXproject MSX, double * mass)
                 else
                     mass[m] += seg->c[m] * seg->v * 4.0 / MSX->Link[k].diam * MSX->Ucf[AREA_UNITS]; //Mass per area unit * ft3 / ft * area unit per ft2;
             }
-            seg = seg->prev;
         }
     }
 
@@ -1769,15 +2272,14 @@ void findstoredmass(MSXproject MSX, double * mass)
         else
         {
             k = MSX->Nobjects[LINK] + i;
-            seg = MSX->FirstSeg[k];
-            while (seg != NULL)
+            for (j = 0; j < MSX->Segs[k].count; j++)
             {
+                seg = SEG_AT(&MSX->Segs[k], j);
                 for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
                 {
                     if (MSX->Species[m].type == BULK)
                         mass[m] += seg->c[m] * seg->v * LperFT3;
                 }
-                seg = seg->prev;
             }
         }
     }
@@ -1785,127 +2287,258 @@ void findstoredmass(MSXproject MSX, double * mass)
 
 //=============================================================================
 
-void MSXqual_reversesegs(MSXproject MSX, int k)
+void setAdaptiveStep(MSXproject MSX)
 /**
 **--------------------------------------------------------------
-**   Input:   k = link index
-**     MSX = the underlying MSXproject data struct.
+**   Input:   MSX = the underlying MSXproject data struct.
 **   Output:  none
-**   Purpose: re-orients a link's segments when flow reverses.
+**   Purpose: chooses the quality time step for a new hydraulic
+**            period in adaptive mode.
+**   Note:    the step is at most MAX_COURANT times the travel
+**            time (volume over flow) of any pipe with flow. Its
+**            local error is estimated by how
+**            much reactions would change the fastest reacting
+**            segment over it (reacting species are split from
+**            transport, so fresh inflow still reacting quickly
+**            is where this error arises), which may be at most
+**            MAX_REACT_CHANGE. The step is then rounded down to
+**            a multiple of the TIMESTEP option and is at most
+**            the reporting time step, but never grows past the
+**            TIMESTEP option when that fails the error test.
 **--------------------------------------------------------------
 */
 {
-    Pseg  seg, nseg, pseg;
+    int    k;
+    double q, rate, tmax;
+
+    // Longest step allowed
+    tmax = (double)MAX(MSX->Rstep, MSX->Qstep);
 
-    seg = MSX->FirstSeg[k];
-    MSX->FirstSeg[k] = MSX->LastSeg[k];
-    MSX->LastSeg[k] = seg;
-    pseg = NULL;
-    while (seg != NULL)
+    // Courant limit from the shortest travel time of a pipe with flow
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++)
     {
-        nseg = seg->prev;
-        seg->prev = pseg;
-        seg->next = nseg;
-        pseg = seg;
-        seg = nseg;
+        if (MSX->Link[k].len == 0.0) continue;
+        q = fabs(MSX->Q[k]);
+        if (q > Q_STAGNANT) tmax = MIN(tmax, MAX_COURANT * LINKVOL(k) / q);
     }
+
+    // Reaction limit from the fastest relative rate of change of any
+    // segment
+    rate = MSXchem_getReactionRate(MSX);
+    if (rate > 0.0) tmax = MIN(tmax, MAX_REACT_CHANGE / rate);
+    MSX->Qdt = MAX((long)tmax / MSX->Qstep, 1) * MSX->Qstep;
 }
 
 //=============================================================================
 
-void MSXqual_removeSeg(MSXproject MSX, Pseg seg)
+long getQualStep(MSXproject MSX)
 /**
-**   Purpose:
-**     places a WQ segment back into the memory pool of segments.
-**
-**   Input:
+**--------------------------------------------------------------
+**   Input:   MSX = the underlying MSXproject data struct.
+**   Output:  returns the time step taken by MSXqual_step (sec)
+**   Purpose: finds how far to route water quality next.
+**   Note:    in adaptive mode the step ends no later than the
+**            next hydraulic time (so new hydraulics can be set
+**            through the toolkit), the next reporting time or
+**            the end of the simulation.
+**--------------------------------------------------------------
+*/
+{
+    long tstep = MSX->Qdt;
+
+    if (MSX->Stepping == ADAPTIVE_STEPPING)
+    {
+        if (MSX->Qtime < MSX->Htime)
+            tstep = MIN(tstep, MSX->Htime - MSX->Qtime);
+        if (MSX->Qtime < MSX->Rstart)
+            tstep = MIN(tstep, MSX->Rstart - MSX->Qtime);
+        else if (MSX->Rstep > 0)
+            tstep = MIN(tstep, MSX->Rstep - (MSX->Qtime - MSX->Rstart) % MSX->Rstep);
+        if (MSX->Qtime < MSX->Dur) tstep = MIN(tstep, MSX->Dur - MSX->Qtime);
+    }
+    return tstep;
+}
+
+//=============================================================================
+
+void MSXqual_reversesegs(MSXproject MSX, int k)
+/**
+**--------------------------------------------------------------
+**   Input:   k = link index
 **     MSX = the underlying MSXproject data struct.
-**     seg = pointer to a WQ segment.
+**   Output:  none
+**   Purpose: re-orients a link's segments when flow reverses.
+**--------------------------------------------------------------
 */
 {
-    if ( seg == NULL ) return;
-    seg->prev = MSX->FreeSeg;
-    seg->next = NULL;
-    MSX->FreeSeg = seg;
+    SsegRing *segs = &MSX->Segs[k];
+    struct Sseg tmp;
+    Pseg  seg1, seg2;
+    int   i, j;
+
+    for (i = 0, j = segs->count - 1; i < j; i++, j--)
+    {
+        seg1 = SEG_AT(segs, i);
+        seg2 = SEG_AT(segs, j);
+        tmp = *seg1;
+        *seg1 = *seg2;
+        *seg2 = tmp;
+    }
 }
 
 //=============================================================================
 
-Pseg MSXqual_getFreeSeg(MSXproject MSX, double v, double c[])
+Pseg  MSXqual_addSeg(MSXproject MSX, int k, double v, double c[])
 /**
 **   Purpose:
-**     retrieves an unused water quality volume segment from the memory pool.
+**     adds a new segment to the upstream end of a link or tank.
 **
 **   Input:
 **     MSX = the underlying MSXproject data struct.
+**     k = link index (or number of links + tank index)
 **     v = segment volume (ft3)
 **     c[] = segment quality
 **
 **   Returns:
-**     a pointer to an unused water quality segment.
+**     a pointer to the new segment (or NULL if out of memory).
 */
 {
+    SsegRing *segs = &MSX->Segs[k];
     Pseg seg;
     int  m;
 
-// --- try using the last discarded segment if one is available
-
-    if (MSX->FreeSeg != NULL)
-    {
-        seg = MSX->FreeSeg;
-        MSX->FreeSeg = seg->prev;
-    }
-
-// --- otherwise create a new segment from the memory pool
+// --- make room for the segment if all slots are in use
 
-    else
+    if (segs->count == segs->size && growSegs(MSX, segs) > 0)
     {
-        seg = (struct Sseg *) Alloc(sizeof(struct Sseg));
-        if (seg == NULL)
-        {
-            MSX->OutOfMemory = TRUE;
-            return NULL;
-        }
-        seg->c = (double *) Alloc((MSX->Nobjects[SPECIES]+1)*sizeof(double));
-        seg->lastc = (double *)Alloc((MSX->Nobjects[SPECIES] + 1) * sizeof(double));
-        if ( seg->c == NULL||seg->lastc == NULL)
-        {
-            MSX->OutOfMemory = TRUE;
-            return NULL;
-        }
+        MSX->OutOfMemory = TRUE;
+        return NULL;
     }
 
 // --- assign volume, WQ, & integration time step to the new segment
 
+    seg = SEG_AT(segs, segs->count);
+    segs->count++;
     seg->v = v;
     for (m=1; m<=MSX->Nobjects[SPECIES]; m++) seg->c[m] = c[m];
     seg->hstep = 0.0;
+    seg->quiet = 0;
+    seg->qtime = 0.0;
     return seg;
 }
 
 //=============================================================================
 
-void  MSXqual_addSeg(MSXproject MSX, int k, Pseg seg)
+void  MSXqual_removeFirstSeg(MSXproject MSX, int k)
 /**
 **   Purpose:
-**     adds a new segment to the upstream end of a link.
+**     removes the first (most downstream) segment of a link or tank.
 **
 **   Input:
 **     MSX = the underlying MSXproject data struct.
-**     k = link index
-**     seg = pointer to a free WQ segment.
+**     k = link index (or number of links + tank index)
 */
+{
+    SsegRing *segs = &MSX->Segs[k];
 
+    if (segs->count == 0) return;
+    segs->first = (segs->first + 1) & (segs->size - 1);
+    segs->count--;
+}
+
+//=============================================================================
+
+void  MSXqual_removeLastSeg(MSXproject MSX, int k)
+/**
+**   Purpose:
+**     removes the last (most upstream) segment of a link or tank.
+**
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+**     k = link index (or number of links + tank index)
+*/
+{
+    if (MSX->Segs[k].count > 0) MSX->Segs[k].count--;
+}
+
+//=============================================================================
+
+int  growSegs(MSXproject MSX, SsegRing *segs)
+/**
+**   Purpose:
+**     doubles the number of slots available to a link's segments.
+**
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+**     segs = the segments of a link or tank
+**
+**   Returns:
+**     an error code (0 if no errors).
+**
+**   Note:
+**     the concentrations of all slots are packed into a single block
+**     and segments are copied into it in order from the first one.
+*/
 {
-    seg->prev = NULL;
-    seg->next = NULL;
-    if (MSX->FirstSeg[k] == NULL) MSX->FirstSeg[k] = seg;
-    if (MSX->LastSeg[k] != NULL)
+    struct Sseg *seg;
+    double *cblock;
+    Pseg   oldseg;
+    int    i, size, n;
+
+    size = (segs->size > 0) ? 2 * segs->size : MIN_SEG_SLOTS;
+    n = MSX->Nobjects[SPECIES] + 1;
+    seg = (struct Sseg *) calloc(size, sizeof(struct Sseg));
+    cblock = (double *) calloc(2 * size * n, sizeof(double));
+    if (seg == NULL || cblock == NULL)
+    {
+        FREE(seg);
+        FREE(cblock);
+        return ERR_MEMORY;
+    }
+    for (i = 0; i < size; i++)
+    {
+        seg[i].c = cblock + 2 * i * n;
+        seg[i].lastc = seg[i].c + n;
+    }
+    for (i = 0; i < segs->count; i++)
     {
-        MSX->LastSeg[k]->prev = seg;
-        seg->next = MSX->LastSeg[k];
+        oldseg = SEG_AT(segs, i);
+        seg[i].hstep = oldseg->hstep;
+        seg[i].v = oldseg->v;
+        seg[i].quiet = oldseg->quiet;
+        seg[i].qtime = oldseg->qtime;
+        seg[i].qlimit = oldseg->qlimit;
+        seg[i].qdrift = oldseg->qdrift;
+        memcpy(seg[i].c, oldseg->c, n * sizeof(double));
+        memcpy(seg[i].lastc, oldseg->lastc, n * sizeof(double));
     }
-    MSX->LastSeg[k] = seg;
+    FREE(segs->seg);
+    FREE(segs->cblock);
+    segs->seg = seg;
+    segs->cblock = cblock;
+    segs->size = size;
+    segs->first = 0;
+    return 0;
+}
+
+//=============================================================================
+
+SqualWorker* MSXqual_getWorker(MSXproject MSX)
+/**
+**   Purpose:
+**     retrieves the transport work space of the calling thread.
+**
+**   Input:
+**     MSX = the underlying MSXproject data struct.
+**
+**   Returns:
+**     a pointer to the thread's work space.
+*/
+{
+#ifdef _OPENMP
+    if ( MSX->NumThreads > 1 ) return &MSX->QualWorker[omp_get_thread_num()];
+#endif
+    return MSX->QualWorker;
 }
 
 //=============================================================================
@@ -20,12 +20,12 @@
 
 //  Imported functions
 //--------------------
-extern void  MSXqual_removeSeg(MSXproject MSX, Pseg seg);
-extern Pseg  MSXqual_getFreeSeg(MSXproject MSX, double v, double c[]);
-extern void  MSXqual_addSeg(MSXproject MSX, int k, Pseg seg);
+extern Pseg  MSXqual_addSeg(MSXproject MSX, int k, double v, double c[]);
+extern void  MSXqual_removeFirstSeg(MSXproject MSX, int k);
+extern void  MSXqual_removeLastSeg(MSXproject MSX, int k);
 extern int   MSXqual_isSame(MSXproject MSX, double c1[], double c2[]);
 extern int   MSXchem_equil(MSXproject MSX, int zone, double *c);
-extern void  MSXqual_reversesegs(MSXproject MSX, int k);
+extern SqualWorker* MSXqual_getWorker(MSXproject MSX);
 
 //  Exported functions
 //--------------------
@@ -60,7 +60,7 @@ void  MSXtank_mix1(MSXproject MSX, int i, double vin, double *massin, double vne
 
     n = MSX->Tank[i].node;
     k = MSX->Nobjects[LINK] + i;
-    seg = MSX->FirstSeg[k];
+    seg = FIRST_SEG(&MSX->Segs[k]);
     if (seg)
     {
         vnew = seg->v + vin;
@@ -110,8 +110,8 @@ void  MSXtank_mix2(MSXproject MSX, int i, double vin, double *massin, double vne
 // --- get segments for each zone
 
     k = MSX->Nobjects[LINK] + i;
-    mixzone = MSX->LastSeg[k];
-    stagzone = MSX->FirstSeg[k];
+    mixzone = LAST_SEG(&MSX->Segs[k]);
+    stagzone = FIRST_SEG(&MSX->Segs[k]);
     if (mixzone == NULL || stagzone == NULL) return;
 
 
@@ -209,6 +209,7 @@ void  MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, double vne
 {
    int    k, m, n;
    double vout, vseg, vsum;
+   double *c1 = MSXqual_getWorker(MSX)->C1;    // thread's concentration vector
    Pseg   seg;
 
 // --- find inflows & outflows
@@ -217,28 +218,27 @@ void  MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, double vne
     n = MSX->Tank[i].node;
     vout = vin - vnet;
     
-    if (MSX->LastSeg[k] == NULL || MSX->FirstSeg[k] == NULL) return;
+    if (MSX->Segs[k].count == 0) return;
 
     if (vin > 0.0)
     {
 
     // --- quality is the same, so just add flow volume to last seg
-        seg = MSX->LastSeg[k];
+        seg = LAST_SEG(&MSX->Segs[k]);
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
         {
-            MSX->C1[m] = massin[m] / (vin*LperFT3);
+            c1[m] = massin[m] / (vin*LperFT3);
         }
-        if (seg != NULL && MSXqual_isSame(MSX, seg->c, MSX->C1))
+        if (seg != NULL && MSXqual_isSame(MSX, seg->c, c1))
         {
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-                seg->c[m] = (seg->c[m] * seg->v + MSX->C1[m] * vin) / (seg->v + vin);
+                seg->c[m] = (seg->c[m] * seg->v + c1[m] * vin) / (seg->v + vin);
             seg->v += vin;
         }
      // --- Otherwise add a new seg to tank
         else 
         {
-            seg = MSXqual_getFreeSeg(MSX, vin, MSX->C1);
-            MSXqual_addSeg(MSX, k, seg);
+            MSXqual_addSeg(MSX, k, vin, c1);
         }
     }
 
@@ -247,23 +247,23 @@ void  MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, double vne
 
     vsum = 0.0;
     for (m=1; m<=MSX->Nobjects[SPECIES]; m++) 
-        MSX->C1[m] = 0.0;
+        c1[m] = 0.0;
 // --- withdraw flow from first segment
 
     while (vout > 0.0)
     {
     // --- get volume of current first segment
-        seg = MSX->FirstSeg[k];
+        seg = FIRST_SEG(&MSX->Segs[k]);
         if (seg == NULL) break;
         vseg = seg->v;
         vseg = MIN(vseg, vout);
-        if ( seg == MSX->LastSeg[k] ) vseg = vout;
+        if ( MSX->Segs[k].count == 1 ) vseg = vout;
 
     // --- update mass & volume removed
         vsum += vseg;
         for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
         {
-            MSX->C1[m] += (seg->c[m]) * vseg * LperFT3;
+            c1[m] += (seg->c[m]) * vseg * LperFT3;
         }
 
     // --- decrease vOut by volume of first segment
@@ -272,13 +272,9 @@ void  MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, double vne
     // --- remove segment if all its volume is consumed
         if (vout >= 0.0 && vseg >= seg->v)
         {
-            if (seg->prev)
+            if (MSX->Segs[k].count > 1)
             {
-                MSX->FirstSeg[k] = seg->prev;
-             //   MSXqual_removeSeg(MSX, seg);
-                seg->prev = MSX->FreeSeg;
-                MSX->FreeSeg = seg;
-
+                MSXqual_removeFirstSeg(MSX, k);
             }
         }
 
@@ -291,9 +287,9 @@ void  MSXtank_mix3(MSXproject MSX, int i, double vin, double *massin, double vne
 
     for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
     {
-        if (vsum > 0.0) MSX->Tank[i].c[m] = MSX->C1[m]/(vsum * LperFT3);
-        else if (MSX->FirstSeg[k] == NULL) MSX->Tank[i].c[m] = 0.0;
-        else            MSX->Tank[i].c[m] = MSX->FirstSeg[k]->c[m];
+        if (vsum > 0.0) MSX->Tank[i].c[m] = c1[m]/(vsum * LperFT3);
+        else if (MSX->Segs[k].count == 0) MSX->Tank[i].c[m] = 0.0;
+        else            MSX->Tank[i].c[m] = FIRST_SEG(&MSX->Segs[k])->c[m];
     }
 // --- add new last segment for new flow entering tank
 }
@@ -315,6 +311,7 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
 {
    int    k, m, n;
    double vsum, vseg;
+   double *c1 = MSXqual_getWorker(MSX)->C1;    // thread's concentration vector
    Pseg   seg;
 
 // --- find inflows & outflows
@@ -322,7 +319,7 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
     k = MSX->Nobjects[LINK] + i;
     n = MSX->Tank[i].node;
 
-    if (MSX->LastSeg[k] == NULL || MSX->FirstSeg[k] == NULL) return;
+    if (MSX->Segs[k].count == 0) return;
 
 // --- keep track of total volume & mass removed from tank
 
@@ -330,27 +327,27 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
     if (vin > 0)
     {
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-            MSX->C1[m] = massin[m] / (vin*LperFT3);
+            c1[m] = massin[m] / (vin*LperFT3);
     }
     else
     {
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-            MSX->C1[m] = 0;
+            c1[m] = 0;
     }
 
     for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-        MSX->Tank[i].c[m] = MSX->LastSeg[k]->c[m];
+        MSX->Tank[i].c[m] = LAST_SEG(&MSX->Segs[k])->c[m];
 
-    seg = MSX->LastSeg[k];
+    seg = LAST_SEG(&MSX->Segs[k]);
 // --- if tank filling, then create a new last segment
     if ( vnet > 0.0 )
     {
 
     // --- inflow quality = last segment quality so just expand last segment
-        if (seg != NULL && MSXqual_isSame(MSX, seg->c, MSX->C1))
+        if (seg != NULL && MSXqual_isSame(MSX, seg->c, c1))
         {
             for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-                seg->c[m] = (seg->c[m] * seg->v + MSX->C1[m] * vnet) / (seg->v + vnet);
+                seg->c[m] = (seg->c[m] * seg->v + c1[m] * vnet) / (seg->v + vnet);
             seg->v += vnet;
         }
 
@@ -358,14 +355,13 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
 
         else
         {
-            seg = MSXqual_getFreeSeg(MSX, vnet, MSX->C1);
-            MSXqual_addSeg(MSX, k, seg);
+            MSXqual_addSeg(MSX, k, vnet, c1);
         }
 
     // --- quality of tank is that of inflow
 
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-            MSX->Tank[i].c[m] = MSX->LastSeg[k]->c[m];
+            MSX->Tank[i].c[m] = LAST_SEG(&MSX->Segs[k])->c[m];
 
     }
 
@@ -374,25 +370,24 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
     else if (vnet < 0.0)
     {
         for (m = 1; m <= MSX->Nobjects[SPECIES]; m++)
-            MSX->C1[m] = 0;
+            c1[m] = 0;
     // --- keep removing volume from last segments until vNet is removed
         vsum = 0;
         vnet = -vnet;
-        MSXqual_reversesegs(MSX, k);
         while (vnet > 0.0)
         {
 
         // --- get volume of current last segment
-            seg = MSX->FirstSeg[k];
+            seg = LAST_SEG(&MSX->Segs[k]);
             if ( seg == NULL ) break;
             vseg = seg->v;
             vseg = MIN(vseg, vnet);
-            if ( seg == MSX->LastSeg[k] ) vseg = vnet;
+            if ( MSX->Segs[k].count == 1 ) vseg = vnet;
 
         // --- update mass & volume removed
             vsum += vseg;
             for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
-                MSX->C1[m] += (seg->c[m])*vseg*LperFT3;
+                c1[m] += (seg->c[m])*vseg*LperFT3;
 
         // --- reduce vNet by volume of last segment
             vnet -= vseg;
@@ -400,11 +395,9 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
         // --- remove segment if all its volume is used up
             if (vnet >= 0.0 && vseg >= seg->v)
             {
-                if (seg->prev)
+                if (MSX->Segs[k].count > 1)
                 {
-                    MSX->FirstSeg[k] = seg->prev;
-                    MSXqual_removeSeg(MSX, seg);
-
+                    MSXqual_removeLastSeg(MSX, k);
                 }
             }
         // --- otherwise just reduce volume of last segment
@@ -413,14 +406,13 @@ void  MSXtank_mix4(MSXproject MSX, int i, double vin, double *massin, double vne
                 seg->v -= vseg;
             }
         }
-        MSXqual_reversesegs(MSX, k);
     // --- tank quality is mixture of flow released and any inflow
         
         vsum = vsum + vin;
         for (m=1; m<=MSX->Nobjects[SPECIES]; m++)
         {
             if (vsum > 0.0)
-                MSX->Tank[i].c[m] = (MSX->C1[m] + massin[m]) / (vsum*LperFT3);
+                MSX->Tank[i].c[m] = (c1[m] + massin[m]) / (vsum*LperFT3);
         }
     }
 }         
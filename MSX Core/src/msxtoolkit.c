@@ -130,6 +130,9 @@ int  DLLEXPORT MSXgetQualityByIndex(int type, int index, int species, double *va
 int  DLLEXPORT MSXgetQualityByID(int type, char *id, char *species, double *value) {
     return MSX_getQualityByID(*(project), type, id, species, value);
 }
+int  DLLEXPORT MSXgetReactionCounts(long *reacted, long *skipped) {
+    return MSX_getReactionCounts(*(project), reacted, skipped);
+}
 int  DLLEXPORT MSXsetconstant(int index, double value) {
     return MSX_setconstant(*(project), index, value);
 }
@@ -18,6 +18,8 @@
 #include "msxenums.h"
 #include "mempool.h"
 #include "mathexpr.h"
+#include "hash.h"
+#include "msxfuncs.h"
 #include <stdio.h>
 
 
@@ -70,6 +72,8 @@ typedef  float REAL4;
 #define   PI           3.141592654
 #define   VISCOS       1.1E-5          // Kinematic viscosity of water
                                        // @ 20 deg C (sq ft/sec)
+#define   MAX_BATCH    32              // Max. # pipe segments reacted together
+#define   MIN_BATCH    4               // Min. # segments for batch evaluation
 
 //-----------------------------------------------------------------------------
 //  Various conversion factors
@@ -178,11 +182,30 @@ struct Sseg                            // PIPE SEGMENT OBJECT
     double    v;                       // segment volume
     double    *c;                      // species concentrations
     double    * lastc;                 // species concentrations of previous step 
-    struct    Sseg *prev;              // ptr. to previous segment
-    struct    Sseg *next;              // ptr. to next segment
+    char      quiet;                   // quiescence of its reactions (see msxchem.c)
+    double    qtime;                   // reaction time skipped while quiescent
+    double    qlimit;                  // reaction time that can be skipped
+    double    qdrift;                  // change by transport while quiescent
 };
 typedef struct Sseg *Pseg;
 
+typedef struct                         // SEGMENTS OF A PIPE OR TANK
+{
+    int       size;                    // number of slots (a power of 2)
+    int       first;                   // slot of first (downstream) segment
+    int       count;                   // number of segments held
+    struct    Sseg *seg;               // segment slots
+    double    *cblock;                 // packed c & lastc of every slot
+} SsegRing;
+
+//-----------------------------------------------------------------------------
+//  Macros to access the segments of a ring, numbered from 0 at the
+//  first (downstream) end to count-1 at the last (upstream) end
+//-----------------------------------------------------------------------------
+#define SEG_AT(r,i)   ( &(r)->seg[((r)->first + (i)) & ((r)->size - 1)] )
+#define FIRST_SEG(r)  ( ((r)->count > 0) ? SEG_AT(r, 0) : NULL )
+#define LAST_SEG(r)   ( ((r)->count > 0) ? SEG_AT(r, (r)->count - 1) : NULL )
+
 
 #define MAXUNITS  16
 typedef struct                         // CHEMICAL SPECIES OBJECT
@@ -231,6 +254,39 @@ typedef struct                         // FILE OBJECT
    FILE*         file;                 // FILE structure pointer
 }  TFile;
 
+typedef struct                         // MEMORY-MAPPED HYDRAULICS FILE
+{
+   char          *view;                // mapped view of the file
+   size_t        size;                 // size of the view (bytes)
+   size_t        pos;                  // offset of next hydraulic period
+   void          *handle;              // file mapping handle (Windows only)
+   REAL4         *D, *H, *Q;           // project's own demand, head & flow arrays
+}  ShydMap;
+
+typedef struct                         // MEMORY-MAPPED OUTPUT FILE & RESULTS
+{
+   char          *view;                // mapped view of the file
+   size_t        size;                 // size of the view (bytes)
+   void          *handle;              // file mapping handle (Windows only)
+   REAL4         *period;              // results of all nodes & links in a period
+   double        *stats1;              // running sum or min. of each result
+   double        *stats2;              // running max. of each result
+   REAL4         *series;              // reported time series of each species
+}  SoutMap;
+
+typedef struct                         // COMPILED CHEMISTRY LIBRARY
+{
+   char          *fname;               // Prefix used for all file names
+   char          tempName[L_tmpnam];   // Temporary file name
+   char          srcFile[MAXFNAME];    // Name of source code file
+   char          objFile[MAXFNAME];    // Name of object file
+   char          libFile[MAXFNAME];    // Name of library file
+   char          cacheFile[MAXFNAME];  // Name of library file in the cache
+   int           compiled;             // Flag for compilation step
+   int           cached;               // Flag for library kept in the cache
+   MSXchemFuncs  funcs;                // Functions loaded from the library
+}  Scompiler;
+
 
 
 struct Sadjlist           // Node Adjacency List Item
@@ -258,14 +314,25 @@ typedef struct                 // Mass Balance Components
     double   * ratio;           // ratio of mass added to mass lost
 } SmassBalance;
 
+typedef struct                 // Transport Work Space (one per thread)
+{
+    double   * C1;              // species concentration vector
+    double   * MassIn;          // mass inflow of each species to a node
+    double   * SourceIn;        // mass inflow of each species from WQ sources
+    double   * MassInflow;      // mass balance inflow accumulated by thread
+    double   * MassOutflow;     // mass balance outflow accumulated by thread
+} SqualWorker;
+
 typedef struct Project                 // MSX PROJECT VARIABLES
 {
    TFile  HydFile,                     // EPANET hydraulics file
           MsxFile,                     // MSX input file
           OutFile,                     // MSX binary output file
-          TmpOutFile,                  // Scratch MSX binary output file
           RptFile;                     // MSX report file
 
+   ShydMap HydMap;                     // Memory-mapped hydraulics file
+   SoutMap OutMap;                     // Memory-mapped output file & results
+
    char   Title[MAXLINE+1],            // Project title
           Msg[MAXLINE+1];              // Message string
 
@@ -279,6 +346,9 @@ typedef struct Project                 // MSX PROJECT VARIABLES
           AreaUnits,                   // Surface area units
           RateUnits,                   // Reaction rate time units
           Solver,                      // Choice of ODE solver
+          Jacobian,                    // Jacobian updating by the ROS2 solver
+          Splitting,                   // Splitting of reaction & transport
+          Stepping,                    // Choice of quality time step
           PageSize,                    // Lines per page in report
           Nperiods,                    // Number of reporting periods
           ErrCode,                     // Error code
@@ -289,6 +359,7 @@ typedef struct Project                 // MSX PROJECT VARIABLES
 
    long   HydOffset,                   // Hydraulics file byte offset
           Qstep,                       // Quality time step (sec)
+          Qdt,                         // Quality time step in use (sec)
           Pstep,                       // Time pattern time step (sec)
           Pstart,                      // Starting pattern time (sec)
           Rstep,                       // Reporting time step (sec)
@@ -307,12 +378,12 @@ typedef struct Project                 // MSX PROJECT VARIABLES
    double Ucf[MAX_UNIT_TYPES],         // Unit conversion factors
           DefRtol,                     // Default relative error tolerance
           DefAtol,                     // Default absolute error tolerance
+          Treact,                      // Strang reaction time still pending (sec)
           *K,                          // Vector of expression constants       //1.1.00
           *C0,                         // Species initial quality vector
           *C1;                         // Species concentration vector
 
-   Pseg   *FirstSeg,                   // First WQ segment in each pipe/tank
-          *LastSeg;                    // Last WQ segment in each pipe/tank
+   SsegRing *Segs;                     // WQ segments in each pipe/tank
 
    Sspecies *Species;                  // WQ species data
    Sparam   *Param;                    // Expression parameters
@@ -325,15 +396,27 @@ typedef struct Project                 // MSX PROJECT VARIABLES
    
    char      HasWallSpecies;  // wall species indicator
    char      OutOfMemory;     // out of memory indicator
+   char      HydChanged;      // new hydraulic snapshot indicator
+   char      CoeffChanged;    // new constant or parameter value indicator
+   long      NumReacted;      // number of segment reaction integrations
+   long      NumSkipped;      // number of them skipped as quiescent
    Padjlist* Adjlist;                   // Node adjacency lists
-   Pseg* NewSeg;         // new segment added to each pipe
-   Pseg  FreeSeg;        // pointer to unused segment
+   struct Sseg* NewSeg;  // new segment added to each pipe
    FlowDirection *FlowDir;        // flow direction for each pipe
    SmassBalance MassBalance;
-   alloc_handle_t* QualPool;       // memory pool
 
-   double* MassIn;        // mass inflow of each species to each node
-   double* SourceIn;      // external mass inflow of each species from WQ source;
-   int* SortedNodes;
+   int* SortedNodes;      // nodes in topological order, grouped by level
+   int* LevelStart;       // position in SortedNodes where each level starts
+   int* SortedWork;       // routing work of the sorted nodes up to each one
+   int  NumLevels;        // number of levels of sorted nodes
+   int  NumThreads;       // number of threads used for routing & reactions
+   SqualWorker* QualWorker;   // transport work space of each thread
+
+   alloc_handle_t* HashPool;           // memory pool for object ID names
+   HTtable* Htable[MAX_OBJECTS];       // hash tables for object ID names
+   int       MathError;                // math error flag
+   char      MathErrorMsg[1024];       // math error message
+   Scompiler ChemLib;                  // compiled chemistry functions
+   struct ChemSystem* Chem;            // chemistry solver data (see msxchem.c)
 
 } *MSXproject;
@@ -37,6 +37,9 @@
 
 #define UCHAR(x) (((x) >= 'a' && (x) <= 'z') ? ((x)&~32) : (x))
 #define TINY1 1.0e-20
+#define MIN_SPARSE_SIZE 8       // Smallest matrix factorized as a sparse one
+#define SPARSE_PIVOT 1.0e-8     // Smallest pivot of a sparse LU factorization
+                                // relative to the largest entry in its row
 
 //=============================================================================
 
@@ -457,6 +460,133 @@ void solve(double **a, int n, int *indx, double b[])
 
 //=============================================================================
 
+int expMatrix(double **a, int n, double **e, double **w, double *v, int *indx)
+/**
+**  Purpose:
+**    computes the exponential of a square matrix.
+**
+**  Input:
+**    a[1..n][1..n] = a square matrix (overwritten)
+**    n = matrix size
+**    w[][] = a work matrix with 3*(n+1) rows of n+1 columns
+**    v[1..n] = a work vector
+**    indx[1..n] = a work vector.
+**
+**  Output:
+**    e[1..n][1..n] = exponential of the matrix.
+**
+**  Returns:
+**    1 if successful, 0 if the matrix holds values that are too large.
+**
+**  Notes:
+**  1. Uses a (6,6) Pade approximation with scaling and squaring, as in
+**     Algorithm 11.3.1 of Golub, G.H. and Van Loan, C.F., "Matrix
+**     Computations", 3rd Ed., Johns Hopkins University Press, 1996.
+**
+**  2. The arrays and matrices used in this function are 1-based, so
+**     they must have been sized to n+1 when first created.
+*/
+{
+    int    i, j, k, l, s, q = 6;
+    double c, x, norm, scale;
+    double **p = w;             // powers of the scaled matrix
+    double **d = w + (n+1);     // denominator of the approximation
+    double **t = w + 2*(n+1);   // product of two matrices
+
+// --- scale the matrix so that its norm is no more than 1/2
+
+    norm = 0.0;
+    for (i=1; i<=n; i++)
+    {
+        x = 0.0;
+        for (j=1; j<=n; j++) x += fabs(a[i][j]);
+        if ( x > norm ) norm = x;
+    }
+    if ( !(norm < 1.0e100) ) return 0;
+    s = 0;
+    while ( norm > 0.5 )
+    {
+        norm = 0.5*norm;
+        s++;
+    }
+    scale = ldexp(1.0, -s);
+
+// --- form the numerator (in e) and denominator of the approximation
+
+    c = 0.5;
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++)
+        {
+            a[i][j] *= scale;
+            p[i][j] = a[i][j];
+            e[i][j] = c*a[i][j];
+            d[i][j] = -c*a[i][j];
+        }
+        e[i][i] += 1.0;
+        d[i][i] += 1.0;
+    }
+    for (k=2; k<=q; k++)
+    {
+        c = c * (q-k+1) / (k * (2*q-k+1));
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++)
+            {
+                x = 0.0;
+                for (l=1; l<=n; l++) x += a[i][l]*p[l][j];
+                t[i][j] = x;
+            }
+        }
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++)
+            {
+                p[i][j] = t[i][j];
+                e[i][j] += c*p[i][j];
+                if ( k % 2 == 0 ) d[i][j] += c*p[i][j];
+                else              d[i][j] -= c*p[i][j];
+            }
+        }
+    }
+
+// --- divide the numerator by the denominator
+
+    if ( !factorize(d, n, v, indx) ) return 0;
+    for (j=1; j<=n; j++)
+    {
+        for (i=1; i<=n; i++) v[i] = e[i][j];
+        solve(d, n, indx, v);
+        for (i=1; i<=n; i++) t[i][j] = v[i];
+    }
+
+// --- square the result once for each halving of the matrix
+
+    for (k=1; k<=s; k++)
+    {
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++)
+            {
+                x = 0.0;
+                for (l=1; l<=n; l++) x += t[i][l]*t[l][j];
+                e[i][j] = x;
+            }
+        }
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++) t[i][j] = e[i][j];
+        }
+    }
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) e[i][j] = t[i][j];
+    }
+    return 1;
+}
+
+//=============================================================================
+
 void jacobian(MSXproject MSX, double *x, int n, double *f, double *w, double **a,
               void (*func)(MSXproject, double, double*, int, double*))
 /**
@@ -531,12 +661,379 @@ void jacobian(MSXproject MSX, double *x, int n, double *f, double *w, double **a
 
 }
 
-int checkID(char *id)
+//=============================================================================
+
+MSXSparse * createSparse(int n, char *pattern)
+/**
+**  Purpose:
+**    creates the sparsity structure of a Jacobian matrix.
+**
+**  Input:
+**    n = matrix size
+**    pattern[] = 1 if row i of the matrix depends on column j (stored
+**                at pattern[i*(n+1)+j], i,j = 1..n), 0 if not.
+**
+**  Returns:
+**    a pointer to the sparsity structure (NULL if out of memory).
+**
+**  Notes:
+**  1. Columns that have no non-zero row in common are put in the same
+**     group (by greedy graph coloring) so that sparseJacobian can find
+**     their derivatives with the same function evaluations.
+**  2. The rows & columns are ordered by minimum degree of the matrix's
+**     symmetric pattern to limit fill-in. The non-zeros of the LU factors
+**     (the symmetric pattern plus its fill-in) are listed row by row in
+**     that order for sparseFactorize and sparseSolve, which do not pivot.
+*/
+{
+    int i, j, k, g, m, n1 = n + 1, nnz, best, degree;
+    char *adj, *rows;
+    int *group, *done;
+    MSXSparse *sp;
+
+    sp = (MSXSparse *)calloc(1, sizeof(MSXSparse));
+    adj = (char *)calloc(n1*n1, sizeof(char));
+    rows = (char *)calloc(n1*n1, sizeof(char));
+    group = (int *)calloc(n1, sizeof(int));
+    done = (int *)calloc(n1, sizeof(int));
+    if ( sp && adj && rows && group && done )
+    {
+        sp->n = n;
+        nnz = 0;
+        for (k=0; k<n1*n1; k++) nnz += (pattern[k] != 0);
+        sp->colStart = (int *)calloc(n+2, sizeof(int));
+        sp->colRow = (int *)calloc(nnz+1, sizeof(int));
+        sp->groupStart = (int *)calloc(n+2, sizeof(int));
+        sp->groupCol = (int *)calloc(n1, sizeof(int));
+        sp->perm = (int *)calloc(n1, sizeof(int));
+        sp->rowStart = (int *)calloc(n+2, sizeof(int));
+        sp->rowDiag = (int *)calloc(n1, sizeof(int));
+    }
+    if ( !sp || !adj || !rows || !group || !done || !sp->colStart ||
+         !sp->colRow || !sp->groupStart || !sp->groupCol || !sp->perm ||
+         !sp->rowStart || !sp->rowDiag )
+    {
+        freeSparse(sp);
+        sp = NULL;
+    }
+
+// --- list the non-zero rows of each column
+
+    else
+    {
+        m = 0;
+        for (j=1; j<=n; j++)
+        {
+            sp->colStart[j] = m;
+            for (i=1; i<=n; i++) if ( pattern[i*n1+j] ) sp->colRow[m++] = i;
+        }
+        sp->colStart[n1] = m;
+
+    // --- put each column in the first group with none of its rows
+
+        sp->ngroups = 0;
+        for (j=1; j<=n; j++)
+        {
+            for (g=1; g<=sp->ngroups; g++)
+            {
+                for (m=sp->colStart[j]; m<sp->colStart[j+1]; m++)
+                {
+                    if ( rows[g*n1+sp->colRow[m]] ) break;
+                }
+                if ( m == sp->colStart[j+1] ) break;
+            }
+            if ( g > sp->ngroups ) sp->ngroups = g;
+            group[j] = g;
+            for (m=sp->colStart[j]; m<sp->colStart[j+1]; m++)
+            {
+                rows[g*n1+sp->colRow[m]] = 1;
+            }
+        }
+        m = 0;
+        for (g=1; g<=sp->ngroups; g++)
+        {
+            sp->groupStart[g] = m;
+            for (j=1; j<=n; j++) if ( group[j] == g ) sp->groupCol[m++] = j;
+        }
+        sp->groupStart[sp->ngroups+1] = m;
+
+    // --- eliminate the node of least degree of the symmetric pattern's
+    //     graph, joining its remaining neighbors (i.e., adding fill-in)
+
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++)
+            {
+                if ( pattern[i*n1+j] || pattern[j*n1+i] || i == j ) adj[i*n1+j] = 1;
+            }
+        }
+        for (k=1; k<=n; k++)
+        {
+            best = 0;
+            m = n1;
+            for (i=1; i<=n; i++)
+            {
+                if ( done[i] ) continue;
+                degree = 0;
+                for (j=1; j<=n; j++) degree += ( !done[j] && adj[i*n1+j] );
+                if ( degree < m )
+                {
+                    m = degree;
+                    best = i;
+                }
+            }
+            sp->perm[k] = best;
+            done[best] = 1;
+            for (i=1; i<=n; i++)
+            {
+                if ( done[i] || !adj[best*n1+i] ) continue;
+                for (j=1; j<=n; j++)
+                {
+                    if ( !done[j] && adj[best*n1+j] ) adj[i*n1+j] = 1;
+                }
+            }
+        }
+
+    // --- list the non-zeros of each row of the LU factors in
+    //     elimination order
+
+        nnz = 0;
+        for (k=0; k<n1*n1; k++) nnz += adj[k];
+        sp->rowCol = (int *)calloc(nnz+1, sizeof(int));
+        if ( sp->rowCol == NULL )
+        {
+            freeSparse(sp);
+            sp = NULL;
+        }
+        else
+        {
+            m = 0;
+            for (k=1; k<=n; k++)
+            {
+                sp->rowStart[k] = m;
+                for (j=1; j<=n; j++)
+                {
+                    if ( j == k ) sp->rowDiag[k] = m;
+                    if ( adj[sp->perm[k]*n1+sp->perm[j]] ) sp->rowCol[m++] = j;
+                }
+            }
+            sp->rowStart[n1] = m;
+            sp->factor = ( n >= MIN_SPARSE_SIZE && 2*nnz <= n*n );
+        }
+    }
+    free(adj);
+    free(rows);
+    free(group);
+    free(done);
+    return sp;
+}
+
+//=============================================================================
+
+void freeSparse(MSXSparse *sp)
+/**
+**  Purpose:
+**    frees the memory allocated for a sparsity structure.
+**
+**  Input:
+**    sp = pointer to a sparsity structure.
+*/
+{
+    if ( sp == NULL ) return;
+    free(sp->groupStart);
+    free(sp->groupCol);
+    free(sp->colStart);
+    free(sp->colRow);
+    free(sp->perm);
+    free(sp->rowStart);
+    free(sp->rowCol);
+    free(sp->rowDiag);
+    free(sp);
+}
+
+//=============================================================================
+
+int sparseFactorize(MSXSparse *sp, double **a, double **lu)
+/**
+**  Purpose:
+**    performs an LU decomposition of a sparse matrix.
+**
+**  Input:
+**    sp = sparsity structure of the matrix (see createSparse)
+**    a[1..n][1..n] = a square matrix of doubles.
+**
+**  Output:
+**    lu[][] = matrix that contains the elements of the L and U matrices
+**             (in the rows & columns of a[][] they belong to).
+**
+**  Returns:
+**    1 if successful, 0 if a pivot is too small (the matrix should
+**    then be factorized with pivoting).
+**
+**  Note:
+**    Only the non-zeros of the LU factors are computed, one row at a
+**    time in elimination order, so a[][] must be zero outside of the
+**    pattern the structure was created from.
+*/
+{
+    int    k, j, m, p, q, pk, pj;
+    double d, scale;
+
+    for (k = 1; k <= sp->n; k++)
+    {
+        pk = sp->perm[k];
+        scale = 0.0;
+        for (p = sp->rowStart[k]; p < sp->rowStart[k+1]; p++)
+        {
+            j = sp->perm[sp->rowCol[p]];
+            lu[pk][j] = a[pk][j];
+            scale = fmax(scale, fabs(a[pk][j]));
+        }
+
+    // --- eliminate the entries of row k left of the diagonal
+
+        for (p = sp->rowStart[k]; p < sp->rowDiag[k]; p++)
+        {
+            j = sp->rowCol[p];
+            pj = sp->perm[j];
+            d = lu[pk][pj] / lu[pj][pj];
+            lu[pk][pj] = d;
+            if ( d == 0.0 ) continue;
+            for (q = sp->rowDiag[j] + 1; q < sp->rowStart[j+1]; q++)
+            {
+                m = sp->perm[sp->rowCol[q]];
+                lu[pk][m] -= d * lu[pj][m];
+            }
+        }
+        if ( fabs(lu[pk][pk]) <= SPARSE_PIVOT * scale ) return 0;
+    }
+    return 1;
+}
+
+//=============================================================================
+
+void sparseSolve(MSXSparse *sp, double **lu, double b[], double w[])
+/**
+**  Purpose:
+**    solves linear equations AX = B after sparse LU decomposition of A.
+**
+**  Input:
+**    sp = sparsity structure of A
+**    lu[1..n][1..n] = LU factors of A returned by sparseFactorize
+**    b[1..n] = right-hand side vector B
+**    w[1..n] = a work vector.
+**
+**  Output:
+**    b[1..n] = solution vector X.
+*/
+{
+    int    k, p, n = sp->n;
+    double sum;
+    double *row;
+
+    for (k = 1; k <= n; k++) w[k] = b[sp->perm[k]];
+
+// --- forward substitution
+
+    for (k = 1; k <= n; k++)
+    {
+        row = lu[sp->perm[k]];
+        sum = w[k];
+        for (p = sp->rowStart[k]; p < sp->rowDiag[k]; p++)
+        {
+            sum -= row[sp->perm[sp->rowCol[p]]] * w[sp->rowCol[p]];
+        }
+        w[k] = sum;
+    }
+
+// --- back substitution
+
+    for (k = n; k >= 1; k--)
+    {
+        row = lu[sp->perm[k]];
+        sum = w[k];
+        for (p = sp->rowDiag[k] + 1; p < sp->rowStart[k+1]; p++)
+        {
+            sum -= row[sp->perm[sp->rowCol[p]]] * w[sp->rowCol[p]];
+        }
+        w[k] = sum / row[sp->perm[k]];
+    }
+    for (k = 1; k <= n; k++) b[sp->perm[k]] = w[k];
+}
+
+//=============================================================================
+
+void sparseJacobian(MSXproject MSX, MSXSparse *sp, double *x, int n, double *f,
+                    double *w, double **a,
+                    void (*func)(MSXproject, double, double*, int, double*))
+/**
+**  Purpose:
+**    computes a sparse Jacobian matrix of F(t,X) at given X.
+**
+**  Input:
+**    sp = sparsity structure of the Jacobian
+**    x[1..n] = vector of function variables
+**    n = number of variables
+**    f[1..n] = a work vector
+**    w[1..n] = a work vector
+**    func = user supplied routine that computes the function
+**           values at x (see jacobian()).
+**
+**  Output:
+**    a[1..n][1..n] = coeffs. of the Jacobian matrix.
+**
+**  Notes:
+**    Uses the same central differences as jacobian(), but perturbs all
+**    columns of a group at once since no function depends on more than
+**    one of them. Row 0 of a[][] (which 1-based matrices don't use)
+**    holds the unperturbed variables.
+*/
+{
+    int    i, j, g, p, q;
+    double eps = 1.0e-7, eps2;
+    double *x0 = a[0];
+
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) a[i][j] = 0.0;
+    }
+    for (g=1; g<=sp->ngroups; g++)
+    {
+        for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+        {
+            j = sp->groupCol[p];
+            x0[j] = x[j];
+            x[j] = x0[j] + eps;
+        }
+        func(MSX, 0.0, x, n, f);
+        for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+        {
+            j = sp->groupCol[p];
+            if ( x0[j] == 0.0 ) x[j] = x0[j];
+            else                x[j] = x0[j] - eps;
+        }
+        func(MSX, 0.0, x, n, w);
+        for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+        {
+            j = sp->groupCol[p];
+            eps2 = (x0[j] == 0.0) ? eps : 2.0*eps;
+            for (q=sp->colStart[j]; q<sp->colStart[j+1]; q++)
+            {
+                i = sp->colRow[q];
+                a[i][j] = (f[i] - w[i]) / eps2;
+            }
+            x[j] = x0[j];
+        }
+    }
+}
+
+int checkID(MSXproject MSX, char *id)
 /**
 **  Purpose:
 **    checks that an object's name is unique
 **
 **  Input:
+**    MSX = the underlying MSXproject data struct.
 **    id = name of an object 
 **
 **  Returns:
@@ -553,10 +1050,10 @@ int checkID(char *id)
     
 // --- check that id name not used before
 
-    if ( findObject(SPECIES, id)   > 0 ||
-         findObject(TERM, id)      > 0 ||
-         findObject(PARAMETER, id) > 0 ||
-         findObject(CONSTANT, id)  > 0
+    if ( findObject(MSX, SPECIES, id)   > 0 ||
+         findObject(MSX, TERM, id)      > 0 ||
+         findObject(MSX, PARAMETER, id) > 0 ||
+         findObject(MSX, CONSTANT, id)  > 0
        ) return 407;    //ERR_DUP_NAME
     return 0;
 }        
@@ -13,9 +13,28 @@
 **  LAST UPDATE:   Refer to git history
 *******************************************************************************/
 
+#ifndef MSXUTILS_H
+#define MSXUTILS_H
+
 // Opaque Pointer
 typedef struct Project *MSXproject;
 
+// Sparsity structure of a Jacobian matrix and of its LU factors
+typedef struct
+{
+    int  n;                   // matrix size
+    int  ngroups;             // number of groups of independent columns
+    int  *groupStart;         // columns in group g are groupCol[groupStart[g]]
+    int  *groupCol;           //   to groupCol[groupStart[g+1]-1]
+    int  *colStart;           // non-zero rows of column j are colRow[colStart[j]]
+    int  *colRow;             //   to colRow[colStart[j+1]-1]
+    int  factor;              // 1 if the sparse LU factorization pays off
+    int  *perm;               // perm[k] = row & column eliminated k-th
+    int  *rowStart;           // (permuted) columns of row k of L and U are
+    int  *rowCol;             //   rowCol[rowStart[k]] to rowCol[rowStart[k+1]-1]
+    int  *rowDiag;            // position of the diagonal of row k in rowCol
+} MSXSparse;
+
 // Gets the name of a temporary file                                           //1.1.00
 char * MSXutils_getTempName(char *s);
 
@@ -52,9 +71,31 @@ int factorize(double **a, int n, double *w, int *indx);
 // Solves a factorized, linear system of equations
 void solve(double **a, int n, int *indx, double b[]);
 
+// Computes the exponential of a square matrix
+int expMatrix(double **a, int n, double **e, double **w, double *v, int *indx);
+
 // Computes the Jacobian matrix of a set of functions
 void jacobian(MSXproject MSX, double *x, int n, double *f, double *w, double **a,
               void (*func)(MSXproject, double, double*, int, double*));
 
+// Creates the sparsity structure of a Jacobian matrix
+MSXSparse * createSparse(int n, char *pattern);
+
+// Deletes a sparsity structure
+void freeSparse(MSXSparse *sp);
+
+// Applies a sparse LU factorization to a square matrix
+int sparseFactorize(MSXSparse *sp, double **a, double **lu);
+
+// Solves a linear system of equations factorized by sparseFactorize
+void sparseSolve(MSXSparse *sp, double **lu, double b[], double w[]);
+
+// Computes a sparse Jacobian matrix perturbing groups of columns together
+void sparseJacobian(MSXproject MSX, MSXSparse *sp, double *x, int n, double *f,
+                    double *w, double **a,
+                    void (*func)(MSXproject, double, double*, int, double*));
+
 // Checks for a valid ID
-int checkID(char *id);
\ No newline at end of file
+int checkID(MSXproject MSX, char *id);
+
+#endif
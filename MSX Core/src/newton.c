@@ -21,22 +21,15 @@
 #include "newton.h"
 #include "msxtypes.h"
 
-// Local declarations
-//-------------------
-MSXNewton MSXNewtonSolver;
-
-#ifdef _OPENMP
-#pragma omp threadprivate(MSXNewtonSolver)
-#endif
-
 //=============================================================================
 
-int newton_open(int n)
+int newton_open(MSXNewton *nr, int n)
 /**
 **  Purpose:
 **    opens the algebraic solver to handle a system of n equations.
 **
 **  Input:
+**    nr = solver work space to initialize
 **    n = number of equations
 **
 **  Returns:
@@ -47,69 +40,44 @@ int newton_open(int n)
 **    must be allocated for the unused 0-th position.
 */
 {
-    int errorcode = 1;
-#ifdef _OPENMP 
-#pragma omp parallel
-    {
-#endif
-        MSXNewtonSolver.Nmax = 0;
-        MSXNewtonSolver.Indx = NULL;
-        MSXNewtonSolver.F = NULL;
-        MSXNewtonSolver.W = NULL;
-        MSXNewtonSolver.Indx = (int*)calloc(n + 1, sizeof(int));
-        MSXNewtonSolver.F = (double*)calloc(n + 1, sizeof(double));
-        MSXNewtonSolver.W = (double*)calloc(n + 1, sizeof(double));
-        MSXNewtonSolver.J = createMatrix(n + 1, n + 1);
-#ifdef _OPENMP
-#pragma omp critical
-        {
-#endif
-            if (!MSXNewtonSolver.Indx || !MSXNewtonSolver.F || !MSXNewtonSolver.W || !MSXNewtonSolver.J) 
-                errorcode = 0;
-#ifdef _OPENMP 
-        }
-#endif
-        MSXNewtonSolver.Nmax = n;
-#ifdef _OPENMP
-    }
-#endif
-    return errorcode;
+    nr->Nmax = 0;
+    nr->Indx = (int*)calloc(n + 1, sizeof(int));
+    nr->F = (double*)calloc(n + 1, sizeof(double));
+    nr->W = (double*)calloc(n + 1, sizeof(double));
+    nr->J = createMatrix(n + 1, n + 1);
+    if (!nr->Indx || !nr->F || !nr->W || !nr->J) return 0;
+    nr->Nmax = n;
+    return 1;
 }
 
 //=============================================================================
 
-void newton_close()
+void newton_close(MSXNewton *nr)
 /**
 **  Purpose:
 **    closes the algebraic solver.
 **
 **  Input:
-**    none
+**    nr = solver work space to free
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        if (MSXNewtonSolver.Indx) { free(MSXNewtonSolver.Indx); MSXNewtonSolver.Indx = NULL; }
-        if (MSXNewtonSolver.F) { free(MSXNewtonSolver.F); MSXNewtonSolver.F = NULL; }
-        if (MSXNewtonSolver.W) { free(MSXNewtonSolver.W); MSXNewtonSolver.W = NULL; }
-        freeMatrix(MSXNewtonSolver.J);
-        MSXNewtonSolver.J = NULL;
-#ifdef _OPENMP
-    }
-#endif
+    if (nr->Indx) { free(nr->Indx); nr->Indx = NULL; }
+    if (nr->F) { free(nr->F); nr->F = NULL; }
+    if (nr->W) { free(nr->W); nr->W = NULL; }
+    freeMatrix(nr->J);
+    nr->J = NULL;
 }
 
 //=============================================================================
 
-int newton_solve(MSXproject MSX, double x[], int n, int maxit, int numsig, 
-                 void (*func)(MSXproject, double, double*, int, double*))
+int newton_solve(MSXproject MSX, MSXNewton *nr, double x[], int n, int maxit,
+                 int numsig, void (*func)(MSXproject, double, double*, int, double*))
 /**
 **  Purpose:
 **    uses newton-raphson iterations to solve n nonlinear eqns.
 **
 **  Input:
+**    nr = solver work space
 **    x[] = solution vector
 **    n = number of equations
 **    maxit = max. number of iterations allowed
@@ -133,23 +101,23 @@ int newton_solve(MSXproject MSX, double x[], int n, int maxit, int numsig,
 
     // --- check that system was sized adequetely
 
-    if ( n > MSXNewtonSolver.Nmax ) return -3;
+    if ( n > nr->Nmax ) return -3;
 
     // --- use up to maxit iterations to find a solution
 
 	for (k=1; k<=maxit; k++) 
 	{
         // --- evaluate the Jacobian matrix
-        jacobian(MSX, x, n, MSXNewtonSolver.F, MSXNewtonSolver.W, MSXNewtonSolver.J, func);
+        jacobian(MSX, x, n, nr->F, nr->W, nr->J, func);
 
         // --- factorize the Jacobian
 
-        if ( !factorize(MSXNewtonSolver.J, n, MSXNewtonSolver.W, MSXNewtonSolver.Indx) ) return -1;
+        if ( !factorize(nr->J, n, nr->W, nr->Indx) ) return -1;
 
         // --- solve for the updates to x (returned in F)
 
-		for (i=1; i<=n; i++) MSXNewtonSolver.F[i] = -MSXNewtonSolver.F[i];
-        solve(MSXNewtonSolver.J, n, MSXNewtonSolver.Indx, MSXNewtonSolver.F);
+		for (i=1; i<=n; i++) nr->F[i] = -nr->F[i];
+        solve(nr->J, n, nr->Indx, nr->F);
 		
 		// --- update solution x & check for convergence
 
@@ -158,8 +126,8 @@ int newton_solve(MSXproject MSX, double x[], int n, int maxit, int numsig,
         {
 			cscal = x[i];
             if (cscal < relconvg) cscal = relconvg;
-			x[i] += MSXNewtonSolver.F[i];
-            errx = fabs(MSXNewtonSolver.F[i]/cscal);
+			x[i] += nr->F[i];
+            errx = fabs(nr->F[i]/cscal);
             if (errx > errmax) errmax = errx;
         }
 		if (errmax <= relconvg) return k;
@@ -25,11 +25,11 @@ typedef struct
 } MSXNewton;
 
 // Opens the equation solver system
-int  newton_open(int n);
+int  newton_open(MSXNewton *nr, int n);
 
 // Closes the equation solver system
-void newton_close(void);
+void newton_close(MSXNewton *nr);
 
 // Applies the solver to a specific system of equations
-int  newton_solve(MSXproject MSX, double x[], int n, int maxit, int numsig,  
-                  void (*func)(MSXproject, double, double*, int, double*));
+int  newton_solve(MSXproject MSX, MSXNewton *nr, double x[], int n, int maxit,
+                  int numsig, void (*func)(MSXproject, double, double*, int, double*));
@@ -19,27 +19,21 @@
 
 #include <stdlib.h>
 #include <math.h>
-#include "rk5.h"
 #include "msxtypes.h"
+#include "rk5.h"
 
 #define fmin(x,y) (((x)<=(y)) ? (x) : (y))     /* minimum of x and y    */
 #define fmax(x,y) (((x)>=(y)) ? (x) : (y))     /* maximum of x and y    */
 
-//  Local variables
-//-----------------
-MSXRungeKutta MSXRungeKuttaSolver;
-
-#ifdef _OPENMP
-#pragma omp threadprivate(MSXRungeKuttaSolver)
-#endif
 //=============================================================================
 
-int rk5_open(int n, int itmax, int adjust)
+int rk5_open(MSXRungeKutta *rk, int n, int itmax, int adjust)
 /**
 **  Purpose:
 **    Opens the RK5 solver to solve system of n equations
 **
 **  Input:
+**    rk = solver work space to initialize
 **    n = number of equtions
 **    itmax = maximum iterations allowed
 **    adjust = 1 if time step adjustment used, 0 if not
@@ -49,65 +43,56 @@ int rk5_open(int n, int itmax, int adjust)
 */
 {
     int n1 = n+1;
-    int errorcode = 1;
-    MSXRungeKuttaSolver.Report = NULL;
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        MSXRungeKuttaSolver.Nmax = 0;
-        MSXRungeKuttaSolver.Itmax = itmax;
-        MSXRungeKuttaSolver.Adjust = adjust;
-        MSXRungeKuttaSolver.Ynew = (double*)calloc(n1, sizeof(double));
-        MSXRungeKuttaSolver.Ak = (double*)calloc(6 * n1, sizeof(double));
-#ifdef _OPENMP
-#pragma omp critical
-        {
-#endif
-         if (!MSXRungeKuttaSolver.Ynew || !MSXRungeKuttaSolver.Ak) errorcode = 0;
-#ifdef _OPENMP 
-        }
-#endif
-        MSXRungeKuttaSolver.Nmax = n;
-        MSXRungeKuttaSolver.K1 = (MSXRungeKuttaSolver.Ak);
-        MSXRungeKuttaSolver.K2 = ((MSXRungeKuttaSolver.Ak)+(n1));
-        MSXRungeKuttaSolver.K3 = ((MSXRungeKuttaSolver.Ak)+(2 * n1));
-        MSXRungeKuttaSolver.K4 = ((MSXRungeKuttaSolver.Ak)+(3 * n1));
-        MSXRungeKuttaSolver.K5 = ((MSXRungeKuttaSolver.Ak)+(4 * n1));
-        MSXRungeKuttaSolver.K6 = ((MSXRungeKuttaSolver.Ak)+(5 * n1));
-#ifdef _OPENMP
-    }
-#endif
-    return errorcode;
+    rk->Report = NULL;
+    rk->Nmax = 0;
+    rk->Itmax = itmax;
+    rk->Adjust = adjust;
+    rk->Ynew = (double*)calloc(n1, sizeof(double));
+    rk->Ak = (double*)calloc(6 * n1, sizeof(double));
+    rk->BatchAk = (double*)calloc(8 * n1 * MAX_BATCH, sizeof(double));
+    rk->BatchLaneAk = (double*)calloc(4 * MAX_BATCH, sizeof(double));
+    rk->BatchLaneIk = (int*)calloc(4 * MAX_BATCH, sizeof(int));
+    if (!rk->Ynew || !rk->Ak) return 0;
+    if (!rk->BatchAk || !rk->BatchLaneAk || !rk->BatchLaneIk) return 0;
+    rk->Nmax = n;
+    rk->K1 = (rk->Ak);
+    rk->K2 = ((rk->Ak)+(n1));
+    rk->K3 = ((rk->Ak)+(2 * n1));
+    rk->K4 = ((rk->Ak)+(3 * n1));
+    rk->K5 = ((rk->Ak)+(4 * n1));
+    rk->K6 = ((rk->Ak)+(5 * n1));
+    return 1;
 }
 
 //=============================================================================
 
-void rk5_close()
+void rk5_close(MSXRungeKutta *rk)
 /**
 **  Purpose:
 **    Closes the RK5 solver.
+**
+**  Input:
+**    rk = solver work space to free
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        if (MSXRungeKuttaSolver.Ynew) free(MSXRungeKuttaSolver.Ynew);
-        MSXRungeKuttaSolver.Ynew = NULL;
-        if (MSXRungeKuttaSolver.Ak) free(MSXRungeKuttaSolver.Ak);
-        MSXRungeKuttaSolver.Ak = NULL;
-        MSXRungeKuttaSolver.Nmax = 0;
-        MSXRungeKuttaSolver.Report = NULL;
-#ifdef _OPENMP
-    }
-#endif
+    if (rk->Ynew) free(rk->Ynew);
+    rk->Ynew = NULL;
+    if (rk->Ak) free(rk->Ak);
+    rk->Ak = NULL;
+    if (rk->BatchAk) free(rk->BatchAk);
+    rk->BatchAk = NULL;
+    if (rk->BatchLaneAk) free(rk->BatchLaneAk);
+    rk->BatchLaneAk = NULL;
+    if (rk->BatchLaneIk) free(rk->BatchLaneIk);
+    rk->BatchLaneIk = NULL;
+    rk->Nmax = 0;
+    rk->Report = NULL;
 }
 
 //=============================================================================
 
-int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
-                  double* htry, double atol[], double rtol[],
+int rk5_integrate(MSXproject MSX, MSXRungeKutta *rk, double y[], int n,
+                  double t, double tnext, double* htry, double atol[], double rtol[],
                   void (*func)(MSXproject, double, double*, int, double*))
 /**
 **  Purpose:
@@ -115,6 +100,7 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
 **    given interval.
 **
 **  Input:
+**    rk     =  solver work space
 **    y[]    =  values of dependent variables at start of interval
 **    n      =  number of dependent variables
 **    t      =  value of independent variable at start of interval
@@ -168,11 +154,11 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
     int    naccpt = 0;
     int    nrejct = 0;
     int    reject = 0;
-    int    adjust = MSXRungeKuttaSolver.Adjust;
+    int    adjust = rk->Adjust;
 
 // --- initial function evaluation
 
-    func(MSX, t, y, n, MSXRungeKuttaSolver.K1);
+    func(MSX, t, y, n, rk->K1);
     nfcn++;
 
 // --- initial step size
@@ -185,8 +171,8 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
         for (i=1; i<=n; i++)
         {
             ytol = atol[i] + rtol[i]*fabs(y[i]);
-            if (MSXRungeKuttaSolver.K1[i] != 0.0)
-                h = fmin(h, (ytol/fabs(MSXRungeKuttaSolver.K1[i])));
+            if (rk->K1[i] != 0.0)
+                h = fmin(h, (ytol/fabs(rk->K1[i])));
         }
     }
     h = fmax(1.e-8, h);
@@ -203,34 +189,34 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
 
         tnew = t + c2*h;
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i] = y[i] + h*a21* MSXRungeKuttaSolver.K1[i];
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K2);
+            rk->Ynew[i] = y[i] + h*a21* rk->K1[i];
+        func(MSX, tnew, rk->Ynew, n, rk->K2);
 
         tnew = t + c3*h;
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i] = y[i] + h*(a31* MSXRungeKuttaSolver.K1[i] + a32* MSXRungeKuttaSolver.K2[i]);
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K3);
+            rk->Ynew[i] = y[i] + h*(a31* rk->K1[i] + a32* rk->K2[i]);
+        func(MSX, tnew, rk->Ynew, n, rk->K3);
 
         tnew = t + c4*h;
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i]=y[i] + h*(a41* MSXRungeKuttaSolver.K1[i] + a42* MSXRungeKuttaSolver.K2[i] + a43* MSXRungeKuttaSolver.K3[i]);
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K4);
+            rk->Ynew[i]=y[i] + h*(a41* rk->K1[i] + a42* rk->K2[i] + a43* rk->K3[i]);
+        func(MSX, tnew, rk->Ynew, n, rk->K4);
 
         tnew = t + c5*h;
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i] = y[i] + h*(a51* MSXRungeKuttaSolver.K1[i] + a52* MSXRungeKuttaSolver.K2[i] + a53* MSXRungeKuttaSolver.K3[i]+a54* MSXRungeKuttaSolver.K4[i]);
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K5);
+            rk->Ynew[i] = y[i] + h*(a51* rk->K1[i] + a52* rk->K2[i] + a53* rk->K3[i]+a54* rk->K4[i]);
+        func(MSX, tnew, rk->Ynew, n, rk->K5);
 
         tnew = t + h;
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i] = y[i] + h*(a61* MSXRungeKuttaSolver.K1[i] + a62* MSXRungeKuttaSolver.K2[i] +
-	                  a63* MSXRungeKuttaSolver.K3[i] + a64* MSXRungeKuttaSolver.K4[i] + a65* MSXRungeKuttaSolver.K5[i]);
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K6);
+            rk->Ynew[i] = y[i] + h*(a61* rk->K1[i] + a62* rk->K2[i] +
+	                  a63* rk->K3[i] + a64* rk->K4[i] + a65* rk->K5[i]);
+        func(MSX, tnew, rk->Ynew, n, rk->K6);
 
         for (i=1; i<=n; i++)
-            MSXRungeKuttaSolver.Ynew[i] = y[i] + h*(a71* MSXRungeKuttaSolver.K1[i] + a73* MSXRungeKuttaSolver.K3[i] +
-	                  a74* MSXRungeKuttaSolver.K4[i] + a75* MSXRungeKuttaSolver.K5[i] + a76* MSXRungeKuttaSolver.K6[i]);
-        func(MSX, tnew, MSXRungeKuttaSolver.Ynew, n, MSXRungeKuttaSolver.K2);
+            rk->Ynew[i] = y[i] + h*(a71* rk->K1[i] + a73* rk->K3[i] +
+	                  a74* rk->K4[i] + a75* rk->K5[i] + a76* rk->K6[i]);
+        func(MSX, tnew, rk->Ynew, n, rk->K2);
         nfcn += 6;
 
     // --- step size adjustment
@@ -240,13 +226,13 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
         if (adjust)
         {
             for (i=1; i<=n; i++)
-                MSXRungeKuttaSolver.K4[i] = (e1* MSXRungeKuttaSolver.K1[i] + e3* MSXRungeKuttaSolver.K3[i] + e4* MSXRungeKuttaSolver.K4[i] + e5* MSXRungeKuttaSolver.K5[i] +
-                         e6* MSXRungeKuttaSolver.K6[i] + e7* MSXRungeKuttaSolver.K2[i])*h;
+                rk->K4[i] = (e1* rk->K1[i] + e3* rk->K3[i] + e4* rk->K4[i] + e5* rk->K5[i] +
+                         e6* rk->K6[i] + e7* rk->K2[i])*h;
  
             for (i=1; i<=n; i++)
             {
-                sk = atol[i] + rtol[i]*fmax(fabs(y[i]), fabs(MSXRungeKuttaSolver.Ynew[i]));
-                sk = MSXRungeKuttaSolver.K4[i]/sk;
+                sk = atol[i] + rtol[i]*fmax(fabs(y[i]), fabs(rk->Ynew[i]));
+                sk = rk->K4[i]/sk;
                 err = err + (sk*sk);
             }
             err = sqrt(err/n);
@@ -266,15 +252,15 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
             naccpt++;
             for (i=1; i<=n; i++)
             {
-                MSXRungeKuttaSolver.K1[i] = MSXRungeKuttaSolver.K2[i];
-                y[i] = MSXRungeKuttaSolver.Ynew[i];
+                rk->K1[i] = rk->K2[i];
+                y[i] = rk->Ynew[i];
             }
             t = t + h;
             if ( adjust && t <= tnext ) *htry = h;
             if (fabs(hnew) > hmax) hnew = hmax; 
             if (reject) hnew = fmin(fabs(hnew), fabs(h));
             reject = 0;
-            if (MSXRungeKuttaSolver.Report) MSXRungeKuttaSolver.Report(t, y, n);
+            if (rk->Report) rk->Report(t, y, n);
         } 
   
     // --- step is rejected
@@ -291,7 +277,300 @@ int rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
         h = hnew;
         if ( adjust ) *htry = h;
         nstep++;
-        if (nstep >= MSXRungeKuttaSolver.Itmax) return -1;
+        if (nstep >= rk->Itmax) return -1;
+    }
+    return nfcn;
+}
+
+//=============================================================================
+
+int rk5_integrateBatch(MSXproject MSX, MSXRungeKutta *rk, double y[], int n,
+                       int nb, double t, double tnext, double htry[], double atol[],
+                       double rtol[],
+                       void (*func)(MSXproject, int, int*, double*, int, double*))
+/**
+**  Purpose:
+**    Integrates a batch of independent systems of equations dY/dt = F(Y)
+**    over a given interval.
+**
+**  Input:
+**    rk     =  solver work space
+**    y[]    =  values of dependent variables at start of interval
+**    n      =  number of dependent variables in each system
+**    nb     =  number of systems in the batch (no more than MAX_BATCH)
+**    t      =  value of independent variable at start of interval
+**    tnext  =  value of independent variable at end of interval
+**    htry[] =  initial step size for each system
+**    atol[] =  absolute error tolerance on each dependent variable
+**    rtol[] =  relative error tolerance on each dependent variable
+**    func   =  pointer to function that evaluates dY/dt for a batch
+**              of systems.
+**
+**  Output:
+**    y[]    =  values of dependent variables at end of interval
+**    htry[] =  last step size used by each system
+**
+**  Returns:
+**    number of calls made to func if successful, -1 if some system
+**    was not successful within Itmax iterations or -2 if its step
+**    size shrinks to 0.
+**
+**  Notes:
+**  1. Variable i of system l is stored in y[i*MAX_BATCH + l] (i = 1..n,
+**     l = 0..nb-1), so that the systems can be processed together.
+**
+**  2. Each system keeps its own step size and takes exactly the same
+**     steps that rk5_integrate would take for it. Systems that have
+**     reached tnext are dropped from the batch.
+**
+**  3. The arguments to the function func() are:
+**      na = number of systems to evaluate
+**      lane[0..na-1] = index in y[] of each system being evaluated
+**      Y[] = dependent variable values of the systems (in the same
+**            layout as y[])
+**      n = number of dependent variables
+**      F[] = vector of derivative values computed (same layout as Y[]).
+*/
+{
+    double a21=0.20, a31=3.0/40.0, a32=9.0/40.0,
+           a41=44.0/45.0, a42=-56.0/15.0, a43=32.0/9.0,
+           a51=19372.0/6561.0, a52=-25360.0/2187.0, a53=64448.0/6561.0,
+           a54=-212.0/729.0, a61=9017.0/3168.0, a62=-355.0/33.0,
+           a63=46732.0/5247.0, a64=49.0/176.0, a65=-5103.0/18656.0,
+           a71=35.0/384.0, a73=500.0/1113.0, a74=125.0/192.0,
+           a75=-2187.0/6784.0, a76=11.0/84.0;
+    double e1=71.0/57600.0, e3=-71.0/16695.0, e4=71.0/1920.0,
+           e5=-17253.0/339200.0, e6=22.0/525.0, e7=-1.0/40.0;
+
+    double h, hmax, hnew, ytol, err, sk, fac, fac11;
+    int    i, j, l, m, na;
+
+// --- parameters for step size control
+
+    double UROUND = 2.3e-16;
+    double SAFE = 0.90;
+    double fac1 = 0.2;
+    double fac2 = 10.0;
+    double beta = 0.04;
+    double expo1 = 0.2 - beta*0.75;
+    double facc1 = 1.0/fac1;
+    double facc2 = 1.0/fac2;
+    int    nfcn  = 0;
+
+// --- work arrays (variables are stored by rows of MAX_BATCH systems)
+
+    int     size = (n+1) * MAX_BATCH;
+    double* Y    = rk->BatchAk;
+    double* Ynew = Y + size;
+    double* K1   = Y + 2*size;
+    double* K2   = Y + 3*size;
+    double* K3   = Y + 4*size;
+    double* K4   = Y + 5*size;
+    double* K5   = Y + 6*size;
+    double* K6   = Y + 7*size;
+
+// --- state of each system in the batch
+
+    double* H      = rk->BatchLaneAk;
+    double* T      = H + MAX_BATCH;
+    double* Htry   = H + 2*MAX_BATCH;
+    double* Facold = H + 3*MAX_BATCH;
+    int*    Lane   = rk->BatchLaneIk;
+    int*    Reject = Lane + MAX_BATCH;
+    int*    Nstep  = Lane + 2*MAX_BATCH;
+    int*    Adjust = Lane + 3*MAX_BATCH;
+
+// --- initial function evaluation
+
+    na = nb;
+    for (i=1; i<=n; i++)
+    {
+        for (l=0; l<na; l++) Y[i*MAX_BATCH+l] = y[i*MAX_BATCH+l];
+    }
+    for (l=0; l<na; l++) Lane[l] = l;
+    func(MSX, na, Lane, Y, n, K1);
+    nfcn++;
+
+// --- initial step sizes
+
+    hmax = tnext - t;
+    for (l=0; l<na; l++)
+    {
+        h = htry[l];
+        Adjust[l] = rk->Adjust;
+        if (h == 0.0)
+        {
+            Adjust[l] = 1;
+            h = tnext - t;
+            for (i=1; i<=n; i++)
+            {
+                j = i*MAX_BATCH + l;
+                ytol = atol[i] + rtol[i]*fabs(Y[j]);
+                if (K1[j] != 0.0) h = fmin(h, (ytol/fabs(K1[j])));
+            }
+        }
+        H[l] = fmax(1.e-8, h);
+        T[l] = t;
+        Htry[l] = htry[l];
+        Facold[l] = 1.e-4;
+        Reject[l] = 0;
+        Nstep[l] = 1;
+    }
+
+// --- while some system is not at end of time interval
+
+    while (na > 0)
+    {
+        for (l=0; l<na; l++)
+        {
+        // --- check for zero step size
+            if (0.10*fabs(H[l]) <= fabs(T[l])*UROUND) return -2;
+
+        // --- adjust step size if interval exceeded
+            if ((T[l] + 1.01*H[l] - tnext) > 0.0) H[l] = tnext - T[l];
+        }
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*a21*K1[j+l];
+        }
+        func(MSX, na, Lane, Ynew, n, K2);
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*(a31*K1[j+l] + a32*K2[j+l]);
+        }
+        func(MSX, na, Lane, Ynew, n, K3);
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*(a41*K1[j+l] + a42*K2[j+l] + a43*K3[j+l]);
+        }
+        func(MSX, na, Lane, Ynew, n, K4);
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*(a51*K1[j+l] + a52*K2[j+l] + a53*K3[j+l] +
+                            a54*K4[j+l]);
+        }
+        func(MSX, na, Lane, Ynew, n, K5);
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*(a61*K1[j+l] + a62*K2[j+l] + a63*K3[j+l] +
+                            a64*K4[j+l] + a65*K5[j+l]);
+        }
+        func(MSX, na, Lane, Ynew, n, K6);
+
+        for (i=1; i<=n; i++)
+        {
+            j = i*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[j+l] = Y[j+l] + H[l]*(a71*K1[j+l] + a73*K3[j+l] + a74*K4[j+l] +
+                            a75*K5[j+l] + a76*K6[j+l]);
+        }
+        func(MSX, na, Lane, Ynew, n, K2);
+        nfcn += 6;
+
+    // --- examine each system in reverse order so that a finished
+    //     system can be replaced by the last one in the batch
+
+        for (l=na-1; l>=0; l--)
+        {
+            h = H[l];
+
+        // --- step size adjustment
+
+            err = 0.0;
+            fac11 = 1.0;
+            hnew = h;
+            if (Adjust[l])
+            {
+                for (i=1; i<=n; i++)
+                {
+                    j = i*MAX_BATCH + l;
+                    K4[j] = (e1*K1[j] + e3*K3[j] + e4*K4[j] + e5*K5[j] +
+                             e6*K6[j] + e7*K2[j])*h;
+                    sk = atol[i] + rtol[i]*fmax(fabs(Y[j]), fabs(Ynew[j]));
+                    sk = K4[j]/sk;
+                    err = err + (sk*sk);
+                }
+                err = sqrt(err/n);
+
+                // --- computation of hnew
+                fac11 = pow(err, expo1);
+                fac = fac11/pow(Facold[l], beta);            // LUND-stabilization
+                fac = fmax(facc2, fmin(facc1, (fac/SAFE)));  // must have FAC1 <= HNEW/H <= FAC2
+                hnew = h/fac;
+            }
+
+        // --- step is accepted
+
+            if( err <= 1.0 )
+            {
+                Facold[l] = fmax(err, 1.0e-4);
+                for (i=1; i<=n; i++)
+                {
+                    j = i*MAX_BATCH + l;
+                    K1[j] = K2[j];
+                    Y[j] = Ynew[j];
+                }
+                T[l] = T[l] + h;
+                if ( Adjust[l] && T[l] <= tnext ) Htry[l] = h;
+                if (fabs(hnew) > hmax) hnew = hmax;
+                if (Reject[l]) hnew = fmin(fabs(hnew), fabs(h));
+                Reject[l] = 0;
+            }
+
+        // --- step is rejected
+
+            else
+            {
+                if ( Adjust[l] ) hnew = h/fmin(facc1, (fac11/SAFE));
+                Reject[l] = 1;
+            }
+
+        // --- take another step
+
+            H[l] = hnew;
+            if ( Adjust[l] ) Htry[l] = hnew;
+            Nstep[l]++;
+            if (Nstep[l] >= rk->Itmax) return -1;
+
+        // --- save the results of a finished system and replace it
+        //     with the last system in the batch
+
+            if ( T[l] < tnext ) continue;
+            m = Lane[l];
+            for (i=1; i<=n; i++) y[i*MAX_BATCH+m] = Y[i*MAX_BATCH+l];
+            htry[m] = Htry[l];
+            na--;
+            if ( l == na ) continue;
+            for (i=1; i<=n; i++)
+            {
+                j = i*MAX_BATCH;
+                Y[j+l]  = Y[j+na];
+                K1[j+l] = K1[j+na];
+            }
+            H[l] = H[na];
+            T[l] = T[na];
+            Htry[l] = Htry[na];
+            Facold[l] = Facold[na];
+            Lane[l] = Lane[na];
+            Reject[l] = Reject[na];
+            Nstep[l] = Nstep[na];
+            Adjust[l] = Adjust[na];
+        }
     }
     return nfcn;
 }
@@ -24,14 +24,23 @@ typedef struct
     double* K6;
     double* Ynew;         // updated solution
     void     (*Report) (double, double*, int);
+    double* BatchAk;      // work arrays for a batch of systems
+    double* BatchLaneAk;  // per-system step size data for a batch
+    int*    BatchLaneIk;  // per-system counters for a batch
 }MSXRungeKutta;
 // Opens the ODE solver system
-int  rk5_open(int n, int itmax, int adjust);
+int  rk5_open(MSXRungeKutta *rk, int n, int itmax, int adjust);
 
 // Closes the ODE solver system
-void rk5_close(void);
+void rk5_close(MSXRungeKutta *rk);
 
 // Applies the solver to integrate a specific system of ODEs
-int  rk5_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
-                   double* htry, double atol[], double rtol[],
+int  rk5_integrate(MSXproject MSX, MSXRungeKutta *rk, double y[], int n,
+                   double t, double tnext, double* htry, double atol[], double rtol[],
                    void (*func)(MSXproject,double, double*, int, double*));
+
+// Applies the solver to a batch of independent systems of ODEs
+int  rk5_integrateBatch(MSXproject MSX, MSXRungeKutta *rk, double y[], int n,
+                        int nb, double t, double tnext, double htry[], double atol[],
+                        double rtol[],
+                        void (*func)(MSXproject, int, int*, double*, int, double*));
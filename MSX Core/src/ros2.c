@@ -22,22 +22,31 @@
 #define fmin(x,y) (((x)<=(y)) ? (x) : (y))     /* minimum of x and y    */
 #define fmax(x,y) (((x)>=(y)) ? (x) : (y))     /* maximum of x and y    */
 
-//  Local variables
-//-----------------
-MSXRosenbrock MSXRosenbrockSolver;
+#define REUSE_STEP 1.2     // growth of a step size kept to reuse LU factors
+#define JAC_CHANGE 0.3     // relative change in y that outdates a Jacobian
 
-#ifdef _OPENMP 
-#pragma omp threadprivate(MSXRosenbrockSolver)
-#endif
+//  Local functions
+//-----------------
+static void batchJacobian(MSXproject MSX, MSXSparse *sp, int *lane, double *y,
+                          int n, double *f, double *w, double **a,
+                          void (*func)(MSXproject, int, int*, double*, int, double*));
+static int  factorMatrix(MSXSparse *sp, double **a, double **lu, int n,
+                         double *w, int *indx, int *dense);
+static void solveMatrix(MSXSparse *sp, double **a, double **lu, int n,
+                        int *indx, int dense, double *b, double *w);
+static int  factorJacobian(MSXSparse *sp, double **a, double **lu, int n,
+                           double ghinv, double *w, int *indx, int *dense);
+static int  hasChanged(double *y0, double *y, int stride, int n, double atol[]);
 
 //=============================================================================
 
-int ros2_open(int n, int adjust)
+int ros2_open(MSXRosenbrock *ros, int n, int adjust)
 /**
 **  Purpose:
 **    Opens the ROS2 integrator.
 **
 **  Input:
+**    ros = integrator work space to initialize
 **    n = number of equations to be solved
 **    adjust = 1 if step size adjustment used, 0 if not
 **
@@ -45,75 +54,205 @@ int ros2_open(int n, int adjust)
 **    1 if successful, 0 if not.
 */
 {
-    int errorcode = 1;
     int n1 = n + 1;
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        MSXRosenbrockSolver.Nmax = n;
-        MSXRosenbrockSolver.Adjust = adjust;
-        MSXRosenbrockSolver.K1 = NULL;
-        MSXRosenbrockSolver.K2 = NULL;
-        MSXRosenbrockSolver.Jindx = NULL;
-        MSXRosenbrockSolver.Ynew = NULL;
-        MSXRosenbrockSolver.A = NULL;
-        MSXRosenbrockSolver.K1 = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.K2 = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.Jindx = (int*)calloc(n1, sizeof(int));
-        MSXRosenbrockSolver.Ynew = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.A = createMatrix(n1, n1);
-#ifdef _OPENMP
-#pragma omp critical
+    int l;
+
+    ros->Nmax = n;
+    ros->Adjust = adjust;
+    ros->Reuse = 0;
+    ros->Jage = -1;
+    ros->Hfact = 0.0;
+    ros->K1 = (double*)calloc(n1, sizeof(double));
+    ros->K2 = (double*)calloc(n1, sizeof(double));
+    ros->Jindx = (int*)calloc(n1, sizeof(int));
+    ros->Ynew = (double*)calloc(n1, sizeof(double));
+    ros->W = (double*)calloc(n1, sizeof(double));
+    ros->A = createMatrix(n1, n1);
+    ros->LU = createMatrix(n1, n1);
+    ros->BatchA = (double***)calloc(MAX_BATCH, sizeof(double**));
+    ros->BatchLU = (double***)calloc(MAX_BATCH, sizeof(double**));
+    ros->BatchJindx = (int**)calloc(MAX_BATCH, sizeof(int*));
+    ros->BatchAk = (double*)calloc(4*n1*MAX_BATCH + 2*n1, sizeof(double));
+    ros->BatchLaneAk = (double*)calloc(5*MAX_BATCH, sizeof(double));
+    ros->BatchLaneIk = (int*)calloc(4*MAX_BATCH, sizeof(int));
+    ros->BatchJage = (int*)calloc(MAX_BATCH, sizeof(int));
+    ros->BatchHfact = (double*)calloc(MAX_BATCH, sizeof(double));
+    if (!ros->Jindx || !ros->Ynew || !ros->K1 || !ros->K2 || !ros->W) return 0;
+    if (!ros->A || !ros->LU) return 0;
+    if (!ros->BatchA || !ros->BatchLU || !ros->BatchJindx || !ros->BatchAk ||
+        !ros->BatchLaneAk || !ros->BatchLaneIk) return 0;
+    if (!ros->BatchJage || !ros->BatchHfact) return 0;
+    for (l=0; l<MAX_BATCH; l++)
     {
-#endif
-     if (!MSXRosenbrockSolver.Jindx || !MSXRosenbrockSolver.Ynew || !MSXRosenbrockSolver.K1 || !MSXRosenbrockSolver.K2) errorcode = 0;
-     if (!MSXRosenbrockSolver.A) errorcode = 0;
-#ifdef _OPENMP
-    }
-#endif
-#ifdef _OPENMP
+        ros->BatchJage[l] = -1;
+        ros->BatchA[l] = createMatrix(n1, n1);
+        ros->BatchLU[l] = createMatrix(n1, n1);
+        ros->BatchJindx[l] = (int*)calloc(n1, sizeof(int));
+        if (!ros->BatchA[l] || !ros->BatchLU[l] || !ros->BatchJindx[l]) return 0;
     }
-#endif
-    return errorcode;
+    return 1;
 }
 
 //=============================================================================
 
-void ros2_close()
+void ros2_close(MSXRosenbrock *ros)
 /**
 **  Purpose:
 **    closes the ROS2 integrator.
 **
 **  Input:
-**    none.
+**    ros = integrator work space to free.
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
+    int l;
+    if (ros->Jindx) { free(ros->Jindx); ros->Jindx = NULL; }
+    if (ros->Ynew) { free(ros->Ynew); ros->Ynew = NULL; }
+    if (ros->K1) { free(ros->K1); ros->K1 = NULL; }
+    if (ros->K2) { free(ros->K2); ros->K2 = NULL; }
+    if (ros->W) { free(ros->W); ros->W = NULL; }
+    freeMatrix(ros->A);
+    ros->A = NULL;
+    freeMatrix(ros->LU);
+    ros->LU = NULL;
+    if (ros->BatchA)
     {
-#endif
-    if (MSXRosenbrockSolver.Jindx) { free(MSXRosenbrockSolver.Jindx); MSXRosenbrockSolver.Jindx = NULL; }
-    if (MSXRosenbrockSolver.Ynew) { free(MSXRosenbrockSolver.Ynew); MSXRosenbrockSolver.Ynew = NULL; }
-    if (MSXRosenbrockSolver.K1) { free(MSXRosenbrockSolver.K1); MSXRosenbrockSolver.K1 = NULL; }
-    if (MSXRosenbrockSolver.K2) { free(MSXRosenbrockSolver.K2); MSXRosenbrockSolver.K2 = NULL; }
-    freeMatrix(MSXRosenbrockSolver.A);
-    MSXRosenbrockSolver.A = NULL;
-#ifdef _OPENMP
+        for (l=0; l<MAX_BATCH; l++) freeMatrix(ros->BatchA[l]);
+        free(ros->BatchA);
+        ros->BatchA = NULL;
     }
-#endif
+    if (ros->BatchLU)
+    {
+        for (l=0; l<MAX_BATCH; l++) freeMatrix(ros->BatchLU[l]);
+        free(ros->BatchLU);
+        ros->BatchLU = NULL;
+    }
+    if (ros->BatchJindx)
+    {
+        for (l=0; l<MAX_BATCH; l++) free(ros->BatchJindx[l]);
+        free(ros->BatchJindx);
+        ros->BatchJindx = NULL;
+    }
+    if (ros->BatchAk) { free(ros->BatchAk); ros->BatchAk = NULL; }
+    if (ros->BatchLaneAk) { free(ros->BatchLaneAk); ros->BatchLaneAk = NULL; }
+    if (ros->BatchLaneIk) { free(ros->BatchLaneIk); ros->BatchLaneIk = NULL; }
+    if (ros->BatchJage) { free(ros->BatchJage); ros->BatchJage = NULL; }
+    if (ros->BatchHfact) { free(ros->BatchHfact); ros->BatchHfact = NULL; }
+}
+
+//=============================================================================
+
+void ros2_newSystem(MSXRosenbrock *ros)
+/**
+**  Purpose:
+**    discards the Jacobians kept from the systems of ODEs integrated
+**    so far.
+**
+**  Input:
+**    ros = integrator work space
+**
+**  Note:
+**    when Jacobians are reused, each system starts with the Jacobian
+**    and LU factors left by the previous one (such as the previous
+**    segment of the same pipe) until this function is called.
+*/
+{
+    int l;
+
+    ros->Jage = -1;
+    for (l=0; l<MAX_BATCH; l++) ros->BatchJage[l] = -1;
+}
+
+//=============================================================================
+
+int ros2_openJacobian(MSXRosJacobian *jac, int n)
+/**
+**  Purpose:
+**    creates a Jacobian to be kept for a system of ODEs.
+**
+**  Input:
+**    jac = Jacobian to create
+**    n = number of equations (as supplied to ros2_open).
+**
+**  Returns:
+**    1 if successful, 0 if not.
+*/
+{
+    jac->A = createMatrix(n+1, n+1);
+    jac->LU = createMatrix(n+1, n+1);
+    jac->Jindx = (int*)calloc(n+1, sizeof(int));
+    jac->Dense = 0;
+    jac->Jage = -1;
+    jac->Hfact = 0.0;
+    if (!jac->A || !jac->LU || !jac->Jindx) return 0;
+    return 1;
+}
+
+//=============================================================================
+
+void ros2_closeJacobian(MSXRosJacobian *jac)
+/**
+**  Purpose:
+**    frees a Jacobian kept for a system of ODEs.
+**
+**  Input:
+**    jac = Jacobian to free.
+*/
+{
+    freeMatrix(jac->A);
+    jac->A = NULL;
+    freeMatrix(jac->LU);
+    jac->LU = NULL;
+    if (jac->Jindx) { free(jac->Jindx); jac->Jindx = NULL; }
+}
+
+//=============================================================================
+
+void ros2_swapJacobian(MSXRosenbrock *ros, MSXRosJacobian *jac)
+/**
+**  Purpose:
+**    exchanges the Jacobian used by ros2_integrate with one kept for
+**    a system of ODEs.
+**
+**  Input:
+**    ros = integrator work space
+**    jac = the system's Jacobian.
+**
+**  Note:
+**    calling this before and after integrating the system lets it
+**    reuse its own Jacobian the next time it is integrated, whatever
+**    other systems were integrated in between.
+*/
+{
+    MSXRosJacobian temp;
+
+    temp.A = ros->A;
+    temp.LU = ros->LU;
+    temp.Jindx = ros->Jindx;
+    temp.Dense = ros->Dense;
+    temp.Jage = ros->Jage;
+    temp.Hfact = ros->Hfact;
+    ros->A = jac->A;
+    ros->LU = jac->LU;
+    ros->Jindx = jac->Jindx;
+    ros->Dense = jac->Dense;
+    ros->Jage = jac->Jage;
+    ros->Hfact = jac->Hfact;
+    *jac = temp;
 }
 
 //=============================================================================
       
-int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
-                   double* htry, double atol[], double rtol[],
-                   void (*func)(MSXproject, double, double*, int, double*))
+int ros2_integrate(MSXproject MSX, MSXRosenbrock *ros, double y[], int n,
+                   double t, double tnext, double* htry, double atol[], double rtol[],
+                   void (*func)(MSXproject, double, double*, int, double*),
+                   int (*jac)(MSXproject, double, double*, int, double**),
+                   MSXSparse *sp)
 /**
 **  Purpose:
 **    integrates a system of ODEs over a specified time interval.
 **
 **  Input:
+**    ros = integrator work space
 **    y[1..n] = vector of dependent variable values at the start
 **              of the integration interval
 **    n = number of dependent variables
@@ -123,6 +262,9 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
 **    atol[1..n] = vector of absolute tolerances on the variables y
 **    rtol[1..n] = vector of relative tolerances on the variables y
 **    func = name of the function that computes dy/dt for each y
+**    jac = name of the function that computes the Jacobian of func
+**          analytically (or NULL to use finite differences)
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
 **
 **  Output:
 **    htry = size of the last full time step taken.
@@ -139,8 +281,23 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
 **      n = number of dependent variables
 **      dfdy[1..n] = vector of derivative values computed.
 **
-**  2. The arrays used in this function are 1-based, so
+**  2. The arguments to the function jac() are:
+**      t = current time
+**      y[1..n] = vector of dependent variable values
+**      n = number of dependent variables
+**      a[1..n][1..n] = Jacobian matrix computed.
+**     It returns 0 if the Jacobian could not be evaluated, in which
+**     case finite differences are used instead.
+**
+**  3. The arrays used in this function are 1-based, so
 **     they must have been sized to n+1 when first created.
+**
+**  4. When ros->Reuse is set the method is used as a W-method, which
+**     keeps second order accuracy with an outdated Jacobian. The
+**     Jacobian is kept until a step with it is rejected or has to be
+**     shortened, or until y has changed too much since it was found.
+**     Its LU factors are kept while the step size stays the same
+**     (steps that could grow only a little are not grown).
 */
 {      
     double UROUND = 2.3e-16;
@@ -149,7 +306,9 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
     double ej, err, factor, facmax;
     int    nfcn, njac, naccept, nreject, j;
     int    isReject;
-	int    adjust = MSXRosenbrockSolver.Adjust;
+	int    adjust = ros->Adjust;
+    int    reuse = ros->Reuse && adjust;
+    double **a = reuse ? ros->LU : ros->A;
 
 // --- Initialize counters, etc.
 
@@ -169,14 +328,14 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
     h = *htry;
     if ( h == 0.0 )
     {
-        func(MSX, t, y, n, MSXRosenbrockSolver.K1);
+        func(MSX, t, y, n, ros->K1);
         nfcn += 1;
         adjust = 1;
         h = tnext - t;
         for (j=1; j<=n; j++)
         {
             ytol = atol[j] + rtol[j]*fabs(y[j]);
-            if (MSXRosenbrockSolver.K1[j] != 0.0) h = fmin(h, (ytol/fabs(MSXRosenbrockSolver.K1[j])));
+            if (ros->K1[j] != 0.0) h = fmin(h, (ytol/fabs(ros->K1[j])));
         }
     }
     h = fmax(hmin, h);
@@ -190,6 +349,12 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
 
         if (0.10*fabs(h) <= fabs(t)*UROUND) return -2;
 
+    // --- keep the step size of the current LU factors if it is
+    //     only a little smaller
+
+        if ( reuse && ros->Jage >= 0 && h > ros->Hfact &&
+             h <= REUSE_STEP*ros->Hfact ) h = ros->Hfact;
+
     // --- adjust step size if interval exceeded
 
         tplus = t + h;
@@ -199,65 +364,124 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
             tplus = tnext;
         }
 
+    // --- re-compute a Jacobian that can't be reused and
+    //     factorize it for a new step size
+
+        if ( reuse )
+        {
+            if ( ros->Jage > 0 && hasChanged(ros->A[0], y, 1, n, atol) )
+                ros->Jage = -1;
+            if ( ros->Jage < 0 )
+            {
+                if ( jac == NULL || !jac(MSX, t, y, n, ros->A) )
+                {
+                    if ( sp )
+                    {
+                        sparseJacobian(MSX, sp, y, n, ros->K1, ros->K2, ros->A, func);
+                        nfcn += 2*sp->ngroups;
+                    }
+                    else
+                    {
+                        jacobian(MSX, y, n, ros->K1, ros->K2, ros->A, func);
+                        nfcn += 2*n;
+                    }
+                }
+                njac++;
+                for (j=1; j<=n; j++) ros->A[0][j] = y[j];
+                ros->Jage = 0;
+                ros->Hfact = 0.0;
+            }
+            ghinv = -1.0 / (g*h);
+            if ( h != ros->Hfact )
+            {
+                ros->Hfact = 0.0;
+                if ( !factorJacobian(sp, ros->A, ros->LU, n, ghinv, ros->K1,
+                                     ros->Jindx, &ros->Dense) )
+                {
+                    if ( ros->Jage == 0 ) return -1;
+                    ros->Jage = -1;
+                    continue;
+                }
+                ros->Hfact = h;
+            }
+        }
+
     // --- Re-compute the Jacobian if step size accepted
 
-        if ( isReject == 0 )
+        else if ( isReject == 0 )
         {
-            jacobian(MSX, y, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.K2, MSXRosenbrockSolver.A, func);
+            if ( jac == NULL || !jac(MSX, t, y, n, ros->A) )
+            {
+                if ( sp )
+                {
+                    sparseJacobian(MSX, sp, y, n, ros->K1, ros->K2, ros->A, func);
+                    nfcn += 2*sp->ngroups;
+                }
+                else
+                {
+                    jacobian(MSX, y, n, ros->K1, ros->K2, ros->A, func);
+                    nfcn += 2*n;
+                }
+            }
             njac++;
-            nfcn += 2*n;
             ghinv1 = 0.0;
+            ros->Jage = -1;
         }
 
     // --- Update the Jacobian to reflect new step size
 
-        ghinv = -1.0 / (g*h);
-        dghinv = ghinv - ghinv1;
-        for (j=1; j<=n; j++)
+        if ( !reuse )
         {
-            MSXRosenbrockSolver.A[j][j] += dghinv;
+            ghinv = -1.0 / (g*h);
+            dghinv = ghinv - ghinv1;
+            for (j=1; j<=n; j++)
+            {
+                ros->A[j][j] += dghinv;
+            }
+            ghinv1 = ghinv;
+            if ( !factorMatrix(sp, ros->A, ros->LU, n, ros->K1, ros->Jindx,
+                               &ros->Dense) ) return -1;
         }
-        ghinv1 = ghinv;
-        if ( !factorize(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.Jindx) ) return -1;
 
     // --- Stage 1 solution
 
-        func(MSX, t, y, n, MSXRosenbrockSolver.K1);
+        func(MSX, t, y, n, ros->K1);
         nfcn += 1;
-        for (j=1; j<=n; j++) MSXRosenbrockSolver.K1[j] *= ghinv;
-        solve(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.Jindx, MSXRosenbrockSolver.K1);
+        for (j=1; j<=n; j++) ros->K1[j] *= ghinv;
+        solveMatrix(sp, a, ros->LU, n, ros->Jindx, ros->Dense, ros->K1, ros->W);
 
     // --- Stage 2 solution
 
         for (j=1; j<=n; j++)
         {
-            MSXRosenbrockSolver.Ynew[j] = y[j] + h* MSXRosenbrockSolver.K1[j];
+            ros->Ynew[j] = y[j] + h* ros->K1[j];
         }
-        func(MSX, t, MSXRosenbrockSolver.Ynew, n, MSXRosenbrockSolver.K2);
+        func(MSX, t, ros->Ynew, n, ros->K2);
         nfcn += 1;
         for (j=1; j<=n; j++)
         {
-            MSXRosenbrockSolver.K2[j] = (MSXRosenbrockSolver.K2[j] - 2.0* MSXRosenbrockSolver.K1[j])*ghinv;
+            ros->K2[j] = (ros->K2[j] - 2.0* ros->K1[j])*ghinv;
         }
-        solve(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.Jindx, MSXRosenbrockSolver.K2);
+        solveMatrix(sp, a, ros->LU, n, ros->Jindx, ros->Dense, ros->K2, ros->W);
 
     // --- Overall solution
 
         for (j=1; j<=n; j++)
         {
-            MSXRosenbrockSolver.Ynew[j] = y[j] + 1.5*h* MSXRosenbrockSolver.K1[j] + 0.5*h* MSXRosenbrockSolver.K2[j];
+            ros->Ynew[j] = y[j] + 1.5*h* ros->K1[j] + 0.5*h* ros->K2[j];
         }
 
     // --- Error estimation
 
         hold = h;
         err = 0.0;
+        factor = 1.0;
         if ( adjust )
         {
             for (j=1; j<=n; j++)
             {
-                ytol = atol[j] + rtol[j]*fabs(MSXRosenbrockSolver.Ynew[j]);
-	            ej = fabs(MSXRosenbrockSolver.Ynew[j] - y[j] - h* MSXRosenbrockSolver.K1[j])/ytol;
+                ytol = atol[j] + rtol[j]*fabs(ros->Ynew[j]);
+	            ej = fabs(ros->Ynew[j] - y[j] - h* ros->K1[j])/ytol;
                 err = err + ej*ej; 
             }
             err = sqrt(err/n);
@@ -281,13 +505,19 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
             isReject = 1;
             nreject++;
             h = 0.5*h;
+            if ( reuse && ros->Jage > 0 ) ros->Jage = -1;
         }
         else
         {
             isReject = 0;
+            if ( reuse )
+            {
+                if ( ros->Jage > 0 && factor < 1.0 ) ros->Jage = -1;
+                else ros->Jage++;
+            }
             for (j=1; j<=n; j++)
             {
-                y[j] = MSXRosenbrockSolver.Ynew[j];
+                y[j] = ros->Ynew[j];
                 if ( y[j] <= UROUND ) y[j] = 0.0;
             }
             if ( adjust ) *htry = h;
@@ -300,3 +530,594 @@ int ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
     }
     return nfcn;
 }
+
+//=============================================================================
+
+int ros2_integrateBatch(MSXproject MSX, MSXRosenbrock *ros, double y[], int n,
+                        int nb, double t, double tnext, double htry[], double atol[],
+                        double rtol[],
+                        void (*func)(MSXproject, int, int*, double*, int, double*),
+                        int (*jac)(MSXproject, int, double*, int, double**),
+                        MSXSparse *sp)
+/**
+**  Purpose:
+**    integrates a batch of independent systems of ODEs over a specified
+**    time interval.
+**
+**  Input:
+**    ros = integrator work space
+**    y[] = dependent variable values of each system at the start
+**          of the integration interval
+**    n = number of dependent variables in each system
+**    nb = number of systems in the batch (no more than MAX_BATCH)
+**    t = time value at the start of the interval
+**    tnext = time value at the end of the interval
+**    htry[] = initial step size to be taken by each system
+**    atol[1..n] = vector of absolute tolerances on the variables y
+**    rtol[1..n] = vector of relative tolerances on the variables y
+**    func = name of the function that computes dy/dt for a batch
+**           of systems
+**    jac = name of the function that computes the Jacobian of a
+**          single system analytically (or NULL to use finite
+**          differences)
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**
+**  Output:
+**    y[] = dependent variable values at the end of the interval
+**    htry[] = size of the last full time step taken by each system.
+**
+**  Returns:
+**    the number of times that func() was called, -1 if the
+**    Jacobian of some system is singular, or -2 if its step
+**    size shrinks to 0.
+**
+**  Notes:
+**  1. Variable j of system l is stored in y[j*MAX_BATCH + l]
+**     (j = 1..n, l = 0..nb-1), so that the systems can be
+**     processed together. Each system takes exactly the same
+**     steps that ros2_integrate would take for it.
+**
+**  2. The arguments to the function func() are:
+**      na = number of systems to evaluate
+**      lane[0..na-1] = index in y[] of each system being evaluated
+**      Y[] = dependent variable values of the systems (in the
+**            same layout as y[])
+**      n = number of dependent variables
+**      F[] = vector of derivative values computed (same layout as Y[]).
+**
+**  3. The arguments to the function jac() are:
+**      lane = index in y[] of the system being evaluated
+**      y[1..n] = vector of the system's dependent variable values
+**      n = number of dependent variables
+**      a[1..n][1..n] = Jacobian matrix computed.
+**     It returns 0 if the Jacobian could not be evaluated, in which
+**     case finite differences are used instead.
+**
+**  4. Jacobians are reused as described in ros2_integrate. Each
+**     system then starts with the Jacobian and LU factors left
+**     behind by the previous system integrated in its place (until
+**     ros2_newSystem is called).
+*/
+{
+    double UROUND = 2.3e-16;
+    double g, ghinv, dghinv, ytol;
+    double h, hmin, hmax, dtemp;
+    double ej, err, factor, facmax;
+    int    nfcn, i, j, l, m, na;
+    double** a;
+    int*     indx;
+    int      ngroups = sp ? sp->ngroups : n;
+    int      reuse;
+
+// --- work arrays (variables are stored by rows of MAX_BATCH systems)
+
+    int     size = (n+1) * MAX_BATCH;
+    double* Y    = ros->BatchAk;
+    double* Ynew = Y + size;
+    double* K1   = Y + 2*size;
+    double* K2   = Y + 3*size;
+    double* W    = Y + 4*size;
+    double* W1   = W + n + 1;
+
+// --- state of each system in the batch
+
+    double* H      = ros->BatchLaneAk;
+    double* T      = H + MAX_BATCH;
+    double* Tplus  = H + 2*MAX_BATCH;
+    double* Htry   = H + 3*MAX_BATCH;
+    double* Ghinv1 = H + 4*MAX_BATCH;
+    int*    Lane     = ros->BatchLaneIk;
+    int*    IsReject = Lane + MAX_BATCH;
+    int*    Adjust   = Lane + 2*MAX_BATCH;
+    int*    Dense    = Lane + 3*MAX_BATCH;
+    double*** A      = ros->BatchA;
+    double*** LU     = ros->BatchLU;
+    int**     Jindx  = ros->BatchJindx;
+    int*      Jage   = ros->BatchJage;
+    double*   Hfact  = ros->BatchHfact;
+
+// --- Initialize counters, etc.
+
+    g = 1.0 + 1.0 / sqrt(2.0);
+    nfcn = 0;
+    na = nb;
+    hmax = tnext - t;
+    hmin = 1.e-8;
+    for (j=1; j<=n; j++)
+    {
+        for (l=0; l<na; l++) Y[j*MAX_BATCH+l] = y[j*MAX_BATCH+l];
+    }
+
+// --- Initial step sizes
+
+    for (l=0; l<na; l++)
+    {
+        Lane[l] = l;
+        T[l] = t;
+        Tplus[l] = t;
+        Ghinv1[l] = 0.0;
+        IsReject[l] = 0;
+        Adjust[l] = ros->Adjust;
+        Htry[l] = htry[l];
+        h = htry[l];
+        if ( h == 0.0 )
+        {
+            func(MSX, 1, &Lane[l], Y+l, n, K1+l);
+            nfcn += 1;
+            Adjust[l] = 1;
+            h = tnext - t;
+            for (j=1; j<=n; j++)
+            {
+                i = j*MAX_BATCH + l;
+                ytol = atol[j] + rtol[j]*fabs(Y[i]);
+                if (K1[i] != 0.0) h = fmin(h, (ytol/fabs(K1[i])));
+            }
+        }
+        h = fmax(hmin, h);
+        H[l] = fmin(hmax, h);
+    }
+
+// --- Start the time loop
+
+    while ( na > 0 )
+    {
+        for (l=0; l<na; l++)
+        {
+            h = H[l];
+            a = A[l];
+            reuse = ros->Reuse && Adjust[l];
+
+        // --- check for zero step size
+
+            if (0.10*fabs(h) <= fabs(T[l])*UROUND) return -2;
+
+        // --- keep the step size of the current LU factors if it is
+        //     only a little smaller
+
+            if ( reuse && Jage[l] >= 0 && h > Hfact[l] &&
+                 h <= REUSE_STEP*Hfact[l] ) h = H[l] = Hfact[l];
+
+        // --- adjust step size if interval exceeded
+
+            Tplus[l] = T[l] + h;
+            if ( Tplus[l] > tnext )
+            {
+                H[l] = tnext - T[l];
+                Tplus[l] = tnext;
+            }
+
+        // --- Re-compute the Jacobian if step size accepted
+        //     (or if it can't be reused)
+
+            if ( reuse && Jage[l] > 0 &&
+                 hasChanged(a[0], Y+l, MAX_BATCH, n, atol) ) Jage[l] = -1;
+            if ( reuse ? Jage[l] < 0 : IsReject[l] == 0 )
+            {
+                for (j=1; j<=n; j++) W[j] = Y[j*MAX_BATCH+l];
+                if ( jac == NULL || !jac(MSX, Lane[l], W, n, a) )
+                {
+                    batchJacobian(MSX, sp, &Lane[l], Y+l, n, K1+l, K2+l, a, func);
+                    nfcn += 2*ngroups;
+                }
+                Ghinv1[l] = 0.0;
+                Hfact[l] = 0.0;
+                Jage[l] = -1;
+                if ( reuse )
+                {
+                    for (j=1; j<=n; j++) a[0][j] = Y[j*MAX_BATCH+l];
+                    Jage[l] = 0;
+                }
+            }
+
+        // --- factorize a reused Jacobian for a new step size
+
+            ghinv = -1.0 / (g*H[l]);
+            if ( reuse )
+            {
+                Ghinv1[l] = ghinv;
+                if ( H[l] == Hfact[l] ) continue;
+                Hfact[l] = 0.0;
+                if ( !factorJacobian(sp, a, LU[l], n, ghinv, W1, Jindx[l], &Dense[l]) )
+                {
+                    if ( Jage[l] == 0 ) return -1;
+                    Jage[l] = -1;
+                    l--;
+                    continue;
+                }
+                Hfact[l] = H[l];
+                continue;
+            }
+
+        // --- Update the Jacobian to reflect new step size
+
+            dghinv = ghinv - Ghinv1[l];
+            for (j=1; j<=n; j++) a[j][j] += dghinv;
+            Ghinv1[l] = ghinv;
+            if ( !factorMatrix(sp, a, LU[l], n, W1, Jindx[l], &Dense[l]) ) return -1;
+        }
+
+    // --- Stage 1 solution
+
+        func(MSX, na, Lane, Y, n, K1);
+        nfcn += 1;
+        for (l=0; l<na; l++)
+        {
+            ghinv = Ghinv1[l];
+            for (j=1; j<=n; j++) W[j] = K1[j*MAX_BATCH+l] * ghinv;
+            a = (ros->Reuse && Adjust[l]) ? LU[l] : A[l];
+            solveMatrix(sp, a, LU[l], n, Jindx[l], Dense[l], W, W1);
+            for (j=1; j<=n; j++) K1[j*MAX_BATCH+l] = W[j];
+        }
+
+    // --- Stage 2 solution
+
+        for (j=1; j<=n; j++)
+        {
+            i = j*MAX_BATCH;
+            for (l=0; l<na; l++) Ynew[i+l] = Y[i+l] + H[l]*K1[i+l];
+        }
+        func(MSX, na, Lane, Ynew, n, K2);
+        nfcn += 1;
+        for (l=0; l<na; l++)
+        {
+            ghinv = Ghinv1[l];
+            for (j=1; j<=n; j++)
+            {
+                i = j*MAX_BATCH + l;
+                W[j] = (K2[i] - 2.0*K1[i])*ghinv;
+            }
+            a = (ros->Reuse && Adjust[l]) ? LU[l] : A[l];
+            solveMatrix(sp, a, LU[l], n, Jindx[l], Dense[l], W, W1);
+            for (j=1; j<=n; j++) K2[j*MAX_BATCH+l] = W[j];
+        }
+
+    // --- Overall solution
+
+        for (j=1; j<=n; j++)
+        {
+            i = j*MAX_BATCH;
+            for (l=0; l<na; l++)
+                Ynew[i+l] = Y[i+l] + 1.5*H[l]*K1[i+l] + 0.5*H[l]*K2[i+l];
+        }
+
+    // --- examine each system in reverse order so that a finished
+    //     system can be replaced by the last one in the batch
+
+        for (l=na-1; l>=0; l--)
+        {
+
+        // --- Error estimation
+
+            h = H[l];
+            err = 0.0;
+            factor = 1.0;
+            reuse = ros->Reuse && Adjust[l];
+            if ( Adjust[l] )
+            {
+                for (j=1; j<=n; j++)
+                {
+                    i = j*MAX_BATCH + l;
+                    ytol = atol[j] + rtol[j]*fabs(Ynew[i]);
+                    ej = fabs(Ynew[i] - Y[i] - h*K1[i])/ytol;
+                    err = err + ej*ej;
+                }
+                err = sqrt(err/n);
+                err = fmax(UROUND, err);
+
+            // --- Choose the step size
+
+                factor = 0.9 / sqrt(err);
+                if (IsReject[l]) facmax = 1.0;
+                else             facmax = 10.0;
+                factor = fmin(factor, facmax);
+                factor = fmax(factor, 1.0e-1);
+                h = factor*h;
+                h = fmin(hmax, h);
+            }
+
+        // --- Reject/accept the step
+
+            if ( err > 1.0 )
+            {
+                IsReject[l] = 1;
+                H[l] = 0.5*h;
+                if ( reuse && Jage[l] > 0 ) Jage[l] = -1;
+                continue;
+            }
+            IsReject[l] = 0;
+            if ( reuse )
+            {
+                if ( Jage[l] > 0 && factor < 1.0 ) Jage[l] = -1;
+                else Jage[l]++;
+            }
+            for (j=1; j<=n; j++)
+            {
+                i = j*MAX_BATCH + l;
+                Y[i] = Ynew[i];
+                if ( Y[i] <= UROUND ) Y[i] = 0.0;
+            }
+            H[l] = h;
+            if ( Adjust[l] ) Htry[l] = h;
+            T[l] = Tplus[l];
+
+        // --- save the results of a finished system and replace it
+        //     with the last system in the batch
+
+            if ( T[l] < tnext ) continue;
+            m = Lane[l];
+            for (j=1; j<=n; j++) y[j*MAX_BATCH+m] = Y[j*MAX_BATCH+l];
+            htry[m] = Htry[l];
+            na--;
+            if ( l == na ) continue;
+            for (j=1; j<=n; j++)
+            {
+                i = j*MAX_BATCH;
+                Y[i+l] = Y[i+na];
+            }
+            H[l] = H[na];
+            T[l] = T[na];
+            Tplus[l] = Tplus[na];
+            Htry[l] = Htry[na];
+            Ghinv1[l] = Ghinv1[na];
+            Lane[l] = Lane[na];
+            IsReject[l] = IsReject[na];
+            Adjust[l] = Adjust[na];
+            j = Dense[l];  Dense[l] = Dense[na];  Dense[na] = j;
+            j = Jage[l];  Jage[l] = Jage[na];  Jage[na] = j;
+            dtemp = Hfact[l];  Hfact[l] = Hfact[na];  Hfact[na] = dtemp;
+            a = A[l];  A[l] = A[na];  A[na] = a;
+            a = LU[l];  LU[l] = LU[na];  LU[na] = a;
+            indx = Jindx[l];  Jindx[l] = Jindx[na];  Jindx[na] = indx;
+        }
+    }
+    return nfcn;
+}
+
+//=============================================================================
+
+void batchJacobian(MSXproject MSX, MSXSparse *sp, int *lane, double *y,
+                   int n, double *f, double *w, double **a,
+                   void (*func)(MSXproject, int, int*, double*, int, double*))
+/**
+**  Purpose:
+**    computes the Jacobian matrix of a single system in a batch
+**    by finite differences.
+**
+**  Input:
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**    lane = index of the system in the caller's batch
+**    y[] = the system's dependent variables (stored at y[j*MAX_BATCH])
+**    n = number of variables
+**    f[] = a work vector (with the same layout as y[])
+**    w[] = a work vector (with the same layout as y[])
+**    func = routine that computes the function values of a batch.
+**
+**  Output:
+**    a[1..n][1..n] = coeffs. of the Jacobian matrix.
+**
+**  Notes:
+**    Uses the same central differences as jacobian() in msxutils.c
+**    (or as sparseJacobian() if the Jacobian is sparse).
+*/
+{
+    int    i, j, g, p, q;
+    double temp, eps = 1.0e-7, eps2;
+    double *x0 = a[0];
+
+    if ( sp )
+    {
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++) a[i][j] = 0.0;
+        }
+        for (g=1; g<=sp->ngroups; g++)
+        {
+            for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+            {
+                j = sp->groupCol[p];
+                x0[j] = y[j*MAX_BATCH];
+                y[j*MAX_BATCH] = x0[j] + eps;
+            }
+            func(MSX, 1, lane, y, n, f);
+            for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+            {
+                j = sp->groupCol[p];
+                if ( x0[j] == 0.0 ) y[j*MAX_BATCH] = x0[j];
+                else                y[j*MAX_BATCH] = x0[j] - eps;
+            }
+            func(MSX, 1, lane, y, n, w);
+            for (p=sp->groupStart[g]; p<sp->groupStart[g+1]; p++)
+            {
+                j = sp->groupCol[p];
+                eps2 = (x0[j] == 0.0) ? eps : 2.0*eps;
+                for (q=sp->colStart[j]; q<sp->colStart[j+1]; q++)
+                {
+                    i = sp->colRow[q];
+                    a[i][j] = (f[i*MAX_BATCH] - w[i*MAX_BATCH]) / eps2;
+                }
+                y[j*MAX_BATCH] = x0[j];
+            }
+        }
+        return;
+    }
+    for (j=1; j<=n; j++)
+    {
+        temp = y[j*MAX_BATCH];
+        y[j*MAX_BATCH] = temp + eps;
+        func(MSX, 1, lane, y, n, f);
+        if ( temp == 0.0 )
+        {
+            y[j*MAX_BATCH] = temp;
+            eps2 = eps;
+        }
+        else
+        {
+            y[j*MAX_BATCH] = temp - eps;
+            eps2 = 2.0*eps;
+        }
+        func(MSX, 1, lane, y, n, w);
+        for (i=1; i<=n; i++) a[i][j] = (f[i*MAX_BATCH] - w[i*MAX_BATCH]) / eps2;
+        y[j*MAX_BATCH] = temp;
+    }
+}
+
+//=============================================================================
+
+int factorMatrix(MSXSparse *sp, double **a, double **lu, int n,
+                 double *w, int *indx, int *dense)
+/**
+**  Purpose:
+**    factorizes the matrix of a Rosenbrock step.
+**
+**  Input:
+**    sp = sparsity structure of the matrix (or NULL if it is dense)
+**    a[1..n][1..n] = the matrix
+**    lu[1..n][1..n] = matrix to hold the LU factors of a sparse matrix
+**    n = matrix size
+**    w[1..n] = a work vector.
+**
+**  Output:
+**    indx[1..n] = row permutation of a pivoted factorization
+**    dense = 1 if a sparse matrix had to be factorized with pivoting.
+**
+**  Returns:
+**    1 if successful, 0 if the matrix is singular.
+**
+**  Note:
+**    a dense matrix is factorized in place. A sparse one is left as it
+**    is, and is factorized into lu[][] with pivoting if the sparse
+**    factorization meets a small pivot.
+*/
+{
+    int i, j;
+
+    *dense = 0;
+    if ( sp == NULL || !sp->factor ) return factorize(a, n, w, indx);
+    if ( sparseFactorize(sp, a, lu) ) return 1;
+    *dense = 1;
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) lu[i][j] = a[i][j];
+    }
+    return factorize(lu, n, w, indx);
+}
+
+//=============================================================================
+
+void solveMatrix(MSXSparse *sp, double **a, double **lu, int n,
+                 int *indx, int dense, double *b, double *w)
+/**
+**  Purpose:
+**    solves a linear system with the matrix factorized by factorMatrix.
+**
+**  Input:
+**    sp, a, lu, n, indx, dense = as used and returned by factorMatrix
+**    b[1..n] = right-hand side vector
+**    w[1..n] = a work vector.
+**
+**  Output:
+**    b[1..n] = solution vector.
+*/
+{
+    if ( sp == NULL || !sp->factor ) solve(a, n, indx, b);
+    else if ( dense ) solve(lu, n, indx, b);
+    else sparseSolve(sp, lu, b, w);
+}
+
+//=============================================================================
+
+int factorJacobian(MSXSparse *sp, double **a, double **lu, int n,
+                   double ghinv, double *w, int *indx, int *dense)
+/**
+**  Purpose:
+**    factorizes the matrix of a Rosenbrock step without changing the
+**    Jacobian it is formed from, so that the Jacobian can be reused.
+**
+**  Input:
+**    sp = sparsity structure of the Jacobian (or NULL if it is dense)
+**    a[1..n][1..n] = the Jacobian
+**    lu[1..n][1..n] = matrix to hold the LU factors
+**    n = matrix size
+**    ghinv = value added to the diagonal of the Jacobian
+**    w[1..n] = a work vector.
+**
+**  Output:
+**    indx[1..n] = row permutation of a pivoted factorization
+**    dense = 1 if the factors were found with pivoting.
+**
+**  Returns:
+**    1 if successful, 0 if the matrix is singular.
+**
+**  Note:
+**    the factors are used with solveMatrix(sp, lu, lu, ...).
+*/
+{
+    int i, j;
+
+    for (i=1; i<=n; i++)
+    {
+        for (j=1; j<=n; j++) lu[i][j] = a[i][j];
+        lu[i][i] += ghinv;
+    }
+    *dense = 0;
+    if ( sp && sp->factor && sparseFactorize(sp, lu, lu) ) return 1;
+    *dense = 1;
+    if ( sp && sp->factor )
+    {
+        for (i=1; i<=n; i++)
+        {
+            for (j=1; j<=n; j++) lu[i][j] = a[i][j];
+            lu[i][i] += ghinv;
+        }
+    }
+    return factorize(lu, n, w, indx);
+}
+
+//=============================================================================
+
+int hasChanged(double *y0, double *y, int stride, int n, double atol[])
+/**
+**  Purpose:
+**    checks if variables have changed too much for a Jacobian found
+**    with their earlier values to be reused.
+**
+**  Input:
+**    y0[1..n] = values the Jacobian was found with
+**    y[] = current values (value j is y[j*stride])
+**    n = number of variables
+**    atol[1..n] = absolute tolerances on the variables.
+**
+**  Returns:
+**    1 if some value has changed by more than a fraction JAC_CHANGE
+**    of its earlier value (plus its absolute tolerance), 0 if not.
+*/
+{
+    int j;
+
+    for (j=1; j<=n; j++)
+    {
+        if ( fabs(y[j*stride] - y0[j]) > JAC_CHANGE*fabs(y0[j]) + atol[j] )
+            return 1;
+    }
+    return 0;
+}
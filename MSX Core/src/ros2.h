@@ -7,27 +7,70 @@
 **  LAST UPDATE:   Refer to git history
 ***********************************************************************/
 
-// Opaque Pointer
-typedef struct Project *MSXproject;
+#include "msxutils.h"
+
+// Jacobian of a system kept between integrations of it
+typedef struct {
+    double** A;                    // Jacobian matrix
+    double** LU;                   // LU factors of A plus its diagonal shift
+    int*     Jindx;                // LU column indexes
+    int      Dense;                // 1 if the LU factors were pivoted
+    int      Jage;                 // steps taken with A (-1 if none)
+    double   Hfact;                // step size the LU factors are for
+}MSXRosJacobian;
 
 typedef struct {
 
     double** A;                     // Jacobian matrix
+    double** LU;                    // LU factors of a sparse Jacobian matrix
+    double*  W;                     // Work array for sparse LU solutions
+    int      Dense;                 // 1 if a sparse matrix had to be pivoted
     double* K1;                    // Intermediate solutions
     double* K2;
     double* Ynew;                  // Updated function values
     int*    Jindx;                 // Jacobian column indexes
     int     Nmax;                  // Max. number of equations
     int     Adjust;                // use adjustable step size
+    int     Reuse;                 // 1 if the Jacobian is kept across steps
+    int     Jage;                  // steps taken with the Jacobian (-1 if none)
+    double  Hfact;                 // step size the LU factors are for
+    double*** BatchA;              // Jacobian matrix of each system in a batch
+    double*** BatchLU;             // sparse LU factors of each system's matrix
+    int**   BatchJindx;            // Jacobian column indexes of each system
+    double* BatchAk;               // work arrays for a batch of systems
+    double* BatchLaneAk;           // per-system step size data for a batch
+    int*    BatchLaneIk;           // per-system counters for a batch
+    int*    BatchJage;             // Jacobian age of each system in a batch
+    double* BatchHfact;            // factored step size of each system
 }MSXRosenbrock;
 
 // Opens the ODE solver system
-int  ros2_open(int n, int adjust);
+int  ros2_open(MSXRosenbrock *ros, int n, int adjust);
 
 // Closes the ODE solver system
-void ros2_close(void);
+void ros2_close(MSXRosenbrock *ros);
+
+// Discards the Jacobians kept from a previous system of ODEs
+void ros2_newSystem(MSXRosenbrock *ros);
+
+// Creates and frees a Jacobian kept for a system of ODEs
+int  ros2_openJacobian(MSXRosJacobian *jac, int n);
+void ros2_closeJacobian(MSXRosJacobian *jac);
+
+// Exchanges the solver's Jacobian with one kept for a system of ODEs
+void ros2_swapJacobian(MSXRosenbrock *ros, MSXRosJacobian *jac);
 
 // Applies the solver to integrate a specific system of ODEs
-int  ros2_integrate(MSXproject MSX, double y[], int n, double t, double tnext,
-                    double* htry, double atol[], double rtol[],
-                    void (*func)(MSXproject, double, double*, int, double*));
+int  ros2_integrate(MSXproject MSX, MSXRosenbrock *ros, double y[], int n,
+                    double t, double tnext, double* htry, double atol[], double rtol[],
+                    void (*func)(MSXproject, double, double*, int, double*),
+                    int (*jac)(MSXproject, double, double*, int, double**),
+                    MSXSparse *sp);
+
+// Applies the solver to a batch of independent systems of ODEs
+int  ros2_integrateBatch(MSXproject MSX, MSXRosenbrock *ros, double y[], int n,
+                         int nb, double t, double tnext, double htry[], double atol[],
+                         double rtol[],
+                         void (*func)(MSXproject, int, int*, double*, int, double*),
+                         int (*jac)(MSXproject, int, double*, int, double**),
+                         MSXSparse *sp);
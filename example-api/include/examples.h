@@ -28,3 +28,5 @@
 int DLLEXPORT example1(char *fname);
 int DLLEXPORT batchExample(char *fname);
 int DLLEXPORT newBatchExample(char *fname);
+int DLLEXPORT adaptiveStepCheck(char *fname);
+int DLLEXPORT wallShiftCheck(char *fname);
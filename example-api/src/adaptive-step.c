@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include <math.h>
+
+#include "coretoolkit.h"
+#include "examples.h"
+
+#define CALL(err, f) (err = ( (err>100) ? (err) : (f) ))
+
+#define MINUTE 60
+#define HOUR 3600
+
+#define NUM_NODES   5
+#define NUM_SPECIES 3
+#define NUM_HOURS   24
+#define NUM_RESULTS ((NUM_HOURS+1)*NUM_NODES*NUM_SPECIES)
+
+static int checkAdaptiveStep(char *qstep, double ka, FILE *f);
+static int runDiurnalExample(char *stepping, char *qstep, double ka, double results[]);
+
+int DLLEXPORT adaptiveStepCheck(char *fname) {
+    // Checks the adaptive quality time step against a fine fixed step
+    // reference on the arsenic oxidation example, with demands dropping
+    // to a tenth overnight: once with fast oxidation (where the step
+    // should not grow) and once with slow oxidation (where it can).
+    // Returns 0 if the adaptive results are about as accurate as those
+    // of a fixed step of the same TIMESTEP, an error code if a run
+    // fails, or -1 if they are not.
+    int err = 0;
+    FILE *f = NULL;
+
+    if (fname != NULL) f = fopen(fname, "w");
+    err = checkAdaptiveStep("300", 10.0, f);
+    if (err == 0) err = checkAdaptiveStep("60", 0.1, f);
+    if (f != NULL) fclose(f);
+    return err;
+}
+
+static int checkAdaptiveStep(char *qstep, double ka, FILE *f) {
+    static double ref[NUM_RESULTS], fixed[NUM_RESULTS], adaptive[NUM_RESULTS];
+    double errFixed = 0.0, errAdaptive = 0.0;
+    int i, err = 0;
+
+    CALL(err, runDiurnalExample("FIXED", "30", ka, ref));
+    CALL(err, runDiurnalExample("FIXED", qstep, ka, fixed));
+    CALL(err, runDiurnalExample("ADAPTIVE", qstep, ka, adaptive));
+    if (err) return err;
+
+    // Total absolute difference from the reference over all hours
+    for (i = 0; i < NUM_RESULTS; i++) {
+        errFixed += fabs(fixed[i] - ref[i]);
+        errAdaptive += fabs(adaptive[i] - ref[i]);
+    }
+    if (f != NULL) {
+        fprintf(f, "Ka = %g, TIMESTEP = %s sec\n", ka, qstep);
+        fprintf(f, "  Total error of a fixed step:     %12.6f\n", errFixed);
+        fprintf(f, "  Total error of an adaptive step: %12.6f\n", errAdaptive);
+    }
+    if (errAdaptive > 1.5 * errFixed + 1.0e-3) return -1;
+    return 0;
+}
+
+static int runDiurnalExample(char *stepping, char *qstep, double ka, double results[]) {
+    int err = 0;
+    MSXproject MSX;
+    CALL(err, MSX_open(&MSX));
+
+    // Builing the network from example.inp
+    CALL(err, MSX_setFlowFlag(MSX, CMH));
+    CALL(err, MSX_setTimeParameter(MSX, DURATION, NUM_HOURS*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, HYDSTEP, 1*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, QUALSTEP, 5*MINUTE));
+    CALL(err, MSX_setTimeParameter(MSX, REPORTSTEP, 1*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, REPORTSTART, 0));
+
+    // Add nodes
+    CALL(err, MSX_addNode(MSX, "a"));
+    CALL(err, MSX_addNode(MSX, "b"));
+    CALL(err, MSX_addNode(MSX, "c"));
+    CALL(err, MSX_addNode(MSX, "e"));
+    CALL(err, MSX_addReservoir(MSX, "source", 0,0,0));
+    // Add links
+    CALL(err, MSX_addLink(MSX, "1", "source", "a", 1000, 200, 100));
+    CALL(err, MSX_addLink(MSX, "2", "a", "b", 800, 150, 100));
+    CALL(err, MSX_addLink(MSX, "3", "a", "c", 1200, 200, 100));
+    CALL(err, MSX_addLink(MSX, "4", "b", "c", 1000, 150, 100));
+    CALL(err, MSX_addLink(MSX, "5", "c", "e", 2000, 150, 100));
+
+    // Add Options
+    CALL(err, MSX_addOption(MSX, AREA_UNITS_OPTION, "M2"));
+    CALL(err, MSX_addOption(MSX, RATE_UNITS_OPTION, "HR"));
+    CALL(err, MSX_addOption(MSX, SOLVER_OPTION, "ROS2"));
+    CALL(err, MSX_addOption(MSX, STEPPING_OPTION, stepping));
+    CALL(err, MSX_addOption(MSX, TIMESTEP_OPTION, qstep));
+    CALL(err, MSX_addOption(MSX, RTOL_OPTION, "0.0001"));
+    CALL(err, MSX_addOption(MSX, ATOL_OPTION, "0.00001"));
+
+    // Add Species
+    CALL(err, MSX_addSpecies(MSX, "AS3", BULK, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "AS5", BULK, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "NH2CL", BULK, MG, 0.0, 0.0));
+
+    //Add Coefficents
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "Ka", ka));
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "Kb", 0.1));
+
+    //Add Expressions
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "AS3", "-Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "AS5", "Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "NH2CL", "-Kb*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "AS3", "-Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "AS5", "Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "NH2CL", "-Kb*NH2CL"));
+
+    //Add Quality
+    CALL(err, MSX_addQuality(MSX, "NODE", "AS3", 10.0, "source"));
+    CALL(err, MSX_addQuality(MSX, "NODE", "NH2CL", 2.5, "source"));
+
+    // Finish Setup
+    CALL(err, MSX_init(MSX));
+
+    // Run, with demands at a tenth from hour 12 to hour 20
+    float demands[] = {0.040220, 0.033353, 0.053953, 0.022562, -0.150088};
+    float heads[] = {327.371979, 327.172974, 327.164185, 326.991211, 328.083984};
+    float flows[] = {0.150088, 0.039916, 0.069952, 0.006563, 0.022562};
+    float d[5], q[5], factor;
+    long t = 0;
+    long tleft = 1;
+    int i, j, m, n = 0;
+
+    while (tleft > 0 && err == 0) {
+        if (t % HOUR == 0 && n + NUM_NODES*NUM_SPECIES < NUM_RESULTS) {
+            for (i = 1; i <= NUM_NODES; i++) {
+                for (m = 1; m <= NUM_SPECIES; m++) {
+                    CALL(err, MSX_getQualityByIndex(MSX, NODE, i, m, &results[n]));
+                    n++;
+                }
+            }
+            factor = (t >= 12*HOUR && t < 20*HOUR) ? 0.1f : 1.0f;
+            for (j = 0; j < 5; j++) {
+                d[j] = demands[j] * factor;
+                q[j] = flows[j] * factor;
+            }
+            CALL(err, MSX_setHydraulics(MSX, d, heads, q));
+        }
+        CALL(err, MSX_step(MSX, &t, &tleft));
+    }
+    for (i = 1; i <= NUM_NODES; i++) {
+        for (m = 1; m <= NUM_SPECIES; m++) {
+            CALL(err, MSX_getQualityByIndex(MSX, NODE, i, m, &results[n]));
+            n++;
+        }
+    }
+
+    // Close
+    MSX_close(MSX);
+    return err;
+}
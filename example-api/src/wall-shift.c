@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "msxtypes.h"
+#include "coretoolkit.h"
+#include "examples.h"
+
+#define CALL(err, f) (err = ( (err>100) ? (err) : (f) ))
+
+#define MINUTE 60
+#define HOUR 3600
+
+#define NUM_HOURS 80
+#define LINKVOL(k) ( 0.785398*MSX->Link[(k)].len*SQR(MSX->Link[(k)].diam) )
+
+//  Imported functions
+//--------------------
+void MSXqual_shiftSegWallQual(MSXproject MSX, int k, long dt);
+
+static int  buildAs5Adsorb(MSXproject MSX);
+static int  compareWallShifts(MSXproject MSX, long dt, double **c, int *size,
+                              double *diff, double *tOld, double *tNew);
+static void saveWallQual(MSXproject MSX, double *c, int put);
+static void shiftSegWallQualOld(MSXproject MSX, int k, long dt);
+
+int DLLEXPORT wallShiftCheck(char *fname) {
+    // Checks the single-sweep redistribution of wall species between
+    // the segments of a pipe (MSXqual_shiftSegWallQual) against the
+    // original one, which rescanned the pipe from its upstream end for
+    // every segment, on the segments built up by the As5Adsorb example.
+    // Demands follow a daily pattern, so that segments formed at one
+    // flow are shifted at another. Before every quality step both are
+    // applied to the same copy of the wall species in each pipe and
+    // timed. Returns 0 if they always
+    // give identical concentrations, an error code if the run fails, or
+    // -1 if they do not.
+    int err = 0, size = 0, calls = 0;
+    double *c = NULL;
+    double diff = 0.0, tOld = 0.0, tNew = 0.0;
+    long t = 0;
+    long tleft = 1;
+    MSXproject MSX;
+
+    CALL(err, MSX_open(&MSX));
+    CALL(err, buildAs5Adsorb(MSX));
+    CALL(err, MSX_init(MSX));
+
+    float demands[] = {0.040220, 0.033353, 0.053953, 0.022562, -0.150088};
+    float heads[] = {327.371979, 327.172974, 327.164185, 326.991211, 328.083984};
+    float flows[] = {0.150088, 0.039916, 0.069952, 0.006563, 0.022562};
+    float pattern[] = {0.5f, 0.4f, 0.3f, 0.3f, 0.4f, 0.7f, 1.2f, 1.5f,
+                       1.4f, 1.2f, 1.1f, 1.0f, 1.1f, 1.0f, 0.9f, 0.9f,
+                       1.0f, 1.2f, 1.4f, 1.3f, 1.1f, 0.9f, 0.7f, 0.6f};
+    float d[5], q[5];
+    int j;
+
+    // Run, comparing both redistributions before each quality step
+    while (tleft > 0 && err == 0) {
+        if (t % HOUR == 0) {
+            for (j = 0; j < 5; j++) {
+                d[j] = demands[j] * pattern[(t / HOUR) % 24];
+                q[j] = flows[j] * pattern[(t / HOUR) % 24];
+            }
+            CALL(err, MSX_setHydraulics(MSX, d, heads, q));
+        }
+        CALL(err, compareWallShifts(MSX, MSX->Qstep, &c, &size, &diff, &tOld, &tNew));
+        calls++;
+        CALL(err, MSX_step(MSX, &t, &tleft));
+    }
+    free(c);
+
+    if (fname != NULL && err == 0) {
+        FILE *f = fopen(fname, "w");
+        if (f != NULL) {
+            fprintf(f, "As5Adsorb, %d quality steps\n", calls);
+            fprintf(f, "  Time of the original redistribution:     %10.3f sec\n", tOld);
+            fprintf(f, "  Time of the single-sweep redistribution: %10.3f sec\n", tNew);
+            fprintf(f, "  Largest difference in wall species:      %10.3g\n", diff);
+            fclose(f);
+        }
+    }
+    MSX_close(MSX);
+    if (err == 0 && diff != 0.0) return -1;
+    return err;
+}
+
+static int buildAs5Adsorb(MSXproject MSX) {
+    // Builds the As5Adsorb example with a 5 minute quality step, so that
+    // its pipes hold many segments
+    int err = 0;
+
+    CALL(err, MSX_setFlowFlag(MSX, CMH));
+    CALL(err, MSX_setTimeParameter(MSX, DURATION, NUM_HOURS*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, HYDSTEP, 1*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, QUALSTEP, 5*MINUTE));
+    CALL(err, MSX_setTimeParameter(MSX, REPORTSTEP, 8*HOUR));
+    CALL(err, MSX_setTimeParameter(MSX, REPORTSTART, 0));
+
+    // Add nodes
+    CALL(err, MSX_addNode(MSX, "a"));
+    CALL(err, MSX_addNode(MSX, "b"));
+    CALL(err, MSX_addNode(MSX, "c"));
+    CALL(err, MSX_addNode(MSX, "e"));
+    CALL(err, MSX_addReservoir(MSX, "source", 0,0,0));
+    // Add links
+    CALL(err, MSX_addLink(MSX, "1", "source", "a", 1000, 200, 100));
+    CALL(err, MSX_addLink(MSX, "2", "a", "b", 800, 150, 100));
+    CALL(err, MSX_addLink(MSX, "3", "a", "c", 1200, 200, 100));
+    CALL(err, MSX_addLink(MSX, "4", "b", "c", 1000, 150, 100));
+    CALL(err, MSX_addLink(MSX, "5", "c", "e", 2000, 150, 100));
+
+    // Add Options
+    CALL(err, MSX_addOption(MSX, AREA_UNITS_OPTION, "M2"));
+    CALL(err, MSX_addOption(MSX, RATE_UNITS_OPTION, "HR"));
+    CALL(err, MSX_addOption(MSX, SOLVER_OPTION, "RK5"));
+    CALL(err, MSX_addOption(MSX, TIMESTEP_OPTION, "300"));
+    CALL(err, MSX_addOption(MSX, RTOL_OPTION, "0.001"));
+    CALL(err, MSX_addOption(MSX, ATOL_OPTION, "0.0001"));
+
+    // Add Species
+    CALL(err, MSX_addSpecies(MSX, "AS3", BULK, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "AS5", BULK, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "AStot", BULK, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "AS5s", WALL, UG, 0.0, 0.0));
+    CALL(err, MSX_addSpecies(MSX, "NH2CL", BULK, MG, 0.0, 0.0));
+
+    //Add Coefficents
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "Ka", 10.0));
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "Kb", 0.1));
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "K1", 5.0));
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "K2", 1.0));
+    CALL(err, MSX_addCoefficeint(MSX, CONSTANT, "Smax", 50));
+
+    //Add terms
+    CALL(err, MSX_addTerm(MSX, "Ks", "K1/K2"));
+
+    //Add Expressions
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "AS3", "-Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "AS5", "Ka*AS3*NH2CL-Av*(K1*(Smax-AS5s)*AS5-K2*AS5s)"));
+    CALL(err, MSX_addExpression(MSX, LINK, RATE, "NH2CL", "-Kb*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, LINK, EQUIL, "AS5s", "Ks*Smax*AS5/(1+Ks*AS5)-AS5s"));
+    CALL(err, MSX_addExpression(MSX, LINK, FORMULA, "AStot", "AS3 + AS5"));
+
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "AS3", "-Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "AS5", "Ka*AS3*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, RATE, "NH2CL", "-Kb*NH2CL"));
+    CALL(err, MSX_addExpression(MSX, TANK, FORMULA, "AStot", "AS3+AS5"));
+
+    //Add Quality
+    CALL(err, MSX_addQuality(MSX, "NODE", "AS3", 10.0, "source"));
+    CALL(err, MSX_addQuality(MSX, "NODE", "NH2CL", 2.5, "source"));
+    return err;
+}
+
+static int compareWallShifts(MSXproject MSX, long dt, double **c, int *size,
+                             double *diff, double *tOld, double *tNew) {
+    // Applies the original and the single-sweep redistribution of wall
+    // species to the current segments of every pipe with flow, adding
+    // their largest difference and run times to diff, tOld and tNew,
+    // and then puts the segments back as they were. *c is a work array
+    // (of *size values) that grows as segments are added.
+    int i, j, k, m, n = 0;
+    int ns = MSX->Nobjects[SPECIES];
+    double x, *saved, *shifted;
+    clock_t t0;
+    Pseg seg;
+
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++) n += MSX->Segs[k].count * ns;
+    if (n == 0) return 0;
+    if (2*n > *size) {
+        free(*c);
+        *size = 4*n;
+        *c = (double *) calloc(*size, sizeof(double));
+        if (*c == NULL) return ERR_MEMORY;
+    }
+    saved = *c;
+    shifted = *c + n;
+    saveWallQual(MSX, saved, 0);
+
+    // Original redistribution
+    t0 = clock();
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++) {
+        if (MSX->Link[k].len == 0.0 || MSX->Q[k] == 0.0) continue;
+        shiftSegWallQualOld(MSX, k, dt);
+    }
+    *tOld += (double)(clock() - t0) / CLOCKS_PER_SEC;
+    saveWallQual(MSX, shifted, 0);
+    saveWallQual(MSX, saved, 1);
+
+    // Single-sweep redistribution
+    t0 = clock();
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++) {
+        if (MSX->Link[k].len == 0.0 || MSX->Q[k] == 0.0) continue;
+        MSXqual_shiftSegWallQual(MSX, k, dt);
+    }
+    *tNew += (double)(clock() - t0) / CLOCKS_PER_SEC;
+
+    // Compare them and put the segments back
+    n = 0;
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++) {
+        for (i = 0; i < MSX->Segs[k].count; i++) {
+            seg = SEG_AT(&MSX->Segs[k], i);
+            for (m = 1; m <= ns; m++) {
+                j = n++;
+                if (MSX->Species[m].type != WALL) continue;
+                x = fabs(seg->c[m] - shifted[j]);
+                if (x > *diff) *diff = x;
+            }
+        }
+    }
+    saveWallQual(MSX, saved, 1);
+    return 0;
+}
+
+static void saveWallQual(MSXproject MSX, double *c, int put) {
+    // Copies the concentrations of all pipe segments into c (put = 0)
+    // or back out of it (put = 1)
+    int i, k, m, n = 0;
+    Pseg seg;
+
+    for (k = 1; k <= MSX->Nobjects[LINK]; k++) {
+        for (i = 0; i < MSX->Segs[k].count; i++) {
+            seg = SEG_AT(&MSX->Segs[k], i);
+            for (m = 1; m <= MSX->Nobjects[SPECIES]; m++) {
+                if (put) seg->c[m] = c[n++];
+                else c[n++] = seg->c[m];
+            }
+        }
+    }
+}
+
+static void shiftSegWallQualOld(MSXproject MSX, int k, long dt) {
+    // The original redistribution of wall species in pipe k, which
+    // searches for the segments each one now overlaps from the
+    // upstream end of the pipe
+    SsegRing *segs = &MSX->Segs[k];
+    Pseg  seg1, seg2;
+    int   i1, i2, m;
+    double v, vin, vstart, vend, vcur, vsum;
+
+    v = LINKVOL(k);
+    vin = ABS((double)MSX->Q[k])*dt;
+    if (vin > v) vin = v;
+    vstart = vin;
+
+    for (i1 = segs->count - 1; i1 >= 0; i1--) {
+        seg1 = SEG_AT(segs, i1);
+        if (vstart >= v) break;
+        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++) MSX->C1[m] = 0.0;
+
+        vend = vstart + seg1->v;
+        if (vend > v) vend = v;
+        vcur = vstart;
+        vsum = 0;
+
+        for (i2 = segs->count - 1; i2 >= 0; i2--) {
+            seg2 = SEG_AT(segs, i2);
+            if (seg2->v == 0.0) continue;
+            vsum += seg2->v;
+            if (vsum >= vstart && vsum <= vend) {
+                for (m = 1; m <= MSX->Nobjects[SPECIES]; m++) {
+                    if (MSX->Species[m].type == WALL)
+                        MSX->C1[m] += (vsum - vcur) * seg2->c[m];
+                }
+                vcur = vsum;
+            }
+            if (vsum >= vend) break;
+        }
+        if (i2 < 0) seg2 = NULL;
+
+        for (m = 1; m <= MSX->Nobjects[SPECIES]; m++) {
+            if (MSX->Species[m].type != WALL) continue;
+            if (seg2 != NULL) MSX->C1[m] += (vend - vcur) * seg2->c[m];
+            seg1->c[m] = MSX->C1[m] / (vend - vstart);
+            if (seg1->c[m] < 0.0) seg1->c[m] = 0.0;
+        }
+        vstart = vend;
+    }
+}